@@ -59,6 +59,8 @@ def build_binary(args):
 
 	ndk_build = os.path.join(os.environ['ANDROID_HOME'], 'ndk-bundle', 'ndk-build')
 	debug_flag = '' if args.release else '-DDEBUG'
+	if args.xwrap_stats:
+		debug_flag += ' -DXWRAP_STATS'
 	proc = subprocess.run('{} APP_CFLAGS=\"-DMAGISK_VERSION=\\\"{}\\\" -DMAGISK_VER_CODE={} {}\" -j{}'.format(
 		ndk_build, args.versionString, args.versionCode, debug_flag, multiprocessing.cpu_count()), shell=True)
 	if proc.returncode != 0:
@@ -121,7 +123,7 @@ def sign_adjust_zip(unsigned, output):
 
 	if os.name != 'nt' and not os.path.exists(os.path.join('ziptools', 'zipadjust')):
 		# Compile zipadjust
-		proc = subprocess.run('gcc -o ziptools/zipadjust ziptools/src/*.c -lz', shell=True)
+		proc = subprocess.run('gcc -o ziptools/zipadjust ziptools/src/*.c -lz -lpthread', shell=True)
 		if proc.returncode != 0:
 			error('Build zipadjust failed!')
 
@@ -255,6 +257,40 @@ def zip_uninstaller(args):
 	output = 'Magisk-uninstaller-{}.zip'.format(datetime.datetime.now().strftime('%Y%m%d'))
 	sign_adjust_zip('tmp_unsigned.zip', output)
 
+def run_bench(args):
+	header('* Running magiskboot benchmarks')
+
+	try:
+		proc = subprocess.run(['adb', 'shell', 'getprop', 'ro.product.cpu.abilist'], stdout=subprocess.PIPE)
+	except FileNotFoundError:
+		error('Please install Android platform tools and make sure \'adb\' is available in PATH')
+	if proc.returncode != 0:
+		error('No device found!')
+
+	remote = '/data/local/tmp/magiskboot_bench'
+	subprocess.run(['adb', 'shell', 'mkdir', '-p', remote])
+	images = []
+	for image in args.images:
+		target = '{}/{}'.format(remote, os.path.basename(image))
+		subprocess.run(['adb', 'push', image, target])
+		images.append(target)
+
+	os.makedirs('bench', exist_ok=True)
+	# Every ABI the device runs, results are one tsv per ABI
+	for abi in proc.stdout.decode().strip().split(','):
+		source = os.path.join('libs', abi, 'magiskboot_bench')
+		if not os.path.exists(source):
+			continue
+		print('bench: ' + abi)
+		subprocess.run(['adb', 'push', source, remote + '/bench'])
+		result = subprocess.run(['adb', 'shell', 'cd {0} && chmod 755 bench && ./bench {1}'.format(
+			remote, ' '.join(images))], stdout=subprocess.PIPE)
+		if result.returncode != 0:
+			error('Benchmark for {} failed!'.format(abi))
+		with open(os.path.join('bench', abi + '.tsv'), 'wb') as out:
+			out.write(result.stdout.replace(b'\r\n', b'\n'))
+	subprocess.run(['adb', 'shell', 'rm', '-rf', remote])
+
 def cleanup(args):
 	if len(args.target) == 0:
 		args.target = ['binary', 'apk', 'zip']
@@ -278,6 +314,7 @@ def cleanup(args):
 
 parser = argparse.ArgumentParser(description='Magisk build script')
 parser.add_argument('--release', action='store_true', help='compile Magisk for release')
+parser.add_argument('--xwrap-stats', action='store_true', help='record the calls of the x wrappers in the binaries')
 subparsers = parser.add_subparsers(title='actions')
 
 all_parser = subparsers.add_parser('all', help='build everything and create flashable zip with uninstaller')
@@ -301,6 +338,10 @@ zip_parser.set_defaults(func=zip_main)
 uninstaller_parser = subparsers.add_parser('uninstaller', help='create flashable uninstaller')
 uninstaller_parser.set_defaults(func=zip_uninstaller)
 
+bench_parser = subparsers.add_parser('bench', help='run magiskboot benchmarks on the connected device, results in bench/<abi>.tsv')
+bench_parser.add_argument('images', nargs='*', help='boot images to benchmark besides the synthetic ones')
+bench_parser.set_defaults(func=run_bench)
+
 clean_parser = subparsers.add_parser('clean', help='clean [target...] targets: binary apk zip')
 clean_parser.add_argument('target', nargs='*')
 clean_parser.set_defaults(func=cleanup)
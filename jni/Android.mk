@@ -20,12 +20,23 @@ LOCAL_SRC_FILES := \
 	utils/xwrap.c \
 	utils/list.c \
 	utils/img.c \
+	utils/ext4.c \
+	utils/mountinfo.c \
 	daemon/daemon.c \
+	daemon/thread_pool.c \
+	daemon/event_loop.c \
 	daemon/socket_trans.c \
 	daemon/log_monitor.c \
 	daemon/bootstages.c \
+	daemon/boot_profile.c \
+	daemon/prop_watch.c \
+	daemon/applet_server.c \
+	daemon/mount_plan.c \
+	daemon/metrics.c \
+	daemon/sepol_cache.c \
 	magiskhide/magiskhide.c \
 	magiskhide/proc_monitor.c \
+	magiskhide/proc_events.c \
 	magiskhide/hide_utils.c \
 	magiskpolicy/magiskpolicy.c \
 	magiskpolicy/rules.c \
@@ -62,7 +73,8 @@ LOCAL_SRC_FILES := \
 	utils/vector.c \
 	utils/xwrap.c \
 	utils/list.c \
-	utils/img.c
+	utils/img.c \
+	utils/ext4.c
 
 LOCAL_CFLAGS := -Wno-implicit-exception-spec-mismatch -DSTATIC -DPIXEL
 
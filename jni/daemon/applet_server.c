@@ -0,0 +1,296 @@
+/* applet_server.c - Run applets through the running daemon
+ *
+ * magisk --exec <applet> [args...] hands the command over to the daemon, which
+ * runs the applet on the stdio, working directory and environment of the
+ * client, so the client only connects and sends one request.
+ * The daemon has threads and cannot run anything but exec in a fork of
+ * itself. So start_daemon forks a single threaded helper first, and request
+ * threads pass the client on to it. For each client the helper forks a runner
+ * that forks the applet, without exec or dynamic linking, and reports its exit
+ * code. Everything from the client is read in the applet process, bad requests
+ * cannot take the daemon down. Only root may use it, the applet runs as the
+ * daemon. Applets past APPLET_TIMEOUT are killed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+#define EXEC_MAX_ARGS  1024
+#define APPLET_TIMEOUT 60
+
+extern char **environ;
+
+// Request threads to the helper, one client and reply fd at a time
+static int helper_fd = -1;
+static pthread_mutex_t helper_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Applets with their own protocol to the daemon are not served
+static int find_applet(const char *name) {
+	if (strcmp(name, "su") == 0)
+		return -1;
+	for (int i = 0; applet[i]; ++i)
+		if (strcmp(name, applet[i]) == 0)
+			return i;
+	return -1;
+}
+
+static void close_other_fds() {
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *entry;
+	int fd;
+	if (dir == NULL)
+		return;
+	while ((entry = readdir(dir))) {
+		fd = atoi(entry->d_name);
+		if (fd > STDERR_FILENO && fd != dirfd(dir))
+			close(fd);
+	}
+	closedir(dir);
+}
+
+static char **read_strings(int client, int *count) {
+	*count = read_int(client);
+	if (*count < 0 || *count > EXEC_MAX_ARGS)
+		exit(1);
+	char **list = xcalloc(*count + 1, sizeof(char *));
+	for (int i = 0; i < *count; ++i)
+		list[i] = read_string(client);
+	return list;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// In the forked applet process, the request is on client
+static void run_applet(int client) {
+	int argc, envc, fds[4], i;
+	char **argv, **envp;
+
+	argv = read_strings(client, &argc);
+	envp = read_strings(client, &envc);
+	for (i = 0; i < 4; ++i)
+		fds[i] = recv_fd(client);
+	if (argc == 0 || (i = find_applet(argv[0])) < 0)
+		exit(127);
+
+	// Replaces the request socket
+	if (fds[0] < 0)
+		fds[0] = xopen("/dev/null", O_RDONLY);
+	for (int j = 0; j < 3; ++j)
+		if (fds[j] >= 0)
+			xdup2(fds[j], j);
+	if (fds[3] >= 0)
+		fchdir(fds[3]);
+	close_other_fds();
+
+	clearenv();
+	for (int j = 0; j < envc; ++j)
+		putenv(envp[j]);
+	signal(SIGPIPE, SIG_DFL);
+	exit(applet_main[i](argc, argv));
+}
+
+// Reap the applet, it is killed past APPLET_TIMEOUT or once the client is gone
+static int wait_applet(int pid, int client) {
+	struct pollfd pfd = { .fd = client, .events = POLLRDHUP };
+	double deadline = now() + APPLET_TIMEOUT;
+	int status, ret, ms = 1;
+	while ((ret = waitpid(pid, &status, WNOHANG)) == 0) {
+		if (now() > deadline || (poll(&pfd, 1, ms) > 0 && pfd.revents)) {
+			LOGW("applet_server: killing PID=%d\n", pid);
+			kill(pid, SIGKILL);
+			ret = waitpid(pid, &status, 0);
+			break;
+		}
+		ms = ms * 2 > 50 ? 50 : ms * 2;
+	}
+	if (ret < 0)
+		return 1;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// The helper never has more than one thread, exits once the daemon is gone
+static void applet_helper(int fd) {
+	int req, client, reply, pid;
+	// Runners are reaped by the kernel
+	signal(SIGCHLD, SIG_IGN);
+	while (read(fd, &req, sizeof(req)) == sizeof(req) && req == APPLET_EXEC) {
+		client = recv_fd(fd);
+		reply = recv_fd(fd);
+		if (client >= 0 && reply >= 0 && fork() == 0) {
+			signal(SIGCHLD, SIG_DFL);
+			close(fd);
+			if ((pid = fork()) == 0) {
+				close(reply);
+				run_applet(client);
+			}
+			write_int(reply, pid < 0 ? 1 : wait_applet(pid, client));
+			_exit(0);
+		}
+		if (client >= 0)
+			close(client);
+		if (reply >= 0)
+			close(reply);
+	}
+	_exit(0);
+}
+
+// Call before the daemon starts any thread. Without the helper --exec runs
+// applets in the client
+void start_applet_helper() {
+	int sv[2], pid = -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0 && (pid = fork()) < 0) {
+		close(sv[0]);
+		close(sv[1]);
+	}
+	if (pid < 0) {
+		LOGE("applet_server: cannot start the helper: %s\n", strerror(errno));
+		return;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		applet_helper(sv[1]);
+	}
+	close(sv[1]);
+	helper_fd = sv[0];
+}
+
+// Reply with the exit code of the applet, 128 + signal if it was killed
+void applet_server(int client) {
+	int sv[2], ret = 1;
+
+	if (helper_fd < 0 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		write_int(client, DAEMON_ERROR);
+		close(client);
+		return;
+	}
+	write_int(client, DAEMON_SUCCESS);
+	pthread_mutex_lock(&helper_lock);
+	write_int(helper_fd, APPLET_EXEC);
+	send_fd(helper_fd, client);
+	send_fd(helper_fd, sv[1]);
+	pthread_mutex_unlock(&helper_lock);
+	close(sv[1]);
+	// Nothing comes if the helper or the runner died
+	if (read(sv[0], &ret, sizeof(ret)) != sizeof(ret))
+		ret = 1;
+	close(sv[0]);
+	write_int(client, ret);
+	close(client);
+}
+
+/**********
+ * Client *
+ **********/
+
+static void write_strings(int fd, char *const list[], int count) {
+	write_int(fd, count);
+	for (int i = 0; i < count; ++i)
+		write_string(fd, list[i]);
+}
+
+// Return -1 if the daemon did not take the request
+static int exec_remote(int argc, char *argv[]) {
+	char *env[EXEC_MAX_ARGS];
+	int envc = 0, fd, cwd, ret, ack;
+
+	if (argc > EXEC_MAX_ARGS)
+		return -1;
+	for (int i = 0; i < argc; ++i)
+		if (strlen(argv[i]) > PATH_MAX)
+			return -1;
+	// Variables the daemon cannot take are left out
+	for (char **e = environ; *e && envc < EXEC_MAX_ARGS; ++e)
+		if (strlen(*e) <= PATH_MAX)
+			env[envc++] = *e;
+
+	// A request the daemon rejects should fail the writes, not kill us
+	void (*pipe_handler)(int) = signal(SIGPIPE, SIG_IGN);
+	fd = connect_daemon();
+	write_int(fd, APPLET_EXEC);
+	// Older daemons just hang up
+	if (read(fd, &ack, sizeof(ack)) != sizeof(ack) || ack != DAEMON_SUCCESS) {
+		close(fd);
+		signal(SIGPIPE, pipe_handler);
+		return -1;
+	}
+	write_strings(fd, argv, argc);
+	write_strings(fd, env, envc);
+	send_fd(fd, STDIN_FILENO);
+	send_fd(fd, STDOUT_FILENO);
+	send_fd(fd, STDERR_FILENO);
+	cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	send_fd(fd, cwd);
+	if (cwd >= 0)
+		close(cwd);
+	ret = read_int(fd);
+	close(fd);
+	signal(SIGPIPE, pipe_handler);
+	return ret;
+}
+
+int exec_applet_main(int argc, char *argv[]) {
+	int i = find_applet(argv[0]), ret;
+	if (i < 0) {
+		fprintf(stderr, "%s: applet not found\n", argv[0]);
+		return 1;
+	}
+	if ((ret = exec_remote(argc, argv)) >= 0)
+		return ret;
+	// Run it right here instead
+	return applet_main[i](argc, argv);
+}
+
+// Average time of an applet run through the daemon, and through fork and exec
+int exec_bench_main(int count, int argc, char *argv[]) {
+	int null = xopen("/dev/null", O_WRONLY | O_CLOEXEC), out = dup(STDOUT_FILENO), pid;
+	double start, remote, local;
+
+	if (find_applet(argv[0]) < 0) {
+		fprintf(stderr, "%s: applet not found\n", argv[0]);
+		return 1;
+	}
+	xdup2(null, STDOUT_FILENO);
+	start = now();
+	for (int i = 0; i < count; ++i) {
+		if (exec_remote(argc, argv) < 0) {
+			xdup2(out, STDOUT_FILENO);
+			fprintf(stderr, "Daemon does not run applets\n");
+			return 1;
+		}
+	}
+	remote = (now() - start) / count;
+
+	start = now();
+	for (int i = 0; i < count; ++i) {
+		if ((pid = fork()) == 0) {
+			execv("/proc/self/exe", argv);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	local = (now() - start) / count;
+	xdup2(out, STDOUT_FILENO);
+
+	printf("%-10s %10.3f ms\n", "daemon", remote * 1e3);
+	printf("%-10s %10.3f ms\n", "fork+exec", local * 1e3);
+	return 0;
+}
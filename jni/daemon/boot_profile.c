@@ -0,0 +1,124 @@
+/* boot_profile.c - Timing of the boot stages
+ *
+ * Spans are recorded with the boot clock, so the report shows where in the
+ * boot each step ran and how long it took. Spans nest per thread, the report
+ * is a small binary file next to the log, dumped with magisk --boot-profile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+static struct prof_span spans[PROF_MAX];
+static int span_count = 0;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int depth = 0;
+
+uint64_t prof_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Return the span id, -1 if the table is full
+static int prof_alloc() {
+	int id = -1;
+	pthread_mutex_lock(&prof_lock);
+	if (span_count < PROF_MAX)
+		id = span_count++;
+	pthread_mutex_unlock(&prof_lock);
+	return id;
+}
+
+int prof_begin(const char *fmt, ...) {
+	va_list args;
+	int id = prof_alloc();
+	if (id < 0)
+		return -1;
+	struct prof_span *s = &spans[id];
+	va_start(args, fmt);
+	vsnprintf(s->name, sizeof(s->name), fmt, args);
+	va_end(args);
+	s->depth = depth++;
+	s->dur = 0;
+	s->start = prof_now();
+	return id;
+}
+
+void prof_end(int id) {
+	if (id < 0)
+		return;
+	spans[id].dur = prof_now() - spans[id].start;
+	--depth;
+}
+
+// Add a span measured elsewhere, e.g. one of many processes running at once
+void prof_record(uint64_t start, uint64_t dur, const char *fmt, ...) {
+	va_list args;
+	int id = prof_alloc();
+	if (id < 0)
+		return;
+	struct prof_span *s = &spans[id];
+	va_start(args, fmt);
+	vsnprintf(s->name, sizeof(s->name), fmt, args);
+	va_end(args);
+	s->depth = depth;
+	s->start = start;
+	s->dur = dur;
+}
+
+// Write out everything recorded so far, running spans have no duration
+void prof_save() {
+	struct prof_hdr hdr = { PROF_MAGIC, PROF_VERSION, 0 };
+	int fd = open(PROFILE_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	pthread_mutex_lock(&prof_lock);
+	hdr.count = span_count;
+	int ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		write(fd, spans, hdr.count * sizeof(*spans)) == hdr.count * sizeof(*spans);
+	pthread_mutex_unlock(&prof_lock);
+	close(fd);
+	if (ok)
+		rename(PROFILE_FILE ".tmp", PROFILE_FILE);
+	else
+		unlink(PROFILE_FILE ".tmp");
+}
+
+int boot_profile_main(const char *file) {
+	struct prof_hdr hdr;
+	struct prof_span s;
+	uint64_t total = 0;
+	FILE *fp = fopen(file, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open %s\n", file);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != PROF_MAGIC || hdr.version != PROF_VERSION) {
+		fprintf(stderr, "%s is not a boot profile\n", file);
+		fclose(fp);
+		return 1;
+	}
+	printf("%10s %10s  %s\n", "START(ms)", "TIME(ms)", "SPAN");
+	for (uint32_t i = 0; i < hdr.count && fread(&s, sizeof(s), 1, fp) == 1; ++i) {
+		s.name[sizeof(s.name) - 1] = '\0';
+		if (s.dur)
+			printf("%10.1f %10.1f  %*s%s\n", s.start / 1e6, s.dur / 1e6, s.depth * 2, "", s.name);
+		else
+			printf("%10.1f %10s  %*s%s\n", s.start / 1e6, "-", s.depth * 2, "", s.name);
+		if (s.depth == 0)
+			total += s.dur;
+	}
+	printf("Total: %.1f ms in %u spans\n", total / 1e6, hdr.count);
+	fclose(fp);
+	return 0;
+}
@@ -14,7 +14,11 @@
 #include <linux/loop.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <sys/wait.h>
+#include <sys/utsname.h>
+#include <signal.h>
 #include <selinux/selinux.h>
 
 #include "magisk.h"
@@ -24,11 +28,60 @@
 
 static char *buf, *buf2;
 static struct vector module_list;
+// Spans of the running stage and of its current step, ended on every exit
+static int stage_span = -1, step_span = -1;
+static int pfsd_run = 0, pfsd_done = 0;
 
 #ifdef DEBUG
 static int debug_log_pid, debug_log_fd;
 #endif
 
+/************
+ * Parallel *
+ ************/
+
+/*
+ * Run func on every entry of v on a few threads at once, the calling thread
+ * is one of them. The work is mostly syscalls on the images, so a few
+ * threads are enough.
+ */
+
+#define PARALLEL_JOBS 4
+
+struct parallel_jobs {
+	struct vector *v;
+	void (*func)(void *);
+	int next;
+};
+
+static void *parallel_worker(void *arg) {
+	struct parallel_jobs *jobs = arg;
+	int i;
+	// Never take down the boot stage from here
+	err_handler = do_nothing;
+	while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < vec_size(jobs->v))
+		jobs->func(vec_entry(jobs->v)[i]);
+	return NULL;
+}
+
+static void parallel_for(struct vector *v, void (*func)(void *)) {
+	struct parallel_jobs jobs = { v, func, 0 };
+	pthread_t threads[PARALLEL_JOBS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = vec_size(v) < PARALLEL_JOBS ? vec_size(v) : PARALLEL_JOBS, started = 0;
+	if (cpus > 0 && n > cpus)
+		n = cpus;
+	for (int i = 1; i < n; ++i) {
+		if (pthread_create(&threads[started], NULL, parallel_worker, &jobs) == 0)
+			++started;
+	}
+	void (*handler)(void) = err_handler;
+	parallel_worker(&jobs);
+	err_handler = handler;
+	for (int i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+}
+
 /******************
  * Node structure *
  ******************/
@@ -43,11 +96,14 @@ static int debug_log_pid, debug_log_fd;
 
 struct node_entry {
 	const char *module;    /* Only used when status & IS_MODULE */
-	char *name;
+	const char *name;      /* Last component of path */
+	char *path;
 	uint8_t type;
 	uint8_t status;
 	struct node_entry *parent;
-	struct vector *children;
+	struct node_entry **children;    /* Sorted by name */
+	uint32_t count;
+	uint32_t cap;
 };
 
 #define IS_DIR(n)  (n->type == DT_DIR)
@@ -62,6 +118,95 @@ struct node_entry {
 #define SOURCE_TMP "/dev/source"
 #define TARGET_TMP "/dev/target"
 
+struct merge_job {
+	char *name;
+	int module;            /* Replaces the old copy, anything else is merged over */
+	int files;
+	uint64_t bytes;
+};
+
+// Files are copied with their mtime, so an unchanged file has the same type, size and mtime
+static int same_file(struct stat *a, struct stat *b) {
+	return (a->st_mode & S_IFMT) == (b->st_mode & S_IFMT) && a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void copy_times(const char *path, struct stat *st) {
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+ * Make target a copy of source, only files that changed are copied.
+ * With prune, anything not in source is removed from target
+ */
+static void sync_dir(const char *source, const char *target, int prune, struct merge_job *job) {
+	DIR *dir;
+	struct dirent *entry;
+	struct stat d_st, s_st, t_st;
+	char *s_path, *t_path;
+
+	if (lstat(source, &d_st) || !(dir = opendir(source)))
+		return;
+	if (lstat(target, &t_st) == 0 && !S_ISDIR(t_st.st_mode))
+		unlink(target);
+	mkdir_p(target, 0755);
+	clone_attr(source, target);
+
+	s_path = xmalloc(PATH_MAX);
+	t_path = xmalloc(PATH_MAX);
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		snprintf(s_path, PATH_MAX, "%s/%s", source, entry->d_name);
+		snprintf(t_path, PATH_MAX, "%s/%s", target, entry->d_name);
+		if (lstat(s_path, &s_st))
+			continue;
+		if (lstat(t_path, &t_st) == 0) {
+			if (!S_ISDIR(s_st.st_mode) && same_file(&s_st, &t_st))
+				continue;
+			if (S_ISDIR(t_st.st_mode) && !S_ISDIR(s_st.st_mode))
+				rm_rf(t_path);
+		}
+		if (S_ISDIR(s_st.st_mode)) {
+			sync_dir(s_path, t_path, prune, job);
+		} else if ((S_ISREG(s_st.st_mode) || S_ISLNK(s_st.st_mode)) && cp_afc(s_path, t_path) == 0) {
+			copy_times(t_path, &s_st);
+			++job->files;
+			if (S_ISREG(s_st.st_mode))
+				job->bytes += s_st.st_size;
+		}
+	}
+	closedir(dir);
+
+	if (prune && (dir = opendir(target))) {
+		while ((entry = readdir(dir))) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+				continue;
+			snprintf(s_path, PATH_MAX, "%s/%s", source, entry->d_name);
+			snprintf(t_path, PATH_MAX, "%s/%s", target, entry->d_name);
+			if (lstat(s_path, &s_st))
+				rm_rf(t_path);
+		}
+		closedir(dir);
+	}
+	free(s_path);
+	free(t_path);
+	copy_times(target, &d_st);
+}
+
+static void merge_entry(void *arg) {
+	struct merge_job *job = arg;
+	char source[PATH_MAX], target[PATH_MAX];
+	uint64_t start = prof_now();
+	snprintf(source, sizeof(source), "%s/%s", SOURCE_TMP, job->name);
+	snprintf(target, sizeof(target), "%s/%s", TARGET_TMP, job->name);
+	if (job->module)
+		LOGI("%s module: %s\n", access(target, F_OK) == 0 ? "Upgrade" : "New", job->name);
+	sync_dir(source, target, job->module, job);
+	prof_record(start, prof_now() - start, "merge %s", job->name);
+}
+
 static int merge_img(const char *source, const char *target) {
 	if (access(source, F_OK) == -1)
 		return 0;
@@ -70,45 +215,61 @@ static int merge_img(const char *source, const char *target) {
 		return 0;
 	}
 	
-	// resize target to worst case
+	// resize target to worst case, if it is not already large enough
 	int s_used, s_total, t_used, t_total, n_total;
 	get_img_size(source, &s_used, &s_total);
 	get_img_size(target, &t_used, &t_total);
 	n_total = round_size(s_used + t_used);
-	if (n_total != t_total)
+	if (n_total > t_total)
 		resize_img(target, n_total);
 
 	xmkdir(SOURCE_TMP, 0755);
 	xmkdir(TARGET_TMP, 0755);
 	char *s_loop, *t_loop;
-	s_loop = mount_image(source, SOURCE_TMP);
+	s_loop = mount_image(source, SOURCE_TMP, 0);
 	if (s_loop == NULL) return 1;
-	t_loop = mount_image(target, TARGET_TMP);
+	t_loop = mount_image(target, TARGET_TMP, 0);
 	if (t_loop == NULL) return 1;
 
 	DIR *dir;
 	struct dirent *entry;
+	struct vector jobs;
+	struct merge_job *job;
+	char s_path[PATH_MAX], t_path[PATH_MAX];
+	uint64_t start = prof_now(), bytes = 0;
+	int files = 0;
 	if (!(dir = opendir(SOURCE_TMP)))
 		return 1;
+	vec_init(&jobs);
 	while ((entry = xreaddir(dir))) {
-		if (entry->d_type == DT_DIR) {
-			if (strcmp(entry->d_name, ".") == 0 ||
-				strcmp(entry->d_name, "..") == 0 ||
-				strcmp(entry->d_name, ".core") == 0 ||
-				strcmp(entry->d_name, "lost+found") == 0)
-				continue;
-			// Cleanup old module if exists
-			snprintf(buf, PATH_MAX, "%s/%s", TARGET_TMP, entry->d_name);
-			if (access(buf, F_OK) == 0) {
-				LOGI("Upgrade module: %s\n", entry->d_name);
-				rm_rf(buf);
-			} else {
-				LOGI("New module: %s\n", entry->d_name);
-			}
+		if (strcmp(entry->d_name, ".") == 0 ||
+			strcmp(entry->d_name, "..") == 0 ||
+			strcmp(entry->d_name, "lost+found") == 0)
+			continue;
+		if (entry->d_type != DT_DIR) {
+			snprintf(s_path, sizeof(s_path), "%s/%s", SOURCE_TMP, entry->d_name);
+			snprintf(t_path, sizeof(t_path), "%s/%s", TARGET_TMP, entry->d_name);
+			if (cp_afc(s_path, t_path) == 0)
+				++files;
+			continue;
 		}
+		job = xcalloc(1, sizeof(*job));
+		job->name = strdup(entry->d_name);
+		job->module = strcmp(entry->d_name, ".core") != 0;
+		vec_push_back(&jobs, job);
 	}
 	closedir(dir);
-	clone_dir(SOURCE_TMP, TARGET_TMP);
+
+	// Modules are independent, copy them at once
+	parallel_for(&jobs, merge_entry);
+	vec_for_each(&jobs, job) {
+		files += job->files;
+		bytes += job->bytes;
+		free(job->name);
+	}
+	vec_deep_destroy(&jobs);
+	LOGI("* Merged %s: %d files, %llu KB copied in %.1f ms\n", source, files,
+		(unsigned long long) (bytes >> 10), (prof_now() - start) / 1e6);
 
 	// Unmount all loop devices
 	umount_image(SOURCE_TMP, s_loop);
@@ -133,128 +294,349 @@ static void trim_img(const char *img) {
  * Scripts *
  ***********/
 
+#define SCRIPT_JOBS      4
+#define SCRIPT_TIMEOUT   10    /* seconds, post-fs-data only */
+#define SCRIPT_POLL      10    /* ms */
+#define PFSD_DEADLINE    45    /* seconds, init stops waiting at 60 */
+
+struct script {
+	char *path;
+	char *name;
+	int serial;            /* Run alone, after everything before it */
+};
+
+struct script_job {
+	int pid;
+	uint64_t start;
+	struct script *script;
+};
+
+static int script_cmp(const void *a, const void *b) {
+	return strcmp((*(struct script **) a)->name, (*(struct script **) b)->name);
+}
+
+static void script_add(struct vector *v, const char *path, const char *name, int serial) {
+	struct script *s = xmalloc(sizeof(*s));
+	s->path = strdup(path);
+	s->name = strdup(name);
+	s->serial = serial;
+	vec_push_back(v, s);
+}
+
+// Scripts get their own process group, so a timeout kills whatever they spawned
+static int script_spawn(struct script *s) {
+	int pid = fork();
+	if (pid == 0) {
+		setpgid(0, 0);
+		signal(SIGPIPE, SIG_DFL);
+		execl("/system/bin/sh", "sh", s->path, NULL);
+		_exit(127);
+	}
+	return pid;
+}
+
+static void script_done(const char *stage, struct script_job *job, int status, int killed) {
+	uint64_t dur = prof_now() - job->start;
+	if (killed)
+		LOGW("%s: [%s] timed out after %d s, killed\n", stage, job->script->name, SCRIPT_TIMEOUT);
+	else
+		LOGI("%s: [%s] exit %d in %llu ms\n", stage, job->script->name,
+			WIFEXITED(status) ? WEXITSTATUS(status) : -1, dur / 1000000ULL);
+	prof_record(job->start, dur, "%s%s", job->script->name, killed ? " (killed)" : "");
+	job->pid = -1;
+}
+
+/*
+ * Run scripts with up to jobs at once, in the order of the vector.
+ * With timeout, scripts still running after that many seconds are killed.
+ * The script entries are freed.
+ */
+static void exec_scripts(const char *stage, struct vector *scripts, int jobs, int timeout) {
+	struct script_job *running;
+	struct script *s;
+	int count = 0, serial = 0, status, pid;
+	size_t next = 0;
+
+	if (jobs < 1)
+		jobs = 1;
+	running = xcalloc(jobs, sizeof(*running));
+	for (int i = 0; i < jobs; ++i)
+		running[i].pid = -1;
+
+	while (next < vec_size(scripts) || count) {
+		// Start as many as allowed, serial scripts only run alone
+		while (next < vec_size(scripts) && count < jobs && !serial) {
+			s = vec_entry(scripts)[next];
+			if (count && s->serial)
+				break;
+			int slot = 0;
+			while (running[slot].pid >= 0) ++slot;
+			LOGI("%s: exec [%s]\n", stage, s->name);
+			if ((pid = script_spawn(s)) < 0) {
+				++next;
+				continue;
+			}
+			running[slot] = (struct script_job) { pid, prof_now(), s };
+			++count;
+			++next;
+			serial = s->serial;
+		}
+
+		int reaped = 0;
+		for (int i = 0; i < jobs; ++i) {
+			if (running[i].pid < 0)
+				continue;
+			status = -1;
+			pid = waitpid(running[i].pid, &status, WNOHANG);
+			if (pid == 0 && timeout && prof_now() - running[i].start >= timeout * 1000000000ULL) {
+				kill(-running[i].pid, SIGKILL);
+				waitpid(running[i].pid, &status, 0);
+				script_done(stage, &running[i], status, 1);
+			} else if (pid != 0) {
+				script_done(stage, &running[i], status, 0);
+			} else {
+				continue;
+			}
+			if (running[i].script->serial)
+				serial = 0;
+			--count;
+			reaped = 1;
+		}
+		if (!reaped && count)
+			usleep(SCRIPT_POLL * 1000);
+	}
+
+	vec_for_each(scripts, s) {
+		free(s->path);
+		free(s->name);
+		free(s);
+	}
+	vec_destroy(scripts);
+	free(running);
+}
+
+// Persist props are not loaded yet when the image is mounted, so it is a flag file
+static int img_flags() {
+	return access(DIRECTIOFILE, F_OK) == 0 ? IMG_DIRECT_IO : 0;
+}
+
+static int script_jobs(const char *stage) {
+	if (strcmp(stage, "service") != 0)
+		return 1;
+	char *prop = getprop(SCRIPT_JOBS_PROP);
+	int jobs = prop ? atoi(prop) : SCRIPT_JOBS;
+	free(prop);
+	return jobs > 0 ? jobs : SCRIPT_JOBS;
+}
+
+// post-fs-data blocks the boot, so its scripts are bounded
+static int script_timeout(const char *stage) {
+	return strcmp(stage, "post-fs-data") == 0 ? SCRIPT_TIMEOUT : 0;
+}
+
 void exec_common_script(const char* stage) {
 	DIR *dir;
 	struct dirent *entry;
+	struct vector scripts;
 	snprintf(buf, PATH_MAX, "%s/%s.d", COREDIR, stage);
 
 	if (!(dir = opendir(buf)))
 		return;
 
+	vec_init(&scripts);
 	while ((entry = xreaddir(dir))) {
 		if (entry->d_type == DT_REG) {
 			snprintf(buf2, PATH_MAX, "%s/%s", buf, entry->d_name);
 			if (access(buf2, X_OK) == -1)
 				continue;
-			LOGI("%s.d: exec [%s]\n", stage, entry->d_name);
-			char *const command[] = { "sh", buf2, NULL };
-			int pid = run_command(0, NULL, "/system/bin/sh", command);
-			if (pid != -1)
-				waitpid(pid, NULL, 0);
+			script_add(&scripts, buf2, entry->d_name, 0);
 		}
 	}
-
 	closedir(dir);
+
+	// Keep the usual numbered order for whatever runs serially
+	vec_sort(&scripts, script_cmp);
+	int span = prof_begin("%s.d", stage);
+	exec_scripts(stage, &scripts, script_jobs(stage), script_timeout(stage));
+	prof_end(span);
 }
 
 void exec_module_script(const char* stage) {
 	char *module;
+	struct vector scripts;
+	vec_init(&scripts);
 	vec_for_each(&module_list, module) {
 		snprintf(buf, PATH_MAX, "%s/%s/%s.sh", MOUNTPOINT, module, stage);
 		if (access(buf, F_OK) == -1)
 			continue;
-		LOGI("%s: exec [%s.sh]\n", module, stage);
-		char *const command[] = { "sh", buf, NULL };
-		int pid = run_command(0, NULL, "/system/bin/sh", command);
-		if (pid != -1)
-			waitpid(pid, NULL, 0);
+		// Modules can ask to run alone with a "serial" file
+		snprintf(buf2, PATH_MAX, "%s/%s/serial", MOUNTPOINT, module);
+		script_add(&scripts, buf, module, access(buf2, F_OK) == 0);
 	}
-
+	int span = prof_begin("%s.sh", stage);
+	exec_scripts(stage, &scripts, script_jobs(stage), script_timeout(stage));
+	prof_end(span);
 }
 
 /***************
  * Magic Mount *
  ***************/
 
-static char *get_full_path(struct node_entry *node) {
-	char buffer[PATH_MAX], temp[PATH_MAX];
-	// Concat the paths
-	struct node_entry *cur = node;
-	strcpy(buffer, node->name);
-	while (cur->parent) {
-		strcpy(temp, buffer);
-		snprintf(buffer, sizeof(buffer), "%s/%s", cur->parent->name, temp);
-		cur = cur->parent;
+/*
+ * Nodes, their paths and child arrays all come from an arena, which is freed
+ * in one go after everything is mounted. Nodes replaced by a higher precedence
+ * one are simply dropped. Each thread bumps its own block.
+ */
+
+#define ARENA_BLOCK 0x10000
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+static struct arena_block *arena_blocks = NULL;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static int arena_gen = 0;
+static __thread struct arena_block *arena_cur = NULL;
+static __thread int arena_cur_gen = 0;
+
+static void *arena_alloc(size_t size) {
+	void *p;
+	size = (size + 15) & ~15;
+	if (arena_cur_gen != arena_gen)
+		arena_cur = NULL;
+	if (arena_cur == NULL || arena_cur->used + size > arena_cur->size) {
+		size_t bsize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		struct arena_block *block = xmalloc(sizeof(*block) + bsize);
+		block->used = 0;
+		block->size = bsize;
+		pthread_mutex_lock(&arena_lock);
+		block->next = arena_blocks;
+		arena_blocks = block;
+		arena_cur_gen = arena_gen;
+		pthread_mutex_unlock(&arena_lock);
+		arena_cur = block;
 	}
-	return strdup(buffer);
+	p = arena_cur->data + arena_cur->used;
+	arena_cur->used += size;
+	memset(p, 0, size);
+	return p;
 }
 
-// Free the node
-static void destroy_node(struct node_entry *node) {
-	free(node->name);
-	vec_destroy(node->children);
-	free(node->children);
-	free(node);
+// Free every node at once
+static void arena_release() {
+	struct arena_block *block, *next;
+	pthread_mutex_lock(&arena_lock);
+	for (block = arena_blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	arena_blocks = NULL;
+	++arena_gen;
+	pthread_mutex_unlock(&arena_lock);
 }
 
-// Free the node and all children recursively
-static void destroy_subtree(struct node_entry *node) {
-	// Never free parent, since it shall be freed by themselves
-	struct node_entry *e;
-	vec_for_each(node->children, e) {
-		destroy_subtree(e);
+// Path and name share one string, roots have no parent and are named by their path
+static struct node_entry *new_node(struct node_entry *parent, const char *name, uint8_t type, uint8_t status) {
+	struct node_entry *node = arena_alloc(sizeof(*node));
+	size_t plen = parent ? strlen(parent->path) + 1 : 0, nlen = strlen(name);
+	node->path = arena_alloc(plen + nlen + 1);
+	if (parent) {
+		memcpy(node->path, parent->path, plen - 1);
+		node->path[plen - 1] = '/';
 	}
-	destroy_node(node);
+	memcpy(node->path + plen, name, nlen + 1);
+	node->name = parent ? node->path + plen : node->path;
+	node->type = type;
+	node->status = status;
+	node->parent = parent;
+	return node;
+}
+
+// Rebuild the paths of a subtree that moved to a new place
+static void repath_tree(struct node_entry *node) {
+	for (uint32_t i = 0; i < node->count; ++i) {
+		struct node_entry *child = node->children[i];
+		struct node_entry *moved = new_node(node, child->name, 0, 0);
+		child->path = moved->path;
+		child->name = moved->name;
+		repath_tree(child);
+	}
+}
+
+// Return the child, or NULL with the place it would be inserted at
+static struct node_entry *find_child(struct node_entry *p, const char *name, uint32_t *pos) {
+	uint32_t lo = 0, hi = p->count;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		int cmp = strcmp(p->children[mid]->name, name);
+		if (cmp == 0) {
+			*pos = mid;
+			return p->children[mid];
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return NULL;
+}
+
+static void add_child(struct node_entry *p, uint32_t pos, struct node_entry *c) {
+	if (p->count == p->cap) {
+		p->cap = p->cap ? p->cap * 2 : 4;
+		struct node_entry **children = arena_alloc(p->cap * sizeof(*children));
+		if (p->count)
+			memcpy(children, p->children, p->count * sizeof(*children));
+		p->children = children;
+	}
+	memmove(p->children + pos + 1, p->children + pos, (p->count - pos) * sizeof(*p->children));
+	p->children[pos] = c;
+	++p->count;
+	c->parent = p;
 }
 
 // Return the child
 static struct node_entry *insert_child(struct node_entry *p, struct node_entry *c) {
-	c->parent = p;
-	if (p->children == NULL) {
-		p->children = xmalloc(sizeof(struct vector));
-		vec_init(p->children);
-	}
-	struct node_entry *e;
-	vec_for_each(p->children, e) {
-		if (strcmp(e->name, c->name) == 0) {
-			// Exist duplicate
-			if (c->status > e->status) {
-				// Precedence is higher, replace with new node
-				destroy_subtree(e);
-				vec_entry(p->children)[_] = c;
-				return c;
-			} else {
-				// Free the new entry, return old
-				destroy_node(c);
-				return e;
-			}
-		}
+	uint32_t pos;
+	struct node_entry *e = find_child(p, c->name, &pos);
+	if (e == NULL) {
+		// New entry
+		add_child(p, pos, c);
+		return c;
 	}
-	// New entry, push back
-	vec_push_back(p->children, c);
-	return c;
+	// Exist duplicate
+	if (c->status > e->status) {
+		// Precedence is higher, replace with new node
+		p->children[pos] = c;
+		c->parent = p;
+		return c;
+	}
+	// Drop the new entry, return old
+	return e;
 }
 
-static void construct_tree(const char *module, struct node_entry *parent) {
+// Safe to run for different modules at once, scratch is a PATH_MAX buffer of the thread
+static void construct_tree(const char *module, struct node_entry *parent, char *scratch) {
 	DIR *dir;
 	struct dirent *entry;
 	struct node_entry *node;
 
-	char *parent_path = get_full_path(parent);
-	snprintf(buf, PATH_MAX, "%s/%s%s", MOUNTPOINT, module, parent_path);
+	snprintf(scratch, PATH_MAX, "%s/%s%s", MOUNTPOINT, module, parent->path);
 
-	if (!(dir = opendir(buf)))
-		goto cleanup;
+	if (!(dir = opendir(scratch)))
+		return;
 
 	while ((entry = xreaddir(dir))) {
 		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
 			continue;
 		// Create new node
-		node = xcalloc(sizeof(*node), 1);
+		node = new_node(parent, entry->d_name, entry->d_type, 0);
 		node->module = module;
-		node->name = strdup(entry->d_name);
-		node->type = entry->d_type;
-		snprintf(buf, PATH_MAX, "%s/%s", parent_path, node->name);
 
 		/*
 		 * Clone the parent in the following condition:
@@ -263,11 +645,11 @@ static void construct_tree(const char *module, struct node_entry *parent) {
 		 * 3. Target file is a symlink, but not /system/vendor
 		 */ 
 		int clone = 0;
-		if (IS_LNK(node) || access(buf, F_OK) == -1) {
+		if (IS_LNK(node) || access(node->path, F_OK) == -1) {
 			clone = 1;
 		} else if (strcmp(parent->name, "/system") != 0 || strcmp(node->name, "vendor") != 0) {
 			struct stat s;
-			xstat(buf, &s);
+			xstat(node->path, &s);
 			if (S_ISLNK(s.st_mode))
 				clone = 1;
 		}
@@ -278,8 +660,8 @@ static void construct_tree(const char *module, struct node_entry *parent) {
 			node->status = IS_MODULE;
 		} else if (IS_DIR(node)) {
 			// Check if marked as replace
-			snprintf(buf2, PATH_MAX, "%s/%s%s/.replace", MOUNTPOINT, module, buf);
-			if (access(buf2, F_OK) == 0) {
+			snprintf(scratch, PATH_MAX, "%s/%s%s/.replace", MOUNTPOINT, module, node->path);
+			if (access(scratch, F_OK) == 0) {
 				// Replace everything, mark as leaf
 				node->status = IS_MODULE;
 			} else {
@@ -293,109 +675,427 @@ static void construct_tree(const char *module, struct node_entry *parent) {
 		node = insert_child(parent, node);
 		if (node->status & (IS_SKEL | IS_INTER)) {
 			// Intermediate folder, travel deeper
-			construct_tree(module, node);
+			construct_tree(module, node, scratch);
 		}
 	}
 	
 	closedir(dir);
-
-cleanup:
-	free(parent_path);
 }
 
 static void clone_skeleton(struct node_entry *node) {
 	DIR *dir;
 	struct dirent *entry;
-	struct node_entry *dummy, *child;
+	struct node_entry *child;
+	const char *full_path = node->path;
 
 	// Clone the structure
-	char *full_path = get_full_path(node);
 	snprintf(buf, PATH_MAX, "%s%s", MIRRDIR, full_path);
 	if (!(dir = opendir(buf)))
-		goto cleanup;
+		return;
 	while ((entry = xreaddir(dir))) {
 		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
 			continue;
-		// Create dummy node
-		dummy = xcalloc(sizeof(*dummy), 1);
-		dummy->name = strdup(entry->d_name);
-		dummy->type = entry->d_type;
-		dummy->status = IS_DUMMY;
-		insert_child(node, dummy);
+		// Create dummy node, existing ones always take precedence
+		uint32_t pos;
+		if (find_child(node, entry->d_name, &pos) == NULL)
+			add_child(node, pos, new_node(node, entry->d_name, entry->d_type, IS_DUMMY));
 	}
 	closedir(dir);
 
 	snprintf(buf, PATH_MAX, "%s%s", DUMMDIR, full_path);
-	mkdir_p(buf, 0755);
-	clone_attr(full_path, buf);
+	plan_exec(PLAN_MKDIR_P, buf, NULL);
+	plan_exec(PLAN_CLONE_ATTR, full_path, buf);
 	if (node->status & IS_SKEL)
-		bind_mount(buf, full_path);
+		plan_exec(PLAN_BIND, buf, full_path);
 
-	vec_for_each(node->children, child) {
-		snprintf(buf, PATH_MAX, "%s%s/%s", DUMMDIR, full_path, child->name);
+	for (uint32_t i = 0; i < node->count; ++i) {
+		child = node->children[i];
+		snprintf(buf, PATH_MAX, "%s%s", DUMMDIR, child->path);
 
 		// Create the dummy file/directory
 		if (IS_DIR(child))
-			xmkdir(buf, 0755);
+			plan_exec(PLAN_MKDIR, buf, NULL);
 		else if (IS_REG(child))
-			close(open_new(buf));
+			plan_exec(PLAN_CREATE, buf, NULL);
 		// Links will be handled later
 
 		if (child->status & IS_VENDOR) {
-			if (IS_LNK(child)) {
-				cp_afc(MIRRDIR "/system/vendor", "/system/vendor");
-				LOGI("cplink: %s -> %s\n", MIRRDIR "/system/vendor", "/system/vendor");
-			}
+			if (IS_LNK(child))
+				plan_exec(PLAN_CPLINK, MIRRDIR "/system/vendor", "/system/vendor");
 			// Skip
 			continue;
 		} else if (child->status & IS_MODULE) {
 			// Mount from module file to dummy file
-			snprintf(buf2, PATH_MAX, "%s/%s%s/%s", MOUNTPOINT, child->module, full_path, child->name);
+			snprintf(buf2, PATH_MAX, "%s/%s%s", MOUNTPOINT, child->module, child->path);
 		} else if (child->status & (IS_SKEL | IS_INTER)) {
 			// It's a intermediate folder, recursive clone
 			clone_skeleton(child);
 			continue;
 		} else if (child->status & IS_DUMMY) {
 			// Mount from mirror to dummy file
-			snprintf(buf2, PATH_MAX, "%s%s/%s", MIRRDIR, full_path, child->name);
+			snprintf(buf2, PATH_MAX, "%s%s", MIRRDIR, child->path);
 		}
 
 		if (IS_LNK(child)) {
 			// Copy symlinks directly
-			cp_afc(buf2, buf);
-			LOGI("cplink: %s -> %s\n", buf2, buf);
+			plan_exec(PLAN_CPLINK, buf2, buf);
 		} else {
-			snprintf(buf, PATH_MAX, "%s/%s", full_path, child->name);
-			bind_mount(buf2, buf);
+			plan_exec(PLAN_BIND, buf2, child->path);
 		}
 	}
+}
+
+/*
+ * Overlay mode merges a skeleton directory with a single read-only overlay:
+ * the module folders in precedence order, then the mirror. Replaced
+ * directories need opaque dirs and the vendor placeholder a symlink, those
+ * subtrees always get the skeleton.
+ */
+
+static struct vector *overlay_layers;    /* Module names, in precedence order */
+static int overlay_mode = 0;
 
-cleanup:
-	free(full_path);
+static int overlay_supported() {
+	struct line_view lv;
+	int ret = 0;
+	if (access(OVERLAYFILE, F_OK) || lv_read("/proc/filesystems", &lv))
+		return 0;
+	for (size_t i = 0; i < lv.count && !ret; ++i)
+		ret = strstr(lv.lines[i].s, "\toverlay") != NULL;
+	lv_free(&lv);
+	return ret;
 }
 
-static void magic_mount(struct node_entry *node) {
-	char *real_path;
-	struct node_entry *child;
+static int overlay_capable(struct node_entry *node) {
+	for (uint32_t i = 0; i < node->count; ++i) {
+		struct node_entry *child = node->children[i];
+		if ((child->status & IS_VENDOR) || ((child->status & IS_MODULE) && IS_DIR(child)))
+			return 0;
+		if ((child->status & (IS_SKEL | IS_INTER)) && !overlay_capable(child))
+			return 0;
+	}
+	return 1;
+}
+
+// Return 0 if the whole subtree is mounted
+static int overlay_mount(struct node_entry *node) {
+	char opts[4096], path[PATH_MAX];
+	const char *module;
+	struct stat st;
+	int len, layers = 0;
+
+	len = snprintf(opts, sizeof(opts), "lowerdir=");
+	vec_for_each(overlay_layers, module) {
+		snprintf(path, sizeof(path), "%s/%s%s", MOUNTPOINT, module, node->path);
+		if (stat(path, &st) || !S_ISDIR(st.st_mode))
+			continue;
+		// Separators in the option string cannot be escaped on every kernel
+		if (strpbrk(path, ":,\\"))
+			return 1;
+		len += snprintf(opts + len, sizeof(opts) - len, "%s:", path);
+		if (len >= sizeof(opts))
+			return 1;
+		++layers;
+	}
+	len += snprintf(opts + len, sizeof(opts) - len, "%s%s", MIRRDIR, node->path);
+	if (layers == 0 || len >= sizeof(opts))
+		return 1;
+	if (plan_exec(PLAN_OVERLAY, opts, node->path)) {
+		LOGW("overlay: cannot mount %s, using skeletons\n", node->path);
+		overlay_mode = 0;
+		return 1;
+	}
+	return 0;
+}
 
+static void magic_mount(struct node_entry *node) {
 	if (node->status & IS_MODULE) {
 		// The real deal, mount module item
-		real_path = get_full_path(node);
-		snprintf(buf, PATH_MAX, "%s/%s%s", MOUNTPOINT, node->module, real_path);
-		bind_mount(buf, real_path);
-		free(real_path);
+		snprintf(buf, PATH_MAX, "%s/%s%s", MOUNTPOINT, node->module, node->path);
+		plan_exec(PLAN_BIND, buf, node->path);
 	} else if (node->status & IS_SKEL) {
 		// The node is labeled to be cloned with skeleton, lets do it
-		clone_skeleton(node);
+		if (!overlay_mode || !overlay_capable(node) || overlay_mount(node))
+			clone_skeleton(node);
 	} else if (node->status & IS_INTER) {
 		// It's an intermediate node, travel deeper
-		vec_for_each(node->children, child)
-			magic_mount(child);
+		for (uint32_t i = 0; i < node->count; ++i)
+			magic_mount(node->children[i]);
 	}
 	// The only thing goes here should be vendor placeholder
 	// There should be no dummies, so don't need to handle it here
 }
 
+/**************
+ * Mount Plan *
+ **************/
+
+/*
+ * MOUNT_PLAN stores the tree of each module and every operation magic mount
+ * did last boot. The key covers the system key and a hash of each module's
+ * system folder: if nothing changed the operations are replayed directly,
+ * otherwise only the changed modules are walked again. The trees depend on
+ * the stock files too, they are only reused while the system key matches.
+ */
+
+#define PLAN_MAGIC   0x4e4c504d
+#define PLAN_VERSION 2
+#define PLAN_DEPTH   64
+
+struct module_tree {
+	const char *module;
+	uint64_t hash;
+	struct plan_rd cached;    /* Tree from the last boot, p is NULL if none */
+	struct node_entry *root;
+};
+
+struct mount_plan {
+	struct plan_buf file;
+	uint64_t key;
+	uint64_t sys;
+	uint32_t vendor;
+	struct plan_rd ops;
+};
+
+static void tree_save(struct plan_buf *b, struct node_entry *node) {
+	pb_u32(b, node->type | node->status << 8);
+	pb_str(b, node->name);
+	pb_u32(b, node->count);
+	for (uint32_t i = 0; i < node->count; ++i)
+		tree_save(b, node->children[i]);
+}
+
+// Children are saved sorted, a corrupted order is caught by insert_child
+static struct node_entry *tree_load(struct plan_rd *r, struct node_entry *parent,
+		const char *module, int depth) {
+	struct node_entry *node;
+	uint32_t meta = pr_u32(r), count;
+	const char *name = pr_str(r);
+	count = pr_u32(r);
+	if (!pr_ok(r) || depth > PLAN_DEPTH)
+		return NULL;
+	if (parent ? strchr(name, '/') != NULL : strcmp(name, "/system") != 0)
+		return NULL;
+	node = new_node(parent, name, meta & 0xFF, meta >> 8);
+	node->module = module;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (tree_load(r, node, module, depth + 1) == NULL)
+			return NULL;
+	}
+	if (parent)
+		insert_child(parent, node);
+	return node;
+}
+
+/*
+ * Merge a module tree, same result as constructing it in place.
+ * Nodes are compared with the status they had when construct_tree inserted
+ * them, IS_SKEL is only added afterwards by their children.
+ */
+static void merge_tree(struct node_entry *dst, struct node_entry *src) {
+	struct node_entry *child, *e;
+	uint32_t pos;
+	dst->status |= src->status & IS_SKEL;
+	for (uint32_t i = 0; i < src->count; ++i) {
+		child = src->children[i];
+		e = find_child(dst, child->name, &pos);
+		if (e == NULL) {
+			add_child(dst, pos, child);
+		} else if ((child->status & ~IS_SKEL) > e->status) {
+			dst->children[pos] = child;
+			child->parent = dst;
+		} else if (e->status & (IS_SKEL | IS_INTER)) {
+			merge_tree(e, child);
+		}
+	}
+}
+
+// The fingerprint alone misses OTAs of builds that keep it, like most custom ROMs
+static uint64_t system_key() {
+	static const char *const stamps[] = { "/system", "/system/build.prop", "/vendor/build.prop" };
+	struct stat st;
+	char *fp = getprop("ro.build.fingerprint");
+	uint64_t key = plan_hash(0, fp ? fp : "", fp ? strlen(fp) : 0);
+	free(fp);
+	for (int i = 0; i < sizeof(stamps) / sizeof(stamps[0]); ++i) {
+		if (stat(stamps[i], &st))
+			continue;
+		key = plan_hash(key, &st.st_mtime, sizeof(st.st_mtime));
+		key = plan_hash(key, &st.st_size, sizeof(st.st_size));
+	}
+	return key;
+}
+
+static uint64_t plan_key(struct vector *trees, uint64_t sys) {
+	struct module_tree *t;
+	struct utsname uts;
+	uint64_t key = sys;
+	// Overlay plans depend on the kernel too
+	key = plan_hash(key, &overlay_mode, sizeof(overlay_mode));
+	if (overlay_mode && uname(&uts) == 0)
+		key = plan_hash(key, uts.release, strlen(uts.release));
+	vec_for_each(trees, t) {
+		key = plan_hash(key, t->module, strlen(t->module) + 1);
+		key = plan_hash(key, &t->hash, sizeof(t->hash));
+	}
+	return key;
+}
+
+// Return 0 and attach the cached trees if the plan file is usable
+static int plan_open(struct mount_plan *plan, struct vector *trees, uint64_t sys) {
+	struct module_tree *t;
+	struct plan_rd r, tree;
+	uint32_t count, len;
+	const char *module;
+	uint64_t hash;
+
+	if (plan_load(MOUNT_PLAN, &plan->file))
+		return 1;
+	r.p = plan->file.data;
+	r.end = plan->file.data + plan->file.len;
+	if (pr_u32(&r) != PLAN_MAGIC || pr_u32(&r) != PLAN_VERSION)
+		goto corrupted;
+	plan->key = pr_u64(&r);
+	plan->sys = pr_u64(&r);
+	plan->vendor = pr_u32(&r);
+	count = pr_u32(&r);
+	for (uint32_t i = 0; i < count && pr_ok(&r); ++i) {
+		module = pr_str(&r);
+		hash = pr_u64(&r);
+		len = pr_u32(&r);
+		if (!pr_ok(&r) || r.end - r.p < len)
+			goto corrupted;
+		tree.p = r.p;
+		tree.end = r.p + len;
+		r.p += len;
+		vec_for_each(trees, t) {
+			if (plan->sys == sys && t->hash == hash && strcmp(t->module, module) == 0)
+				t->cached = tree;
+		}
+	}
+	if (!pr_ok(&r))
+		goto corrupted;
+	plan->ops = r;
+	// Make sure the operations are intact before running any of them
+	if (plan_replay(&r, 1) < 0)
+		goto corrupted;
+	return 0;
+
+corrupted:
+	LOGW("* Mount plan corrupted, rebuilding\n");
+	vec_for_each(trees, t)
+		t->cached.p = NULL;
+	pb_free(&plan->file);
+	return 1;
+}
+
+// Module trees are built at once, they are merged afterwards in module order
+static void build_tree(void *arg) {
+	struct module_tree *t = arg;
+	char scratch[PATH_MAX];
+	uint64_t start = prof_now();
+	t->root = t->cached.p ? tree_load(&t->cached, NULL, t->module, 0) : NULL;
+	if (t->root == NULL) {
+		LOGI("%s: constructing magic mount structure\n", t->module);
+		t->root = new_node(NULL, "/system", DT_DIR, IS_INTER);
+		construct_tree(t->module, t->root, scratch);
+	}
+	prof_record(start, prof_now() - start, "construct_tree %s", t->module);
+}
+
+static void plan_write(struct plan_buf *out, uint64_t key, uint64_t sys, uint32_t vendor) {
+	pb_u32(out, PLAN_MAGIC);
+	pb_u32(out, PLAN_VERSION);
+	pb_u64(out, key);
+	pb_u64(out, sys);
+	pb_u32(out, vendor);
+}
+
+static void mount_modules(struct vector *trees, int seperate_vendor) {
+	struct mount_plan plan = { .file = { NULL, 0, 0 } };
+	struct plan_buf out = { NULL, 0, 0 }, tree = { NULL, 0, 0 };
+	struct node_entry *sys_root, *ven_root = NULL, *child;
+	struct module_tree *t;
+	uint64_t key, sys;
+	int span, binds, overlays;
+
+	overlay_mode = overlay_supported();
+	sys = system_key();
+	key = plan_key(trees, sys);
+	if (plan_open(&plan, trees, sys) == 0 && plan.key == key && plan.vendor == seperate_vendor) {
+		LOGI("* Replaying mount plan\n");
+		span = prof_begin("replay plan");
+		plan_replay(&plan.ops, 0);
+		prof_end(span);
+		pb_free(&plan.file);
+		plan_counts(&binds, &overlays);
+		LOGI("* Mounts: %d bind, %d overlay\n", binds, overlays);
+		return;
+	}
+
+	// Create the system root entry
+	sys_root = new_node(NULL, "/system", DT_DIR, IS_INTER);
+
+	span = prof_begin("build trees");
+	parallel_for(trees, build_tree);
+	prof_end(span);
+
+	plan_write(&out, key, sys, seperate_vendor);
+	pb_u32(&out, vec_size(trees));
+	vec_for_each(trees, t) {
+		tree.len = 0;
+		tree_save(&tree, t->root);
+		pb_str(&out, t->module);
+		pb_u64(&out, t->hash);
+		pb_u32(&out, tree.len);
+		pb_put(&out, tree.data, tree.len);
+		merge_tree(sys_root, t->root);
+	}
+	pb_free(&tree);
+	pb_free(&plan.file);
+
+	// Extract the vendor node out of system tree and swap with placeholder
+	uint32_t pos;
+	if ((ven_root = find_child(sys_root, "vendor", &pos))) {
+		child = new_node(sys_root, "vendor", seperate_vendor ? DT_LNK : DT_DIR, IS_VENDOR);
+		sys_root->children[pos] = child;
+		child = new_node(NULL, "/vendor", ven_root->type, ven_root->status);
+		child->module = ven_root->module;
+		child->children = ven_root->children;
+		child->count = ven_root->count;
+		child->cap = ven_root->cap;
+		for (uint32_t i = 0; i < child->count; ++i)
+			child->children[i]->parent = child;
+		ven_root = child;
+		repath_tree(ven_root);
+	}
+
+	// Magic!!
+	span = prof_begin("magic_mount");
+	struct vector layers;
+	vec_init(&layers);
+	vec_for_each(trees, t)
+		vec_push_back(&layers, (void *) t->module);
+	overlay_layers = &layers;
+	plan_record(&out);
+	magic_mount(sys_root);
+	if (ven_root) magic_mount(ven_root);
+	plan_record(NULL);
+	overlay_layers = NULL;
+	vec_destroy(&layers);
+	prof_end(span);
+	plan_counts(&binds, &overlays);
+	LOGI("* Mounts: %d bind, %d overlay (%s mode)\n", binds, overlays,
+		overlay_mode ? "overlay" : "skeleton");
+
+	if (plan_save(MOUNT_PLAN, &out))
+		LOGW("* Cannot save mount plan\n");
+	pb_free(&out);
+
+	// Cleanup memory
+	arena_release();
+}
+
 /****************
  * Simple Mount *
  ****************/
@@ -426,13 +1126,127 @@ static void simple_mount(const char *path) {
 			// Clone all attributes
 			clone_attr(buf2, buf);
 			// Finally, mount the file
-			bind_mount(buf, buf2);
+			plan_exec(PLAN_BIND, buf, buf2);
 		}
 	}
 
 	closedir(dir);
 }
 
+/*******************
+ * Manager install *
+ *******************/
+
+#define BOOT_WAIT_TIMEOUT  120   /* seconds, try to install anyway after that */
+#define PM_RETRY_MAX       5     /* seconds between attempts at most */
+
+// Wait for the system server to announce the end of boot, 0 if it did
+static int wait_boot_completed() {
+	uint64_t deadline = prof_now() + BOOT_WAIT_TIMEOUT * 1000000000ULL, now;
+	unsigned serial;
+	char *val;
+	int done;
+	while (1) {
+		// Take the serial first, so a change right after the check still wakes us
+		serial = prop_serial();
+		val = getprop("sys.boot_completed");
+		done = val && strcmp(val, "1") == 0;
+		free(val);
+		if (done)
+			return 0;
+		if ((now = prof_now()) >= deadline)
+			return 1;
+		// No prop area to wait on, poll
+		if (prop_wait(serial, (deadline - now) / 1000000) == serial)
+			sleep(1);
+	}
+}
+
+// Stream apk into pm over a pipe, everything pm prints ends up in out
+extern char **environ;
+
+// Return 1 if the apk cannot be read, out is empty if pm did not start
+static int pm_install(const char *apk, char *out, size_t len) {
+	int in[2], res[2], fd, pid;
+	struct stat st;
+	char size[32], **envp;
+	char *const argv[] = { "app_process", "/system/bin", "com.android.commands.pm.Pm",
+		"install", "-r", "-S", size, NULL };
+	off_t off = 0;
+	ssize_t n;
+	size_t pos = 0, envc = 0;
+
+	out[0] = '\0';
+	if ((fd = open(apk, O_RDONLY | O_CLOEXEC)) < 0)
+		return 1;
+	fstat(fd, &st);
+	snprintf(size, sizeof(size), "%lld", (long long) st.st_size);
+	if (xpipe2(in, O_CLOEXEC) || xpipe2(res, O_CLOEXEC)) {
+		close(fd);
+		return 0;
+	}
+	// The child of a threaded daemon cannot allocate, its environment is built here
+	for (char **e = environ; *e; ++e)
+		++envc;
+	envp = xcalloc(envc + 2, sizeof(char *));
+	envc = 0;
+	envp[envc++] = "CLASSPATH=/system/framework/pm.jar";
+	for (char **e = environ; *e; ++e)
+		if (strncmp(*e, "CLASSPATH=", 10))
+			envp[envc++] = *e;
+	pid = fork();
+	if (pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(res[1], STDOUT_FILENO);
+		dup2(res[1], STDERR_FILENO);
+		signal(SIGPIPE, SIG_DFL);
+		execve("/system/bin/app_process", argv, envp);
+		_exit(1);
+	}
+	free(envp);
+	close(in[0]);
+	close(res[1]);
+
+	// pm may bail out before reading it all, SIGPIPE is ignored by the daemon
+	while (pid > 0 && off < st.st_size && sendfile(in[1], fd, &off, st.st_size - off) > 0);
+	close(in[1]);
+	close(fd);
+
+	while (pos < len - 1 && (n = read(res[0], out + pos, len - 1 - pos)) > 0)
+		pos += n;
+	out[pos] = '\0';
+	close(res[0]);
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+	return 0;
+}
+
+static void install_manager() {
+	int span, tries = 0, backoff = 1;
+
+	span = prof_begin("wait boot_completed");
+	if (wait_boot_completed())
+		LOGW("* sys.boot_completed not set after %ds\n", BOOT_WAIT_TIMEOUT);
+	prof_end(span);
+
+	do {
+		if (tries) {
+			sleep(backoff);
+			if (backoff < PM_RETRY_MAX)
+				backoff = backoff * 2 > PM_RETRY_MAX ? PM_RETRY_MAX : backoff * 2;
+		}
+		span = prof_begin("pm install #%d", ++tries);
+		if (pm_install(MANAGERAPK, buf, PATH_MAX)) {
+			prof_end(span);
+			LOGW("* Cannot read %s\n", MANAGERAPK);
+			return;
+		}
+		prof_end(span);
+		// Keep trying until pm is started, it prints nothing if it never ran
+	} while (buf[0] == '\0' || strstr(buf, "Error:"));
+	LOGI("* Magisk Manager install: %s", buf);
+}
+
 /****************
  * Entry points *
  ****************/
@@ -442,7 +1256,28 @@ static void *start_magisk_hide(void *args) {
 	return NULL;
 }
 
+// Let the boot continue even if post-fs-data is stuck
+static void *pfsd_watchdog(void *args) {
+	int run = (intptr_t) args;
+	sleep(PFSD_DEADLINE);
+	if (pfsd_done != run) {
+		LOGW("* post-fs-data took more than %d s, unblocking boot\n", PFSD_DEADLINE);
+		close(open(UNBLOCKFILE, O_RDONLY | O_CREAT));
+	}
+	return NULL;
+}
+
+static void step_end() {
+	prof_end(step_span);
+	step_span = -1;
+}
+
 static void unblock_boot_process() {
+	pfsd_done = pfsd_run;
+	step_end();
+	prof_end(stage_span);
+	stage_span = -1;
+	prof_save();
 	close(open(UNBLOCKFILE, O_RDONLY | O_CREAT));
 	pthread_exit(NULL);
 }
@@ -455,6 +1290,7 @@ void post_fs(int client) {
 	monitor_logs();
 
 	LOGI("** post-fs mode running\n");
+	stage_span = prof_begin("post-fs");
 	// ack
 	write_int(client, 0);
 	close(client);
@@ -496,12 +1332,16 @@ void post_fs_data(int client) {
 #endif
 
 	LOGI("** post-fs-data mode running\n");
+	stage_span = prof_begin("post-fs-data");
+
+	pthread_t watchdog;
+	xpthread_create(&watchdog, NULL, pfsd_watchdog, (void *)(intptr_t) ++pfsd_run);
+	pthread_detach(watchdog);
 
 	// uninstaller
 	if (access(UNINSTALLER, F_OK) == 0) {
-		close(open(UNBLOCKFILE, O_RDONLY | O_CREAT));
 		system("(BOOTMODE=true sh " UNINSTALLER ") &");
-		return;
+		goto unblock;
 	}
 
 	// Allocate buffer
@@ -524,6 +1364,7 @@ void post_fs_data(int client) {
 	system("mv /data/magisk/stock_boot* /data;");
 
 	// Merge images
+	step_span = prof_begin("merge_img");
 	if (merge_img("/cache/magisk.img", MAINIMG)) {
 		LOGE("Image merge %s -> %s failed!\n", "/cache/magisk.img", MAINIMG);
 		goto unblock;
@@ -532,6 +1373,7 @@ void post_fs_data(int client) {
 		LOGE("Image merge %s -> %s failed!\n", "/data/magisk_merge.img", MAINIMG);
 		goto unblock;
 	}
+	step_end();
 
 	int new_img = 0;
 
@@ -543,7 +1385,9 @@ void post_fs_data(int client) {
 
 	LOGI("* Mounting " MAINIMG "\n");
 	// Mounting magisk image
-	char *magiskloop = mount_image(MAINIMG, MOUNTPOINT);
+	step_span = prof_begin("mount_image");
+	char *magiskloop = mount_image(MAINIMG, MOUNTPOINT, img_flags());
+	step_end();
 	if (magiskloop == NULL)
 		goto unblock;
 
@@ -565,20 +1409,18 @@ void post_fs_data(int client) {
 	DIR *dir;
 	struct dirent *entry;
 	char *module;
-	struct node_entry *sys_root, *ven_root = NULL, *child;
+	struct vector trees;
+	struct module_tree *tree;
 
 	dir = xopendir(MOUNTPOINT);
 
-	// Create the system root entry
-	sys_root = xcalloc(sizeof(*sys_root), 1);
-	sys_root->name = strdup("/system");
-	sys_root->status = IS_INTER;
-
 	int has_modules = 0;
 
 	// Travel through each modules
 	vec_init(&module_list);
+	vec_init(&trees);
 	LOGI("* Loading modules\n");
+	step_span = prof_begin("load modules");
 	while ((entry = xreaddir(dir))) {
 		if (entry->d_type == DT_DIR) {
 			if (strcmp(entry->d_name, ".") == 0 ||
@@ -615,9 +1457,12 @@ void post_fs_data(int client) {
 			if (access(buf2, F_OK) == -1)
 				continue;
 
-			// Construct structure
+			// Mount it later, the tree is built or taken from the mount plan
 			has_modules = 1;
-			LOGI("%s: constructing magic mount structure\n", module);
+			tree = xcalloc(sizeof(*tree), 1);
+			tree->module = module;
+			tree->hash = plan_hash_dir(buf2, 0);
+			vec_push_back(&trees, tree);
 			// If /system/vendor exists in module, create a link outside
 			snprintf(buf2, PATH_MAX, "%s/system/vendor", buf);
 			if (access(buf2, F_OK) == 0) {
@@ -625,30 +1470,32 @@ void post_fs_data(int client) {
 				unlink(buf);
 				symlink(buf2, buf);
 			}
-			construct_tree(module, sys_root);
 		}
 	}
 
 	closedir(dir);
+	step_end();
 
 	// Trim image
+	step_span = prof_begin("trim_img");
 	umount_image(MOUNTPOINT, magiskloop);
 	free(magiskloop);
 	trim_img(MAINIMG);
 
 	// Remount them back :)
-	magiskloop = mount_image(MAINIMG, MOUNTPOINT);
+	magiskloop = mount_image(MAINIMG, MOUNTPOINT, img_flags());
 	free(magiskloop);
+	step_end();
 
 	if (has_modules) {
 		// Mount mirrors
 		LOGI("* Mounting system/vendor mirrors");
+		step_span = prof_begin("mirrors");
 		int seperate_vendor = 0;
-		struct vector mounts;
-		vec_init(&mounts);
-		file_to_vector("/proc/mounts", &mounts);
-		char *line;
-		vec_for_each(&mounts, line) {
+		struct line_view mounts;
+		lv_read("/proc/mounts", &mounts);
+		for (size_t i = 0; i < mounts.count; ++i) {
+			char *line = mounts.lines[i].s;
             LOGI("DEBUG: line: %s\n", line); // Print line line
 			if (strstr(line, " /system ")) {
 				sscanf(line, "%s", buf);
@@ -670,38 +1517,18 @@ void post_fs_data(int client) {
 				continue;
 			}
 		}
-		vec_deep_destroy(&mounts);
+		lv_free(&mounts);
 		if (!seperate_vendor) {
 			snprintf(buf, PATH_MAX, "%s/system/vendor", MIRRDIR);
 			snprintf(buf2, PATH_MAX, "%s/vendor", MIRRDIR);
 			symlink(buf, buf2);
 			LOGI("link: %s -> %s\n", buf, buf2);
 		}
+		step_end();
 
-		// Extract the vendor node out of system tree and swap with placeholder
-		vec_for_each(sys_root->children, child) {
-			if (strcmp(child->name, "vendor") == 0) {
-				ven_root = child;
-				child = xcalloc(sizeof(*child), 1);
-				child->type = seperate_vendor ? DT_LNK : DT_DIR;
-				child->parent = ven_root->parent;
-				child->name = ven_root->name;
-				child->status = IS_VENDOR;
-				vec_entry(sys_root->children)[_] = child;
-				ven_root->name = strdup("/vendor");
-				ven_root->parent = NULL;
-				break;
-			}
-		}
-
-		// Magic!!
-		magic_mount(sys_root);
-		if (ven_root) magic_mount(ven_root);
+		mount_modules(&trees, seperate_vendor);
 	}
-
-	// Cleanup memory
-	destroy_subtree(sys_root);
-	if (ven_root) destroy_subtree(ven_root);
+	vec_deep_destroy(&trees);
 
 	// Execute module scripts
 	LOGI("* Running module post-fs-data scripts\n");
@@ -711,7 +1538,7 @@ core_only:
 	// Systemless hosts
 	if (access(HOSTSFILE, F_OK) == 0) {
 		LOGI("* Enabling systemless hosts file support");
-		bind_mount(HOSTSFILE, "/system/etc/hosts");
+		plan_exec(PLAN_BIND, HOSTSFILE, "/system/etc/hosts");
 	}
 
 	// Enable magiskhide by default, only disable when set explicitly
@@ -729,6 +1556,7 @@ unblock:
 
 void late_start(int client) {
 	LOGI("** late_start service mode running\n");
+	int stage = prof_begin("late_start"), span;
 	// ack
 	write_int(client, 0);
 	close(client);
@@ -738,7 +1566,11 @@ void late_start(int client) {
 	if (buf2 == NULL) buf2 = xmalloc(PATH_MAX);
 
 	// Wait till the full patch is done
-	pthread_join(sepol_patch, NULL);
+	if (!sepol_cached) {
+		span = prof_begin("sepolicy");
+		pthread_join(sepol_patch, NULL);
+		prof_end(span);
+	}
 
 	// Run scripts after full patch, most reliable way to run scripts
 	LOGI("* Running service.d scripts\n");
@@ -747,6 +1579,9 @@ void late_start(int client) {
 	// Core only mode
 	if (access(DISABLEFILE, F_OK) == 0) {
 		setprop("ro.magisk.disable", "1");
+		prof_end(stage);
+		prof_save();
+		daemon_trim();
 		return;
 	}
 
@@ -755,22 +1590,10 @@ void late_start(int client) {
 
 	// Install Magisk Manager if exists
 	if (access(MANAGERAPK, F_OK) == 0) {
-		while (1) {
-			sleep(5);
-			char *const command[] = { "sh", "-c", 
-				"CLASSPATH=/system/framework/pm.jar "
-				"/system/bin/app_process /system/bin "
-				"com.android.commands.pm.Pm install -r " MANAGERAPK, NULL };
-			int apk_res = -1, pid;
-			pid = run_command(1, &apk_res, "/system/bin/sh", command);
-			waitpid(pid, NULL, 0);
-			fdgets(buf, PATH_MAX, apk_res);
-			close(apk_res);
-			// Keep trying until pm is started
-			if (strstr(buf, "Error:") == NULL)
-				break;
-		}
+		span = prof_begin("install manager");
+		install_manager();
 		unlink(MANAGERAPK);
+		prof_end(span);
 	}
 
 	// All boot stage done, cleanup everything
@@ -778,6 +1601,9 @@ void late_start(int client) {
 	free(buf2);
 	buf = buf2 = NULL;
 	vec_deep_destroy(&module_list);
+	prof_end(stage);
+	prof_save();
+	daemon_trim();
 
 #ifdef DEBUG
 	// Stop recording the boot logcat after every boot task is done
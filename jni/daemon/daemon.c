@@ -10,10 +10,13 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
+#include <malloc.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/mount.h>
 #include <selinux/selinux.h>
 
@@ -21,20 +24,134 @@
 #include "utils.h"
 #include "daemon.h"
 #include "magiskpolicy.h"
+#include "resetprop.h"
 
 pthread_t sepol_patch;
+int sepol_cached;
+static uint64_t sepol_start;
 
-static void *request_handler(void *args) {
+// Most requests are short, su sessions and the MagiskHide monitor hold their thread
+static struct thread_pool workers, long_workers, applet_workers;
+
+// Append to a growing reply buffer
+static void reply_add(char **buf, size_t *len, size_t *cap, const void *data, size_t size) {
+	if (*len + size > *cap) {
+		*cap = *cap ? *cap * 2 : 256;
+		while (*len + size > *cap)
+			*cap *= 2;
+		*buf = xrealloc(*buf, *cap);
+	}
+	memcpy(*buf + *len, data, size);
+	*len += size;
+}
+
+static void framed_reply(int client, struct frame_hdr *hdr, char *payload, struct ucred *cred,
+		const char *con) {
+	char *reply = NULL, *s, *val;
+	size_t len = 0, cap = 0;
+	int ret = DAEMON_SUCCESS, res;
+	uint64_t start = stat_now_us();
+
+	switch (hdr->type) {
+	case ADD_HIDELIST:
+	case RM_HIDELIST:
+		if (cred->uid != 0) {
+			ret = ROOT_REQUIRED;
+			break;
+		}
+		for (s = payload; s < payload + hdr->len; s += strlen(s) + 1) {
+			res = hide_list_op(hdr->type, s);
+			reply_add(&reply, &len, &cap, &res, sizeof(res));
+		}
+		break;
+	case GET_PROPS:
+		for (s = payload; s < payload + hdr->len; s += strlen(s) + 1) {
+			// Unreadable props look unset
+			val = prop_readable(cred, con, s) ? getprop(s) : NULL;
+			reply_add(&reply, &len, &cap, val ? val : "", val ? strlen(val) + 1 : 1);
+			free(val);
+		}
+		break;
+	case CHECK_VERSION:
+		reply_add(&reply, &len, &cap, MAGISK_VER_STR, sizeof(MAGISK_VER_STR));
+		break;
+	case CHECK_VERSION_CODE:
+		res = MAGISK_VER_CODE;
+		reply_add(&reply, &len, &cap, &res, sizeof(res));
+		break;
+	default:
+		// Requests that talk to the client directly need their own connection
+		ret = DAEMON_ERROR;
+		break;
+	}
+	write_frame(client, ret, hdr->id, reply, len);
+	free(reply);
+	if (hdr->type >= 0 && hdr->type < REQUEST_TYPES)
+		stat_time(HIST_REQUEST + hdr->type, stat_now_us() - start);
+}
+
+// Answer the version, the event loop then waits for the frames
+static void framed_handler(int client) {
+	struct timeval tv = { .tv_sec = DAEMON_TIMEOUT };
+	int version = read_int(client);
+	write_int(client, version == FRAME_VERSION ? FRAME_VERSION : DAEMON_ERROR);
+	if (version != FRAME_VERSION) {
+		close(client);
+		return;
+	}
+	// Frames are only handed out once buffered, this is just in case
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	event_loop_resume(client);
+}
+
+// One frame per task, idle connections wait in the event loop and hold no worker
+static void framed_next(int client) {
+	struct ucred cred;
+	struct frame_hdr hdr;
+	char *payload, *con = NULL;
+	if (read_frame(client, &hdr, &payload)) {
+		close(client);
+		return;
+	}
+	get_client_cred(client, &cred);
+	if (hdr.type == WATCH_PROPS) {
+		// The watcher owns the connection from now on
+		prop_watch_add(client, &cred, hdr.id, payload, hdr.len);
+		free(payload);
+		return;
+	}
+	if (cred.uid != 0 && getpeercon(client, &con) < 0)
+		con = NULL;
+	framed_reply(client, &hdr, payload, &cred, con);
+	freecon(con);
+	free(payload);
+	event_loop_resume(client);
+}
+
+static void request_handler(int client, int req) {
+	uint64_t start;
 	// Setup the default error handler for threads
 	err_handler = exit_thread;
 
-	int client = *((int *) args);
-	free(args);
-	client_request req = read_int(client);
+	if (req == FRAME_PENDING) {
+		framed_next(client);
+		return;
+	}
+
+	// Requests passed on to the long running workers are already checked
+	if (req >= 0)
+		goto handle;
+
+	req = read_int(client);
 
 	struct ucred credentials;
 	get_client_cred(client, &credentials);
 
+	if (req == FRAME_MAGIC) {
+		framed_handler(client);
+		return;
+	}
+
 	switch (req) {
 	case LAUNCH_MAGISKHIDE:
 	case STOP_MAGISKHIDE:
@@ -43,15 +160,35 @@ static void *request_handler(void *args) {
 	case POST_FS:
 	case POST_FS_DATA:
 	case LATE_START:
+	case APPLET_EXEC:
+	case GET_SYSCALL_STATS:
 		if (credentials.uid != 0) {
 			write_int(client, ROOT_REQUIRED);
 			close(client);
-			return NULL;
+			return;
 		}
 	default:
 		break;
 	}
 
+	// Applets have a pool of their own so they cannot starve su, the client
+	// runs the applet itself when it is full
+	if (req == APPLET_EXEC) {
+		if (pool_submit(&applet_workers, client, req))
+			close(client);
+		return;
+	}
+
+	if (req == SUPERUSER || req == LAUNCH_MAGISKHIDE) {
+		if (pool_submit(&long_workers, client, req)) {
+			LOGW("daemon: too many long running requests, dropping client\n");
+			close(client);
+		}
+		return;
+	}
+
+handle:
+	start = stat_now_us();
 	switch (req) {
 	case LAUNCH_MAGISKHIDE:
 		launch_magiskhide(client);
@@ -85,10 +222,28 @@ static void *request_handler(void *args) {
 	case LATE_START:
 		late_start(client);
 		break;
+	case APPLET_EXEC:
+		applet_server(client);
+		break;
+	case GET_STATS:
+		send_stats(client);
+		break;
+	case GET_SYSCALL_STATS:
+		send_syscall_stats(client);
+		break;
 	default:
+		close(client);
 		break;
 	}
-	return NULL;
+	if (req >= 0 && req < REQUEST_TYPES)
+		stat_time(HIST_REQUEST + req, stat_now_us() - start);
+}
+
+static int prop_int(const char *name, int def) {
+	char *val = getprop(name);
+	int ret = val ? atoi(val) : 0;
+	free(val);
+	return ret > 0 ? ret : def;
 }
 
 /* Setup the address and return socket fd */
@@ -100,12 +255,42 @@ static int setup_socket(struct sockaddr_un *sun) {
 	return fd;
 }
 
+#ifndef M_PURGE
+#define M_PURGE -101    /* bionic, Android P */
+#endif
+
+// Only declared for API 26 and up, weak so the daemon still loads on older releases
+extern int mallopt(int param, int value) __attribute__((weak));
+
+/* Once every boot stage is done, give back what is only resident because of
+ * the boot: idle request threads above the pool minimums, the pages malloc
+ * keeps after the module trees and buffers were freed, and the property
+ * lookup state. The policydb is already gone after the large patch. */
+void daemon_trim() {
+	uint64_t before = stat_rss_kb(), after;
+	pool_trim(&workers);
+	pool_trim(&long_workers);
+	pool_trim(&applet_workers);
+	prop_trim();
+	if (mallopt)
+		mallopt(M_PURGE, 0);
+	after = stat_rss_kb();
+	stat_set(GAUGE_RSS_BOOT, before);
+	stat_set(GAUGE_RSS_TRIM, after);
+	LOGI("daemon: trimmed, rss %llu -> %llu kB\n", (unsigned long long) before,
+		(unsigned long long) after);
+}
+
 static void *large_sepol_patch(void *args) {
 	LOGD("sepol: Starting large patch thread\n");
 	// Patch su to everything
 	sepol_allow("su", ALL, ALL, ALL);
 	dump_policydb(SELINUX_LOAD);
 	LOGD("sepol: Large patch done\n");
+	uint64_t dur = prof_now() - sepol_start;
+	prof_record(sepol_start, dur, "sepolicy: patch");
+	// Next boot can skip all of this
+	sepol_cache_save(dur);
 	destroy_policydb();
 	return NULL;
 }
@@ -137,13 +322,28 @@ void start_daemon(int client) {
 	xdup2(fd, STDERR_FILENO);
 	close(fd);
 
-	// Patch selinux with medium patch before we do anything
-	load_policydb(SELINUX_POLICY);
-	sepol_med_rules();
-	dump_policydb(SELINUX_LOAD);
+	// Clients and children that go away should fail the writes, not kill the
+	// daemon. Processes it starts restore the default before exec
+	signal(SIGPIPE, SIG_IGN);
+
+	// Forked while we still have a single thread
+	start_applet_helper();
+
+	// Logs are kept in memory until the log file can be written
+	start_log_buffer();
 
-	// Continue the larger patch in another thread, we will join later
-	pthread_create(&sepol_patch, NULL, large_sepol_patch, NULL);
+	// Reuse the fully patched policy of the last boot if the stock one did not change
+	sepol_start = prof_now();
+	sepol_cached = sepol_cache_load() == 0;
+	if (!sepol_cached) {
+		// Patch selinux with medium patch before we do anything
+		load_policydb(SELINUX_POLICY);
+		sepol_med_rules();
+		dump_policydb(SELINUX_LOAD);
+
+		// Continue the larger patch in another thread, we will join later
+		pthread_create(&sepol_patch, NULL, large_sepol_patch, NULL);
+	}
 
 	struct sockaddr_un sun;
 	fd = setup_socket(&sun);
@@ -170,15 +370,15 @@ void start_daemon(int client) {
 	xchmod("/magisk", 0755);
 	xmount(NULL, "/", NULL, MS_REMOUNT | MS_RDONLY, NULL);
 
+	// Limits can be tuned through props before the daemon starts
+	int nworkers = prop_int(WORKERS_PROP, DAEMON_WORKERS);
+	int depth = prop_int(QUEUE_PROP, DAEMON_QUEUE_DEPTH);
+	pool_init(&workers, "workers", request_handler, nworkers, nworkers, depth);
+	pool_init(&long_workers, "long_workers", request_handler, 0, DAEMON_LONG_WORKERS, depth);
+	pool_init(&applet_workers, "applet_workers", request_handler, 0, DAEMON_APPLETS, DAEMON_APPLETS);
+
 	// Loop forever to listen for requests
-	while(1) {
-		int *client = xmalloc(sizeof(int));
-		*client = xaccept4(fd, NULL, NULL, SOCK_CLOEXEC);
-		pthread_t thread;
-		xpthread_create(&thread, NULL, request_handler, client);
-		// Detach the thread, we will never join it
-		pthread_detach(thread);
-	}
+	event_loop(fd, &workers);
 }
 
 /* Connect the daemon, and return a socketfd */
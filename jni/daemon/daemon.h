@@ -4,9 +4,11 @@
 #ifndef _DAEMON_H_
 #define _DAEMON_H_
 
+#include <stdint.h>
 #include <pthread.h>
 
 extern pthread_t sepol_patch;
+extern int sepol_cached;
 
 // Commands require connecting to daemon
 typedef enum {
@@ -21,9 +23,45 @@ typedef enum {
 	POST_FS,
 	POST_FS_DATA,
 	LATE_START,
-	TEST
+	TEST,
+	GET_PROPS,
+	WATCH_PROPS,
+	APPLET_EXEC,
+	GET_STATS,
+	GET_SYSCALL_STATS
 } client_request;
 
+#define REQUEST_TYPES (GET_SYSCALL_STATS + 1)
+
+/* Framed protocol
+ *
+ * Instead of a request code the client sends FRAME_MAGIC and its FRAME_VERSION,
+ * and the daemon answers with its own version. Then any number of request frames
+ * follow on the same connection, each answered with one reply frame carrying the
+ * same id. Request types are client_request, reply types are daemon_response.
+ * Between frames the connection waits in the event loop, idle ones are closed
+ * after DAEMON_TIMEOUT.
+ * Payloads are lists of null terminated strings:
+ *   ADD_HIDELIST / RM_HIDELIST: process names, replied with an int result each
+ *   GET_PROPS: prop names, replied with their values ("" if not set, or if
+ *     the SELinux context of a non-root client may not read it)
+ *   CHECK_VERSION / CHECK_VERSION_CODE: no payload, replied as a string / an int
+ *   WATCH_PROPS: prop names or prefixes ending with '*', the connection then only
+ *     gets reply frames of name, value pairs for each change, see prop_watch.c
+ */
+#define FRAME_MAGIC   0x4d47534d
+#define FRAME_VERSION 1
+#define FRAME_MAX     0x10000
+
+// Task of a framed connection with a whole frame buffered, see event_loop_resume
+#define FRAME_PENDING -2
+
+struct frame_hdr {
+	int32_t type;
+	uint32_t id;
+	uint32_t len;
+};
+
 // Return codes for daemon
 typedef enum {
 	DAEMON_ERROR = -1,
@@ -35,11 +73,54 @@ typedef enum {
 	HIDE_ITEM_NOT_EXIST,
 } daemon_response;
 
+// Default limits of the request pools, see start_daemon
+#define DAEMON_WORKERS      4
+#define DAEMON_LONG_WORKERS 16
+#define DAEMON_APPLETS      4
+#define DAEMON_QUEUE_DEPTH  64
+
+// Stacks of the request threads, no handler keeps more than a few PATH_MAX buffers on it
+#define DAEMON_STACK_SIZE   (256 * 1024)
+
+// Pending clients in the event loop, and the seconds they have to send a request
+#define DAEMON_MAX_CLIENTS  256
+#define DAEMON_TIMEOUT      5
+
 // daemon.c
 
 void start_daemon(int client);
+void daemon_trim();
 int connect_daemon();
 
+// event_loop.c
+
+struct thread_pool;
+void event_loop(int sockfd, struct thread_pool *pool);
+void event_loop_resume(int fd);
+
+// thread_pool.c
+
+struct pool_task {
+	int client;
+	int req;
+};
+
+struct thread_pool {
+	const char *name;
+	void (*func)(int client, int req);
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pool_task *queue;
+	int depth, head, count;
+	int min, max, threads, idle;
+	int retire;         /* Idle workers still to exit, see pool_trim */
+};
+
+void pool_init(struct thread_pool *pool, const char *name, void (*func)(int, int),
+	int min, int max, int depth);
+int pool_submit(struct thread_pool *pool, int client, int req);
+void pool_trim(struct thread_pool *pool);
+
 // socket_trans.c
 
 int recv_fd(int sockfd);
@@ -48,11 +129,37 @@ int read_int(int fd);
 void write_int(int fd, int val);
 char* read_string(int fd);
 void write_string(int fd, const char* val);
+int read_frame(int fd, struct frame_hdr *hdr, char **payload);
+int write_frame(int fd, int type, uint32_t id, const void *payload, size_t len);
+int connect_framed();
 
 // log_monitor.c
 
+void start_log_buffer();
 void monitor_logs();
 
+// applet_server.c
+
+void start_applet_helper();
+void applet_server(int client);
+int exec_applet_main(int argc, char *argv[]);
+int exec_bench_main(int count, int argc, char *argv[]);
+
+// sepol_cache.c
+
+#define SEPOL_CACHE_MAGIC 0x4c4f5053
+
+int sepol_cache_load();
+void sepol_cache_save(uint64_t patch_ns);
+
+// prop_watch.c
+
+struct ucred;
+int prop_readable(const struct ucred *cred, const char *con, const char *name);
+void prop_watch_add(int client, const struct ucred *cred, uint32_t id, const char *patterns, size_t len);
+int watch_props_main(int argc, char *argv[]);
+int wait_prop_main(const char *name, const char *value);
+
 /***************
  * Boot Stages *
  ***************/
@@ -61,6 +168,138 @@ void post_fs(int client);
 void post_fs_data(int client);
 void late_start(int client);
 
+/****************
+ * Boot Profile *
+ ****************/
+
+#define PROF_MAGIC   0x4650474d
+#define PROF_VERSION 1
+#define PROF_MAX     512
+
+struct prof_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+};
+
+// Times are in ns of CLOCK_BOOTTIME
+struct prof_span {
+	uint64_t start;
+	uint64_t dur;
+	uint32_t depth;
+	char name[44];
+};
+
+uint64_t prof_now();
+int prof_begin(const char *fmt, ...);
+void prof_end(int id);
+void prof_record(uint64_t start, uint64_t dur, const char *fmt, ...);
+void prof_save();
+int boot_profile_main(const char *file);
+
+/***********
+ * Metrics *
+ ***********/
+
+#define STATS_VERSION 4
+#define HIST_BUCKETS  24    /* [2^n, 2^(n+1)) us, the last one is open ended */
+
+enum {
+	STAT_MOUNTS,      /* Bind and overlay mounts created */
+	STAT_UNMOUNTS,    /* Mounts detached by hide_daemon */
+	STAT_HIDDEN,      /* Processes hidden */
+	STAT_ZYGOTE_TIMEOUTS,  /* Zygotes gone or stuck in the init namespace */
+	STAT_UNSHARE_TIMEOUTS, /* Apps gone or stuck in the zygote namespace */
+	STAT_COUNTERS
+};
+
+enum {
+	GAUGE_RSS,        /* Resident memory in kB, read when the stats are sent */
+	GAUGE_RSS_BOOT,   /* Right before daemon_trim */
+	GAUGE_RSS_TRIM,   /* Right after daemon_trim */
+	STAT_GAUGES
+};
+
+enum {
+	HIST_MOUNT,       /* A single mount */
+	HIST_UNMOUNT,     /* All unmounts for one hidden process */
+	HIST_STOPPED,     /* SIGSTOP to SIGCONT of one hidden process */
+	HIST_ZYGOTE_WAIT,  /* A zygote leaving the init namespace */
+	HIST_UNSHARE_WAIT, /* A hidden process leaving the zygote namespace */
+	HIST_REQUEST,     /* Then one per client_request */
+	HIST_COUNT = HIST_REQUEST + REQUEST_TYPES
+};
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+// Only 64 bit fields, snapshots are copied word by word
+struct daemon_stats {
+	uint64_t version;
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t gauges[STAT_GAUGES];
+	struct histogram hists[HIST_COUNT];
+};
+
+uint64_t stat_now_us();
+int stat_mark();
+uint64_t stat_since(int mark);
+void stat_add(int counter, uint64_t n);
+void stat_time(int hist, uint64_t us);
+void stat_set(int gauge, uint64_t n);
+uint64_t stat_rss_kb();
+void send_stats(int client);
+void send_syscall_stats(int client);
+int stats_main();
+int syscall_stats_main();
+
+/**************
+ * Mount Plan *
+ **************/
+
+enum {
+	PLAN_MKDIR_P,
+	PLAN_MKDIR,
+	PLAN_CREATE,
+	PLAN_CLONE_ATTR,
+	PLAN_BIND,
+	PLAN_CPLINK,
+	PLAN_OVERLAY
+};
+
+struct plan_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct plan_rd {
+	const char *p;
+	const char *end;
+};
+
+void pb_put(struct plan_buf *b, const void *data, size_t len);
+void pb_u32(struct plan_buf *b, uint32_t val);
+void pb_u64(struct plan_buf *b, uint64_t val);
+void pb_str(struct plan_buf *b, const char *s);
+void pb_free(struct plan_buf *b);
+uint32_t pr_u32(struct plan_rd *r);
+uint64_t pr_u64(struct plan_rd *r);
+const char *pr_str(struct plan_rd *r);
+int pr_ok(struct plan_rd *r);
+uint64_t plan_hash(uint64_t h, const void *data, size_t len);
+uint64_t plan_hash_dir(const char *path, uint64_t h);
+void plan_record(struct plan_buf *b);
+int plan_exec(int op, const char *a, const char *b);
+void plan_counts(int *bind_count, int *overlay_count);
+int plan_replay(struct plan_rd *r, int dry);
+int plan_load(const char *file, struct plan_buf *b);
+int plan_save(const char *file, struct plan_buf *b);
+
 /**************
  * MagiskHide *
  **************/
@@ -69,6 +308,7 @@ void launch_magiskhide(int client);
 void stop_magiskhide(int client);
 void add_hide_list(int client);
 void rm_hide_list(int client);
+int hide_list_op(int req, const char *proc);
 
 /*************
  * Superuser *
@@ -0,0 +1,219 @@
+/* event_loop.c - Non-blocking front end of the daemon
+ *
+ * New connections are watched with epoll until the whole request is buffered
+ * in the socket (checked with MSG_PEEK), then handed to the workers, which read
+ * it as usual without ever blocking. Clients that do not finish their request
+ * in time are dropped, version checks are answered right here. Framed
+ * connections come back after every frame, so an idle client holds no worker.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+#define EVENT_MAX 16
+
+struct conn {
+	int fd;
+	int framed;
+	time_t deadline;
+};
+
+// Workers give framed connections back through this pipe
+static int resume_pipe[2] = { -1, -1 };
+
+static time_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// Bytes a request needs in the socket before its handler can run
+static int request_size(const char *buf, int len) {
+	int req, slen;
+	if (len < sizeof(int))
+		return sizeof(int);
+	memcpy(&req, buf, sizeof(int));
+	switch (req) {
+	case FRAME_MAGIC:
+		// Then the version, frames are read by the worker
+		return 2 * sizeof(int);
+	case ADD_HIDELIST:
+	case RM_HIDELIST:
+		if (len < 2 * sizeof(int))
+			return 2 * sizeof(int);
+		memcpy(&slen, buf + sizeof(int), sizeof(int));
+		// Bad lengths are rejected by read_string
+		if (slen < 0 || slen > PATH_MAX)
+			return 2 * sizeof(int);
+		return 2 * sizeof(int) + slen;
+	default:
+		return sizeof(int);
+	}
+}
+
+static void conn_drop(struct vector *conns, struct conn *c) {
+	for (size_t i = 0; i < vec_size(conns); ++i) {
+		if (vec_entry(conns)[i] == c) {
+			vec_entry(conns)[i] = vec_entry(conns)[vec_size(conns) - 1];
+			--vec_size(conns);
+			break;
+		}
+	}
+	free(c);
+}
+
+// Whether the next frame is all in the socket, too large ones are rejected by read_frame
+static int frame_ready(int fd, const char *buf, int len) {
+	struct frame_hdr hdr;
+	int avail;
+	if (len < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.len > FRAME_MAX)
+		return 1;
+	return ioctl(fd, FIONREAD, &avail) == 0 && avail >= sizeof(hdr) + hdr.len;
+}
+
+// Return 1 if the connection is done with the event loop
+static int conn_ready(int epfd, struct conn *c, struct thread_pool *pool) {
+	char buf[2 * sizeof(int) + PATH_MAX];
+	int len, req;
+
+	len = recv(c->fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (len <= 0) {
+		close(c->fd);
+		return 1;
+	}
+	if (c->framed) {
+		if (!frame_ready(c->fd, buf, len))
+			return 0;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+		if (pool_submit(pool, c->fd, FRAME_PENDING)) {
+			LOGW("daemon: request queue full, dropping client\n");
+			close(c->fd);
+		}
+		return 1;
+	}
+	if (len < request_size(buf, len))
+		return 0;
+
+	memcpy(&req, buf, sizeof(int));
+	switch (req) {
+	case CHECK_VERSION:
+		read(c->fd, &req, sizeof(int));
+		write_string(c->fd, MAGISK_VER_STR);
+		close(c->fd);
+		return 1;
+	case CHECK_VERSION_CODE:
+		read(c->fd, &req, sizeof(int));
+		write_int(c->fd, MAGISK_VER_CODE);
+		close(c->fd);
+		return 1;
+	default:
+		break;
+	}
+
+	// Handlers expect blocking sockets
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+	if (pool_submit(pool, c->fd, -1)) {
+		LOGW("daemon: request queue full, dropping client\n");
+		close(c->fd);
+	}
+	return 1;
+}
+
+// Wait for the next frame of a framed connection, called by the worker done with it
+void event_loop_resume(int fd) {
+	if (write(resume_pipe[1], &fd, sizeof(fd)) != sizeof(fd))
+		close(fd);
+}
+
+static void conn_add(int epfd, struct vector *conns, int fd, int framed, time_t t) {
+	struct epoll_event ev;
+	struct conn *c = xmalloc(sizeof(*c));
+	c->fd = fd;
+	c->framed = framed;
+	c->deadline = t + DAEMON_TIMEOUT;
+	// Edge triggered, peeked data stays in the socket. Data already there is reported right away
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	vec_push_back(conns, c);
+}
+
+void event_loop(int sockfd, struct thread_pool *pool) {
+	struct epoll_event ev, events[EVENT_MAX];
+	struct vector conns;
+	struct conn *c;
+	int epfd, n, fd;
+	time_t t;
+
+	vec_init(&conns);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		PLOGE("epoll_create1");
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+	if (pipe2(resume_pipe, O_CLOEXEC))
+		PLOGE("pipe2");
+	fcntl(resume_pipe[0], F_SETFL, O_NONBLOCK);
+	ev.data.ptr = resume_pipe;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, resume_pipe[0], &ev);
+
+	while (1) {
+		// Wake up every second to expire stalled clients
+		n = epoll_wait(epfd, events, EVENT_MAX, vec_size(&conns) ? 1000 : -1);
+		t = now();
+		for (int i = 0; i < n; ++i) {
+			c = events[i].data.ptr;
+			if (c == (void *) resume_pipe) {
+				while (read(resume_pipe[0], &fd, sizeof(fd)) == sizeof(fd))
+					conn_add(epfd, &conns, fd, 1, t);
+				continue;
+			}
+			if (c) {
+				if (conn_ready(epfd, c, pool))
+					conn_drop(&conns, c);
+				continue;
+			}
+			// New connections
+			while ((fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+				if (vec_size(&conns) >= DAEMON_MAX_CLIENTS) {
+					LOGW("daemon: too many pending clients, dropping\n");
+					close(fd);
+					continue;
+				}
+				conn_add(epfd, &conns, fd, 0, t);
+			}
+		}
+		for (size_t i = 0; i < vec_size(&conns);) {
+			c = vec_entry(&conns)[i];
+			if (c->deadline <= t) {
+				// Idle framed connections are simply closed
+				if (!c->framed)
+					LOGW("daemon: client timed out\n");
+				close(c->fd);
+				conn_drop(&conns, c);
+			} else {
+				++i;
+			}
+		}
+	}
+}
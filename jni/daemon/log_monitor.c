@@ -1,49 +1,218 @@
-/* log_monitor.c - New thread to monitor logcat
- *
- * Open a new thread to call logcat and get logs with tag "Magisk"
- * Also, write the logs to a log file for debugging purpose
+/* log_monitor.c - Log buffer of the daemon
  *
+ * LOGD/LOGI/LOGW/LOGE of the daemon go into a fixed ring of message slots.
+ * Any thread can claim a slot without locking, a single writer thread drains
+ * the ring into the log file with batched writev, and rotates it when it
+ * gets too large. Messages are also forwarded to logcat, unless NOLOGCAT exists.
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <limits.h>
 #include <pthread.h>
 #include <unistd.h>
-#include <sys/wait.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "magisk.h"
 #include "utils.h"
 #include "daemon.h"
 
+#define LOG_SLOTS      256      /* Power of 2 */
+#define LOG_SLOT_SIZE  512
+#define LOG_BATCH      64
+#define LOG_ROTATE     (1 << 20)
+#define ROTATED_LOG    LOGFILE ".1"
+
+struct log_slot {
+	uint32_t seq;
+	int prio;
+	int pid, tid;
+	struct timespec ts;
+	size_t len;
+	char msg[LOG_SLOT_SIZE];
+};
+
+/*
+ * Bounded queue with a sequence number per slot: a slot is free for the
+ * producer at position pos when seq == pos, and readable when seq == pos + 1.
+ * The writer gives it back with seq = pos + LOG_SLOTS.
+ */
+static struct log_slot ring[LOG_SLOTS];
+static uint32_t tail, head, dropped;
+static int writer_sleeping, forward = 1, ring_ready;
+
+static int futex(int *uaddr, int op, int val) {
+	return syscall(__NR_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static struct log_slot *claim_slot() {
+	uint32_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+	while (1) {
+		struct log_slot *slot = &ring[pos & (LOG_SLOTS - 1)];
+		int32_t diff = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				return slot;
+		} else if (diff < 0) {
+			// Full, the writer is behind or not running yet
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static int buffer_log(int prio, const char *tag, const char *fmt, ...) {
+	struct log_slot *slot;
+	va_list ap;
+	int len;
+
+	if (__atomic_load_n(&forward, __ATOMIC_RELAXED)) {
+		va_start(ap, fmt);
+		__android_log_vprint(prio, tag, fmt, ap);
+		va_end(ap);
+	}
+
+	if ((slot = claim_slot()) == NULL) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	slot->prio = prio;
+	slot->pid = getpid();
+	slot->tid = gettid();
+	clock_gettime(CLOCK_REALTIME, &slot->ts);
+	va_start(ap, fmt);
+	len = vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		len = 0;
+	else if (len > sizeof(slot->msg) - 1)
+		len = sizeof(slot->msg) - 1;
+	// Exactly one newline per message
+	while (len && slot->msg[len - 1] == '\n')
+		--len;
+	slot->msg[len++] = '\n';
+	slot->len = len;
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+	// Pairs with the fence in wait_logs
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&writer_sleeping, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+		futex(&writer_sleeping, FUTEX_WAKE_PRIVATE, 1);
+	}
+	return len;
+}
+
+// Children of the daemon have no writer thread, log straight to logcat
+static void log_atfork_child() {
+	log_print = __android_log_print;
+}
+
+/* Route the logs of this process into the ring, the file is written once monitor_logs is called */
+void start_log_buffer() {
+	if (!ring_ready) {
+		for (uint32_t i = 0; i < LOG_SLOTS; ++i)
+			ring[i].seq = i;
+		pthread_atfork(NULL, NULL, log_atfork_child);
+		ring_ready = 1;
+	}
+	log_print = buffer_log;
+}
+
+static int slot_ready(uint32_t pos) {
+	return __atomic_load_n(&ring[pos & (LOG_SLOTS - 1)].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+static void wait_logs() {
+	__atomic_store_n(&writer_sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	// Recheck, a message may have been published right before we went to sleep
+	if (!slot_ready(head) && __atomic_load_n(&dropped, __ATOMIC_RELAXED) == 0)
+		futex(&writer_sleeping, FUTEX_WAIT_PRIVATE, 1);
+	__atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static const char prio_char[] = "??VDIWEF";
+
 static void *logger_thread(void *args) {
 	// Setup error handler
 	err_handler = exit_thread;
 
-	rename(LOGFILE, LASTLOG);
-	int log_fd, log_pid;
+	static char hdr[LOG_BATCH + 1][48];
+	struct iovec iov[LOG_BATCH * 2 + 1];
+	struct tm tm;
+	struct log_slot *slot;
+	uint32_t n, lost;
+	size_t size = 0;
+	ssize_t ret;
+	int log_fd, cnt;
 
-	log_fd = xopen(LOGFILE, O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC, 0644);
+	if (access(NOLOGCAT, F_OK) == 0)
+		__atomic_store_n(&forward, 0, __ATOMIC_RELAXED);
+	rename(LOGFILE, LASTLOG);
+	unlink(ROTATED_LOG);
+	log_fd = xopen(LOGFILE, O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC | O_APPEND, 0644);
 
 	while (1) {
-		// Start logcat
-		char *const command[] = { "logcat", "-s", "Magisk", "-v", "thread", NULL };
-		log_pid = run_command(0, &log_fd, "/system/bin/logcat", command);
-		if (log_pid > 0)
-			waitpid(log_pid, NULL, 0);
-		// For some reason it went here, clear buffer and restart
-		char *const restart[] = { "logcat", "-c", NULL };
-		log_pid = run_command(0, NULL, "/system/bin/logcat", restart);
-		if (log_pid > 0)
-			waitpid(log_pid, NULL, 0);
+		for (n = 0; n < LOG_BATCH && slot_ready(head + n); ++n);
+		lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+		if (n == 0 && lost == 0) {
+			wait_logs();
+			continue;
+		}
+
+		cnt = 0;
+		if (lost) {
+			iov[cnt].iov_base = hdr[LOG_BATCH];
+			iov[cnt++].iov_len = snprintf(hdr[LOG_BATCH], sizeof(hdr[0]),
+				"--- %u messages dropped\n", lost);
+		}
+		for (uint32_t i = 0; i < n; ++i) {
+			slot = &ring[(head + i) & (LOG_SLOTS - 1)];
+			localtime_r(&slot->ts.tv_sec, &tm);
+			iov[cnt].iov_base = hdr[i];
+			iov[cnt++].iov_len = snprintf(hdr[i], sizeof(hdr[0]),
+				"%02d-%02d %02d:%02d:%02d.%03ld %5d %5d %c " LOG_TAG ": ",
+				tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+				slot->ts.tv_nsec / 1000000, slot->pid, slot->tid,
+				prio_char[slot->prio & 7]);
+			iov[cnt].iov_base = slot->msg;
+			iov[cnt++].iov_len = slot->len;
+		}
+		ret = writev(log_fd, iov, cnt);
+		if (ret > 0)
+			size += ret;
+
+		// Give the slots back only after their messages are written
+		for (uint32_t i = 0; i < n; ++i) {
+			slot = &ring[(head + i) & (LOG_SLOTS - 1)];
+			__atomic_store_n(&slot->seq, head + i + LOG_SLOTS, __ATOMIC_RELEASE);
+		}
+		head += n;
+
+		if (size >= LOG_ROTATE) {
+			close(log_fd);
+			rename(LOGFILE, ROTATED_LOG);
+			log_fd = xopen(LOGFILE, O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC | O_APPEND, 0644);
+			size = 0;
+		}
 	}
 
 	// Should never be here, but well...
 	return NULL;
 }
 
-/* Start a new thread to monitor logcat and dump to logfile */
+/* Start the thread dumping the log buffer to logfile */
 void monitor_logs() {
+	static int started = 0;
 	pthread_t thread;
+	if (!ring_ready || __atomic_exchange_n(&started, 1, __ATOMIC_RELAXED))
+		return;
 	xpthread_create(&thread, NULL, logger_thread, NULL);
 	pthread_detach(thread);
 }
@@ -0,0 +1,195 @@
+/* metrics.c - Counters and latency histograms of the daemon
+ *
+ * Everything is a fixed array updated with relaxed atomics, so recording
+ * never takes a lock. Gauges hold the last value set. Histogram buckets are powers of two of microseconds.
+ * magisk --stats fetches a snapshot with GET_STATS, --stats syscalls the
+ * table of xwrap_dump() with GET_SYSCALL_STATS.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+static struct daemon_stats stats = { .version = STATS_VERSION };
+
+static const char *counter_names[STAT_COUNTERS] = {
+	"mounts", "unmounts", "hidden", "zygote wait timeouts",
+	"unshare wait timeouts"
+};
+
+static const char *gauge_names[STAT_GAUGES] = {
+	"rss (kB)", "rss before trim (kB)", "rss after trim (kB)"
+};
+
+static const char *hist_names[HIST_REQUEST] = {
+	"mount", "unmount/app", "stopped/app", "zygote wait", "unshare wait/app"
+};
+
+static const char *request_names[REQUEST_TYPES] = {
+	"DO_NOTHING", "LAUNCH_MAGISKHIDE", "STOP_MAGISKHIDE", "ADD_HIDELIST",
+	"RM_HIDELIST", "SUPERUSER", "CHECK_VERSION", "CHECK_VERSION_CODE", "POST_FS",
+	"POST_FS_DATA", "LATE_START", "TEST", "GET_PROPS", "WATCH_PROPS", "APPLET_EXEC",
+	"GET_STATS", "GET_SYSCALL_STATS"
+};
+
+uint64_t stat_now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Timestamp small enough to pass around as an int, wraps every 35 minutes
+int stat_mark() {
+	return stat_now_us() & 0x7FFFFFFF;
+}
+
+uint64_t stat_since(int mark) {
+	return (stat_now_us() - mark) & 0x7FFFFFFF;
+}
+
+void stat_add(int counter, uint64_t n) {
+	if (counter >= 0 && counter < STAT_COUNTERS)
+		__atomic_fetch_add(&stats.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stat_time(int hist, uint64_t us) {
+	struct histogram *h;
+	uint64_t max;
+	int b = 0;
+	if (hist < 0 || hist >= HIST_COUNT)
+		return;
+	h = &stats.hists[hist];
+	while (b < HIST_BUCKETS - 1 && us >> (b + 1))
+		++b;
+	__atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stat_set(int gauge, uint64_t n) {
+	if (gauge >= 0 && gauge < STAT_GAUGES)
+		__atomic_store_n(&stats.gauges[gauge], n, __ATOMIC_RELAXED);
+}
+
+// The second field of statm is the resident set in pages
+uint64_t stat_rss_kb() {
+	char buf[64];
+	unsigned long size, rss;
+	int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	ssize_t len;
+	if (fd < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	if (sscanf(buf, "%lu %lu", &size, &rss) != 2)
+		return 0;
+	return (uint64_t) rss * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+// Fields may be from slightly different moments, good enough for monitoring
+static void stats_snapshot(struct daemon_stats *s) {
+	uint64_t *src = (uint64_t *) &stats, *dst = (uint64_t *) s;
+	for (size_t i = 0; i < sizeof(stats) / sizeof(uint64_t); ++i)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+void send_stats(int client) {
+	struct daemon_stats s;
+	stats_snapshot(&s);
+	s.gauges[GAUGE_RSS] = stat_rss_kb();
+	write_int(client, sizeof(s));
+	xwrite(client, &s, sizeof(s));
+	close(client);
+}
+
+/**********
+ * Client *
+ **********/
+
+// Upper bound of the bucket holding the given fraction of the samples
+static uint64_t percentile(struct histogram *h, double q) {
+	uint64_t seen = 0, want = h->count * q;
+	for (int b = 0; b < HIST_BUCKETS; ++b) {
+		seen += h->buckets[b];
+		if (seen > want)
+			return b == HIST_BUCKETS - 1 ? h->max_us : (2ULL << b) - 1;
+	}
+	return h->max_us;
+}
+
+static void print_hist(const char *name, struct histogram *h) {
+	if (h->count == 0)
+		return;
+	printf("%-26s %8llu %10.2f %10.2f %10.2f %10.2f\n", name, (unsigned long long) h->count,
+		h->sum_us / 1000.0 / h->count, percentile(h, 0.5) / 1000.0,
+		percentile(h, 0.99) / 1000.0, h->max_us / 1000.0);
+}
+
+void send_syscall_stats(int client) {
+	write_int(client, DAEMON_SUCCESS);
+	xwrap_dump(client);
+	close(client);
+}
+
+int stats_main() {
+	struct daemon_stats s;
+	char name[64];
+	size_t len = 0;
+	ssize_t n = 0;
+	int fd = connect_daemon();
+	write_int(fd, GET_STATS);
+	if (read_int(fd) == sizeof(s))
+		while (len < sizeof(s) && (n = read(fd, (char *) &s + len, sizeof(s) - len)) > 0)
+			len += n;
+	if (len != sizeof(s) || s.version != STATS_VERSION) {
+		fprintf(stderr, "Daemon has no matching stats\n");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	for (int i = 0; i < STAT_COUNTERS; ++i)
+		printf("%-26s %8llu\n", counter_names[i], (unsigned long long) s.counters[i]);
+	for (int i = 0; i < STAT_GAUGES; ++i) {
+		// The trim gauges stay 0 until late_start is done
+		if (s.gauges[i] || i == GAUGE_RSS)
+			printf("%-26s %8llu\n", gauge_names[i], (unsigned long long) s.gauges[i]);
+	}
+	printf("\n%-26s %8s %10s %10s %10s %10s\n", "LATENCY", "COUNT", "AVG(ms)", "P50(ms)",
+		"P99(ms)", "MAX(ms)");
+	for (int i = 0; i < HIST_REQUEST; ++i)
+		print_hist(hist_names[i], &s.hists[i]);
+	for (int i = 0; i < REQUEST_TYPES; ++i) {
+		snprintf(name, sizeof(name), "request/%s", request_names[i]);
+		print_hist(name, &s.hists[HIST_REQUEST + i]);
+	}
+	return 0;
+}
+
+// The daemon writes a text table until it closes the connection
+int syscall_stats_main() {
+	char buf[4096];
+	ssize_t n;
+	int fd = connect_daemon();
+	write_int(fd, GET_SYSCALL_STATS);
+	if (read_int(fd) != DAEMON_SUCCESS) {
+		fprintf(stderr, "Root is required for the syscall stats\n");
+		close(fd);
+		return 1;
+	}
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+	close(fd);
+	return 0;
+}
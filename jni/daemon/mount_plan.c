@@ -0,0 +1,277 @@
+/* mount_plan.c - Recorded magic mount operations
+ *
+ * Every filesystem operation magic mount does goes through plan_exec, which
+ * can record it into a buffer. The buffer is stored in COREDIR together with
+ * the module trees, so an unchanged boot only replays the operations.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+static struct plan_buf *recording = NULL;
+
+/**********
+ * Buffer *
+ **********/
+
+void pb_put(struct plan_buf *b, const void *data, size_t len) {
+	if (b->len + len > b->cap) {
+		b->cap = b->cap ? b->cap : 4096;
+		while (b->len + len > b->cap)
+			b->cap *= 2;
+		b->data = xrealloc(b->data, b->cap);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+void pb_u32(struct plan_buf *b, uint32_t val) {
+	pb_put(b, &val, sizeof(val));
+}
+
+void pb_u64(struct plan_buf *b, uint64_t val) {
+	pb_put(b, &val, sizeof(val));
+}
+
+// Length, then the string with its terminator
+void pb_str(struct plan_buf *b, const char *s) {
+	uint32_t len = s ? strlen(s) : 0;
+	pb_u32(b, len);
+	pb_put(b, s ? s : "", len + 1);
+}
+
+void pb_free(struct plan_buf *b) {
+	free(b->data);
+	memset(b, 0, sizeof(*b));
+}
+
+// Short reads poison the reader, check pr_ok once at the end
+static const void *pr_get(struct plan_rd *r, size_t len) {
+	const char *p = r->p;
+	if (p == NULL || r->end - p < len) {
+		r->p = NULL;
+		return NULL;
+	}
+	r->p += len;
+	return p;
+}
+
+uint32_t pr_u32(struct plan_rd *r) {
+	uint32_t val = 0;
+	const void *p = pr_get(r, sizeof(val));
+	if (p) memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+uint64_t pr_u64(struct plan_rd *r) {
+	uint64_t val = 0;
+	const void *p = pr_get(r, sizeof(val));
+	if (p) memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+// Points into the buffer, "" when corrupted
+const char *pr_str(struct plan_rd *r) {
+	uint32_t len = pr_u32(r);
+	const char *s = pr_get(r, (size_t) len + 1);
+	if (s == NULL || s[len] != '\0') {
+		r->p = NULL;
+		return "";
+	}
+	return s;
+}
+
+int pr_ok(struct plan_rd *r) {
+	return r->p != NULL;
+}
+
+/***********
+ * Hashing *
+ ***********/
+
+// 64 bit FNV-1a
+uint64_t plan_hash(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data;
+	if (h == 0)
+		h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t hash_dir(int dirfd, uint64_t h) {
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	int fd;
+
+	if (!(dir = fdopendir(dirfd))) {
+		close(dirfd);
+		return h;
+	}
+	while ((entry = readdir(dir))) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		h = plan_hash(h, entry->d_name, strlen(entry->d_name) + 1);
+		h = plan_hash(h, &st.st_mode, sizeof(st.st_mode));
+		h = plan_hash(h, &st.st_size, sizeof(st.st_size));
+		h = plan_hash(h, &st.st_mtime, sizeof(st.st_mtime));
+		if (S_ISDIR(st.st_mode)) {
+			fd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd >= 0)
+				h = hash_dir(fd, plan_hash(h, "/", 1));
+			h = plan_hash(h, "..", 2);
+		}
+	}
+	closedir(dir);
+	return h;
+}
+
+// Names, types, sizes and mtimes of everything under path
+uint64_t plan_hash_dir(const char *path, uint64_t h) {
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return plan_hash(h, "-", 1);
+	return hash_dir(fd, h);
+}
+
+/**************
+ * Operations *
+ **************/
+
+void plan_record(struct plan_buf *b) {
+	recording = b;
+}
+
+static void plan_put(int op, const char *a, const char *b) {
+	unsigned char code = op;
+	pb_put(recording, &code, 1);
+	pb_str(recording, a);
+	pb_str(recording, b);
+}
+
+static int binds, overlays;
+
+// An overlay that did not mount is not recorded, the caller falls back to the skeleton
+int plan_exec(int op, const char *a, const char *b) {
+	uint64_t start = stat_now_us();
+	int ret = 0;
+	if (recording && op != PLAN_OVERLAY)
+		plan_put(op, a, b);
+	switch (op) {
+	case PLAN_MKDIR_P:
+		mkdir_p(a, 0755);
+		break;
+	case PLAN_MKDIR:
+		xmkdir(a, 0755);
+		break;
+	case PLAN_CREATE:
+		close(open_new(a));
+		break;
+	case PLAN_CLONE_ATTR:
+		clone_attr(a, b);
+		break;
+	case PLAN_BIND:
+		if ((ret = bind_mount(a, b)) == 0) {
+			++binds;
+			stat_add(STAT_MOUNTS, 1);
+			stat_time(HIST_MOUNT, stat_now_us() - start);
+		}
+		break;
+	case PLAN_CPLINK:
+		cp_afc(a, b);
+		LOGI("cplink: %s -> %s\n", a, b);
+		break;
+	case PLAN_OVERLAY:
+		// a is the mount options
+		if ((ret = mount(OVERLAY_SRC, b, "overlay", MS_RDONLY, a)) == 0) {
+			++overlays;
+			stat_add(STAT_MOUNTS, 1);
+			stat_time(HIST_MOUNT, stat_now_us() - start);
+			LOGI("overlay: %s\n", b);
+			if (recording)
+				plan_put(op, a, b);
+		}
+		break;
+	}
+	return ret;
+}
+
+// Mounts done so far by both modes
+void plan_counts(int *bind_count, int *overlay_count) {
+	*bind_count = binds;
+	*overlay_count = overlays;
+}
+
+// Return the number of operations, -1 if the plan is corrupted. dry only checks
+int plan_replay(struct plan_rd *r, int dry) {
+	const unsigned char *code;
+	const char *a, *b;
+	int count = 0;
+	while (r->p && r->p < r->end) {
+		code = pr_get(r, 1);
+		a = pr_str(r);
+		b = pr_str(r);
+		if (!pr_ok(r) || *code > PLAN_OVERLAY)
+			return -1;
+		if (!dry)
+			plan_exec(*code, a, b);
+		++count;
+	}
+	return count;
+}
+
+/********
+ * File *
+ ********/
+
+// The whole file in a buffer
+int plan_load(const char *file, struct plan_buf *b) {
+	struct stat st;
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	memset(b, 0, sizeof(*b));
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &st) || st.st_size == 0) {
+		close(fd);
+		return 1;
+	}
+	b->data = xmalloc(st.st_size);
+	b->cap = st.st_size;
+	b->len = read(fd, b->data, st.st_size) == st.st_size ? st.st_size : 0;
+	close(fd);
+	if (b->len == 0) {
+		pb_free(b);
+		return 1;
+	}
+	return 0;
+}
+
+int plan_save(const char *file, struct plan_buf *b) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return 1;
+	if (write(fd, b->data, b->len) != b->len) {
+		close(fd);
+		unlink(tmp);
+		return 1;
+	}
+	fsync(fd);
+	close(fd);
+	return rename(tmp, file);
+}
@@ -0,0 +1,378 @@
+/* prop_watch.c - Property change notifications
+ *
+ * Clients subscribe to prop names, or prefixes ending with '*', with a
+ * WATCH_PROPS frame. A single thread waits on the global prop serial for all
+ * of them, and every time it moves each client gets one frame listing the
+ * props that changed since the last one, "" for deleted props. The first
+ * frame has the current values. Clients that hang up are dropped within a
+ * second, the thread quits when nobody is left. Clients besides root only
+ * see the props their SELinux context can read, WATCH_PER_UID at most each.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <selinux/selinux.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+#include "resetprop.h"
+
+#define WATCH_TIMEOUT 1000
+// Clients that do not take their frames in time are dropped
+#define SEND_TIMEOUT  1
+// Watchers a single uid may have at once
+#define WATCH_PER_UID 8
+
+struct watcher {
+	int fd;
+	uint32_t id;
+	unsigned serial;
+	struct ucred cred;
+	// Peer context, NULL for root
+	char *con;
+	// Null terminated patterns
+	char *patterns;
+	size_t len;
+	// Sorted "name\0value" entries sent last time
+	struct vector snap;
+	// Frame waiting to be sent outside of watch_lock
+	struct plan_buf out;
+	int send;
+};
+
+struct collect {
+	struct watcher **ws;
+	int count;
+	struct vector *props;
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct vector watchers = { 0, 0, NULL };
+static int watch_running = 0;
+
+// Root reads every prop, other clients (con is their peer context) only what SELinux lets them
+int prop_readable(const struct ucred *cred, const char *con, const char *name) {
+	char *ctx;
+	int ret;
+	if (cred->uid == 0)
+		return 1;
+	if (con == NULL || (ctx = prop_context(name)) == NULL)
+		return 0;
+	// The single area before Android 7 has no context, every app reads it
+	ret = strchr(ctx, ':') == NULL || selinux_check_access(con, ctx, "file", "read", NULL) == 0;
+	free(ctx);
+	return ret;
+}
+
+static int match(struct watcher *w, const char *name) {
+	size_t len;
+	for (char *s = w->patterns; s < w->patterns + w->len; s += len + 1) {
+		len = strlen(s);
+		if (len && s[len - 1] == '*' ? strncmp(name, s, len - 1) == 0 : strcmp(name, s) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static char *new_entry(const char *name, const char *value) {
+	size_t nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+	char *e = xmalloc(nlen + vlen);
+	memcpy(e, name, nlen);
+	memcpy(e + nlen, value, vlen);
+	return e;
+}
+
+static inline const char *entry_value(const char *e) {
+	return e + strlen(e) + 1;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+static void collect_cb(const char *name, const char *value, void *cookie) {
+	struct collect *c = cookie;
+	for (int i = 0; i < c->count; ++i) {
+		if (match(c->ws[i], name)) {
+			vec_push_back(c->props, new_entry(name, value));
+			return;
+		}
+	}
+}
+
+// The props any of the watchers wants, sorted by name
+static void collect(struct watcher **ws, int count, struct vector *props) {
+	struct collect c = { ws, count, props };
+	getprop_all2(collect_cb, &c);
+	vec_sort(props, entry_cmp);
+}
+
+static void put_entry(struct plan_buf *b, const char *name, const char *value) {
+	pb_put(b, name, strlen(name) + 1);
+	pb_put(b, value, strlen(value) + 1);
+}
+
+// Build the frame of what changed since the last one into w->out, sent by send_frame
+static void diff(struct watcher *w, struct vector *props, int first) {
+	struct vector snap;
+	struct plan_buf *b = &w->out;
+	size_t i = 0, j = 0;
+	int cmp;
+	char *e;
+
+	vec_init(&snap);
+	for (size_t k = 0; k < vec_size(props); ++k) {
+		e = vec_entry(props)[k];
+		if (match(w, e) && prop_readable(&w->cred, w->con, e))
+			vec_push_back(&snap, new_entry(e, entry_value(e)));
+	}
+
+	// Both are sorted, walk them side by side
+	while (i < vec_size(&w->snap) || j < vec_size(&snap)) {
+		if (i == vec_size(&w->snap))
+			cmp = 1;
+		else if (j == vec_size(&snap))
+			cmp = -1;
+		else
+			cmp = strcmp(vec_entry(&w->snap)[i], vec_entry(&snap)[j]);
+		if (cmp < 0) {
+			put_entry(b, vec_entry(&w->snap)[i], "");
+			++i;
+		} else if (cmp > 0) {
+			e = vec_entry(&snap)[j];
+			put_entry(b, e, entry_value(e));
+			++j;
+		} else {
+			e = vec_entry(&snap)[j];
+			if (strcmp(entry_value(vec_entry(&w->snap)[i]), entry_value(e)))
+				put_entry(b, e, entry_value(e));
+			++i;
+			++j;
+		}
+	}
+
+	w->send = b->len || first;
+	for (i = 0; i < vec_size(&w->snap); ++i)
+		free(vec_entry(&w->snap)[i]);
+	vec_destroy(&w->snap);
+	w->snap = snap;
+}
+
+// Return 1 if the client is gone. Blocks up to SEND_TIMEOUT, never call with watch_lock held
+static int send_frame(struct watcher *w) {
+	int ret = 0;
+	if (w->send)
+		ret = write_frame(w->fd, DAEMON_SUCCESS, w->id, w->out.data, w->out.len) != 0;
+	w->send = 0;
+	pb_free(&w->out);
+	return ret;
+}
+
+static void free_watcher(struct watcher *w) {
+	close(w->fd);
+	for (size_t i = 0; i < vec_size(&w->snap); ++i)
+		free(vec_entry(&w->snap)[i]);
+	vec_destroy(&w->snap);
+	pb_free(&w->out);
+	freecon(w->con);
+	free(w->patterns);
+	free(w);
+}
+
+static void free_props(struct vector *props) {
+	for (size_t i = 0; i < vec_size(props); ++i)
+		free(vec_entry(props)[i]);
+	vec_destroy(props);
+}
+
+// Call with watch_lock held
+static void drop_watcher(struct watcher *w) {
+	for (size_t i = 0; i < vec_size(&watchers); ++i) {
+		if (vec_entry(&watchers)[i] == w) {
+			vec_entry(&watchers)[i] = vec_entry(&watchers)[vec_size(&watchers) - 1];
+			--vec_size(&watchers);
+			break;
+		}
+	}
+	free_watcher(w);
+}
+
+/* Only this thread drops watchers, so the ones it picked stay valid while it
+ * sends their frames without watch_lock; prop_watch_add may add more meanwhile */
+static void *watch_thread(void *args) {
+	struct pollfd pfd;
+	struct vector props, behind;
+	struct watcher *w;
+	unsigned serial;
+
+	err_handler = do_nothing;
+	vec_init(&behind);
+	pthread_mutex_lock(&watch_lock);
+	serial = prop_serial();
+	while (vec_size(&watchers)) {
+		pthread_mutex_unlock(&watch_lock);
+		serial = prop_wait(serial, WATCH_TIMEOUT);
+		pthread_mutex_lock(&watch_lock);
+
+		// Clients only read, anything else means they are done
+		for (size_t i = 0; i < vec_size(&watchers);) {
+			w = vec_entry(&watchers)[i];
+			pfd.fd = w->fd;
+			pfd.events = POLLIN | POLLRDHUP;
+			if (poll(&pfd, 1, 0) > 0)
+				drop_watcher(w);
+			else
+				++i;
+		}
+
+		// Nothing changed for anyone, e.g. just the timeout to check for hangups
+		vec_size(&behind) = 0;
+		for (size_t i = 0; i < vec_size(&watchers); ++i) {
+			w = vec_entry(&watchers)[i];
+			if (w->serial != serial)
+				vec_push_back(&behind, w);
+		}
+		if (vec_size(&behind) == 0)
+			continue;
+
+		// One walk over the props for everyone that is behind
+		vec_init(&props);
+		collect((struct watcher **) vec_entry(&behind), vec_size(&behind), &props);
+		for (size_t i = 0; i < vec_size(&behind); ++i) {
+			w = vec_entry(&behind)[i];
+			diff(w, &props, 0);
+			w->serial = serial;
+		}
+		free_props(&props);
+
+		pthread_mutex_unlock(&watch_lock);
+		for (size_t i = 0; i < vec_size(&behind); ++i) {
+			if (send_frame(vec_entry(&behind)[i]) == 0)
+				vec_entry(&behind)[i] = NULL;
+		}
+		pthread_mutex_lock(&watch_lock);
+		for (size_t i = 0; i < vec_size(&behind); ++i) {
+			if (vec_entry(&behind)[i])
+				drop_watcher(vec_entry(&behind)[i]);
+		}
+	}
+	watch_running = 0;
+	vec_destroy(&watchers);
+	pthread_mutex_unlock(&watch_lock);
+	vec_destroy(&behind);
+	LOGD("prop_watch: no watchers left\n");
+	return NULL;
+}
+
+// Takes over the connection, patterns are the payload of the WATCH_PROPS frame
+void prop_watch_add(int client, const struct ucred *cred, uint32_t id, const char *patterns, size_t len) {
+	struct timeval tv = { .tv_sec = SEND_TIMEOUT };
+	struct watcher *w;
+	struct vector props;
+	pthread_t thread;
+	int count = 0;
+
+	pthread_mutex_lock(&watch_lock);
+	for (size_t i = 0; i < vec_size(&watchers); ++i)
+		count += ((struct watcher *) vec_entry(&watchers)[i])->cred.uid == cred->uid;
+	pthread_mutex_unlock(&watch_lock);
+	if (cred->uid != 0 && count >= WATCH_PER_UID) {
+		LOGW("prop_watch: too many watchers of uid %d\n", cred->uid);
+		write_frame(client, DAEMON_ERROR, id, NULL, 0);
+		close(client);
+		return;
+	}
+
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	w = xcalloc(1, sizeof(*w));
+	w->fd = client;
+	w->id = id;
+	w->cred = *cred;
+	if (cred->uid != 0 && getpeercon(client, &w->con) < 0)
+		w->con = NULL;
+	w->patterns = xmalloc(len + 1);
+	memcpy(w->patterns, patterns, len);
+	w->patterns[len] = '\0';
+	w->len = len;
+	vec_init(&w->snap);
+
+	// Not shared yet, the first frame needs no lock. Changes from here on move the serial
+	w->serial = prop_serial();
+	vec_init(&props);
+	collect(&w, 1, &props);
+	diff(w, &props, 1);
+	free_props(&props);
+	if (send_frame(w)) {
+		free_watcher(w);
+		return;
+	}
+
+	pthread_mutex_lock(&watch_lock);
+	if (vec_entry(&watchers) == NULL)
+		vec_init(&watchers);
+	vec_push_back(&watchers, w);
+	if (!watch_running) {
+		watch_running = 1;
+		xpthread_create(&thread, NULL, watch_thread, NULL);
+		pthread_detach(thread);
+	}
+	pthread_mutex_unlock(&watch_lock);
+}
+
+/**********
+ * Client *
+ **********/
+
+// Print name=value for every change, or stop once name has value (any value if NULL)
+static int watch_client(char *const patterns[], int count, const char *name, const char *value) {
+	struct plan_buf b = { NULL, 0, 0 };
+	struct frame_hdr hdr;
+	char *payload, *s, *v;
+	int fd = connect_framed();
+	if (fd < 0) {
+		fprintf(stderr, "Daemon does not support prop watching\n");
+		return 1;
+	}
+	for (int i = 0; i < count; ++i)
+		pb_put(&b, patterns[i], strlen(patterns[i]) + 1);
+	if (b.len > FRAME_MAX || write_frame(fd, WATCH_PROPS, 0, b.data, b.len)) {
+		pb_free(&b);
+		close(fd);
+		return 1;
+	}
+	pb_free(&b);
+	while (read_frame(fd, &hdr, &payload) == 0 && hdr.type == DAEMON_SUCCESS) {
+		for (s = payload; s < payload + hdr.len; s = v + strlen(v) + 1) {
+			v = s + strlen(s) + 1;
+			if (v >= payload + hdr.len)
+				break;
+			if (name == NULL) {
+				printf("%s=%s\n", s, v);
+			} else if (strcmp(s, name) == 0 && (value ? strcmp(v, value) == 0 : v[0] != '\0')) {
+				free(payload);
+				close(fd);
+				return 0;
+			}
+		}
+		free(payload);
+		fflush(stdout);
+	}
+	close(fd);
+	return 1;
+}
+
+int watch_props_main(int argc, char *argv[]) {
+	return watch_client(argv, argc, NULL, NULL);
+}
+
+int wait_prop_main(const char *name, const char *value) {
+	char *const pattern[] = { (char *) name };
+	return watch_client(pattern, 1, name, value);
+}
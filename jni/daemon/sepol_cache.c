@@ -0,0 +1,129 @@
+/* sepol_cache.c - Reuse the patched SELinux policy of the last boot
+ *
+ * After the large patch, the final policy is dumped once more into a cache
+ * file with a trailer holding the Magisk version and a hash of the stock
+ * policy the kernel booted with. On a later boot with the same key the cached
+ * policy is loaded in a single write, skipping both patches and dumps.
+ * Users besides root can write to /cache, and the hash lives in the file
+ * itself, so the cache is only trusted as a regular file of root with a
+ * single link that nobody else may write. It is written into a temporary
+ * file created exclusively by the daemon, then renamed over the cache.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+#include "magiskpolicy.h"
+
+struct sepol_trailer {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint64_t patch_ns;    /* How long patching took when the cache was made */
+};
+
+static uint64_t policy_key;
+
+// Non-zero unless the file at fd could only have been written by root
+static int untrusted(int fd, struct stat *st) {
+	return fstat(fd, st) || !S_ISREG(st->st_mode) || st->st_uid != 0 ||
+		(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// The policy currently in the kernel, call before it is replaced
+static uint64_t policy_hash() {
+	char buf[65536];
+	ssize_t len;
+	uint64_t h = 0;
+	int fd = open(SELINUX_POLICY, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		h = plan_hash(h, buf, len);
+	close(fd);
+	return len < 0 ? 0 : h;
+}
+
+// Return 0 if the cached policy got loaded
+int sepol_cache_load() {
+	struct sepol_trailer t;
+	struct stat st;
+	uint64_t start = prof_now(), dur;
+	void *map;
+	size_t len;
+	int fd, ret = 1;
+
+	if ((policy_key = policy_hash()) == 0)
+		return 1;
+	if ((fd = open(SEPOL_CACHE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		return 1;
+	if (untrusted(fd, &st) || st.st_nlink != 1 || st.st_size <= (off_t) sizeof(t)) {
+		LOGW("sepol: ignoring cached policy\n");
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 1;
+
+	len = st.st_size - sizeof(t);
+	memcpy(&t, (char *) map + len, sizeof(t));
+	if (t.magic == SEPOL_CACHE_MAGIC && t.version == MAGISK_VER_CODE && t.key == policy_key) {
+		// The kernel only takes the whole policy in one write
+		fd = open(SELINUX_LOAD, O_WRONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			ret = write(fd, map, len) != len;
+			close(fd);
+		}
+		if (ret)
+			LOGW("sepol: cached policy rejected, patching\n");
+	}
+	munmap(map, st.st_size);
+	if (ret)
+		return 1;
+
+	dur = prof_now() - start;
+	prof_record(start, dur, "sepolicy: cached, %llums saved",
+		(unsigned long long) (t.patch_ns > dur ? t.patch_ns - dur : 0) / 1000000);
+	LOGI("sepol: Loaded cached policy\n");
+	return 0;
+}
+
+// Dump the patched policydb with its key, patch_ns is the time patching took
+void sepol_cache_save(uint64_t patch_ns) {
+	struct sepol_trailer t = {
+		.magic = SEPOL_CACHE_MAGIC,
+		.version = MAGISK_VER_CODE,
+		.key = policy_key,
+		.patch_ns = patch_ns
+	};
+	struct stat st;
+	char path[32];
+	int fd;
+
+	if (policy_key == 0)
+		return;
+	// Only a file we just created is written, never one someone else left
+	// there or links to. The policy is dumped through our own fd
+	unlink(SEPOL_CACHE ".tmp");
+	fd = open(SEPOL_CACHE ".tmp", O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return;
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	if (fchown(fd, 0, 0) || untrusted(fd, &st) || st.st_nlink != 1 || dump_policydb(path) ||
+		lseek(fd, 0, SEEK_END) < 0 || write(fd, &t, sizeof(t)) != sizeof(t) || fsync(fd)) {
+		close(fd);
+		unlink(SEPOL_CACHE ".tmp");
+		return;
+	}
+	close(fd);
+	if (rename(SEPOL_CACHE ".tmp", SEPOL_CACHE))
+		unlink(SEPOL_CACHE ".tmp");
+}
@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
 
 #include "magisk.h"
 #include "utils.h"
@@ -143,6 +145,79 @@ char* read_string(int fd) {
 void write_string(int fd, const char* val) {
     if (fd < 0) return;
     int len = strlen(val);
-    write_int(fd, len);
-    xwrite(fd, val, len);
+    // Length and data in a single syscall
+    struct iovec iov[2] = {
+        { .iov_base = &len, .iov_len = sizeof(len) },
+        { .iov_base = (void *) val, .iov_len = len },
+    };
+    xwritev(fd, iov, 2);
+}
+
+/*
+ * Framed protocol, see daemon.h
+ *
+ * These never kill the thread, errors are returned so a
+ * connection serving many requests can be closed properly
+ */
+
+static int read_full(int fd, void *buf, size_t len) {
+    ssize_t ret;
+    while (len) {
+        ret = read(fd, buf, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        buf = (char *) buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// Payload is null terminated, free it after use
+int read_frame(int fd, struct frame_hdr *hdr, char **payload) {
+    *payload = NULL;
+    if (read_full(fd, hdr, sizeof(*hdr)) || hdr->len > FRAME_MAX)
+        return -1;
+    *payload = xmalloc(hdr->len + 1);
+    if (read_full(fd, *payload, hdr->len)) {
+        free(*payload);
+        *payload = NULL;
+        return -1;
+    }
+    (*payload)[hdr->len] = '\0';
+    return 0;
+}
+
+// Header and payload in a single sendmsg
+int write_frame(int fd, int type, uint32_t id, const void *payload, size_t len) {
+    struct frame_hdr hdr = { .type = type, .id = id, .len = len };
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *) payload, .iov_len = len },
+    };
+    struct msghdr msg = {
+        .msg_iov    = iov,
+        .msg_iovlen = len ? 2 : 1,
+    };
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hdr) + len)
+        return -1;
+    return 0;
+}
+
+// Connect to the daemon and switch to the framed protocol, return -1 if unsupported.
+// Older daemons may never answer the hello, so it is only waited for DAEMON_TIMEOUT
+int connect_framed() {
+    int fd = connect_daemon();
+    int hello[2] = { FRAME_MAGIC, FRAME_VERSION }, version;
+    struct timeval tv = { .tv_sec = DAEMON_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (write(fd, hello, sizeof(hello)) != sizeof(hello)
+        || read_full(fd, &version, sizeof(version)) || version != FRAME_VERSION) {
+        close(fd);
+        return -1;
+    }
+    tv.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
 }
@@ -0,0 +1,119 @@
+/* thread_pool.c - Bounded worker pools for daemon requests
+ *
+ * Each pool has a fixed size ring of pending tasks, and grows up to max
+ * threads when no worker is idle. Workers only exit when pool_trim retires
+ * them, idle threads sleep on a condition variable (a futex in bionic).
+ * Stacks are DAEMON_STACK_SIZE instead of the default of libc.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "daemon.h"
+
+static void *pool_worker(void *arg);
+
+// Call with the lock held
+static void pool_spawn(struct thread_pool *pool) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, DAEMON_STACK_SIZE);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, pool_worker, pool);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		LOGE("%s: cannot create worker\n", pool->name);
+		return;
+	}
+	++pool->threads;
+}
+
+// A task ended the thread with pthread_exit (e.g. exit_thread), keep the pool running
+static void pool_worker_exit(void *arg) {
+	struct thread_pool *pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	--pool->threads;
+	if (pool->threads < pool->min || pool->count > pool->idle)
+		pool_spawn(pool);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *pool_worker(void *arg) {
+	struct thread_pool *pool = arg;
+	struct pool_task task;
+	pthread_cleanup_push(pool_worker_exit, pool);
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		++pool->idle;
+		while (pool->count == 0 && pool->retire == 0)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		--pool->idle;
+		if (pool->count == 0) {
+			--pool->retire;
+			--pool->threads;
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		task = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->depth;
+		--pool->count;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->func(task.client, task.req);
+	}
+	pthread_cleanup_pop(0);
+	return NULL;
+}
+
+void pool_init(struct thread_pool *pool, const char *name, void (*func)(int, int),
+		int min, int max, int depth) {
+	pool->name = name;
+	pool->func = func;
+	pool->min = min;
+	pool->max = max < min ? min : max;
+	pool->depth = depth > 0 ? depth : 1;
+	pool->queue = xmalloc(pool->depth * sizeof(*pool->queue));
+	pool->head = pool->count = 0;
+	pool->threads = pool->idle = pool->retire = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->threads < pool->min)
+		pool_spawn(pool);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Queue a task, return 1 if the queue is full
+int pool_submit(struct thread_pool *pool, int client, int req) {
+	pthread_mutex_lock(&pool->lock);
+	if (pool->count == pool->depth) {
+		pthread_mutex_unlock(&pool->lock);
+		return 1;
+	}
+	pool->queue[(pool->head + pool->count) % pool->depth] = (struct pool_task) { client, req };
+	++pool->count;
+	// Busy again, keep the threads that are left
+	pool->retire = 0;
+	if (pool->count > pool->idle && pool->threads < pool->max)
+		pool_spawn(pool);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+// Let the idle workers above min exit, their stacks are unmapped with them
+void pool_trim(struct thread_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->retire = pool->threads - pool->min;
+	if (pool->retire > pool->idle)
+		pool->retire = pool->idle;
+	if (pool->retire < 0)
+		pool->retire = 0;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
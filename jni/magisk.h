@@ -26,21 +26,29 @@
 
 #define LOGFILE         "/cache/magisk.log"
 #define LASTLOG         "/cache/last_magisk.log"
+#define PROFILE_FILE    "/cache/magisk.profile"
+#define SEPOL_CACHE     "/cache/magisk.sepol"
 #define DEBUG_LOG       "/data/magisk_debug.log"
 #define UNBLOCKFILE     "/dev/.magisk.unblock"
 #define DISABLEFILE     "/cache/.disable_magisk"
+#define NOLOGCAT        "/cache/.magisk_nologcat"
 #define UNINSTALLER     "/cache/magisk_uninstaller.sh"
 #define MOUNTPOINT      "/magisk"
 #define COREDIR         MOUNTPOINT "/.core"
 #define HOSTSFILE       COREDIR "/hosts"
 #define HIDELIST        COREDIR "/hidelist"
+#define MOUNT_PLAN      COREDIR "/mount.plan"
 #define MAINIMG         "/data/magisk.img"
 #define DATABIN         "/data/magisk"
 #define LATELOGMON      "/data/magisk/.late_logmon"
+#define DIRECTIOFILE    DATABIN "/.img_direct_io"
+#define OVERLAYFILE     DATABIN "/.overlay_mount"
 #define MANAGERAPK      DATABIN "/magisk.apk"
 #define MAGISKTMP       "/dev/magisk"
 #define MIRRDIR         MAGISKTMP "/mirror"
 #define DUMMDIR         MAGISKTMP "/dummy"
+#define OVERLAY_SRC     MAGISKTMP "/overlay"
+#define PROPCTX_CACHE   MAGISKTMP "/prop_contexts"
 #define CACHEMOUNT      "/cache/magisk_mount"
 
 #define SELINUX_PATH        "/sys/fs/selinux/"
@@ -49,6 +57,9 @@
 #define SELINUX_LOAD        SELINUX_PATH "load"
 
 #define MAGISKHIDE_PROP     "persist.magisk.hide"
+#define WORKERS_PROP        "magisk.daemon.workers"
+#define QUEUE_PROP          "magisk.daemon.queue"
+#define SCRIPT_JOBS_PROP    "persist.magisk.script.jobs"
 
 // Global handler for PLOGE
 extern __thread void (*err_handler)(void);
@@ -61,14 +72,23 @@ static inline void do_nothing() {}
 // Dummy function to depress debug message
 static inline void stub(const char *fmt, ...) {}
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+// __android_log_print, the daemon switches it to its log buffer
+extern int (*log_print)(int prio, const char *tag, const char *fmt, ...);
+#ifdef __cplusplus
+}
+#endif
+
 #ifdef DEBUG
-#define LOGD(...)  __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGD(...)  log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
 #else
 #define LOGD(...)  stub(__VA_ARGS__)
 #endif
-#define LOGI(...)  __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
-#define LOGW(...)  __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
-#define LOGE(...)  __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#define LOGI(...)  log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGW(...)  log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+#define LOGE(...)  log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
 #define PLOGE(fmt, args...) { LOGE(fmt " failed with %d: %s", ##args, errno, strerror(errno)); err_handler(); }
 
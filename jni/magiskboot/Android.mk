@@ -14,15 +14,60 @@ LOCAL_C_INCLUDES := \
 LOCAL_SRC_FILES := \
 	main.c \
 	bootimg.c \
+	batch.c \
+	pool.c \
 	hexpatch.c \
+	dtb.c \
 	compress.c \
 	boot_utils.c \
 	cpio.c \
+	textpatch.c \
 	sha1.c \
+	sha256.c \
+	sha_hw.c \
 	../utils/xwrap.c \
 	../utils/vector.c \
 	../utils/list.c
 LOCAL_CFLAGS += -DZLIB_CONST
+# SHA kernels in sha_hw.c, only used when the CPU reports the extensions
+ifeq ($(TARGET_ARCH_ABI),arm64-v8a)
+LOCAL_CFLAGS += -march=armv8-a+crypto
+endif
+include $(BUILD_EXECUTABLE)
+
+# Benchmarks, not shipped
+include $(CLEAR_VARS)
+LOCAL_MODULE := magiskboot_bench
+LOCAL_STATIC_LIBRARIES := libz liblzma liblz4 libbz2
+LOCAL_LDFLAGS += -static
+LOCAL_C_INCLUDES := \
+	jni/utils \
+	jni/ndk-compression/zlib/ \
+	jni/ndk-compression/xz/src/liblzma/api/ \
+	jni/ndk-compression/lz4/lib/ \
+	jni/ndk-compression/bzip2/
+
+LOCAL_SRC_FILES := \
+	bench.c \
+	bootimg.c \
+	batch.c \
+	pool.c \
+	hexpatch.c \
+	dtb.c \
+	compress.c \
+	boot_utils.c \
+	cpio.c \
+	textpatch.c \
+	sha1.c \
+	sha256.c \
+	sha_hw.c \
+	../utils/xwrap.c \
+	../utils/vector.c \
+	../utils/list.c
+LOCAL_CFLAGS += -DZLIB_CONST
+ifeq ($(TARGET_ARCH_ABI),arm64-v8a)
+LOCAL_CFLAGS += -march=armv8-a+crypto
+endif
 include $(BUILD_EXECUTABLE)
 
 include jni/ndk-compression/zlib/Android.mk
@@ -0,0 +1,182 @@
+/* batch.c - Many boot images in one magiskboot process
+ *
+ * Every line of the manifest is a directory and a command, run as if
+ * magiskboot was started in that directory. The lines are jobs on the
+ * thread pool, the block compression of an image adds sub-tasks to it.
+ * Jobs of the same directory work on the same files, they run in manifest
+ * order on one task. Messages of a job go to BATCH_LOG in its directory.
+ */
+
+#include "magiskboot.h"
+#include "sha_hw.h"
+
+#define BATCH_ARGS      64
+
+enum { JOB_UNPACK, JOB_REPACK, JOB_PATCH, JOB_CLEANUP };
+
+struct batch_job {
+	int line;
+	int type;
+	int hash;
+	comp_opt opt;
+	int argc;
+	char *argv[BATCH_ARGS];
+	char *buf;          // The line argv points into
+	int ret;            // Returned by the command
+	int err;            // The command failed with this code
+	FILE *log;
+	boot_img boot;
+	struct batch_job *next;   // Next job of the same directory
+	int chained;        // Run by the task of an earlier job, appends to its log
+};
+
+// Split at whitespace, a "quoted string" is one argument, # starts a comment
+static int split_line(char *line, char *argv[], int max) {
+	int argc = 0;
+	char *p = line;
+	while (argc < max) {
+		while (isspace(*p))
+			++p;
+		if (*p == '\0' || *p == '#')
+			break;
+		if (*p == '"') {
+			argv[argc++] = ++p;
+			while (*p && *p != '"')
+				++p;
+		} else {
+			argv[argc++] = p;
+			while (*p && !isspace(*p))
+				++p;
+		}
+		if (*p)
+			*p++ = '\0';
+	}
+	return argc;
+}
+
+// Same commands as the command line: unpack[=sha1|sha256], repack[=options],
+// patch-image[=options] and cleanup, with the same parameters
+static int parse_job(struct batch_job *j) {
+	const char *cmd = j->argv[1];
+	int argc = j->argc - 2;
+	if (j->argc < 2)
+		return 1;
+	if (strcmp(cmd, "unpack") == 0 || strcmp(cmd, "unpack=sha1") == 0 || strcmp(cmd, "unpack=sha256") == 0) {
+		j->type = JOB_UNPACK;
+		j->hash = strcmp(cmd, "unpack=sha256") == 0 ? 2 : cmd[6] ? 1 : 0;
+		return argc != 1;
+	} else if (strncmp(cmd, "repack", 6) == 0 && comp_opt_arg(&j->opt, cmd + 6)) {
+		j->type = JOB_REPACK;
+		return argc < 1 || argc > 2;
+	} else if (strncmp(cmd, "patch-image", 11) == 0 && comp_opt_arg(&j->opt, cmd + 11)) {
+		j->type = JOB_PATCH;
+		return argc < 2;
+	} else if (strcmp(cmd, "cleanup") == 0) {
+		j->type = JOB_CLEANUP;
+		return argc != 0;
+	}
+	return 1;
+}
+
+static void run_job(void *arg) {
+	struct batch_job *j = arg;
+	char **argv = j->argv + 2, path[PATH_MAX];
+
+	xmkdir(j->boot.dir, 0755);
+	j->log = xfopen(boot_path(&j->boot, BATCH_LOG, path), j->chained ? "a" : "w");
+	boot_log = j->log;
+	switch (j->type) {
+		case JOB_UNPACK:
+			j->ret = unpack(&j->boot, argv[0], j->hash);
+			break;
+		case JOB_REPACK:
+			repack(&j->boot, argv[0], j->argc > 3 ? argv[1] : boot_path(&j->boot, NEW_BOOT, path), &j->opt);
+			break;
+		case JOB_PATCH:
+			j->ret = patch_image(&j->boot, argv[0], argv[1], &j->opt, j->argc - 4, argv + 2);
+			break;
+		case JOB_CLEANUP:
+			cleanup(&j->boot);
+			break;
+	}
+}
+
+static void batch_task(void *arg) {
+	for (struct batch_job *j = arg; j; j = j->next) {
+		j->err = pool_try(run_job, j);
+		if (j->log)
+			fclose(j->log);
+	}
+}
+
+// "dir" and "dir/" are the same directory
+static int same_dir(const char *a, const char *b) {
+	size_t la = strlen(a), lb = strlen(b);
+	while (la > 1 && a[la - 1] == '/')
+		--la;
+	while (lb > 1 && b[lb - 1] == '/')
+		--lb;
+	return la == lb && strncmp(a, b, la) == 0;
+}
+
+// Returns 1 if any job failed, the exit codes of the others are shown only
+int boot_batch(const char *manifest, int threads) {
+	struct vector jobs;
+	struct batch_job *j, *prev;
+	task_group g = { 0 };
+	char *line = NULL;
+	size_t len = 0;
+	int num = 0, failed = 0;
+	FILE *fp = xfopen(manifest, "r");
+
+	// The whole manifest is checked before anything runs
+	vec_init(&jobs);
+	while (getline(&line, &len, fp) >= 0) {
+		j = xcalloc(1, sizeof(*j));
+		j->line = ++num;
+		j->buf = strdup(line);
+		j->argc = split_line(j->buf, j->argv, BATCH_ARGS);
+		if (j->argc == 0) {
+			free(j->buf);
+			free(j);
+			continue;
+		}
+		if (parse_job(j))
+			LOGE(1, "%s:%d: Invalid command [%s]\n", manifest, num, j->argc > 1 ? j->argv[1] : "");
+		j->boot.dir = j->argv[0];
+		// Chained after the last job of the directory, submitted with the first
+		for (size_t i = vec_size(&jobs); i > 0; --i) {
+			prev = vec_entry(&jobs)[i - 1];
+			if (same_dir(prev->boot.dir, j->boot.dir)) {
+				prev->next = j;
+				j->chained = 1;
+				break;
+			}
+		}
+		vec_push_back(&jobs, j);
+	}
+	free(line);
+	fclose(fp);
+
+	// Probe the SHA instructions once, not racing in the workers
+	sha1_hw_blocks();
+	pool_start(threads);
+	vec_for_each(&jobs, j)
+		if (!j->chained)
+			pool_submit(&g, batch_task, j);
+	pool_wait(&g);
+	pool_stop();
+
+	vec_for_each(&jobs, j) {
+		if (j->err) {
+			fprintf(stderr, "%d [%s]: failed with %d, see %s/" BATCH_LOG "\n", j->line, j->argv[1],
+				j->err, j->boot.dir);
+			failed = 1;
+		} else {
+			fprintf(stderr, "%d [%s]: done with %d\n", j->line, j->argv[1], j->ret);
+		}
+		free(j->buf);
+	}
+	vec_deep_destroy(&jobs);
+	return failed;
+}
@@ -0,0 +1,561 @@
+/* bench.c - benchmarks for magiskboot hot paths
+ *
+ * magiskboot_bench [-v] [-s size in MB] [-t seconds] [bootimg...]
+ * Runs the codecs, cpio operations, hexpatch, hashing and image I/O on a
+ * synthetic corpus (AOSP gzip, Samsung lz4, MTK headers, ChromeOS) and on the
+ * given boot images. Prints one tab separated line per operation to stdout;
+ * the output of the operations themselves goes to stderr only with -v.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "magiskboot.h"
+#include "sha256.h"
+#include "sha_hw.h"
+
+#if defined(__aarch64__)
+#define ABI "arm64-v8a"
+#elif defined(__arm__)
+#define ABI "armeabi-v7a"
+#elif defined(__x86_64__)
+#define ABI "x86_64"
+#elif defined(__i386__)
+#define ABI "x86"
+#else
+#define ABI "unknown"
+#endif
+
+#define PAGE_SIZE_IMG   2048
+#define MAX_ITER        1000
+
+static double min_time = 0.5;
+
+// stderr of the bench itself, fd 2 is where the operations print
+static int log_fd = STDERR_FILENO;
+
+#define BENCH_ERR(...) { dprintf(log_fd, __VA_ARGS__); exit(1); }
+
+/*************
+ * Measuring
+ *************/
+
+struct usage {
+	double time;
+	long rss_kb;
+	long syscr, syscw;
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read and write calls of this process so far, not all syscalls
+static void read_io(long *syscr, long *syscw) {
+	char buf[512], *p;
+	int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+	ssize_t len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+	*syscr = *syscw = 0;
+	if (fd >= 0)
+		close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+	if ((p = strstr(buf, "syscr: ")))
+		*syscr = atol(p + 7);
+	if ((p = strstr(buf, "syscw: ")))
+		*syscw = atol(p + 7);
+}
+
+static long peak_rss_kb() {
+	char buf[2048], *p;
+	int fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+	ssize_t len = fd < 0 ? -1 : read(fd, buf, sizeof(buf) - 1);
+	if (fd >= 0)
+		close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	return (p = strstr(buf, "VmHWM:")) ? atol(p + 6) : 0;
+}
+
+// Make VmHWM start from the current RSS (Linux 4.0+, otherwise it is the process peak)
+static void reset_peak_rss() {
+	int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		write(fd, "5", 1);
+		close(fd);
+	}
+}
+
+static void usage_begin(struct usage *u) {
+	reset_peak_rss();
+	read_io(&u->syscr, &u->syscw);
+	u->time = now();
+}
+
+static void usage_end(struct usage *u) {
+	long syscr, syscw;
+	u->time = now() - u->time;
+	read_io(&syscr, &syscw);
+	u->syscr = syscr - u->syscr;
+	u->syscw = syscw - u->syscw;
+	u->rss_kb = peak_rss_kb();
+}
+
+static struct usage overhead;
+
+typedef void (*bench_fn)(void *arg);
+
+// Repeat fn for at least min_time, bytes is what one run processes
+static void run(const char *op, const char *input, size_t bytes, bench_fn fn, void *arg) {
+	struct usage u;
+	int iter = 0;
+	usage_begin(&u);
+	do {
+		fn(arg);
+		++iter;
+	} while (iter < MAX_ITER && now() - u.time < min_time);
+	usage_end(&u);
+	printf("%s\t%s\t%s\t%.2f\t%.1f\t%ld\t%.2f\t%.2f\n", ABI, op, input, bytes / 1048576.0,
+		bytes * (double) iter / u.time / 1048576.0, u.rss_kb,
+		(u.syscr - overhead.syscr) / (double) iter, (u.syscw - overhead.syscw) / (double) iter);
+	fflush(stdout);
+}
+
+/*******************
+ * Synthetic corpus
+ *******************/
+
+static uint32_t rnd_state = 2463534242U;
+
+static uint32_t rnd() {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static const char *words[] = {
+	"service", "class", "main", "user", "root", "group", "system", "on", "boot",
+	"write", "/proc/sys/kernel", "chmod", "0644", "mount", "/dev/block", "setprop",
+	"ro.build", "start", "stop", "oneshot", "seclabel", "u:r:init:s0", "exec", "mkdir"
+};
+
+// Text of init scripts and props
+static void fill_text(unsigned char *buf, size_t size) {
+	size_t pos = 0, len;
+	const char *w;
+	while (pos < size) {
+		w = words[rnd() % (sizeof(words) / sizeof(words[0]))];
+		len = strlen(w);
+		if (len > size - pos)
+			len = size - pos;
+		memcpy(buf + pos, w, len);
+		pos += len;
+		if (pos < size)
+			buf[pos++] = rnd() % 6 ? ' ' : '\n';
+	}
+}
+
+// Roughly the redundancy of machine code: half of the chunks repeat earlier ones
+static void fill_binary(unsigned char *buf, size_t size) {
+	uint32_t r;
+	for (size_t pos = 0; pos < size; pos += 16) {
+		r = rnd();
+		for (size_t i = pos; i < pos + 16 && i < size; ++i) {
+			if (pos >= 4096 && (r & 1))
+				buf[i] = buf[i - 16 * (1 + (r >> 20) % 256)];
+			else
+				buf[i] = rnd();
+		}
+	}
+}
+
+static void cpio_entry(sink_t *s, const char *name, int mode, const unsigned char *data, size_t size) {
+	static int ino = 300000;
+	char hdr[128];
+	size_t namesize = strlen(name) + 1;
+	sprintf(hdr, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+		ino++, mode, 0, 0, 1, 0, (unsigned) size, 0, 0, 0, 0, (unsigned) namesize, 0);
+	sink_write(s, hdr, 110);
+	sink_write(s, name, namesize);
+	sink_align(s, 4);
+	sink_write(s, data, size);
+	sink_align(s, 4);
+}
+
+// A ramdisk of a few MB with the kinds of entries stock ramdisks have
+static void make_ramdisk(sink_t *s) {
+	static const char fstab[] =
+		"/dev/block/bootdevice/by-name/system /system ext4 ro,barrier=1 wait,verify\n"
+		"/dev/block/bootdevice/by-name/userdata /data ext4 noatime wait,forceencrypt=footer\n";
+	unsigned char *buf = xmalloc(1 << 20);
+	char name[64];
+	mem_sink(s);
+	cpio_entry(s, ".", S_IFDIR | 0755, NULL, 0);
+	fill_binary(buf, 1 << 20);
+	cpio_entry(s, "init", S_IFREG | 0750, buf, 1 << 20);
+	cpio_entry(s, "fstab.qcom", S_IFREG | 0640, (const unsigned char *) fstab, sizeof(fstab) - 1);
+	for (int i = 0; i < 40; ++i) {
+		snprintf(name, sizeof(name), "init.%d.rc", i);
+		fill_text(buf, 8192);
+		cpio_entry(s, name, S_IFREG | 0750, buf, 8192);
+	}
+	cpio_entry(s, "res", S_IFDIR | 0755, NULL, 0);
+	for (int i = 0; i < 200; ++i) {
+		snprintf(name, sizeof(name), "res/image_%d.png", i);
+		for (int j = 0; j < 4096; ++j)
+			buf[j] = rnd();
+		cpio_entry(s, name, S_IFREG | 0644, buf, 4096);
+	}
+	cpio_entry(s, "sbin", S_IFDIR | 0750, NULL, 0);
+	fill_binary(buf, 512 << 10);
+	cpio_entry(s, "sbin/adbd", S_IFREG | 0750, buf, 512 << 10);
+	cpio_entry(s, "TRAILER!!!", 0, NULL, 0);
+	free(buf);
+}
+
+enum { PLAIN, SAMSUNG, MEDIATEK, CHROME };
+
+static void mtk_header(sink_t *s, const char *name, size_t size) {
+	unsigned char buf[512];
+	mtk_hdr *m = (mtk_hdr *) buf;
+	memset(buf, 0xff, sizeof(buf));
+	memcpy(m->magic, "\x88\x16\x88\x58", 4);
+	m->size = size;
+	memset(m->name, 0, sizeof(m->name));
+	strcpy((char *) m->name, name);
+	sink_write(s, buf, sizeof(buf));
+}
+
+static void make_image(const char *file, int kind, file_t type, const unsigned char *kernel,
+		size_t kernel_size, const sink_t *cpio) {
+	boot_img_hdr hdr;
+	sink_t rd, img;
+	int mtk = kind == MEDIATEK;
+	int fd = open_new(file);
+
+	mem_sink(&rd);
+	comp_sink(type, NULL, &rd, cpio->buf, cpio->size);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+	hdr.kernel_size = kernel_size + (mtk ? 512 : 0);
+	hdr.kernel_addr = 0x10008000;
+	hdr.ramdisk_size = rd.size + (mtk ? 512 : 0);
+	hdr.ramdisk_addr = 0x11000000;
+	hdr.tags_addr = 0x10000100;
+	hdr.page_size = PAGE_SIZE_IMG;
+	strcpy((char *) hdr.cmdline, "console=ttyHSL0,115200,n8 androidboot.hardware=qcom");
+
+	buf_sink(&img, fd);
+	if (kind == CHROME) {
+		// Signed ChromeOS images have their own header in front
+		sink_write(&img, CHROMEOS_MAGIC, 8);
+		sink_zero(&img, 0x10000 - 8);
+	}
+	sink_write(&img, &hdr, sizeof(hdr));
+	sink_align(&img, PAGE_SIZE_IMG);
+	if (mtk)
+		mtk_header(&img, "KERNEL", kernel_size);
+	sink_write(&img, kernel, kernel_size);
+	sink_align(&img, PAGE_SIZE_IMG);
+	if (mtk)
+		mtk_header(&img, "ROOTFS", rd.size);
+	sink_write(&img, rd.buf, rd.size);
+	sink_align(&img, PAGE_SIZE_IMG);
+	if (kind == SAMSUNG)
+		sink_write(&img, "SEANDROIDENFORCE", 16);
+	sink_free(&img);
+	close(fd);
+	free(rd.buf);
+}
+
+/*************
+ * Operations
+ *************/
+
+struct job {
+	file_t type;
+	const unsigned char *buf;
+	size_t size;
+	const char *file;
+	int sha256;
+	int cmdc;
+	char **cmdv;
+};
+
+static void bench_comp(void *arg) {
+	struct job *j = arg;
+	sink_t out;
+	mem_sink(&out);
+	comp_sink(j->type, NULL, &out, j->buf, j->size);
+	free(out.buf);
+}
+
+static void bench_decomp(void *arg) {
+	struct job *j = arg;
+	sink_t out;
+	mem_sink(&out);
+	decomp_sink(j->type, &out, j->buf, j->size);
+	free(out.buf);
+}
+
+static void bench_cpio(void *arg) {
+	struct job *j = arg;
+	sink_t out;
+	mem_sink(&out);
+	cpio_mem_commands(&out, j->buf, j->size, j->cmdc, j->cmdv);
+	free(out.buf);
+}
+
+static void bench_hash(void *arg) {
+	struct job *j = arg;
+	unsigned char digest[32];
+	SHA1_CTX sha1_ctx;
+	SHA256_CTX sha256_ctx;
+	if (j->sha256) {
+		SHA256Init(&sha256_ctx);
+		SHA256Update(&sha256_ctx, j->buf, j->size);
+		SHA256Final(digest, &sha256_ctx);
+	} else {
+		SHA1Init(&sha1_ctx);
+		SHA1Update(&sha1_ctx, j->buf, j->size);
+		SHA1Final(digest, &sha1_ctx);
+	}
+}
+
+static void bench_parse(void *arg) {
+	struct job *j = arg;
+	boot_img boot = { 0 };
+	unsigned char *buf;
+	size_t size;
+	mmap_ro(j->file, &buf, &size);
+	parse_img(&boot, buf, size);
+	munmap(buf, size);
+}
+
+static void bench_unpack(void *arg) {
+	struct job *j = arg;
+	boot_img boot = { 0 };
+	unpack(&boot, j->file, j->sha256 ? 2 : 0);
+}
+
+static void bench_repack(void *arg) {
+	boot_img boot = { 0 };
+	repack(&boot, ((struct job *) arg)->file, "bench-repack.img", NULL);
+}
+
+static void bench_patch_image(void *arg) {
+	struct job *j = arg;
+	boot_img boot = { 0 };
+	patch_image(&boot, j->file, "bench-patch.img", NULL, j->cmdc, j->cmdv);
+}
+
+static void bench_hexpatch(void *arg) {
+	struct job *j = arg;
+	hexpatch(j->file, j->cmdc, j->cmdv);
+}
+
+static int hash_check(const unsigned char *buf, size_t size) {
+	struct job j = { .buf = buf, .size = size };
+	unsigned char soft[32], hw[32];
+	SHA1_CTX sha1_ctx;
+	SHA256_CTX sha256_ctx;
+	int ret = 0;
+	for (j.sha256 = 0; j.sha256 < 2; ++j.sha256) {
+		const char *name = j.sha256 ? "sha256" : "sha1", *impl[2] = { "soft", sha_hw_name() };
+		char op[32];
+		for (int hw_on = 0; hw_on < 2; ++hw_on) {
+			sha_hw_enable(hw_on);
+			snprintf(op, sizeof(op), "%s/%s", name, impl[hw_on]);
+			run(op, "random", size, bench_hash, &j);
+			if (j.sha256) {
+				SHA256Init(&sha256_ctx);
+				SHA256Update(&sha256_ctx, buf, size);
+				SHA256Final(hw_on ? hw : soft, &sha256_ctx);
+			} else {
+				SHA1Init(&sha1_ctx);
+				SHA1Update(&sha1_ctx, buf, size);
+				SHA1Final(hw_on ? hw : soft, &sha1_ctx);
+			}
+		}
+		if (memcmp(soft, hw, j.sha256 ? 32 : 20)) {
+			dprintf(log_fd, "%s digest mismatch!\n", name);
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+static const char *basename_of(const char *path) {
+	const char *p = strrchr(path, '/');
+	return p ? p + 1 : path;
+}
+
+static void bench_image(const char *file, const char *input) {
+	static char *patch_cmd[] = { "patch false false" };
+	// skip_initramfs <-> want_initramfs, so every run patches
+	static char *hex[] = {
+		"736B69705F696E697472616D6673", "77616E745F696E697472616D6673",
+		"77616E745F696E697472616D6673", "736B69705F696E697472616D6673"
+	};
+	struct job j = { .file = file };
+	boot_img boot = { 0 };
+	struct stat st;
+	char copy[PATH_MAX];
+	unsigned char *buf;
+	size_t size;
+	int fd;
+
+	if (stat(file, &st))
+		BENCH_ERR("Cannot stat [%s]\n", file);
+	run("parse_img", input, st.st_size, bench_parse, &j);
+	run("unpack", input, st.st_size, bench_unpack, &j);
+	j.sha256 = 1;
+	run("unpack/sha256", input, st.st_size, bench_unpack, &j);
+	j.sha256 = 0;
+	run("repack", input, st.st_size, bench_repack, &j);
+	j.cmdc = 1;
+	j.cmdv = patch_cmd;
+	run("patch_image", input, st.st_size, bench_patch_image, &j);
+
+	// hexpatch modifies the file, work on a copy
+	snprintf(copy, sizeof(copy), "bench-hex.img");
+	mmap_ro(file, &buf, &size);
+	fd = open_new(copy);
+	xwrite(fd, buf, size);
+	close(fd);
+	j.file = copy;
+	j.cmdc = 4;
+	j.cmdv = hex;
+	run("hexpatch", input, size, bench_hexpatch, &j);
+	unlink(copy);
+
+	// Hash the image the way --sha1 does
+	j.buf = buf;
+	j.size = size;
+	j.sha256 = 0;
+	run("sha1", input, size, bench_hash, &j);
+	munmap(buf, size);
+
+	cleanup(&boot);
+	unlink("bench-repack.img");
+	unlink("bench-patch.img");
+}
+
+static void usage(char *arg0) {
+	fprintf(stderr,
+		"%s [-v] [-s size] [-t seconds] [bootimg...]\n"
+		"  Benchmark magiskboot on a synthetic corpus and the given boot images\n"
+		"  -s: size of the hashed buffer in MB (default: 64)\n"
+		"  -t: minimum run time of each operation (default: 0.5)\n"
+		"  -v: show the output of the operations\n"
+		"  Columns: abi, op, input, MB, MB/s, peak RSS (kB), average read and write\n"
+		"  calls per run (syscr and syscw of /proc/self/io)\n"
+		"  Temporary files are created in the current directory\n", arg0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	static const struct { const char *name; int kind; file_t type; } images[] = {
+		{ "aosp_gzip", PLAIN, GZIP },
+		{ "samsung_lz4", SAMSUNG, LZ4 },
+		{ "mtk_gzip", MEDIATEK, GZIP },
+		{ "chromeos_gzip", CHROME, GZIP },
+	};
+	static char *patch_cmd[] = { "patch false false" };
+	size_t size = 64 << 20, kernel_size = 8 << 20;
+	struct job j;
+	sink_t cpio, comp;
+	unsigned char *buf, *kernel;
+	char dir[] = "bench.XXXXXX", file[PATH_MAX], op[32];
+	int opt, ret, verbose = 0;
+
+	while ((opt = getopt(argc, argv, "vs:t:")) != -1) {
+		switch (opt) {
+			case 'v':
+				verbose = 1;
+				break;
+			case 's':
+				size = strtoul(optarg, NULL, 10) << 20;
+				break;
+			case 't':
+				min_time = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (size == 0)
+		usage(argv[0]);
+	// The images are used after changing into the temporary directory
+	for (int i = optind; i < argc; ++i) {
+		if (realpath(argv[i], file) == NULL)
+			BENCH_ERR("Cannot find [%s]\n", argv[i]);
+		argv[i] = strdup(file);
+	}
+
+	if (!verbose) {
+		log_fd = dup(STDERR_FILENO);
+		dup2(xopen("/dev/null", O_WRONLY | O_CLOEXEC), STDERR_FILENO);
+	}
+	usage_begin(&overhead);
+	usage_end(&overhead);
+	printf("#abi\top\tinput\tMB\tMB/s\trss_kB\treads\twrites\n");
+
+	// Hashing
+	buf = xmalloc(size);
+	for (size_t i = 0; i < size; ++i)
+		buf[i] = rnd();
+	ret = hash_check(buf, size);
+	free(buf);
+
+	// Codecs and cpio on the synthetic ramdisk
+	make_ramdisk(&cpio);
+	for (int i = 0; SUP_LIST[i]; ++i) {
+		memset(&j, 0, sizeof(j));
+		j.type = SUP_TYPE_LIST[i];
+		j.buf = cpio.buf;
+		j.size = cpio.size;
+		snprintf(op, sizeof(op), "comp/%s", SUP_LIST[i]);
+		run(op, "ramdisk", cpio.size, bench_comp, &j);
+		mem_sink(&comp);
+		comp_sink(j.type, NULL, &comp, cpio.buf, cpio.size);
+		j.buf = comp.buf;
+		j.size = comp.size;
+		snprintf(op, sizeof(op), "decomp/%s", SUP_LIST[i]);
+		run(op, "ramdisk", cpio.size, bench_decomp, &j);
+		free(comp.buf);
+	}
+	memset(&j, 0, sizeof(j));
+	j.buf = cpio.buf;
+	j.size = cpio.size;
+	run("cpio/parse_dump", "ramdisk", cpio.size, bench_cpio, &j);
+	j.cmdc = 1;
+	j.cmdv = patch_cmd;
+	run("cpio/patch", "ramdisk", cpio.size, bench_cpio, &j);
+
+	// Image I/O, everything is written in a temporary directory
+	if (mkdtemp(dir) == NULL || chdir(dir))
+		BENCH_ERR("Cannot create [%s]: %s\n", dir, strerror(errno));
+	kernel = xmalloc(kernel_size);
+	fill_binary(kernel, kernel_size);
+	memcpy(kernel + kernel_size / 2, "skip_initramfs", 14);
+	for (int i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+		snprintf(file, sizeof(file), "%s.img", images[i].name);
+		make_image(file, images[i].kind, images[i].type, kernel, kernel_size, &cpio);
+		bench_image(file, images[i].name);
+		unlink(file);
+	}
+	for (int i = optind; i < argc; ++i)
+		bench_image(argv[i], basename_of(argv[i]));
+	free(kernel);
+	free(cpio.buf);
+	chdir("..");
+	rmdir(dir);
+	return ret;
+}
@@ -82,16 +82,161 @@ int open_new(const char *filename) {
 	return xopen(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 }
 
-void cleanup() {
-	fprintf(stderr, "Cleaning up...\n");
-	char name[PATH_MAX];
-	unlink(KERNEL_FILE);
-	unlink(RAMDISK_FILE);
-	unlink(RAMDISK_FILE ".unsupport");
-	unlink(SECOND_FILE);
-	unlink(DTB_FILE);
+static void fd_write(sink_t *s, const void *buf, size_t size) {
+	xwrite(s->fd, buf, size);
+	s->size += size;
+}
+
+static void mem_write(sink_t *s, const void *buf, size_t size) {
+	if (s->size + size > s->cap) {
+		if (s->cap == 0)
+			s->cap = 4096;
+		while (s->size + size > s->cap)
+			s->cap *= 2;
+		s->buf = xrealloc(s->buf, s->cap);
+	}
+	memcpy(s->buf + s->size, buf, size);
+	s->size += size;
+}
+
+void fd_sink(sink_t *s, int fd) {
+	memset(s, 0, sizeof(*s));
+	s->write = fd_write;
+	s->fd = fd;
+}
+
+// The buffer belongs to the caller, free(s->buf) when done
+void mem_sink(sink_t *s) {
+	memset(s, 0, sizeof(*s));
+	s->write = mem_write;
+	s->fd = -1;
+}
+
+static void null_write(sink_t *s, const void *buf, size_t size) {
+	s->size += size;
+}
+
+// Only counts the bytes written
+void null_sink(sink_t *s) {
+	memset(s, 0, sizeof(*s));
+	s->write = null_write;
+	s->fd = -1;
+}
+
+// Small writes are collected in buf, anything that does not fit goes out
+// together with the buffered bytes in a single writev
+static void buf_write(sink_t *s, const void *buf, size_t size) {
+	struct iovec iov[2];
+	if (s->fill + size <= s->cap) {
+		memcpy(s->buf + s->fill, buf, size);
+		s->fill += size;
+	} else {
+		iov[0].iov_base = s->buf;
+		iov[0].iov_len = s->fill;
+		iov[1].iov_base = (void *) buf;
+		iov[1].iov_len = size;
+		xwritev(s->fd, iov, 2);
+		s->fill = 0;
+	}
+	s->size += size;
+}
+
+// Call sink_free when done, the fd is not closed
+void buf_sink(sink_t *s, int fd) {
+	memset(s, 0, sizeof(*s));
+	s->write = buf_write;
+	s->fd = fd;
+	s->cap = BUF_SINK_SIZE;
+	s->buf = xmmap(NULL, s->cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+// Write out buffered bytes, the fd is then in sync with s->size
+void sink_flush(sink_t *s) {
+	if (s->write == buf_write && s->fill) {
+		xwrite(s->fd, s->buf, s->fill);
+		s->fill = 0;
+	}
+}
+
+void sink_free(sink_t *s) {
+	if (s->write == buf_write) {
+		sink_flush(s);
+		munmap(s->buf, s->cap);
+	} else {
+		free(s->buf);
+	}
+	s->buf = NULL;
+}
+
+void sink_zero(sink_t *s, size_t size) {
+	static const char zeros[512];
+	while (size) {
+		size_t n = size > sizeof(zeros) ? sizeof(zeros) : size;
+		sink_write(s, zeros, n);
+		size -= n;
+	}
+}
+
+// Pad with zeros to the alignment, counted from the start of the sink
+void sink_align(sink_t *s, size_t align) {
+	size_t pos = s->size;
+	mem_align(&pos, align);
+	sink_zero(s, pos - s->size);
+}
+
+void digest_init(digest_t *d, int sha256) {
+	d->sha256 = sha256;
+	if (sha256)
+		SHA256Init(&d->sha256_ctx);
+	else
+		SHA1Init(&d->sha1_ctx);
+}
+
+void digest_update(digest_t *d, const unsigned char *buf, size_t size) {
+	// The SHA functions take 32 bit lengths
+	for (size_t n; size; buf += n, size -= n) {
+		n = size > 0x40000000 ? 0x40000000 : size;
+		if (d->sha256)
+			SHA256Update(&d->sha256_ctx, buf, n);
+		else
+			SHA1Update(&d->sha1_ctx, buf, n);
+	}
+}
+
+// hex needs DIGEST_HEX_SIZE bytes. With compat, SHA-1 digests are printed as
+// chars like --sha1 always did, its output names stock image backups
+void digest_hex(digest_t *d, char *hex, int compat) {
+	unsigned char digest[32];
+	hex[0] = '\0';
+	if (d->sha256) {
+		SHA256Final(digest, &d->sha256_ctx);
+		for (int i = 0; i < 32; ++i)
+			hex += sprintf(hex, "%02x", digest[i]);
+	} else {
+		SHA1Final(digest, &d->sha1_ctx);
+		for (int i = 0; i < 20; ++i)
+			hex += sprintf(hex, "%02x", compat ? (char) digest[i] : digest[i]);
+	}
+}
+
+// Name of a section file in the directory of boot, path needs PATH_MAX bytes
+const char *boot_path(boot_img *boot, const char *name, char *path) {
+	if (boot->dir == NULL)
+		return name;
+	snprintf(path, PATH_MAX, "%s/%s", boot->dir, name);
+	return path;
+}
+
+void cleanup(boot_img *boot) {
+	fprintf(LOG_FILE, "Cleaning up...\n");
+	char path[PATH_MAX], name[PATH_MAX];
+	unlink(boot_path(boot, KERNEL_FILE, path));
+	unlink(boot_path(boot, RAMDISK_FILE, path));
+	unlink(boot_path(boot, RAMDISK_FILE ".unsupport", path));
+	unlink(boot_path(boot, SECOND_FILE, path));
+	unlink(boot_path(boot, DTB_FILE, path));
 	for (int i = 0; SUP_EXT_LIST[i]; ++i) {
 		sprintf(name, "%s.%s", RAMDISK_FILE, SUP_EXT_LIST[i]);
-		unlink(name);
+		unlink(boot_path(boot, name, path));
 	}
 }
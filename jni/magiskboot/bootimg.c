@@ -1,22 +1,16 @@
 #include "bootimg.h"
 #include "magiskboot.h"
 
-static unsigned char *kernel, *ramdisk, *second, *dtb, *extra;
-static boot_img_hdr hdr;
-static int mtk_kernel = 0, mtk_ramdisk = 0;
-static file_t ramdisk_type;
+static const char *digest_names[DIGEST_NUM] = { "", "KERNEL_", "RAMDISK_", "SECOND_", "DTB_", "RAMDISK_CPIO_" };
 
-static void dump(unsigned char *buf, size_t size, const char *filename) {
-	int fd = open_new(filename);
-	xwrite(fd, buf, size);
-	close(fd);
-}
-
-static size_t restore(const char *filename, int fd) {
+static size_t restore(const char *filename, sink_t *out) {
 	int ifd = xopen(filename, O_RDONLY);
 	size_t size = lseek(ifd, 0, SEEK_END);
 	lseek(ifd, 0, SEEK_SET);
-	xsendfile(fd, ifd, NULL, size);
+	// Whole files skip the buffer
+	sink_flush(out);
+	xsendfile(out->fd, ifd, NULL, size);
+	out->size += size;
 	close(ifd);
 	return size;
 }
@@ -25,56 +19,66 @@ static void restore_buf(int fd, const void *buf, size_t size) {
 	xwrite(fd, buf, size);
 }
 
-static void print_info() {
-	fprintf(stderr, "KERNEL [%d] @ 0x%08x\n", hdr.kernel_size, hdr.kernel_addr);
-	fprintf(stderr, "RAMDISK [%d] @ 0x%08x\n", hdr.ramdisk_size, hdr.ramdisk_addr);
-	fprintf(stderr, "SECOND [%d] @ 0x%08x\n", hdr.second_size, hdr.second_addr);
-	fprintf(stderr, "DTB [%d] @ 0x%08x\n", hdr.dt_size, hdr.tags_addr);
-	fprintf(stderr, "PAGESIZE [%d]\n", hdr.page_size);
-	if (hdr.os_version != 0) {
+static void restore_mtk(sink_t *out, const unsigned char *buf, mtk_hdr *mtk, size_t *off) {
+	*off = out->size;
+	sink_write(out, buf, 512);
+	memcpy(mtk, buf, sizeof(*mtk));
+}
+
+static void print_info(boot_img *boot) {
+	fprintf(LOG_FILE, "KERNEL [%d] @ 0x%08x\n", boot->hdr.kernel_size, boot->hdr.kernel_addr);
+	fprintf(LOG_FILE, "RAMDISK [%d] @ 0x%08x\n", boot->hdr.ramdisk_size, boot->hdr.ramdisk_addr);
+	fprintf(LOG_FILE, "SECOND [%d] @ 0x%08x\n", boot->hdr.second_size, boot->hdr.second_addr);
+	fprintf(LOG_FILE, "DTB [%d] @ 0x%08x\n", boot->hdr.dt_size, boot->hdr.tags_addr);
+	fprintf(LOG_FILE, "PAGESIZE [%d]\n", boot->hdr.page_size);
+	if (boot->hdr.os_version != 0) {
 		int a,b,c,y,m = 0;
 		int os_version, os_patch_level;
-		os_version = hdr.os_version >> 11;
-		os_patch_level = hdr.os_version & 0x7ff;
+		os_version = boot->hdr.os_version >> 11;
+		os_patch_level = boot->hdr.os_version & 0x7ff;
 		
 		a = (os_version >> 14) & 0x7f;
 		b = (os_version >> 7) & 0x7f;
 		c = os_version & 0x7f;
-		fprintf(stderr, "OS_VERSION [%d.%d.%d]\n", a, b, c);
+		fprintf(LOG_FILE, "OS_VERSION [%d.%d.%d]\n", a, b, c);
 		
 		y = (os_patch_level >> 4) + 2000;
 		m = os_patch_level & 0xf;
-		fprintf(stderr, "PATCH_LEVEL [%d-%02d]\n", y, m);
+		fprintf(LOG_FILE, "PATCH_LEVEL [%d-%02d]\n", y, m);
 	}
-	fprintf(stderr, "NAME [%s]\n", hdr.name);
-	fprintf(stderr, "CMDLINE [%s]\n", hdr.cmdline);
+	fprintf(LOG_FILE, "NAME [%s]\n", boot->hdr.name);
+	fprintf(LOG_FILE, "CMDLINE [%s]\n", boot->hdr.cmdline);
 
-	switch (ramdisk_type) {
+	switch (boot->ramdisk_type) {
 		case GZIP:
-			fprintf(stderr, "COMPRESSION [%s]\n", "gzip");
+			fprintf(LOG_FILE, "COMPRESSION [%s]\n", "gzip");
 			break;
 		case XZ:
-			fprintf(stderr, "COMPRESSION [%s]\n", "xz");
+			fprintf(LOG_FILE, "COMPRESSION [%s]\n", "xz");
 			break;
 		case LZMA:
-			fprintf(stderr, "COMPRESSION [%s]\n", "lzma");
+			fprintf(LOG_FILE, "COMPRESSION [%s]\n", "lzma");
 			break;
 		case BZIP2:
-			fprintf(stderr, "COMPRESSION [%s]\n", "bzip2");
+			fprintf(LOG_FILE, "COMPRESSION [%s]\n", "bzip2");
 			break;
 		case LZ4:
-			fprintf(stderr, "COMPRESSION [%s]\n", "lz4");
+			fprintf(LOG_FILE, "COMPRESSION [%s]\n", "lz4");
 			break;
 		case LZ4_LEGACY:
-			fprintf(stderr, "COMPRESSION [%s]\n", "lz4_legacy");
+			fprintf(LOG_FILE, "COMPRESSION [%s]\n", "lz4_legacy");
 			break;
 		default:
-			fprintf(stderr, "Unknown ramdisk format!\n");
+			fprintf(LOG_FILE, "Unknown ramdisk format!\n");
+	}
+	for (int i = 0; boot->hash_alg && i < DIGEST_NUM; ++i) {
+		if (boot->digests[i][0])
+			fprintf(LOG_FILE, "%s%s [%s]\n", digest_names[i], boot->hash_alg == 2 ? "SHA256" : "SHA1", boot->digests[i]);
 	}
-	fprintf(stderr, "\n");
+	fprintf(LOG_FILE, "\n");
 }
 
-int parse_img(unsigned char *orig, size_t size) {
+int parse_img(boot_img *boot, unsigned char *orig, size_t size) {
 	unsigned char *base, *end;
 	size_t pos = 0;
 	int ret = 0;
@@ -85,58 +89,63 @@ int parse_img(unsigned char *orig, size_t size) {
 			ret = 2;
 			continue;
 		case ELF32:
-			exit(3);
+			boot_error(3);
 		case ELF64:
-			exit(4);
+			boot_error(4);
 		case AOSP:
+			// Nothing is left from an image parsed before
+			boot->second = boot->dtb = boot->extra = NULL;
+			boot->mtk_kernel = boot->mtk_ramdisk = 0;
+
 			// Read the header
-			memcpy(&hdr, base, sizeof(hdr));
-			pos += hdr.page_size;
+			memcpy(&boot->hdr, base, sizeof(boot->hdr));
+			pos += boot->hdr.page_size;
 
 			// Kernel position
-			kernel = base + pos;
-			pos += hdr.kernel_size;
-			mem_align(&pos, hdr.page_size);
+			boot->kernel = base + pos;
+			pos += boot->hdr.kernel_size;
+			mem_align(&pos, boot->hdr.page_size);
 
 			// Ramdisk position
-			ramdisk = base + pos;
-			pos += hdr.ramdisk_size;
-			mem_align(&pos, hdr.page_size);
+			boot->ramdisk = base + pos;
+			pos += boot->hdr.ramdisk_size;
+			mem_align(&pos, boot->hdr.page_size);
 
-			if (hdr.second_size) {
+			if (boot->hdr.second_size) {
 				// Second position
-				second = base + pos;
-				pos += hdr.second_size;
-				mem_align(&pos, hdr.page_size);
+				boot->second = base + pos;
+				pos += boot->hdr.second_size;
+				mem_align(&pos, boot->hdr.page_size);
 			}
 
-			if (hdr.dt_size) {
+			if (boot->hdr.dt_size) {
 				// dtb position
-				dtb = base + pos;
-				pos += hdr.dt_size;
-				mem_align(&pos, hdr.page_size);
+				boot->dtb = base + pos;
+				pos += boot->hdr.dt_size;
+				mem_align(&pos, boot->hdr.page_size);
 			}
 
 			if (pos < size) {
-				extra = base + pos;
+				boot->extra = base + pos;
 			}
 
 			// Check ramdisk compression type
-			ramdisk_type = check_type(ramdisk);
+			boot->ramdisk_type = check_type(boot->ramdisk);
 
 			// Check MTK
-			if (check_type(kernel) == MTK) {
-				fprintf(stderr, "MTK header found in kernel\n");
-				mtk_kernel = 1;
+			if (check_type(boot->kernel) == MTK) {
+				fprintf(LOG_FILE, "MTK header found in kernel\n");
+				boot->mtk_kernel = 1;
 			}
-			if (ramdisk_type == MTK) {
-				fprintf(stderr, "MTK header found in ramdisk\n");
-				mtk_ramdisk = 1;
-				ramdisk_type = check_type(ramdisk + 512);
+			if (boot->ramdisk_type == MTK) {
+				fprintf(LOG_FILE, "MTK header found in ramdisk\n");
+				boot->mtk_ramdisk = 1;
+				boot->ramdisk_type = check_type(boot->ramdisk + 512);
 			}
 
-			// Print info
-			print_info();
+			// Print info, unpack does when it is done hashing
+			if (!boot->hash_alg)
+				print_info(boot);
 			return ret;
 		default:
 			continue;
@@ -145,106 +154,284 @@ int parse_img(unsigned char *orig, size_t size) {
 	LOGE(1, "No boot image magic found!\n");
 }
 
-void unpack(const char* image) {
+// Locate the ramdisk in the boot image, without its MTK header
+void img_ramdisk(unsigned char *orig, size_t size, const unsigned char **buf, size_t *len, file_t *type) {
+	boot_img boot = { 0 };
+	parse_img(&boot, orig, size);
+	*buf = boot.ramdisk + (boot.mtk_ramdisk ? 512 : 0);
+	*len = boot.hdr.ramdisk_size - (boot.mtk_ramdisk ? 512 : 0);
+	*type = boot.ramdisk_type;
+}
+
+// A section unpack dumps while walking the image
+struct section {
+	const char *file;
+	const unsigned char *buf;
 	size_t size;
-	unsigned char *orig;
-	mmap_ro(image, &orig, &size);
+	int fd;
+	sink_t out;
+	codec_t *codec;     // Decoder in front of out
+	digest_t digest;
+};
+
+// Passes everything on to next, hashing it on the way
+struct hash_sink {
+	sink_t s;
+	sink_t *next;
+	digest_t *digest;
+};
+
+static void hash_write(sink_t *s, const void *buf, size_t size) {
+	struct hash_sink *h = (struct hash_sink *) s;
+	digest_update(h->digest, buf, size);
+	sink_write(h->next, buf, size);
+	s->size += size;
+}
 
-	// Parse image
-	fprintf(stderr, "Parsing boot image: [%s]\n\n", image);
-	int ret = parse_img(orig, size);
+static void section_feed(boot_img *boot, struct section *sec, const unsigned char *chunk, size_t n) {
+	if (boot->hash_alg)
+		digest_update(&sec->digest, chunk, n);
+	if (sec->codec)
+		codec_update(sec->codec, chunk, n);
+	else
+		sink_write(&sec->out, chunk, n);
+}
 
-	// Dump kernel
-	if (mtk_kernel) {
-		kernel += 512;
-		hdr.kernel_size -= 512;
+// hash: 0 = none; 1 = SHA-1; 2 = SHA-256 of the image and of every section,
+// computed in the pass that dumps them and shown by print_info
+int unpack(boot_img *boot, const char* image, int hash) {
+	size_t size, pos, n, start, end;
+	unsigned char *orig;
+	struct section secs[DIGEST_DTB + 1], *sec;
+	struct hash_sink cpio_hash;
+	digest_t img_digest, cpio_digest;
+	codec_t codec;
+	char paths[DIGEST_DTB + 1][PATH_MAX];
+	int unsupported;
+	mmap_ro(image, &orig, &size);
+	madvise(orig, size, MADV_SEQUENTIAL);
+
+	// Parse image, the info is printed after hashing
+	fprintf(LOG_FILE, "Parsing boot image: [%s]\n\n", image);
+	boot->hash_alg = hash;
+	memset(boot->digests, 0, sizeof(boot->digests));
+	int ret = parse_img(boot, orig, size);
+
+	// Skip the MTK headers
+	if (boot->mtk_kernel) {
+		boot->kernel += 512;
+		boot->hdr.kernel_size -= 512;
+	}
+	if (boot->mtk_ramdisk) {
+		boot->ramdisk += 512;
+		boot->hdr.ramdisk_size -= 512;
 	}
-	dump(kernel, hdr.kernel_size, KERNEL_FILE);
 
-	// Dump ramdisk
-	if (mtk_ramdisk) {
-		ramdisk += 512;
-		hdr.ramdisk_size -= 512;
+	memset(secs, 0, sizeof(secs));
+	secs[DIGEST_KERNEL] = (struct section) { KERNEL_FILE, boot->kernel, boot->hdr.kernel_size };
+	secs[DIGEST_RAMDISK] = (struct section) { RAMDISK_FILE, boot->ramdisk, boot->hdr.ramdisk_size };
+	if (boot->hdr.second_size)
+		secs[DIGEST_SECOND] = (struct section) { SECOND_FILE, boot->second, boot->hdr.second_size };
+	if (boot->hdr.dt_size)
+		secs[DIGEST_DTB] = (struct section) { DTB_FILE, boot->dtb, boot->hdr.dt_size };
+	memset(&codec, 0, sizeof(codec));
+	unsupported = codec_init(&codec, boot->ramdisk_type, 0, NULL);
+	if (unsupported)
+		secs[DIGEST_RAMDISK].file = RAMDISK_FILE ".unsupport";
+	for (int i = DIGEST_KERNEL; i <= DIGEST_DTB; ++i) {
+		if (secs[i].file)
+			secs[i].file = boot_path(boot, secs[i].file, paths[i]);
 	}
-	if (decomp(ramdisk_type, RAMDISK_FILE, ramdisk, hdr.ramdisk_size)) {
-		// Dump the compressed ramdisk
-		dump(ramdisk, hdr.ramdisk_size, RAMDISK_FILE ".unsupport");
-		LOGE(1, "Unsupported ramdisk format! Dumped to %s\n", RAMDISK_FILE ".unsupport");
+	if (!unsupported)
+		fprintf(LOG_FILE, "Decompressing to [%s]\n\n", secs[DIGEST_RAMDISK].file);
+	for (int i = DIGEST_KERNEL; i <= DIGEST_DTB; ++i) {
+		sec = &secs[i];
+		if (sec->file == NULL)
+			continue;
+		if (sec->buf + sec->size > orig + size)
+			LOGE(1, "Boot image is truncated!\n");
+		sec->fd = open_new(sec->file);
+		buf_sink(&sec->out, sec->fd);
+		if (hash)
+			digest_init(&sec->digest, hash == 2);
+	}
+	if (!unsupported) {
+		// The decompressed ramdisk is hashed on its way to the file
+		secs[DIGEST_RAMDISK].codec = &codec;
+		codec.out = &secs[DIGEST_RAMDISK].out;
+		if (hash) {
+			digest_init(&cpio_digest, hash == 2);
+			memset(&cpio_hash, 0, sizeof(cpio_hash));
+			cpio_hash.s.write = hash_write;
+			cpio_hash.next = codec.out;
+			cpio_hash.digest = &cpio_digest;
+			codec.out = &cpio_hash.s;
+		}
+	}
+	if (hash)
+		digest_init(&img_digest, hash == 2);
+
+	// A single pass in file order, every chunk goes to the sections it overlaps
+	for (pos = 0; pos < size; pos += n) {
+		n = size - pos > HASH_CHUNK ? HASH_CHUNK : size - pos;
+		if (hash)
+			digest_update(&img_digest, orig + pos, n);
+		for (int i = DIGEST_KERNEL; i <= DIGEST_DTB; ++i) {
+			sec = &secs[i];
+			if (sec->file == NULL)
+				continue;
+			start = sec->buf - orig;
+			end = start + sec->size;
+			if (end <= pos || start >= pos + n)
+				continue;
+			if (start < pos)
+				start = pos;
+			if (end > pos + n)
+				end = pos + n;
+			section_feed(boot, sec, orig + start, end - start);
+		}
 	}
+	if (!unsupported)
+		codec_finish(&codec);
 
-	if (hdr.second_size) {
-		// Dump second
-		dump(second, hdr.second_size, SECOND_FILE);
+	for (int i = DIGEST_KERNEL; i <= DIGEST_DTB; ++i) {
+		sec = &secs[i];
+		if (sec->file == NULL)
+			continue;
+		sink_free(&sec->out);
+		close(sec->fd);
+		if (hash)
+			digest_hex(&sec->digest, boot->digests[i], 0);
+	}
+	if (hash) {
+		// Same as --sha1, to name stock image backups
+		digest_hex(&img_digest, boot->digests[DIGEST_IMAGE], 1);
+		if (!unsupported)
+			digest_hex(&cpio_digest, boot->digests[DIGEST_CPIO], 0);
+		print_info(boot);
+		boot->hash_alg = 0;
 	}
+	munmap(orig, size);
 
-	if (hdr.dt_size) {
-		// Dump dtb
-		dump(dtb, hdr.dt_size, DTB_FILE);
+	if (unsupported)
+		LOGE(1, "Unsupported ramdisk format! Dumped to %s\n", secs[DIGEST_RAMDISK].file);
+	return ret;
+}
+
+// Check extra info, currently only for LG Bump and Samsung SEANDROIDENFORCE
+static int keep_extra(boot_img *boot) {
+	return boot->extra && (memcmp(boot->extra, "SEANDROIDENFORCE", 16) == 0 ||
+		memcmp(boot->extra, "\x41\xa9\xe4\x67\x74\x4d\x1d\x1b\xa4\x29\xf2\xec\xea\x65\x52\x79", 16) == 0);
+}
+
+// Room left for the ramdisk in fit bytes, pos is where it starts, and the
+// second and dtb of the given sizes follow
+static size_t ramdisk_budget(boot_img *boot, size_t fit, size_t pos, size_t second_size, size_t dt_size) {
+	size_t used = pos;
+	mem_align(&second_size, boot->hdr.page_size);
+	mem_align(&dt_size, boot->hdr.page_size);
+	used += second_size + dt_size + (keep_extra(boot) ? 16 : 0);
+	if (used + boot->hdr.page_size > fit)
+		LOGE(1, "Image does not fit into [%zu] bytes even without a ramdisk\n", fit);
+	// The ramdisk is padded to a page
+	return (fit - used) / boot->hdr.page_size * boot->hdr.page_size;
+}
+
+static void finish_img(boot_img *boot, sink_t *out) {
+	int fd = out->fd;
+	if (keep_extra(boot))
+		sink_write(out, boot->extra, 16);
+	sink_free(out);
+
+	// Write headers back
+	if (boot->mtk_kernel) {
+		lseek(fd, boot->mtk_kernel_off, SEEK_SET);
+		boot->mtk_kernel_hdr.size = boot->hdr.kernel_size;
+		boot->hdr.kernel_size += 512;
+		restore_buf(fd, &boot->mtk_kernel_hdr, sizeof(boot->mtk_kernel_hdr));
+	}
+	if (boot->mtk_ramdisk) {
+		lseek(fd, boot->mtk_ramdisk_off, SEEK_SET);
+		boot->mtk_ramdisk_hdr.size = boot->hdr.ramdisk_size;
+		boot->hdr.ramdisk_size += 512;
+		restore_buf(fd, &boot->mtk_ramdisk_hdr, sizeof(boot->mtk_ramdisk_hdr));
 	}
+	// Main header
+	lseek(fd, 0, SEEK_SET);
+	restore_buf(fd, &boot->hdr, sizeof(boot->hdr));
 
-	munmap(orig, size);
-	exit(ret);
+	// Print new image info
+	print_info(boot);
 }
 
-void repack(const char* orig_image, const char* out_image) {
+void repack(boot_img *boot, const char* orig_image, const char* out_image, const comp_opt *opt) {
 	size_t size;
 	unsigned char *orig;
-	char name[PATH_MAX];
-
-	// There are possible two MTK headers
-	mtk_hdr mtk_kernel_hdr, mtk_ramdisk_hdr;
-	size_t mtk_kernel_off, mtk_ramdisk_off;
+	char name[PATH_MAX], path[PATH_MAX];
+	const char *file;
+	comp_opt o = { .threads = 1 };
+	struct stat st;
+	size_t fit, second_size = 0, dt_size = 0;
 
 	// Load original image
 	mmap_ro(orig_image, &orig, &size);
 
 	// Parse original image
-	fprintf(stderr, "Parsing boot image: [%s]\n\n", orig_image);
-	parse_img(orig, size);
+	fprintf(LOG_FILE, "Parsing boot image: [%s]\n\n", orig_image);
+	parse_img(boot, orig, size);
 
-	fprintf(stderr, "Repack to boot image: [%s]\n\n", out_image);
+	fprintf(LOG_FILE, "Repack to boot image: [%s]\n\n", out_image);
+
+	// Dumped from the partition, the original image has the size of it
+	if (opt)
+		o = *opt;
+	fit = o.fit == SIZE_MAX ? size : o.fit;
 
 	// Create new image
 	int fd = open_new(out_image);
+	sink_t out;
+	buf_sink(&out, fd);
 
 	// Set all sizes to 0
-	hdr.kernel_size = 0;
-	hdr.ramdisk_size = 0;
-	hdr.second_size = 0;
-	hdr.dt_size = 0;
+	boot->hdr.kernel_size = 0;
+	boot->hdr.ramdisk_size = 0;
+	boot->hdr.second_size = 0;
+	boot->hdr.dt_size = 0;
 
 	// Skip a page for header
-	write_zero(fd, hdr.page_size);
+	sink_zero(&out, boot->hdr.page_size);
 
 	// Restore kernel
-	if (mtk_kernel) {
-		mtk_kernel_off = lseek(fd, 0, SEEK_CUR);
-		restore_buf(fd, kernel, 512);
-		memcpy(&mtk_kernel_hdr, kernel, sizeof(mtk_kernel_hdr));
-	}
-	hdr.kernel_size = restore(KERNEL_FILE, fd);
-	file_align(fd, hdr.page_size, 1);
+	if (boot->mtk_kernel)
+		restore_mtk(&out, boot->kernel, &boot->mtk_kernel_hdr, &boot->mtk_kernel_off);
+	boot->hdr.kernel_size = restore(boot_path(boot, KERNEL_FILE, path), &out);
+	sink_align(&out, boot->hdr.page_size);
 
 	// Restore ramdisk
-	if (mtk_ramdisk) {
-		mtk_ramdisk_off = lseek(fd, 0, SEEK_CUR);
-		restore_buf(fd, ramdisk, 512);
-		memcpy(&mtk_ramdisk_hdr, ramdisk, sizeof(mtk_ramdisk_hdr));
-	}
-	if (access(RAMDISK_FILE, R_OK) == 0) {
+	if (boot->mtk_ramdisk)
+		restore_mtk(&out, boot->ramdisk, &boot->mtk_ramdisk_hdr, &boot->mtk_ramdisk_off);
+	file = boot_path(boot, RAMDISK_FILE, path);
+	if (access(file, R_OK) == 0) {
 		// If we found raw cpio, compress to original format
 
 		// Before we start, clean up previous compressed files
 		for (int i = 0; SUP_EXT_LIST[i]; ++i) {
-			sprintf(name, "%s.%s", RAMDISK_FILE, SUP_EXT_LIST[i]);
+			sprintf(name, "%s.%s", file, SUP_EXT_LIST[i]);
 			unlink(name);
 		}
 
 		size_t cpio_size;
 		unsigned char *cpio;
-		mmap_ro(RAMDISK_FILE, &cpio, &cpio_size);
-
-		if (comp(ramdisk_type, RAMDISK_FILE, cpio, cpio_size))
+		mmap_ro(file, &cpio, &cpio_size);
+
+		if (fit) {
+			if (stat(boot_path(boot, SECOND_FILE, name), &st) == 0)
+				second_size = st.st_size;
+			if (stat(boot_path(boot, DTB_FILE, name), &st) == 0)
+				dt_size = st.st_size;
+			o.fit = ramdisk_budget(boot, fit, out.size, second_size, dt_size);
+		}
+		if (comp_opts(boot->ramdisk_type, &o, file, cpio, cpio_size))
 			LOGE(1, "Unsupported ramdisk format!\n");
 
 		munmap(cpio, cpio_size);
@@ -252,59 +439,109 @@ void repack(const char* orig_image, const char* out_image) {
 
 	int found = 0;
 	for (int i = 0; SUP_EXT_LIST[i]; ++i) {
-		sprintf(name, "%s.%s", RAMDISK_FILE, SUP_EXT_LIST[i]);
+		sprintf(name, "%s.%s", file, SUP_EXT_LIST[i]);
 		if (access(name, R_OK) == 0) {
-			ramdisk_type = SUP_TYPE_LIST[i];
+			boot->ramdisk_type = SUP_TYPE_LIST[i];
 			found = 1;
 			break;
 		}
 	}
 	if (!found)
 		LOGE(1, "No ramdisk exists!\n");
-	hdr.ramdisk_size = restore(name, fd);
-	file_align(fd, hdr.page_size, 1);
+	boot->hdr.ramdisk_size = restore(name, &out);
+	sink_align(&out, boot->hdr.page_size);
 
 	// Restore second
-	if (access(SECOND_FILE, R_OK) == 0) {
-		hdr.second_size = restore(SECOND_FILE, fd);
-		file_align(fd, hdr.page_size, 1);
+	file = boot_path(boot, SECOND_FILE, path);
+	if (access(file, R_OK) == 0) {
+		boot->hdr.second_size = restore(file, &out);
+		sink_align(&out, boot->hdr.page_size);
 	}
 
 	// Restore dtb
-	if (access(DTB_FILE, R_OK) == 0) {
-		hdr.dt_size = restore(DTB_FILE, fd);
-		file_align(fd, hdr.page_size, 1);
+	file = boot_path(boot, DTB_FILE, path);
+	if (access(file, R_OK) == 0) {
+		boot->hdr.dt_size = restore(file, &out);
+		sink_align(&out, boot->hdr.page_size);
 	}
 
-	// Check extra info, currently only for LG Bump and Samsung SEANDROIDENFORCE
-	if (extra) {
-		if (memcmp(extra, "SEANDROIDENFORCE", 16) == 0 || 
-			memcmp(extra, "\x41\xa9\xe4\x67\x74\x4d\x1d\x1b\xa4\x29\xf2\xec\xea\x65\x52\x79", 16) == 0 ) {
-			restore_buf(fd, extra, 16);
-		}
-	}
+	finish_img(boot, &out);
 
-	// Write headers back
-	if (mtk_kernel) {
-		lseek(fd, mtk_kernel_off, SEEK_SET);
-		mtk_kernel_hdr.size = hdr.kernel_size;
-		hdr.kernel_size += 512;
-		restore_buf(fd, &mtk_kernel_hdr, sizeof(mtk_kernel_hdr));
+	munmap(orig, size);
+	close(fd);
+	if (fit && out.size > fit)
+		LOGE(1, "Image [%zu] does not fit into [%zu] bytes\n", out.size, fit);
+}
+
+// Unpack, run cpio commands on the ramdisk and repack in a single pass.
+// The ramdisk only lives in memory, all other sections are copied straight from the mapped image
+int patch_image(boot_img *boot, const char *image, const char *out_image, const comp_opt *opt, int cmdc, char *cmdv[]) {
+	size_t size;
+	unsigned char *orig;
+	sink_t cpio, patched, out;
+	comp_opt o = { .threads = 1 };
+	size_t fit;
+	int ret;
+
+	mmap_ro(image, &orig, &size);
+
+	fprintf(LOG_FILE, "Parsing boot image: [%s]\n\n", image);
+	parse_img(boot, orig, size);
+
+	// Skip the MTK headers, they are restored as is
+	if (boot->mtk_kernel)
+		boot->hdr.kernel_size -= 512;
+	if (boot->mtk_ramdisk)
+		boot->hdr.ramdisk_size -= 512;
+
+	mem_sink(&cpio);
+	if (decomp_sink(boot->ramdisk_type, &cpio, boot->ramdisk + (boot->mtk_ramdisk ? 512 : 0), boot->hdr.ramdisk_size))
+		LOGE(1, "Unsupported ramdisk format!\n");
+	mem_sink(&patched);
+	ret = cpio_mem_commands(&patched, cpio.buf, cpio.size, cmdc, cmdv);
+	free(cpio.buf);
+
+	fprintf(LOG_FILE, "\nPatch to boot image: [%s]\n\n", out_image);
+
+	int fd = open_new(out_image);
+	buf_sink(&out, fd);
+
+	// Skip a page for header
+	sink_zero(&out, boot->hdr.page_size);
+
+	if (boot->mtk_kernel)
+		restore_mtk(&out, boot->kernel, &boot->mtk_kernel_hdr, &boot->mtk_kernel_off);
+	sink_write(&out, boot->kernel + (boot->mtk_kernel ? 512 : 0), boot->hdr.kernel_size);
+	sink_align(&out, boot->hdr.page_size);
+
+	// Compress the patched ramdisk directly into the new image
+	if (boot->mtk_ramdisk)
+		restore_mtk(&out, boot->ramdisk, &boot->mtk_ramdisk_hdr, &boot->mtk_ramdisk_off);
+	size_t off = out.size;
+	if (opt)
+		o = *opt;
+	if ((fit = o.fit == SIZE_MAX ? size : o.fit))
+		o.fit = ramdisk_budget(boot, fit, off, boot->hdr.second_size, boot->hdr.dt_size);
+	comp_sink(boot->ramdisk_type, &o, &out, patched.buf, patched.size);
+	free(patched.buf);
+	boot->hdr.ramdisk_size = out.size - off;
+	sink_align(&out, boot->hdr.page_size);
+
+	if (boot->hdr.second_size) {
+		sink_write(&out, boot->second, boot->hdr.second_size);
+		sink_align(&out, boot->hdr.page_size);
 	}
-	if (mtk_ramdisk) {
-		lseek(fd, mtk_ramdisk_off, SEEK_SET);
-		mtk_ramdisk_hdr.size = hdr.ramdisk_size;
-		hdr.ramdisk_size += 512;
-		restore_buf(fd, &mtk_ramdisk_hdr, sizeof(mtk_ramdisk_hdr));
+
+	if (boot->hdr.dt_size) {
+		sink_write(&out, boot->dtb, boot->hdr.dt_size);
+		sink_align(&out, boot->hdr.page_size);
 	}
-	// Main header
-	lseek(fd, 0, SEEK_SET);
-	restore_buf(fd, &hdr, sizeof(hdr));
 
-	// Print new image info
-	print_info();
+	finish_img(boot, &out);
 
 	munmap(orig, size);
 	close(fd);
+	if (fit && out.size > fit)
+		LOGE(1, "Image [%zu] does not fit into [%zu] bytes\n", out.size, fit);
+	return ret;
 }
-
@@ -1,7 +1,11 @@
+#include <pthread.h>
+#include <time.h>
+
 #include <zlib.h>
 #include <lzma.h>
 #include <lz4.h>
 #include <lz4frame.h>
+#include <lz4hc.h>
 #include <bzlib.h>
 
 #include "magiskboot.h"
@@ -15,469 +19,906 @@
 #define LZ4_FOOTER_SIZE 4
 #define LZ4_LEGACY_BLOCKSIZE  0x800000
 
-static void write_file(const int fd, const void *buf, const size_t size, const char *filename) {
-	xwrite(fd, buf, size);
-}
+// Smallest block handed to a compression thread
+#define MT_BLOCK_MIN    0x100000
 
 static void report(const int mode, const char* filename) {
 	switch(mode) {
 		case 0:
-			fprintf(stderr, "Decompressing to [%s]\n\n", filename);
+			fprintf(LOG_FILE, "Decompressing to [%s]\n\n", filename);
 			break;
 		default:
-			fprintf(stderr, "Compressing to [%s]\n\n", filename);
+			fprintf(LOG_FILE, "Compressing to [%s]\n\n", filename);
 			break;
 	}
 }
 
-// Mode: 0 = decode; 1 = encode
-void gzip(int mode, const char* filename, const unsigned char* buf, size_t size) {
-	size_t ret = 0, flush, have, pos = 0;
+/*********
+ * gzip
+ *********/
+
+struct gzip_ctx {
 	z_stream strm;
+	int ret;
 	unsigned char out[CHUNK];
+};
 
-	report(mode, filename);
-	int fd = open_new(filename);
-
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-
-	switch(mode) {
+static void gzip_init(codec_t *c) {
+	struct gzip_ctx *ctx = xcalloc(sizeof(*ctx), 1);
+	c->ctx = ctx;
+	switch(c->mode) {
 		case 0:
-			ret = inflateInit2(&strm, windowBits | ZLIB_GZIP);
+			ctx->ret = inflateInit2(&ctx->strm, windowBits | ZLIB_GZIP);
 			break;
 		case 1:
-			ret = deflateInit2(&strm, 9, Z_DEFLATED, windowBits | ZLIB_GZIP, memLevel, Z_DEFAULT_STRATEGY);
+			ctx->ret = deflateInit2(&ctx->strm, c->level ? c->level : 9, Z_DEFLATED,
+				windowBits | ZLIB_GZIP, memLevel, c->strategy);
 			break;
-		default:
-			LOGE(1, "Unsupported gzip mode!\n");
 	}
-
-	if (ret != Z_OK)
+	if (ctx->ret != Z_OK)
 		LOGE(1, "Unable to init zlib stream\n");
+}
 
+static void gzip_code(codec_t *c, const unsigned char *buf, size_t size, int flush) {
+	struct gzip_ctx *ctx = c->ctx;
+	ctx->strm.next_in = buf;
+	ctx->strm.avail_in = size;
 	do {
-		strm.next_in = buf + pos;
-		if (pos + CHUNK >= size) {
-			strm.avail_in = size - pos;
-			flush = Z_FINISH;
-		} else {
-			strm.avail_in = CHUNK;
-			flush = Z_NO_FLUSH;
+		// Parallel compressed data consists of multiple gzip members
+		if (c->mode == 0 && ctx->ret == Z_STREAM_END) {
+			if (ctx->strm.avail_in == 0)
+				break;
+			inflateReset(&ctx->strm);
 		}
-		pos += strm.avail_in;
-
-		do {
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-			switch(mode) {
-				case 0:
-					ret = inflate(&strm, flush);
-					break;
-				case 1:
-					ret = deflate(&strm, flush);
-					break;
-			}
-			if (ret == Z_STREAM_ERROR)
-				LOGE(1, "Error when running gzip\n");
-
-			have = CHUNK - strm.avail_out;
-			write_file(fd, out, have, filename);
-
-		} while (strm.avail_out == 0);
+		ctx->strm.avail_out = CHUNK;
+		ctx->strm.next_out = ctx->out;
+		switch(c->mode) {
+			case 0:
+				ctx->ret = inflate(&ctx->strm, flush);
+				break;
+			case 1:
+				ctx->ret = deflate(&ctx->strm, flush);
+				break;
+		}
+		if (ctx->ret == Z_STREAM_ERROR)
+			LOGE(1, "Error when running gzip\n");
+		sink_write(c->out, ctx->out, CHUNK - ctx->strm.avail_out);
+		// Stop at broken data or trailing garbage
+		if (ctx->ret != Z_OK && ctx->ret != Z_STREAM_END && ctx->ret != Z_BUF_ERROR)
+			break;
+	} while (ctx->strm.avail_out == 0 || (c->mode == 0 && ctx->ret == Z_STREAM_END && ctx->strm.avail_in));
+}
 
-	} while(pos < size);
+static void gzip_update(codec_t *c, const unsigned char *buf, size_t size) {
+	gzip_code(c, buf, size, Z_NO_FLUSH);
+}
 
-	switch(mode) {
+static void gzip_finish(codec_t *c) {
+	struct gzip_ctx *ctx = c->ctx;
+	if (!c->abort)
+		gzip_code(c, NULL, 0, Z_FINISH);
+	switch(c->mode) {
 		case 0:
-			inflateEnd(&strm);
+			inflateEnd(&ctx->strm);
 			break;
 		case 1:
-			deflateEnd(&strm);
+			deflateEnd(&ctx->strm);
 			break;
 	}
-	close(fd);
+	free(ctx);
 }
 
+/*********
+ * xz/lzma
+ *********/
 
-// Mode: 0 = decode xz/lzma; 1 = encode xz; 2 = encode lzma
-void lzma(int mode, const char* filename, const unsigned char* buf, size_t size) {
-	size_t have, pos = 0;
-	lzma_ret ret = 0;
-	lzma_stream strm = LZMA_STREAM_INIT;
-	lzma_options_lzma opt;
-	lzma_action action;
+struct lzma_ctx {
+	lzma_stream strm;
+	lzma_ret ret;
 	unsigned char out[BUFSIZ];
+};
 
-	report(mode, filename);
-	int fd = open_new(filename);
+static void lzma_init(codec_t *c) {
+	struct lzma_ctx *ctx = xcalloc(sizeof(*ctx), 1);
+	lzma_stream init = LZMA_STREAM_INIT;
+	lzma_options_lzma opt;
+	lzma_mt mt;
+	c->ctx = ctx;
+	ctx->strm = init;
 
 	// Initialize preset
-	lzma_lzma_preset(&opt, LZMA_PRESET_DEFAULT);
+	lzma_lzma_preset(&opt, c->level ? c->level : LZMA_PRESET_DEFAULT);
+	if (c->dict)
+		opt.dict_size = c->dict;
 	lzma_filter filters[] = {
 		{ .id = LZMA_FILTER_LZMA2, .options = &opt },
 		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
 	};
 
-	switch(mode) {
-		case 0:
-			ret = lzma_auto_decoder(&strm, UINT64_MAX, 0);
-			break;
-		case 1:
-			ret = lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC32);
-			break;
-		case 2:
-			ret = lzma_alone_encoder(&strm, &opt);
-			break;
-		default:
-			LOGE(1, "Unsupported lzma mode!\n");
+	if (c->mode == 0) {
+		ctx->ret = lzma_auto_decoder(&ctx->strm, UINT64_MAX, 0);
+	} else if (c->type == LZMA) {
+		ctx->ret = lzma_alone_encoder(&ctx->strm, &opt);
+	} else if (c->threads > 1) {
+		// A single xz stream with multiple blocks
+		memset(&mt, 0, sizeof(mt));
+		mt.threads = c->threads;
+		mt.block_size = c->size_hint / c->threads + 1;
+		if (mt.block_size < MT_BLOCK_MIN)
+			mt.block_size = MT_BLOCK_MIN;
+		mt.filters = filters;
+		mt.check = LZMA_CHECK_CRC32;
+		ctx->ret = lzma_stream_encoder_mt(&ctx->strm, &mt);
+	} else {
+		ctx->ret = lzma_stream_encoder(&ctx->strm, filters, LZMA_CHECK_CRC32);
 	}
 
-
-	if (ret != LZMA_OK)
+	if (ctx->ret != LZMA_OK)
 		LOGE(1, "Unable to init lzma stream\n");
+}
 
+static void lzma_do(codec_t *c, const unsigned char *buf, size_t size, lzma_action action) {
+	struct lzma_ctx *ctx = c->ctx;
+	if (ctx->ret == LZMA_STREAM_END)
+		return;
+	ctx->strm.next_in = buf;
+	ctx->strm.avail_in = size;
 	do {
-		strm.next_in = buf + pos;
-		if (pos + BUFSIZ >= size) {
-			strm.avail_in = size - pos;
-			action = LZMA_FINISH;
-		} else {
-			strm.avail_in = BUFSIZ;
-			action = LZMA_RUN;
-		}
-		pos += strm.avail_in;
-
-		do {
-			strm.avail_out = BUFSIZ;
-			strm.next_out = out;
-			ret = lzma_code(&strm, action);
-			have = BUFSIZ - strm.avail_out;
-			write_file(fd, out, have, filename);
-		} while (strm.avail_out == 0 && ret == LZMA_OK);
-
-		if (ret != LZMA_OK && ret != LZMA_STREAM_END)
-			LOGE(1, "LZMA error %d!\n", ret);
+		ctx->strm.avail_out = BUFSIZ;
+		ctx->strm.next_out = ctx->out;
+		ctx->ret = lzma_code(&ctx->strm, action);
+		sink_write(c->out, ctx->out, BUFSIZ - ctx->strm.avail_out);
+	} while ((ctx->strm.avail_out == 0 || (action == LZMA_FINISH && ctx->strm.avail_in)) && ctx->ret == LZMA_OK);
+
+	if (ctx->ret != LZMA_OK && ctx->ret != LZMA_STREAM_END)
+		LOGE(1, "LZMA error %d!\n", ctx->ret);
+}
 
-	} while (pos < size);
+static void lzma_update(codec_t *c, const unsigned char *buf, size_t size) {
+	lzma_do(c, buf, size, LZMA_RUN);
+}
 
-	lzma_end(&strm);
-	close(fd);
+static void lzma_finish(codec_t *c) {
+	struct lzma_ctx *ctx = c->ctx;
+	// Run until the stream ends, encoders may still hold a lot of data
+	while (!c->abort && ctx->ret == LZMA_OK)
+		lzma_do(c, NULL, 0, LZMA_FINISH);
+	lzma_end(&ctx->strm);
+	free(ctx);
 }
 
-// Mode: 0 = decode; 1 = encode
-void lz4(int mode, const char* filename, const unsigned char* buf, size_t size) {
+/*********
+ * lz4
+ *********/
+
+struct lz4_ctx {
 	LZ4F_decompressionContext_t dctx;
 	LZ4F_compressionContext_t cctx;
-	LZ4F_frameInfo_t info;
-
-	size_t outCapacity, avail_in, ret = 0, pos = 0;
-	size_t have, read;
-	unsigned char *out = NULL;
-
-	report(mode, filename);
-	int fd = open_new(filename);
-
-	// Initialize context
-	switch(mode) {
+	LZ4F_preferences_t prefs;
+	size_t ret;
+	size_t outCapacity;
+	unsigned char *out;
+	// Decoding: magic of the next frame, it may be split across updates
+	unsigned char magic[4];
+	size_t held;
+	int done;
+};
+
+static void lz4_init(codec_t *c) {
+	struct lz4_ctx *ctx = xcalloc(sizeof(*ctx), 1);
+	c->ctx = ctx;
+	switch(c->mode) {
 		case 0:
-			ret = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+			ctx->ret = LZ4F_createDecompressionContext(&ctx->dctx, LZ4F_VERSION);
+			ctx->outCapacity = CHUNK;
 			break;
 		case 1:
-			ret = LZ4F_createCompressionContext(&cctx, LZ4F_VERSION);
+			ctx->ret = LZ4F_createCompressionContext(&ctx->cctx, LZ4F_VERSION);
+			// Levels from LZ4HC_CLEVEL_MIN on use lz4hc
+			ctx->prefs.compressionLevel = c->level;
+			ctx->outCapacity = LZ4F_compressBound(CHUNK, &ctx->prefs) + LZ4_HEADER_SIZE + LZ4_FOOTER_SIZE;
 			break;
-		default:
-			LOGE(1, "Unsupported lz4 mode!\n");
 	}
-	
-	if (LZ4F_isError(ret))
-		LOGE(1, "Context creation error: %s\n", LZ4F_getErrorName(ret));
+	if (LZ4F_isError(ctx->ret))
+		LOGE(1, "Context creation error: %s\n", LZ4F_getErrorName(ctx->ret));
 
-	// Allocate out buffer
-	switch(mode) {
-		case 0:
-			// Read header
-			read = CHUNK;
-			ret = LZ4F_getFrameInfo(dctx, &info, buf, &read);
-			if (LZ4F_isError(ret))
-				LOGE(1, "LZ4F_getFrameInfo error: %s\n", LZ4F_getErrorName(ret));
-			switch (info.blockSizeID) {
-				case LZ4F_default:
-				case LZ4F_max64KB:  outCapacity = 1 << 16; break;
-				case LZ4F_max256KB: outCapacity = 1 << 18; break;
-				case LZ4F_max1MB:   outCapacity = 1 << 20; break;
-				case LZ4F_max4MB:   outCapacity = 1 << 22; break;
-				default:
-					LOGE(1, "Impossible unless more block sizes are allowed\n");
-			}
-			pos += read;
-			break;
-		case 1:
-			outCapacity = LZ4F_compressBound(CHUNK, NULL) + LZ4_HEADER_SIZE + LZ4_FOOTER_SIZE;
-			break;
-	}
-
-	out = xmalloc(outCapacity);
+	ctx->out = xmalloc(ctx->outCapacity);
 
 	// Write header
-	if (mode == 1) {
-		have = ret = LZ4F_compressBegin(cctx, out, size, NULL);
-		if (LZ4F_isError(ret))
-			LOGE(1, "Failed to start compression: error %s\n", LZ4F_getErrorName(ret));
-		write_file(fd, out, have, filename);
+	if (c->mode == 1) {
+		ctx->ret = LZ4F_compressBegin(ctx->cctx, ctx->out, ctx->outCapacity, &ctx->prefs);
+		if (LZ4F_isError(ctx->ret))
+			LOGE(1, "Failed to start compression: error %s\n", LZ4F_getErrorName(ctx->ret));
+		sink_write(c->out, ctx->out, ctx->ret);
 	}
+}
 
-	do {
-		if (pos + CHUNK >= size) {
-			avail_in = size - pos;
-		} else {
-			avail_in = CHUNK;
+static void lz4_update(codec_t *c, const unsigned char *buf, size_t size) {
+	struct lz4_ctx *ctx = c->ctx;
+	size_t have, read, pos = 0;
+	while (pos < size) {
+		switch(c->mode) {
+			case 0:
+				// Frame finished, parallel compressed data consists of multiple frames
+				if (ctx->ret == 0) {
+					if (ctx->done)
+						return;
+					read = 4 - ctx->held < size - pos ? 4 - ctx->held : size - pos;
+					memcpy(ctx->magic + ctx->held, buf + pos, read);
+					ctx->held += read;
+					pos += read;
+					if (ctx->held < 4)
+						return;
+					ctx->held = 0;
+					// Anything else is padding after the last frame
+					if (memcmp(ctx->magic, "\x04\x22\x4d\x18", 4) != 0) {
+						ctx->done = 1;
+						return;
+					}
+					have = ctx->outCapacity, read = 4;
+					ctx->ret = LZ4F_decompress(ctx->dctx, ctx->out, &have, ctx->magic, &read, NULL);
+					// Already counted in pos, the context keeps partial headers
+					read = 0;
+					break;
+				}
+				have = ctx->outCapacity, read = size - pos;
+				ctx->ret = LZ4F_decompress(ctx->dctx, ctx->out, &have, buf + pos, &read, NULL);
+				break;
+			case 1:
+				read = size - pos > CHUNK ? CHUNK : size - pos;
+				have = ctx->ret = LZ4F_compressUpdate(ctx->cctx, ctx->out, ctx->outCapacity, buf + pos, read, NULL);
+				break;
 		}
+		if (LZ4F_isError(ctx->ret))
+			LOGE(1, "LZ4 coding error: %s\n", LZ4F_getErrorName(ctx->ret));
+
+		sink_write(c->out, ctx->out, have);
+		pos += read;
+	}
+}
 
-		do {
-			switch(mode) {
-				case 0:
-					have = outCapacity, read = avail_in;
-					ret = LZ4F_decompress(dctx, out, &have, buf + pos, &read, NULL);
+static void lz4_finish(codec_t *c) {
+	struct lz4_ctx *ctx = c->ctx;
+	size_t have, read;
+	switch(c->mode) {
+		case 0:
+			// Flush decompressed data still held in the context
+			while (!c->abort) {
+				have = ctx->outCapacity, read = 0;
+				ctx->ret = LZ4F_decompress(ctx->dctx, ctx->out, &have, NULL, &read, NULL);
+				if (LZ4F_isError(ctx->ret))
 					break;
-				case 1:
-					read = avail_in;
-					have = ret = LZ4F_compressUpdate(cctx, out, outCapacity, buf + pos, avail_in, NULL);
+				sink_write(c->out, ctx->out, have);
+				if (have == 0)
 					break;
 			}
-			if (LZ4F_isError(ret))
-				LOGE(1, "LZ4 coding error: %s\n", LZ4F_getErrorName(ret));
-
-			write_file(fd, out, have, filename);
-			// Update status
-			pos += read;
-			avail_in -= read;
-		} while(avail_in != 0 && ret != 0);
-
-	} while(pos < size && ret != 0);
-
-	switch(mode) {
-		case 0:
-			LZ4F_freeDecompressionContext(dctx);
+			LZ4F_freeDecompressionContext(ctx->dctx);
 			break;
 		case 1:
-			have = ret = LZ4F_compressEnd(cctx, out, outCapacity, NULL);
-			if (LZ4F_isError(ret))
-				LOGE(1, "Failed to end compression: error %s\n", LZ4F_getErrorName(ret));
+			have = ctx->ret = LZ4F_compressEnd(ctx->cctx, ctx->out, ctx->outCapacity, NULL);
+			if (LZ4F_isError(ctx->ret))
+				LOGE(1, "Failed to end compression: error %s\n", LZ4F_getErrorName(ctx->ret));
 
-			write_file(fd, out, have, filename);
+			sink_write(c->out, ctx->out, have);
 
-			LZ4F_freeCompressionContext(cctx);
+			LZ4F_freeCompressionContext(ctx->cctx);
 			break;
 	}
-
-	free(out);
-	close(fd);
+	free(ctx->out);
+	free(ctx);
 }
 
-// Mode: 0 = decode; 1 = encode
-void bzip2(int mode, const char* filename, const unsigned char* buf, size_t size) {
-	size_t ret = 0, action, have, pos = 0;
+/*********
+ * bzip2
+ *********/
+
+struct bzip2_ctx {
 	bz_stream strm;
+	int ret;
 	char out[CHUNK];
+};
 
-	report(mode, filename);
-	int fd = open_new(filename);
-
-	strm.bzalloc = NULL;
-	strm.bzfree = NULL;
-	strm.opaque = NULL;
-
-	switch(mode) {
+static void bzip2_init(codec_t *c) {
+	struct bzip2_ctx *ctx = xcalloc(sizeof(*ctx), 1);
+	c->ctx = ctx;
+	switch(c->mode) {
 		case 0:
-			ret = BZ2_bzDecompressInit(&strm, 0, 0);
+			ctx->ret = BZ2_bzDecompressInit(&ctx->strm, 0, 0);
 			break;
 		case 1:
-			ret = BZ2_bzCompressInit(&strm, 9, 0, 0);
+			ctx->ret = BZ2_bzCompressInit(&ctx->strm, c->level ? c->level : 9, 0, 0);
 			break;
-		default:
-			LOGE(1, "Unsupported bzip2 mode!\n");
 	}
-
-	if (ret != BZ_OK)
+	if (ctx->ret != BZ_OK)
 		LOGE(1, "Unable to init bzlib stream\n");
+}
 
+static void bzip2_code(codec_t *c, const unsigned char *buf, size_t size, int action) {
+	struct bzip2_ctx *ctx = c->ctx;
+	ctx->strm.next_in = (char *) buf;
+	ctx->strm.avail_in = size;
 	do {
-		strm.next_in = (char *) buf + pos;
-		if (pos + CHUNK >= size) {
-			strm.avail_in = size - pos;
-			action = BZ_FINISH;
-		} else {
-			strm.avail_in = CHUNK;
-			action = BZ_RUN;
+		// Parallel compressed data consists of multiple bzip2 streams
+		if (c->mode == 0 && ctx->ret == BZ_STREAM_END) {
+			if (ctx->strm.avail_in == 0)
+				break;
+			BZ2_bzDecompressEnd(&ctx->strm);
+			if (BZ2_bzDecompressInit(&ctx->strm, 0, 0) != BZ_OK)
+				LOGE(1, "Unable to init bzlib stream\n");
 		}
-		pos += strm.avail_in;
-
-		do {
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-			switch(mode) {
-				case 0:
-					ret = BZ2_bzDecompress(&strm);
-					break;
-				case 1:
-					ret = BZ2_bzCompress(&strm, action);
-					break;
-			}
-
-			have = CHUNK - strm.avail_out;
-			write_file(fd, out, have, filename);
-
-		} while (strm.avail_out == 0);
+		ctx->strm.avail_out = CHUNK;
+		ctx->strm.next_out = ctx->out;
+		switch(c->mode) {
+			case 0:
+				ctx->ret = BZ2_bzDecompress(&ctx->strm);
+				break;
+			case 1:
+				ctx->ret = BZ2_bzCompress(&ctx->strm, action);
+				break;
+		}
+		sink_write(c->out, ctx->out, CHUNK - ctx->strm.avail_out);
+		// Stop at broken data or trailing garbage
+		if (ctx->ret < 0)
+			break;
+	} while (ctx->strm.avail_out == 0 || ctx->strm.avail_in
+		|| (c->mode == 1 && action == BZ_FINISH && ctx->ret != BZ_STREAM_END));
+}
 
-	} while(pos < size);
+static void bzip2_update(codec_t *c, const unsigned char *buf, size_t size) {
+	bzip2_code(c, buf, size, BZ_RUN);
+}
 
-	switch(mode) {
+static void bzip2_finish(codec_t *c) {
+	struct bzip2_ctx *ctx = c->ctx;
+	switch(c->mode) {
 		case 0:
-			BZ2_bzDecompressEnd(&strm);
+			BZ2_bzDecompressEnd(&ctx->strm);
 			break;
 		case 1:
-			BZ2_bzCompressEnd(&strm);
+			bzip2_code(c, NULL, 0, BZ_FINISH);
+			BZ2_bzCompressEnd(&ctx->strm);
 			break;
 	}
-	close(fd);
+	free(ctx);
 }
 
-// Mode: 0 = decode; 1 = encode
-void lz4_legacy(int mode, const char* filename, const unsigned char* buf, size_t size) {
-	size_t pos = 0;
-	int have;
+/*************
+ * lz4_legacy
+ *************/
+
+struct lz4_legacy_ctx {
+	// Input is collected into full blocks
+	char *in;
+	size_t have;
+	size_t need;
+	int skip;
+	int header;     // Decoding: collecting a block size
 	char *out;
-	unsigned block_size, insize;
-	unsigned char block_size_le[4];
-
+};
 
-	report(mode, filename);
-	int fd = open_new(filename);
-
-	switch(mode) {
+static void lz4_legacy_init(codec_t *c) {
+	struct lz4_legacy_ctx *ctx = xcalloc(sizeof(*ctx), 1);
+	c->ctx = ctx;
+	switch(c->mode) {
 		case 0:
-			out = xmalloc(LZ4_LEGACY_BLOCKSIZE);
-			// Skip magic
-			pos += 4;
+			ctx->in = xmalloc(LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
+			ctx->out = xmalloc(LZ4_LEGACY_BLOCKSIZE);
+			// Skip magic, then read the first block size
+			ctx->skip = 4;
+			ctx->need = 4;
+			ctx->header = 1;
 			break;
 		case 1:
-			out = xmalloc(LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
+			ctx->in = xmalloc(LZ4_LEGACY_BLOCKSIZE);
+			ctx->out = xmalloc(LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
+			ctx->need = LZ4_LEGACY_BLOCKSIZE;
 			// Write magic
-			write_file(fd, "\x02\x21\x4c\x18", 4, filename);
+			sink_write(c->out, "\x02\x21\x4c\x18", 4);
 			break;
-		default:
-			LOGE(1, "Unsupported lz4_legacy mode!\n");
 	}
+}
 
-	do {
-		switch(mode) {
-			case 0:
-				block_size = buf[pos];
-				block_size += (buf[pos + 1]<<8);
-				block_size += (buf[pos + 2]<<16);
-				block_size += ((unsigned)buf[pos + 3])<<24;
-				pos += 4;
+static void lz4_legacy_block(codec_t *c) {
+	struct lz4_legacy_ctx *ctx = c->ctx;
+	unsigned block_size;
+	unsigned char block_size_le[4];
+	int have;
+	switch(c->mode) {
+		case 0:
+			if (ctx->header) {
+				// Got the size of the next block
+				block_size = ctx->in[0] & 0xff;
+				block_size += (ctx->in[1] & 0xff) << 8;
+				block_size += (ctx->in[2] & 0xff) << 16;
+				block_size += ((unsigned)ctx->in[3] & 0xff) << 24;
 				if (block_size > LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE))
 					LOGE(1, "lz4_legacy block size too large!\n");
-				have = LZ4_decompress_safe((const char*) (buf + pos), out, block_size, LZ4_LEGACY_BLOCKSIZE);
-				if (have < 0)
-					LOGE(1, "Cannot decode lz4_legacy block\n");
-				pos += block_size;
-				break;
-			case 1:
-				if (pos + LZ4_LEGACY_BLOCKSIZE >= size)
-					insize = size - pos;
-				else
-					insize = LZ4_LEGACY_BLOCKSIZE;
-				have = LZ4_compress_default((const char*) (buf + pos), out, insize, LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
-				if (have == 0)
-					LOGE(1, "lz4_legacy compression error\n");
-				pos += insize;
-				block_size_le[0] = (unsigned char)have;
-				block_size_le[1] = (unsigned char)(have >> 8);
-				block_size_le[2] = (unsigned char)(have >> 16);
-				block_size_le[3] = (unsigned char)(have >> 24);
-				write_file(fd, block_size_le, 4, filename);
+				ctx->need = block_size;
+				ctx->header = 0;
 				break;
+			}
+			have = LZ4_decompress_safe(ctx->in, ctx->out, ctx->have, LZ4_LEGACY_BLOCKSIZE);
+			if (have < 0)
+				LOGE(1, "Cannot decode lz4_legacy block\n");
+			sink_write(c->out, ctx->out, have);
+			ctx->need = 4;
+			ctx->header = 1;
+			break;
+		case 1:
+			if (c->level >= LZ4HC_CLEVEL_MIN)
+				have = LZ4_compress_HC(ctx->in, ctx->out, ctx->have, LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE), c->level);
+			else
+				have = LZ4_compress_default(ctx->in, ctx->out, ctx->have, LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
+			if (have == 0)
+				LOGE(1, "lz4_legacy compression error\n");
+			block_size_le[0] = (unsigned char)have;
+			block_size_le[1] = (unsigned char)(have >> 8);
+			block_size_le[2] = (unsigned char)(have >> 16);
+			block_size_le[3] = (unsigned char)(have >> 24);
+			sink_write(c->out, block_size_le, 4);
+			sink_write(c->out, ctx->out, have);
+			break;
+	}
+	ctx->have = 0;
+}
+
+static void lz4_legacy_update(codec_t *c, const unsigned char *buf, size_t size) {
+	struct lz4_legacy_ctx *ctx = c->ctx;
+	size_t len;
+	while (size) {
+		if (ctx->skip) {
+			len = size < ctx->skip ? size : ctx->skip;
+			ctx->skip -= len;
+		} else {
+			len = ctx->need - ctx->have;
+			if (len > size)
+				len = size;
+			memcpy(ctx->in + ctx->have, buf, len);
+			ctx->have += len;
+			if (ctx->have == ctx->need)
+				lz4_legacy_block(c);
 		}
-		// Write main data
-		write_file(fd, out, have, filename);
-	} while(pos < size);
+		buf += len;
+		size -= len;
+	}
+}
 
-	free(out);
-	close(fd);
+static void lz4_legacy_finish(codec_t *c) {
+	struct lz4_legacy_ctx *ctx = c->ctx;
+	// Compress the last partial block
+	if (c->mode == 1 && ctx->have)
+		lz4_legacy_block(c);
+	// A size prefix that runs past the end; bytes short of a prefix are ignored
+	if (c->mode == 0 && !ctx->header && !c->abort)
+		LOGE(1, "lz4_legacy block is truncated\n");
+	free(ctx->in);
+	free(ctx->out);
+	free(ctx);
 }
 
-int decomp(file_t type, const char *to, const unsigned char *from, size_t size) {
+static const codec_ops gzip_ops = { gzip_init, gzip_update, gzip_finish };
+static const codec_ops lzma_ops = { lzma_init, lzma_update, lzma_finish };
+static const codec_ops lz4_ops = { lz4_init, lz4_update, lz4_finish };
+static const codec_ops bzip2_ops = { bzip2_init, bzip2_update, bzip2_finish };
+static const codec_ops lz4_legacy_ops = { lz4_legacy_init, lz4_legacy_update, lz4_legacy_finish };
+
+// Mode: 0 = decode; 1 = encode. Returns 1 if the format is not supported
+int codec_init(codec_t *c, file_t type, int mode, sink_t *out) {
 	switch (type) {
 		case GZIP:
-			gzip(0, to, from, size);
+			c->ops = &gzip_ops;
 			break;
 		case XZ:
-			lzma(0, to, from, size);
-			break;
 		case LZMA:
-			lzma(0, to, from, size);
+			c->ops = &lzma_ops;
 			break;
 		case BZIP2:
-			bzip2(0, to, from, size);
+			c->ops = &bzip2_ops;
 			break;
 		case LZ4:
-			lz4(0, to, from, size);
+			c->ops = &lz4_ops;
 			break;
 		case LZ4_LEGACY:
-			lz4_legacy(0, to, from, size);
+			c->ops = &lz4_legacy_ops;
 			break;
 		default:
-			// Unsupported
 			return 1;
 	}
+	c->type = type;
+	c->mode = mode;
+	c->out = out;
+	if (c->threads <= 0)
+		c->threads = 1;
+	c->ops->init(c);
+	return 0;
+}
+
+// Encoder with the tuning of opt for size bytes of input
+static void comp_codec(codec_t *c, file_t type, const comp_opt *opt, size_t size, sink_t *out) {
+	memset(c, 0, sizeof(*c));
+	c->size_hint = size;
+	c->threads = opt->threads;
+	c->level = opt->level;
+	c->strategy = opt->strategy;
+	c->dict = opt->dict;
+	codec_init(c, type, 1, out);
+}
+
+/*****************************
+ * Block parallel compression
+ *****************************/
+
+struct mt_block {
+	const unsigned char *in;
+	size_t in_size;
+	sink_t out;
+};
+
+struct mt_job {
+	file_t type;
+	const comp_opt *opt;
+	struct mt_block *blocks;
+	int num;
+	int next;
+	pthread_mutex_t lock;
+	// Fills b->out from b->in
+	void (*code)(struct mt_job *job, struct mt_block *b);
+};
+
+static void *mt_worker(void *arg) {
+	struct mt_job *job = arg;
+	struct mt_block *b;
+	while (1) {
+		pthread_mutex_lock(&job->lock);
+		b = job->next < job->num ? &job->blocks[job->next++] : NULL;
+		pthread_mutex_unlock(&job->lock);
+		if (b == NULL)
+			break;
+		job->code(job, b);
+	}
+	return NULL;
+}
+
+static void mt_task(void *arg) {
+	mt_worker(arg);
+}
+
+// Run all blocks of job on up to threads threads, the calling thread is also a worker
+static void mt_run(struct mt_job *job, int threads) {
+	pthread_t *pool;
+	int i;
+
+	job->next = 0;
+	if (threads > job->num)
+		threads = job->num;
+	if (pool_active()) {
+		// In a batch, the other workers are sub-tasks of the image on the pool.
+		// job is on our stack, wait for them even if our share failed
+		task_group g = { 0 };
+		for (i = 1; i < threads; ++i)
+			pool_submit(&g, mt_task, job);
+		i = pool_try(mt_task, job);
+		if (pool_wait(&g) || i)
+			LOGE(1, "Block compression failed\n");
+	} else {
+		pool = xcalloc(threads, sizeof(pthread_t));
+		for (i = 1; i < threads; ++i)
+			xpthread_create(&pool[i], NULL, mt_worker, job);
+		mt_worker(job);
+		for (i = 1; i < threads; ++i)
+			pthread_join(pool[i], NULL);
+		free(pool);
+	}
+}
+
+// Each block becomes a standalone gzip member / bzip2 stream / lz4 frame
+static void block_codec(struct mt_job *job, struct mt_block *b) {
+	codec_t c;
+	mem_sink(&b->out);
+	comp_codec(&c, job->type, job->opt, b->in_size, &b->out);
+	codec_update(&c, b->in, b->in_size);
+	codec_finish(&c);
+}
+
+// Split buf into blocks, compress them concurrently and write them out in order
+static void block_comp(file_t type, const comp_opt *opt, sink_t *sink, const unsigned char* buf, size_t size) {
+	struct mt_job job;
+	size_t block_size, pos = 0;
+	int i;
+
+	block_size = size / opt->threads + 1;
+	if (block_size < MT_BLOCK_MIN)
+		block_size = MT_BLOCK_MIN;
+
+	job.type = type;
+	job.opt = opt;
+	job.code = block_codec;
+	// No empty trailing block, but an empty input still gets one
+	job.num = size ? (size + block_size - 1) / block_size : 1;
+	job.blocks = xcalloc(job.num, sizeof(struct mt_block));
+	pthread_mutex_init(&job.lock, NULL);
+	for (i = 0; i < job.num; ++i) {
+		job.blocks[i].in = buf + pos;
+		job.blocks[i].in_size = pos + block_size > size ? size - pos : block_size;
+		pos += job.blocks[i].in_size;
+	}
+
+	mt_run(&job, opt->threads);
+
+	for (i = 0; i < job.num; ++i) {
+		sink_write(sink, job.blocks[i].out.buf, job.blocks[i].out.size);
+		free(job.blocks[i].out.buf);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(job.blocks);
+}
+
+/******************************
+ * Block parallel lz4_legacy
+ ******************************/
+
+// The blocks of lz4_legacy are independent already, so the output is the same
+// as the one of the sequential codec. Blocks are coded LZ4_LEGACY_INFLIGHT at most
+// at a time, into slots of a window that is then written out in order.
+#define LZ4_LEGACY_INFLIGHT 16
+
+static void lz4_legacy_mt_block(struct mt_job *job, struct mt_block *b) {
+	int have;
+	if (job->opt == NULL) {
+		have = LZ4_decompress_safe((const char *) b->in, (char *) b->out.buf, b->in_size, LZ4_LEGACY_BLOCKSIZE);
+		if (have < 0)
+			LOGE(1, "Cannot decode lz4_legacy block\n");
+		b->out.size = have;
+		return;
+	}
+	if (job->opt->level >= LZ4HC_CLEVEL_MIN)
+		have = LZ4_compress_HC((const char *) b->in, (char *) b->out.buf + 4, b->in_size,
+			LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE), job->opt->level);
+	else
+		have = LZ4_compress_default((const char *) b->in, (char *) b->out.buf + 4, b->in_size,
+			LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE));
+	if (have == 0)
+		LOGE(1, "lz4_legacy compression error\n");
+	b->out.buf[0] = (unsigned char)have;
+	b->out.buf[1] = (unsigned char)(have >> 8);
+	b->out.buf[2] = (unsigned char)(have >> 16);
+	b->out.buf[3] = (unsigned char)(have >> 24);
+	b->out.size = have + 4;
+}
+
+// opt is NULL to decode, the whole input is in buf
+static void lz4_legacy_mt(const comp_opt *opt, int threads, sink_t *sink, const unsigned char *buf, size_t size) {
+	struct mt_job job;
+	struct vector blocks;
+	struct mt_block *b;
+	unsigned char *window;
+	size_t pos, slot, block_size, n;
+	int i;
+
+	// Locate every block first. Like the sequential codec, fewer than 4
+	// trailing bytes end the stream and a truncated block is an error
+	vec_init(&blocks);
+	if (opt == NULL) {
+		slot = LZ4_LEGACY_BLOCKSIZE;
+		for (pos = 4; pos + 4 <= size; pos += 4 + block_size) {
+			block_size = buf[pos] | buf[pos + 1] << 8 | buf[pos + 2] << 16 | (size_t) buf[pos + 3] << 24;
+			if (block_size > LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE))
+				LOGE(1, "lz4_legacy block size too large!\n");
+			if (pos + 4 + block_size > size)
+				LOGE(1, "lz4_legacy block is truncated\n");
+			b = xcalloc(1, sizeof(*b));
+			b->in = buf + pos + 4;
+			b->in_size = block_size;
+			vec_push_back(&blocks, b);
+		}
+	} else {
+		slot = 4 + LZ4_COMPRESSBOUND(LZ4_LEGACY_BLOCKSIZE);
+		sink_write(sink, "\x02\x21\x4c\x18", 4);
+		for (pos = 0; pos < size; pos += LZ4_LEGACY_BLOCKSIZE) {
+			b = xcalloc(1, sizeof(*b));
+			b->in = buf + pos;
+			b->in_size = size - pos < LZ4_LEGACY_BLOCKSIZE ? size - pos : LZ4_LEGACY_BLOCKSIZE;
+			vec_push_back(&blocks, b);
+		}
+	}
+
+	if (threads > LZ4_LEGACY_INFLIGHT)
+		threads = LZ4_LEGACY_INFLIGHT;
+	n = vec_size(&blocks) < (size_t) threads ? vec_size(&blocks) : threads;
+	if (n == 0) {
+		vec_destroy(&blocks);
+		return;
+	}
+	window = xmalloc(n * slot);
+	job.opt = opt;
+	job.code = lz4_legacy_mt_block;
+	job.blocks = xcalloc(n, sizeof(struct mt_block));
+	pthread_mutex_init(&job.lock, NULL);
+	for (pos = 0; pos < vec_size(&blocks); pos += n) {
+		job.num = vec_size(&blocks) - pos < n ? vec_size(&blocks) - pos : n;
+		for (i = 0; i < job.num; ++i) {
+			job.blocks[i] = *(struct mt_block *) vec_entry(&blocks)[pos + i];
+			job.blocks[i].out.buf = window + i * slot;
+		}
+		mt_run(&job, threads);
+		for (i = 0; i < job.num; ++i)
+			sink_write(sink, job.blocks[i].out.buf, job.blocks[i].out.size);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(job.blocks);
+	free(window);
+	vec_deep_destroy(&blocks);
+}
+
+static const char *comp_ext(file_t type) {
+	for (int i = 0; SUP_EXT_LIST[i]; ++i) {
+		if (SUP_TYPE_LIST[i] == type)
+			return SUP_EXT_LIST[i];
+	}
+	return NULL;
+}
+
+int decomp_sink(file_t type, sink_t *out, const unsigned char *from, size_t size) {
+	codec_t c;
+	int threads;
+	if (type == LZ4_LEGACY && (threads = sysconf(_SC_NPROCESSORS_ONLN)) > 1) {
+		// Everything is in memory, decode all blocks concurrently
+		lz4_legacy_mt(NULL, threads, out, from, size);
+		return 0;
+	}
+	memset(&c, 0, sizeof(c));
+	if (codec_init(&c, type, 0, out))
+		return 1;
+	codec_update(&c, from, size);
+	codec_finish(&c);
+	return 0;
+}
+
+// Levels accepted by the encoders of each format, the first is the fastest
+static void level_range(file_t type, int *min, int *max) {
+	*min = 1;
+	*max = 9;
+	if (type == LZ4 || type == LZ4_LEGACY)
+		*max = LZ4HC_CLEVEL_MAX;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void comp_level(file_t type, const comp_opt *opt, sink_t *out, const unsigned char *from, size_t size) {
+	codec_t c;
+	size_t off = out->size;
+	double start = now();
+	char level[16] = "default";
+	if (opt->level)
+		sprintf(level, "%d", opt->level);
+	if (opt->threads > 1 && (type == GZIP || type == BZIP2 || type == LZ4)) {
+		block_comp(type, opt, out, from, size);
+	} else if (opt->threads > 1 && type == LZ4_LEGACY) {
+		lz4_legacy_mt(opt, opt->threads, out, from, size);
+	} else {
+		comp_codec(&c, type, opt, size, out);
+		codec_update(&c, from, size);
+		codec_finish(&c);
+	}
+	fprintf(LOG_FILE, "%s level %s: [%zu] -> [%zu] (%.1f%%) in %.3fs\n", comp_ext(type),
+		level, size, out->size - off, size ? (out->size - off) * 100.0 / size : 0.0, now() - start);
+}
+
+static void check_opt(file_t type, const comp_opt *opt) {
+	int lo, hi;
+	level_range(type, &lo, &hi);
+	if (opt->level > hi)
+		LOGE(1, "%s only supports levels %d-%d\n", comp_ext(type), lo, hi);
+	if (opt->fit == SIZE_MAX)
+		LOGE(1, "No size to fit into\n");
+}
+
+// All fields of opt are optional, NULL compresses with the defaults in one thread
+int comp_sink(file_t type, const comp_opt *opt, sink_t *out, const unsigned char *from, size_t size) {
+	comp_opt o = { .threads = 1 };
+	sink_t best, mem;
+	int lo, hi, pick = 0;
+	if (comp_ext(type) == NULL)
+		return 1;
+	if (opt)
+		o = *opt;
+	if (o.threads <= 0)
+		o.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	check_opt(type, &o);
+	level_range(type, &lo, &hi);
+	if (o.fast)
+		o.level = lo;
+	if (o.fit == 0) {
+		comp_level(type, &o, out, from, size);
+		return 0;
+	}
+
+	mem_sink(&best);
+	if (type == BZIP2) {
+		// The level is the block size, how the input falls into blocks matters
+		// more than their size: try every level, keep the lowest that fits
+		for (o.level = lo; o.level <= hi; ++o.level) {
+			mem_sink(&mem);
+			comp_level(type, &o, &mem, from, size);
+			if (best.buf == NULL || mem.size < best.size) {
+				free(best.buf);
+				best = mem;
+				pick = o.level;
+			} else {
+				free(mem.buf);
+			}
+			if (best.size <= o.fit)
+				break;
+		}
+		lo = hi = pick;
+	} else {
+		// Search the lowest level that fits, assuming higher levels never get larger
+		o.level = hi;
+		comp_level(type, &o, &best, from, size);
+	}
+	if (best.size > o.fit)
+		LOGE(1, "Cannot compress into [%zu] bytes, smallest is [%zu]\n", o.fit, best.size);
+	while (lo < hi) {
+		o.level = (lo + hi) / 2;
+		mem_sink(&mem);
+		comp_level(type, &o, &mem, from, size);
+		if (mem.size <= o.fit) {
+			free(best.buf);
+			best = mem;
+			hi = o.level;
+		} else {
+			free(mem.buf);
+			lo = o.level + 1;
+		}
+	}
+	fprintf(LOG_FILE, "Picked %s level %d\n", comp_ext(type), hi);
+	sink_write(out, best.buf, best.size);
+	free(best.buf);
+	return 0;
+}
+
+int decomp(file_t type, const char *to, const unsigned char *from, size_t size) {
+	sink_t out;
+	if (comp_ext(type) == NULL)
+		return 1;
+	report(0, to);
+	int fd = open_new(to);
+	buf_sink(&out, fd);
+	decomp_sink(type, &out, from, size);
+	sink_free(&out);
+	close(fd);
 	return 0;
 }
 
 // Output will be to.ext
 int comp(file_t type, const char *to, const unsigned char *from, size_t size) {
+	return comp_opts(type, NULL, to, from, size);
+}
+
+int comp_opts(file_t type, const comp_opt *opt, const char *to, const unsigned char *from, size_t size) {
 	char name[PATH_MAX];
-	const char *ext = strrchr(to, '.');
+	sink_t out;
+	const char *ext = strrchr(to, '.'), *type_ext = comp_ext(type);
+	if (type_ext == NULL)
+		return 1;
 	if (ext == NULL) ext = to;
 	strcpy(name, to);
-	switch (type) {
-		case GZIP:
-			if (strcmp(ext, ".gz") != 0)
-				sprintf(name, "%s.%s", to, "gz");
-			gzip(1, name, from, size);
-			break;
-		case XZ:
-			if (strcmp(ext, ".xz") != 0)
-				sprintf(name, "%s.%s", to, "xz");
-			lzma(1, name, from, size);
-			break;
-		case LZMA:
-			if (strcmp(ext, ".lzma") != 0)
-				sprintf(name, "%s.%s", to, "lzma");
-			lzma(2, name, from, size);
-			break;
-		case BZIP2:
-			if (strcmp(ext, ".bz2") != 0)
-				sprintf(name, "%s.%s", to, "bz2");
-			bzip2(1, name, from, size);
-			break;
-		case LZ4:
-			if (strcmp(ext, ".lz4") != 0)
-				sprintf(name, "%s.%s", to, "lz4");
-			lz4(1, name, from, size);
-			break;
-		case LZ4_LEGACY:
-			if (strcmp(ext, ".lz4") != 0)
-				sprintf(name, "%s.%s", to, "lz4");
-			lz4_legacy(1, name, from, size);
-			break;
-		default:
-			// Unsupported
-			return 1;
-	}
+	if (ext[0] != '.' || strcmp(ext + 1, type_ext) != 0)
+		sprintf(name, "%s.%s", to, type_ext);
+	if (opt)
+		check_opt(type, opt);
+	report(1, name);
+	int fd = open_new(name);
+	buf_sink(&out, fd);
+	comp_sink(type, opt, &out, from, size);
+	sink_free(&out);
+	close(fd);
 	return 0;
 }
 
@@ -535,8 +976,82 @@ void decomp_file(char *from, const char *to) {
 	munmap(file, size);
 }
 
+// Indexed by the zlib Z_*_STRATEGY values
+static const char *strategies[] = { "default", "filtered", "huffman", "rle", "fixed", NULL };
+
+// Size with an optional k or m suffix
+static size_t parse_size(const char *str) {
+	char *end;
+	size_t size = strtoull(str, &end, 10);
+	if (end == str)
+		return 0;
+	if (*end == 'k' || *end == 'K')
+		size <<= 10, ++end;
+	else if (*end == 'm' || *end == 'M')
+		size <<= 20, ++end;
+	return *end ? 0 : size;
+}
+
+// Comma separated: threads=N, level=N, strategy=NAME, dict=SIZE, fast, fit[=SIZE].
+// fit without a size sets SIZE_MAX, for callers to replace with a size they know
+void comp_opt_parse(comp_opt *opt, const char *opts) {
+	char buf[128], *tok, *val, *save;
+	snprintf(buf, sizeof(buf), "%s", opts);
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+		if (strcmp(tok, "fast") == 0 && val == NULL) {
+			opt->fast = 1;
+		} else if (strcmp(tok, "fit") == 0) {
+			if (val == NULL)
+				opt->fit = SIZE_MAX;
+			else if ((opt->fit = parse_size(val)) == 0)
+				LOGE(1, "Bad size \'%s\'\n", val);
+		} else if (val && strcmp(tok, "threads") == 0 && isdigit(val[0])) {
+			opt->threads = atoi(val);
+		} else if (val && strcmp(tok, "level") == 0 && isdigit(val[0])) {
+			opt->level = atoi(val);
+			if (opt->level < 1 || opt->level > LZ4HC_CLEVEL_MAX)
+				LOGE(1, "Unsupported compression level \'%s\'\n", val);
+		} else if (val && strcmp(tok, "dict") == 0) {
+			opt->dict = parse_size(val);
+			if (opt->dict < LZMA_DICT_SIZE_MIN)
+				LOGE(1, "Bad dictionary size \'%s\'\n", val);
+		} else if (val && strcmp(tok, "strategy") == 0) {
+			for (opt->strategy = 0; strategies[opt->strategy]; ++opt->strategy)
+				if (strcmp(strategies[opt->strategy], val) == 0)
+					break;
+			if (strategies[opt->strategy] == NULL)
+				LOGE(1, "Unsupported gzip strategy \'%s\'\n", val);
+		} else {
+			LOGE(1, "Unsupported compression option \'%s\'\n", tok);
+		}
+	}
+}
+
+// Options of --repack and --patch-image, arg is what follows the command name:
+// nothing, or = and the options. NULL if arg is neither
+const comp_opt *comp_opt_arg(comp_opt *opt, const char *arg) {
+	memset(opt, 0, sizeof(*opt));
+	opt->threads = 1;
+	if (arg[0] == '=')
+		comp_opt_parse(opt, arg + 1);
+	else if (arg[0])
+		return NULL;
+	return opt;
+}
+
+// method can carry options, e.g. gzip:level=6,threads=4 (threads=0 uses all CPUs)
 void comp_file(const char *method, const char *from, const char *to) {
 	file_t type;
+	comp_opt opt = { .threads = 1 };
+	char name[32], *opts;
+	snprintf(name, sizeof(name), "%s", method);
+	method = name;
+	opts = strchr(name, ':');
+	if (opts)
+		*opts++ = '\0';
 	if (strcmp(method, "gzip") == 0) {
 		type = GZIP;
 	} else if (strcmp(method, "xz") == 0) {
@@ -550,20 +1065,21 @@ void comp_file(const char *method, const char *from, const char *to) {
 	} else if (strcmp(method, "bzip2") == 0) {
 		type = BZIP2;
 	} else {
-		fprintf(stderr, "Only support following methods: ");
+		fprintf(LOG_FILE, "Only support following methods: ");
 		for (int i = 0; SUP_LIST[i]; ++i)
-			fprintf(stderr, "%s ", SUP_LIST[i]);
-		fprintf(stderr, "\n");
+			fprintf(LOG_FILE, "%s ", SUP_LIST[i]);
+		fprintf(LOG_FILE, "\n");
 		exit(1);
 	}
+	if (opts)
+		comp_opt_parse(&opt, opts);
 	unsigned char *file;
 	size_t size;
 	mmap_ro(from, &file, &size);
 	if (!to)
 		to = from;
-	comp(type, to, file, size);
+	comp_opts(type, &opt, to, file, size);
 	munmap(file, size);
 	if (to == from)
 		unlink(from);
 }
-
@@ -1,9 +1,9 @@
 #include "magiskboot.h"
 #include "cpio.h"
+#include "textpatch.h"
 #include "vector.h"
-#include "list.h"
 
-static uint32_t x8u(char *hex) {
+static uint32_t x8u(const char *hex) {
   uint32_t val, inpos = 8, outpos;
   char pattern[6];
 
@@ -21,96 +21,372 @@ static uint32_t x8u(char *hex) {
 
 static void cpio_free(cpio_file *f) {
 	if (f) {
-		free(f->filename);
-		free(f->data);
-		free(f);
+		if (f->flags & CPIO_OWN_NAME)
+			free(f->filename);
+		if (f->flags & CPIO_OWN_DATA)
+			free(f->data);
+		if (f->flags & CPIO_OWN_ENTRY)
+			free(f);
 	}
 }
 
-static void cpio_vec_insert(struct vector *v, cpio_file *n) {
-	cpio_file *f, *t;
-	int shift = 0;
-	// Insert in alphabet order
-	vec_for_each(v, f) {
-		if (shift) {
-			vec_entry(v)[_] = t;
-			t = f;
-			continue;
-		}
-		t = f;
-		if (strcmp(f->filename, n->filename) == 0) {
-			// Replace, then all is done
-			cpio_free(f);
-			vec_entry(v)[_] = n;
-			return;
-		} else if (strcmp(f->filename, n->filename) > 0) {
-			// Insert, then start shifting
-			vec_entry(v)[_] = n;
-			t = f;
-			shift = 1;
-		}
+// Entries created at runtime own everything
+static cpio_file *cpio_new(const char *entry) {
+	cpio_file *f = xcalloc(sizeof(*f), 1);
+	f->flags = CPIO_OWN_ENTRY | CPIO_OWN_NAME | CPIO_OWN_DATA;
+	f->namesize = strlen(entry) + 1;
+	f->filename = xmalloc(f->namesize);
+	memcpy(f->filename, entry, f->namesize);
+	return f;
+}
+
+// 64 bit non-cryptographic hash, mixes 8 bytes at a time (MurmurHash3 constants)
+static uint64_t data_hash(const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, k;
+	for (; len; p += 8, len -= len < 8 ? len : 8) {
+		k = 0;
+		memcpy(&k, p, len < 8 ? len : 8);
+		k *= 0x87c37b91114253d5ULL;
+		k = (k << 31) | (k >> 33);
+		k *= 0x4cf5ad432745937fULL;
+		h ^= k;
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
 	}
-	if (shift)
-		vec_push_back(v, t);
-	else
-		vec_push_back(v, n);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t cpio_hash(const cpio_file *f) {
+	return data_hash(f->data, f->filesize);
+}
+
+static int cpio_same_data(const cpio_file *a, const cpio_file *b) {
+	if (a->filesize != b->filesize)
+		return 0;
+	if (a->data == b->data)
+		return 1;
+	return memcmp(a->data, b->data, a->filesize) == 0;
+}
+
+// Grow a malloced buffer geometrically
+static void buf_append(char **buf, uint32_t *size, size_t *cap, const void *data, size_t len) {
+	if (*size + len > *cap) {
+		*cap = *cap ? *cap : 256;
+		while (*size + len > *cap)
+			*cap *= 2;
+		*buf = xrealloc(*buf, *cap);
+	}
+	memcpy(*buf + *size, data, len);
+	*size += len;
 }
 
 static int cpio_compare(const void *a, const void *b) {
 	return strcmp((*(cpio_file **) a)->filename, (*(cpio_file **) b)->filename);
 }
 
-// Parse cpio file to a vector of cpio_file
-static void parse_cpio(const char *filename, struct vector *v) {
-	fprintf(stderr, "Loading cpio: [%s]\n\n", filename);
-	int fd = xopen(filename, O_RDONLY);
+// Key is the name
+static int cpio_name_cmp(const void *name, const void *f) {
+	return strcmp(name, ((cpio_file *) f)->filename);
+}
+
+static cpio_file *cpio_find(cpio_t *c, const char *name) {
+	return vec_bsearch(&c->files, name, cpio_name_cmp);
+}
+
+// Entries are sorted, so everything starting with prefix is within [*begin, *end)
+static void cpio_prefix_range(cpio_t *c, const char *prefix, size_t *begin, size_t *end) {
+	size_t len = strlen(prefix);
+	*begin = *end = vec_lower_bound(&c->files, prefix, cpio_name_cmp);
+	while (*end < vec_size(&c->files)
+		&& strncmp(((cpio_file *) vec_entry(&c->files)[*end])->filename, prefix, len) == 0)
+		++*end;
+}
+
+static void cpio_vec_insert(cpio_t *c, cpio_file *n) {
+	struct vector *v = &c->files;
+	size_t i = vec_lower_bound(v, n->filename, cpio_name_cmp);
+	if (i < vec_size(v) && strcmp(((cpio_file *) vec_entry(v)[i])->filename, n->filename) == 0) {
+		// Replace, then all is done
+		cpio_free(vec_entry(v)[i]);
+		vec_entry(v)[i] = n;
+		return;
+	}
+	// Insert in alphabet order
+	vec_insert_at(v, i, n);
+}
+
+static void cpio_init(cpio_t *c) {
+	vec_init(&c->files);
+	vec_init(&c->blocks);
+}
+
+// Keep a buffer the entries point into alive until cpio_destroy, size 0 means malloced
+static void cpio_hold(cpio_t *c, void *addr, size_t size) {
+	struct cpio_block *b = xmalloc(sizeof(*b));
+	b->addr = addr;
+	b->size = size;
+	vec_push_back(&c->blocks, b);
+}
+
+// Parse cpio archive in memory, entries point into buf which has to outlive c
+static void parse_cpio_buf(const unsigned char *buf, size_t size, cpio_t *c) {
+	const cpio_newc_header *header;
+	cpio_file *arena, *f;
+	size_t pos, num = 0;
+	uint32_t namesize, filesize;
+
+	// First count the entries, so all of them fit in a single arena
+	for (pos = 0; pos + sizeof(*header) <= size; ++num) {
+		header = (const cpio_newc_header *) (buf + pos);
+		namesize = x8u(header->namesize);
+		filesize = x8u(header->filesize);
+		pos += sizeof(*header) + namesize;
+		if (pos > size)
+			LOGE(1, "bad cpio header\n");
+		if (strcmp((const char *) buf + pos - namesize, "TRAILER!!!") == 0)
+			break;
+		mem_align(&pos, 4);
+		pos += filesize;
+		mem_align(&pos, 4);
+	}
+	if (num == 0)
+		return;
+	// One more slot for parsing the trailer
+	arena = xcalloc(sizeof(*arena), num + 1);
+	cpio_hold(c, arena, 0);
+	vec_reserve(&c->files, vec_size(&c->files) + num);
+
+	for (pos = 0, f = arena; pos + sizeof(*header) <= size; ) {
+		header = (const cpio_newc_header *) (buf + pos);
+		pos += sizeof(*header);
+		// f->ino = x8u(header->ino);
+		f->mode = x8u(header->mode);
+		f->uid = x8u(header->uid);
+		f->gid = x8u(header->gid);
+		// f->nlink = x8u(header->nlink);
+		// f->mtime = x8u(header->mtime);
+		f->filesize = x8u(header->filesize);
+		// f->devmajor = x8u(header->devmajor);
+		// f->devminor = x8u(header->devminor);
+		// f->rdevmajor = x8u(header->rdevmajor);
+		// f->rdevminor = x8u(header->rdevminor);
+		f->namesize = x8u(header->namesize);
+		// f->check = x8u(header->check);
+		f->filename = (char *) buf + pos;
+		pos += f->namesize;
+		mem_align(&pos, 4);
+		if (strcmp(f->filename, "TRAILER!!!") == 0)
+			break;
+		if (f->filesize) {
+			if (pos + f->filesize > size)
+				LOGE(1, "bad cpio header\n");
+			f->data = (char *) buf + pos;
+			pos += f->filesize;
+			mem_align(&pos, 4);
+		}
+		if (strcmp(f->filename, ".") == 0 || strcmp(f->filename, "..") == 0)
+			continue;
+		vec_push_back(&c->files, f++);
+	}
+	// Sort by name
+	vec_sort(&c->files, cpio_compare);
+}
+
+// Parse cpio file, the mapping is kept until cpio_destroy
+static void parse_cpio(const char *filename, cpio_t *c) {
+	unsigned char *buf;
+	size_t size;
+	fprintf(LOG_FILE, "Loading cpio: [%s]\n\n", filename);
+	mmap_ro(filename, &buf, &size);
+	cpio_hold(c, buf, size);
+	parse_cpio_buf(buf, size, c);
+}
+
+/*******************
+ * Streaming reader
+ *******************/
+
+// Input is fed to the decoder in chunks this large, so the scan can stop early
+#define STREAM_CHUNK 0x10000
+
+enum { RD_HEADER, RD_NAME, RD_DATA, RD_PAD };
+
+// A sink parsing the archive as it is decompressed, only wanted entries are kept
+typedef struct cpio_reader {
+	sink_t sink;            // First, the codec writes to it
+	cpio_t *c;
+	const char **names;
+	int num;
+	int stop;               // Finding names[i] with i < stop ends the scan
+	int left;
+	uint32_t seen;
+	int done;
+	int state, next;
+	size_t off, have, need, next_need;
 	cpio_newc_header header;
+	char name[PATH_MAX];
+	cpio_file *cur;         // Entry being collected, NULL when skipped
+	int idx;
+} cpio_reader;
+
+// Skip to the 4 byte alignment, then expect need bytes of state
+static void reader_expect(cpio_reader *r, int state, size_t need) {
+	size_t pad = (4 - (r->off & 3)) & 3;
+	r->have = 0;
+	if (pad) {
+		r->state = RD_PAD;
+		r->need = pad;
+		r->next = state;
+		r->next_need = need;
+	} else {
+		r->state = state;
+		r->need = need;
+	}
+}
+
+static void reader_step(cpio_reader *r) {
 	cpio_file *f;
-	while(read(fd, &header, 110) == 110) {
-		f = xcalloc(sizeof(*f), 1);
-		// f->ino = x8u(header.ino);
-		f->mode = x8u(header.mode);
-		f->uid = x8u(header.uid);
-		f->gid = x8u(header.gid);
-		// f->nlink = x8u(header.nlink);
-		// f->mtime = x8u(header.mtime);
-		f->filesize = x8u(header.filesize);
-		// f->devmajor = x8u(header.devmajor);
-		// f->devminor = x8u(header.devminor);
-		// f->rdevmajor = x8u(header.rdevmajor);
-		// f->rdevminor = x8u(header.rdevminor);
-		f->namesize = x8u(header.namesize);
-		// f->check = x8u(header.check);
-		f->filename = malloc(f->namesize);
-		xxread(fd, f->filename, f->namesize);
-		file_align(fd, 4, 0);
-		if (strcmp(f->filename, ".") == 0 || strcmp(f->filename, "..") == 0) {
-			cpio_free(f);
-			continue;
-		}
-		if (strcmp(f->filename, "TRAILER!!!") == 0) {
-			cpio_free(f);
+	switch (r->state) {
+	case RD_HEADER:
+		if (memcmp(r->header.magic, "07070", 5) != 0)
+			LOGE(1, "bad cpio header\n");
+		r->have = 0;
+		r->need = x8u(r->header.namesize);
+		if (r->need == 0 || r->need > sizeof(r->name))
+			LOGE(1, "bad cpio header\n");
+		r->state = RD_NAME;
+		break;
+	case RD_NAME:
+		r->name[r->need - 1] = '\0';
+		if (strcmp(r->name, "TRAILER!!!") == 0) {
+			r->done = 1;
 			break;
 		}
-		if (f->filesize) {
-			f->data = malloc(f->filesize);
-			xxread(fd, f->data, f->filesize);
-			file_align(fd, 4, 0);
+		r->cur = NULL;
+		for (int i = 0; i < r->num; ++i) {
+			if (strcmp(r->name, r->names[i]) == 0) {
+				f = r->cur = cpio_new(r->name);
+				f->mode = x8u(r->header.mode);
+				f->uid = x8u(r->header.uid);
+				f->gid = x8u(r->header.gid);
+				f->filesize = x8u(r->header.filesize);
+				f->data = xmalloc(f->filesize + 1);
+				f->data[f->filesize] = '\0';
+				r->idx = i;
+				break;
+			}
+		}
+		reader_expect(r, RD_DATA, x8u(r->header.filesize));
+		break;
+	case RD_DATA:
+		if (r->cur) {
+			cpio_vec_insert(r->c, r->cur);
+			if (!(r->seen & (1U << r->idx))) {
+				r->seen |= 1U << r->idx;
+				--r->left;
+			}
+			if (r->idx < r->stop || r->left == 0)
+				r->done = 1;
+			r->cur = NULL;
 		}
-		vec_push_back(v, f);
+		reader_expect(r, RD_HEADER, sizeof(r->header));
+		break;
+	case RD_PAD:
+		r->have = 0;
+		r->state = r->next;
+		r->need = r->next_need;
+		break;
 	}
-	close(fd);
-	// Sort by name
-	vec_sort(v, cpio_compare);
 }
 
-static void dump_cpio(const char *filename, struct vector *v) {
-	fprintf(stderr, "\nDump cpio: [%s]\n\n", filename);
-	int fd = open_new(filename);
+static void reader_write(sink_t *s, const void *buf, size_t size) {
+	cpio_reader *r = (cpio_reader *) s;
+	const char *p = buf;
+	size_t len;
+	s->size += size;
+	// Zero sized steps have to run too, so go on while there is input
+	while (size && !r->done) {
+		len = r->need - r->have;
+		if (len > size)
+			len = size;
+		if (r->state == RD_HEADER)
+			memcpy((char *) &r->header + r->have, p, len);
+		else if (r->state == RD_NAME)
+			memcpy(r->name + r->have, p, len);
+		else if (r->state == RD_DATA && r->cur)
+			memcpy(r->cur->data + r->have, p, len);
+		p += len;
+		size -= len;
+		r->have += len;
+		r->off += len;
+		if (r->have == r->need)
+			reader_step(r);
+	}
+}
+
+/*
+ * Load only the entries in names from the ramdisk of a boot image, or from a
+ * compressed archive, without decompressing more than needed.
+ * Return 1 if filename is a plain cpio archive, nothing is loaded then
+ */
+static int stream_cpio(const char *filename, cpio_t *c, const char **names, int num, int stop) {
+	unsigned char *buf;
+	const unsigned char *in;
+	size_t size, len, n;
+	file_t type;
+	codec_t codec;
+	cpio_reader r;
+
+	mmap_ro(filename, &buf, &size);
+	if (size < 16 || memcmp(buf, "07070", 5) == 0) {
+		munmap(buf, size);
+		return 1;
+	}
+	fprintf(LOG_FILE, "Streaming cpio: [%s]\n\n", filename);
+	in = buf;
+	len = size;
+	type = check_type(buf);
+	if (type == AOSP || type == CHROMEOS)
+		img_ramdisk(buf, size, &in, &len, &type);
+
+	memset(&r, 0, sizeof(r));
+	r.sink.write = reader_write;
+	r.c = c;
+	r.names = names;
+	r.num = r.left = num;
+	r.stop = stop;
+	r.state = RD_HEADER;
+	r.need = sizeof(r.header);
+
+	memset(&codec, 0, sizeof(codec));
+	if (codec_init(&codec, type, 0, &r.sink)) {
+		// Not compressed
+		reader_write(&r.sink, in, len);
+	} else {
+		for (size_t pos = 0; pos < len && !r.done; pos += n) {
+			n = len - pos > STREAM_CHUNK ? STREAM_CHUNK : len - pos;
+			codec_update(&codec, in + pos, n);
+		}
+		codec.abort = r.done;
+		codec_finish(&codec);
+	}
+	// A truncated entry
+	if (r.cur)
+		cpio_free(r.cur);
+	munmap(buf, size);
+	return 0;
+}
+
+static void dump_cpio_sink(sink_t *out, cpio_t *c) {
 	unsigned inode = 300000;
 	char header[111];
 	cpio_file *f;
-	vec_for_each(v, f) {
+	vec_for_each(&c->files, f) {
 		if (f->remove) continue;
 		sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
 			inode++,	// f->ino
@@ -127,262 +403,248 @@ static void dump_cpio(const char *filename, struct vector *v) {
 			f->namesize,
 			0			// f->check
 		);
-		xwrite(fd, header, 110);
-		xwrite(fd, f->filename, f->namesize);
-		file_align(fd, 4, 1);
+		sink_write(out, header, 110);
+		sink_write(out, f->filename, f->namesize);
+		sink_align(out, 4);
 		if (f->filesize) {
-			xwrite(fd, f->data, f->filesize);
-			file_align(fd, 4, 1);
+			sink_write(out, f->data, f->filesize);
+			sink_align(out, 4);
 		}
 	}
 	// Write trailer
 	sprintf(header, "070701%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x", inode++, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 11, 0);
-	xwrite(fd, header, 110);
-	xwrite(fd, "TRAILER!!!\0", 11);
-	file_align(fd, 4, 1);
+	sink_write(out, header, 110);
+	sink_write(out, "TRAILER!!!\0", 11);
+	sink_align(out, 4);
+}
+
+static void dump_cpio(const char *filename, cpio_t *c) {
+	sink_t out;
+	fprintf(LOG_FILE, "\nDump cpio: [%s]\n\n", filename);
+	// The new archive is written to a temp file first, the old one may still be mapped
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	int fd = open_new(tmp);
+	buf_sink(&out, fd);
+	dump_cpio_sink(&out, c);
+	sink_free(&out);
 	close(fd);
+	xrename(tmp, filename);
 }
 
-static void cpio_vec_destroy(struct vector *v) {
-	// Free each cpio_file
+static void cpio_destroy(cpio_t *c) {
+	struct cpio_block *b;
 	cpio_file *f;
-	vec_for_each(v, f) {
+	// Free each cpio_file
+	vec_for_each(&c->files, f) {
 		cpio_free(f);
 	}
-	vec_destroy(v);
+	vec_destroy(&c->files);
+	vec_for_each(&c->blocks, b) {
+		if (b->size)
+			munmap(b->addr, b->size);
+		else
+			free(b->addr);
+		free(b);
+	}
+	vec_destroy(&c->blocks);
+}
+
+// Drop removed entries, so the next command sees the same archive as after a dump
+static void cpio_vec_compact(cpio_t *c) {
+	size_t size = 0;
+	cpio_file *f;
+	vec_for_each(&c->files, f) {
+		if (f->remove)
+			cpio_free(f);
+		else
+			vec_entry(&c->files)[size++] = f;
+	}
+	vec_size(&c->files) = size;
 }
 
-static void cpio_rm(int recursive, const char *entry, struct vector *v) {
+static void cpio_rm(int recursive, const char *entry, cpio_t *c) {
+	size_t begin, end;
 	cpio_file *f;
-	vec_for_each(v, f) {
-		if ((recursive && strncmp(f->filename, entry, strlen(entry)) == 0)
-			|| (strcmp(f->filename, entry) == 0) ) {
+	if (recursive) {
+		cpio_prefix_range(c, entry, &begin, &end);
+		for (; begin < end; ++begin) {
+			f = vec_entry(&c->files)[begin];
 			if (!f->remove) {
-				fprintf(stderr, "Remove [%s]\n", entry);
+				fprintf(LOG_FILE, "Remove [%s]\n", entry);
 				f->remove = 1;
 			}
-			if (!recursive) return;
 		}
+	} else if ((f = cpio_find(c, entry)) && !f->remove) {
+		fprintf(LOG_FILE, "Remove [%s]\n", entry);
+		f->remove = 1;
 	}
 }
 
-static void cpio_mkdir(mode_t mode, const char *entry, struct vector *v) {
-	cpio_file *f = xcalloc(sizeof(*f), 1);
+static void cpio_mkdir(mode_t mode, const char *entry, cpio_t *c) {
+	cpio_file *f = cpio_new(entry);
 	f->mode = S_IFDIR | mode;
-	f->namesize = strlen(entry) + 1;
-	f->filename = xmalloc(f->namesize);
-	memcpy(f->filename, entry, f->namesize);
-	cpio_vec_insert(v, f);
-	fprintf(stderr, "Create directory [%s] (%04o)\n",entry, mode);
+	cpio_vec_insert(c, f);
+	fprintf(LOG_FILE, "Create directory [%s] (%04o)\n",entry, mode);
 }
 
-static void cpio_add(mode_t mode, const char *entry, const char *filename, struct vector *v) {
+static void cpio_add(mode_t mode, const char *entry, const char *filename, cpio_t *c) {
 	int fd = xopen(filename, O_RDONLY);
-	cpio_file *f = xcalloc(sizeof(*f), 1);
+	cpio_file *f = cpio_new(entry);
 	f->mode = S_IFREG | mode;
-	f->namesize = strlen(entry) + 1;
-	f->filename = xmalloc(f->namesize);
-	memcpy(f->filename, entry, f->namesize);
 	f->filesize = lseek(fd, 0, SEEK_END);
 	lseek(fd, 0, SEEK_SET);
-	f->data = malloc(f->filesize);
+	f->data = xmalloc(f->filesize + 1);
 	xxread(fd, f->data, f->filesize);
+	f->data[f->filesize] = '\0';
 	close(fd);
-	cpio_vec_insert(v, f);
-	fprintf(stderr, "Add entry [%s] (%04o)\n", entry, mode);
+	cpio_vec_insert(c, f);
+	fprintf(LOG_FILE, "Add entry [%s] (%04o)\n", entry, mode);
 }
 
-static void cpio_test(struct vector *v) {
+// Entries of other root solutions come first, then the Magisk one
+static const char *TEST_LIST[] = { "sbin/launch_daemonsu.sh", "sbin/su", "init.xposed.rc", "init.supersu.rc", "init.magisk.rc" };
+#define TEST_OTHERS 4
+#define TEST_NUM    5
+
+static int cpio_test(cpio_t *c) {
 	#define MAGISK_PATCH  0x1
 	#define OTHER_PATCH 0x2
 	int ret = 0;
-	cpio_file *f;
-	const char *OTHER_LIST[] = { "sbin/launch_daemonsu.sh", "sbin/su", "init.xposed.rc", "init.supersu.rc", NULL };
-	vec_for_each(v, f) {
-		for (int i = 0; OTHER_LIST[i]; ++i) {
-			if (strcmp(f->filename, OTHER_LIST[i]) == 0)
-				ret |= OTHER_PATCH;
-		}
-		if (strcmp(f->filename, "init.magisk.rc") == 0)
-			ret |= MAGISK_PATCH;
+	for (int i = 0; i < TEST_OTHERS; ++i) {
+		if (cpio_find(c, TEST_LIST[i]))
+			ret |= OTHER_PATCH;
 	}
-	cpio_vec_destroy(v);
-	exit((ret & OTHER_PATCH) ? OTHER_PATCH : (ret & MAGISK_PATCH));
+	if (cpio_find(c, TEST_LIST[TEST_OTHERS]))
+		ret |= MAGISK_PATCH;
+	return (ret & OTHER_PATCH) ? OTHER_PATCH : (ret & MAGISK_PATCH);
 }
 
-static int check_verity_pattern(const char *s) {
-	int pos = 0;
-	if (s[0] == ',') ++pos;
-	if (strncmp(s + pos, "verify", 6) != 0) return -1;
-	pos += 6;
-	if (s[pos] == '=') {
-		while (s[pos] != ' ' && s[pos] != '\n' && s[pos] != ',') ++pos;
-	}
-	return pos;
-}
+static const text_rule INIT_RC_RULES[] = {
+	// Inject magisk script as import
+	{ TEXT_INSERT, "import", "import /init.magisk.rc", "init.magisk.rc" },
+	{ TEXT_REMOVE, "selinux.reload_policy" },
+};
 
-static struct list_head *block_to_list(char *data) {
-	struct list_head *head = xmalloc(sizeof(*head));
-	line_list *line;
-	init_list_head(head);
-	char *tok;
-	tok = strsep(&data, "\n");
-	while (tok) {
-		line = xcalloc(sizeof(*line), 1);
-		line->line = tok;
-		list_insert_end(head, &line->pos);
-		tok = strsep(&data, "\n");
-	}
-	return head;
-}
+static const text_rule VERITY_RULES[] = {
+	{ TEXT_REPLACE, ",verify", "", NULL, TEXT_VALUE },
+	{ TEXT_REPLACE, "verify", "", NULL, TEXT_VALUE },
+};
 
-static char *list_to_block(struct list_head *head, uint32_t filesize) {
-	line_list *line;
-	char *data = xmalloc(filesize);
-	uint32_t off = 0;
-	list_for_each(line, head, line_list, pos) {
-		strcpy(data + off, line->line);
-		off += strlen(line->line);
-		data[off++] = '\n';
-	}
-	return data;
+static const text_rule ENCRYPT_RULES[] = {
+	{ TEXT_REPLACE, "forceencrypt", "encryptable" },
+	{ TEXT_REPLACE, "forcefdeorfbe", "encryptable" },
+	{ TEXT_REPLACE, "fileencryptioninline", "encryptable" },
+};
+
+#define RULE_NUM(r) (sizeof(r) / sizeof(text_rule))
+
+static void cpio_patch_text(cpio_file *f, const text_patcher *p) {
+	size_t size;
+	char *data = text_patch(p, f->filename, f->data, f->filesize, &size);
+	if (data == NULL)
+		return;
+	if (f->flags & CPIO_OWN_DATA)
+		free(f->data);
+	f->data = data;
+	f->filesize = size;
+	f->flags |= CPIO_OWN_DATA;
 }
 
-static void free_newline(line_list *line) {
-	if (line->isNew)
-		free(line->line);
+// Also used for the fstab nodes of DTBs
+text_patcher *fstab_patcher(int keepverity, int keepforceencrypt) {
+	text_rule fstab[RULE_NUM(VERITY_RULES) + RULE_NUM(ENCRYPT_RULES)];
+	int num = 0;
+	if (!keepverity) {
+		memcpy(fstab + num, VERITY_RULES, sizeof(VERITY_RULES));
+		num += RULE_NUM(VERITY_RULES);
+	}
+	if (!keepforceencrypt) {
+		memcpy(fstab + num, ENCRYPT_RULES, sizeof(ENCRYPT_RULES));
+		num += RULE_NUM(ENCRYPT_RULES);
+	}
+	return num ? text_patcher_new(fstab, num) : NULL;
 }
 
-static void cpio_patch(struct vector *v, int keepverity, int keepforceencrypt) {
-	struct list_head *head;
-	line_list *line;
+static void cpio_patch(cpio_t *c, int keepverity, int keepforceencrypt) {
+	text_patcher *rc, *fs;
 	cpio_file *f;
-	int skip, injected = 0;
-	size_t read, write;
-	const char *ENCRYPT_LIST[] = { "forceencrypt", "forcefdeorfbe", "fileencryptioninline", NULL };
-	vec_for_each(v, f) {
+	rc = text_patcher_new(INIT_RC_RULES, RULE_NUM(INIT_RC_RULES));
+	fs = fstab_patcher(keepverity, keepforceencrypt);
+	vec_for_each(&c->files, f) {
 		if (strcmp(f->filename, "init.rc") == 0) {
-			head = block_to_list(f->data);
-			list_for_each(line, head, line_list, pos) {
-				if (strstr(line->line, "import")) {
-					if (strstr(line->line, "init.magisk.rc"))
-						injected = 1;
-					if (injected)
-						continue;
-					// Inject magisk script as import
-					fprintf(stderr, "Inject new line [import /init.magisk.rc] in [init.rc]\n");
-					line = xcalloc(sizeof(*line), 1);
-					line->line = strdup("import /init.magisk.rc");
-					line->isNew = 1;
-					f->filesize += 23;
-					list_insert(__->prev, &line->pos);
-					injected = 1;
-				} else if (strstr(line->line, "selinux.reload_policy")) {
-					// Remove this line
-					fprintf(stderr, "Remove line [%s] in [init.rc]\n", line->line);
-					f->filesize -= strlen(line->line) + 1;
-					__ = list_pop(&line->pos);
-					free(line);
-				}
-			}
-			char *temp = list_to_block(head, f->filesize);
-			free(f->data);
-			f->data = temp;
-			list_destory(head, list_head, pos, free_newline);
-			free(head);
-		} else {
-			if (!keepverity) {
-				if (strstr(f->filename, "fstab") != NULL && S_ISREG(f->mode)) {
-					for (read = 0, write = 0; read < f->filesize; ++read, ++write) {
-						skip = check_verity_pattern(f->data + read);
-						if (skip > 0) {
-							fprintf(stderr, "Remove pattern [%.*s] in [%s]\n", skip, f->data + read, f->filename);
-							read += skip;
-						}
-						f->data[write] = f->data[read];
-					}
-					f->filesize = write;
-				} else if (strcmp(f->filename, "verity_key") == 0) {
-					fprintf(stderr, "Remove [verity_key]\n");
-					f->remove = 1;
-				}
-			}
-			if (!keepforceencrypt) {
-				if (strstr(f->filename, "fstab") != NULL && S_ISREG(f->mode)) {
-					for (read = 0, write = 0; read < f->filesize; ++read, ++write) {
-						for (int i = 0 ; ENCRYPT_LIST[i]; ++i) {
-							if (strncmp(f->data + read, ENCRYPT_LIST[i], strlen(ENCRYPT_LIST[i])) == 0) {
-								memcpy(f->data + write, "encryptable", 11);
-								fprintf(stderr, "Replace [%s] with [%s] in [%s]\n", ENCRYPT_LIST[i], "encryptable", f->filename);
-								write += 11;
-								read += strlen(ENCRYPT_LIST[i]);
-								break;
-							}
-						}
-						f->data[write] = f->data[read];
-					}
-					f->filesize = write;
-				}
-			}
+			cpio_patch_text(f, rc);
+		} else if (strstr(f->filename, "fstab") != NULL && S_ISREG(f->mode)) {
+			if (fs)
+				cpio_patch_text(f, fs);
+		} else if (!keepverity && strcmp(f->filename, "verity_key") == 0) {
+			fprintf(LOG_FILE, "Remove [verity_key]\n");
+			f->remove = 1;
 		}
 	}
+	text_patcher_free(rc);
+	if (fs)
+		text_patcher_free(fs);
 }
 
-static void cpio_extract(const char *entry, const char *filename, struct vector *v) {
-	cpio_file *f;
-	vec_for_each(v, f) {
-		if (strcmp(f->filename, entry) == 0 && S_ISREG(f->mode)) {
-			fprintf(stderr, "Extracting [%s] to [%s]\n\n", entry, filename);
-			int fd = open_new(filename);
-			xwrite(fd, f->data, f->filesize);
-			fchmod(fd, f->mode);
-			fchown(fd, f->uid, f->gid);
-			close(fd);
-			exit(0);
-		}
+static int cpio_extract(const char *entry, const char *filename, cpio_t *c) {
+	cpio_file *f = cpio_find(c, entry);
+	if (f && S_ISREG(f->mode)) {
+		fprintf(LOG_FILE, "Extracting [%s] to [%s]\n\n", entry, filename);
+		int fd = open_new(filename);
+		xwrite(fd, f->data, f->filesize);
+		fchmod(fd, f->mode);
+		fchown(fd, f->uid, f->gid);
+		close(fd);
+		return 0;
 	}
 	LOGE(1, "Cannot find the file entry [%s]\n", entry);
 }
 
-static void cpio_backup(const char *orig, struct vector *v) {
-	struct vector o_body, *o = &o_body, bak;
-	cpio_file *m, *n, *dir, *rem;
-	char buf[PATH_MAX];
+static void cpio_backup(const char *orig, cpio_t *c) {
+	cpio_t o_body, *o = &o_body;
+	struct vector bak, *v = &c->files;
+	cpio_file *m, *n, *dir, *rem, *man;
+	struct cpio_block *b;
+	char *name;
+	size_t rem_cap = 0, man_cap = 0;
+	uint64_t hash;
 	int res, doBak;
 
-	dir = xcalloc(sizeof(*dir), 1);
-	rem = xcalloc(sizeof(*rem), 1);
-	vec_init(o);
+	dir = cpio_new(".backup");
+	rem = cpio_new(".backup/.rmlist");
+	man = cpio_new(CPIO_MANIFEST);
+	cpio_init(o);
 	vec_init(&bak);
-	// First push back the directory and the rmlist
+	// First push back the directory, the rmlist and the manifest
 	vec_push_back(&bak, dir);
 	vec_push_back(&bak, rem);
+	vec_push_back(&bak, man);
 	parse_cpio(orig, o);
 	// Remove possible backups in original ramdisk
 	cpio_rm(1, ".backup", o);
-	cpio_rm(1, ".backup", v);
+	cpio_rm(1, ".backup", c);
+	cpio_rm(0, CPIO_MANIFEST, o);
+	cpio_rm(0, CPIO_MANIFEST, c);
 
-	// Init the directory and rmlist
-	dir->filename = strdup(".backup");
-	dir->namesize = strlen(dir->filename) + 1;
+	// Init the directory, rmlist and manifest
 	dir->mode = S_IFDIR;
-	rem->filename = strdup(".backup/.rmlist");
-	rem->namesize = strlen(rem->filename) + 1;
 	rem->mode = S_IFREG;
+	man->mode = S_IFREG;
 
 	// Start comparing
 	size_t i = 0, j = 0;
-	while(i != vec_size(o) || j != vec_size(v)) {
+	while(i != vec_size(&o->files) || j != vec_size(v)) {
 		doBak = 0;
-		if (i != vec_size(o) && j != vec_size(v)) {
-			m = vec_entry(o)[i];
+		if (i != vec_size(&o->files) && j != vec_size(v)) {
+			m = vec_entry(&o->files)[i];
 			n = vec_entry(v)[j];
 			res = strcmp(m->filename, n->filename);
-		} else if (i == vec_size(o)) {
+		} else if (i == vec_size(&o->files)) {
 			n = vec_entry(v)[j];
 			res = 1;
 		} else if (j == vec_size(v)) {
-			m = vec_entry(o)[i];
+			m = vec_entry(&o->files)[i];
 			res = -1;
 		}
 
@@ -390,32 +652,38 @@ static void cpio_backup(const char *orig, struct vector *v) {
 			// Something is missing in new ramdisk, backup!
 			++i;
 			doBak = 1;
-			fprintf(stderr, "Backup missing entry: ");
+			fprintf(LOG_FILE, "Backup missing entry: ");
 		} else if (res == 0) {
 			++i; ++j;
-			if (m->filesize == n->filesize && memcmp(m->data, n->data, m->filesize) == 0)
+			if (cpio_same_data(m, n))
 				continue;
 			// Not the same!
 			doBak = 1;
-			fprintf(stderr, "Backup mismatch entry: ");
+			fprintf(LOG_FILE, "Backup mismatch entry: ");
 		} else {
 			// Someting new in ramdisk, record in rem
 			++j;
 			if (n->remove) continue;
-			rem->data = xrealloc(rem->data, rem->filesize + n->namesize);
-			memcpy(rem->data + rem->filesize, n->filename, n->namesize);
-			rem->filesize += n->namesize;
-			fprintf(stderr, "Record new entry: [%s] -> [.backup/.rmlist]\n", n->filename);
+			buf_append(&rem->data, &rem->filesize, &rem_cap, n->filename, n->namesize);
+			fprintf(LOG_FILE, "Record new entry: [%s] -> [.backup/.rmlist]\n", n->filename);
 		}
 		if (doBak) {
+			// The manifest lets restore verify the backup
+			hash = cpio_hash(m);
+			buf_append(&man->data, &man->filesize, &man_cap, &hash, sizeof(hash));
+			buf_append(&man->data, &man->filesize, &man_cap, m->filename, m->namesize);
+			name = xmalloc(m->namesize + 8);
+			memcpy(name, ".backup/", 8);
+			memcpy(name + 8, m->filename, m->namesize);
+			fprintf(LOG_FILE, "[%s] -> [%s]\n", m->filename, name);
+			if (m->flags & CPIO_OWN_NAME)
+				free(m->filename);
+			m->filename = name;
 			m->namesize += 8;
-			m->filename = realloc(m->filename, m->namesize);
-			strcpy(buf, m->filename);
-			sprintf(m->filename, ".backup/%s", buf);
-			fprintf(stderr, "[%s] -> [%s]\n", buf, m->filename);
+			m->flags |= CPIO_OWN_NAME;
 			vec_push_back(&bak, m);
 			// NULL the original entry, so it won't be freed
-			vec_entry(o)[i - 1] = NULL;
+			vec_entry(&o->files)[i - 1] = NULL;
 		}
 	}
 
@@ -425,112 +693,312 @@ static void cpio_backup(const char *orig, struct vector *v) {
 	}
 
 	// Don't include if empty
-	if (rem->filesize == 0) {
+	if (man->filesize == 0)
+		man->remove = 1;
+	else
+		buf_append(&rem->data, &rem->filesize, &rem_cap, man->filename, man->namesize);
+	if (rem->filesize == 0)
 		rem->remove = 1;
-		if (bak.size == 2)
-			dir->remove = 1;
-	}
+	if (rem->filesize == 0 && bak.size == 3)
+		dir->remove = 1;
 
 	// Sort
 	vec_sort(v, cpio_compare);
 
+	// The backups still point into the original archive, keep it alive
+	vec_for_each(&o->blocks, b) {
+		vec_push_back(&c->blocks, b);
+	}
+	vec_size(&o->blocks) = 0;
+
 	// Cleanup
-	cpio_vec_destroy(o);
+	vec_destroy(&bak);
+	cpio_destroy(o);
 }
 
-static int cpio_restore(struct vector *v) {
-	cpio_file *f, *n;
+// Hash of name in the manifest, return 1 if it is not listed
+static int manifest_hash(cpio_file *man, const char *name, uint64_t *hash) {
+	const cpio_manifest *rec;
+	size_t pos = 0, len, avail;
+	while (pos + sizeof(*rec) < man->filesize) {
+		rec = (const cpio_manifest *) (man->data + pos);
+		avail = man->filesize - pos - sizeof(*rec);
+		len = strnlen(rec->name, avail);
+		// A name without its terminator ends the manifest
+		if (len == avail)
+			break;
+		if (strcmp(rec->name, name) == 0) {
+			*hash = rec->hash;
+			return 0;
+		}
+		pos += sizeof(*rec) + len + 1;
+	}
+	return 1;
+}
+
+static int cpio_restore(cpio_t *c) {
+	struct vector restored;
+	cpio_file *f, *n, *man;
+	size_t begin, end;
+	uint64_t hash;
 	int ret = 1;
-	vec_for_each(v, f) {
-		if (strstr(f->filename, ".backup") != NULL) {
-			ret = 0;
-			f->remove = 1;
-			if (strcmp(f->filename, ".backup") == 0) continue;
-			if (strcmp(f->filename, ".backup/.rmlist") == 0) {
-				for (int pos = 0; pos < f->filesize; pos += strlen(f->data + pos) + 1)
-					cpio_rm(0, f->data + pos, v);
-				continue;
-			}
-			n = xcalloc(sizeof(*n), 1);
-			memcpy(n, f, sizeof(*f));
-			n->namesize -= 8;
-			n->filename = xmalloc(n->namesize);
-			memcpy(n->filename, f->filename + 8, n->namesize);
-			n->data = xmalloc(n->filesize);
-			memcpy(n->data, f->data, n->filesize);
-			n->remove = 0;
-			fprintf(stderr, "Restoring [%s] -> [%s]\n", f->filename, n->filename);
-			cpio_vec_insert(v, n);
+	vec_init(&restored);
+	// Backups made before the manifest existed are restored unchecked
+	man = cpio_find(c, CPIO_MANIFEST);
+	if (man && man->remove)
+		man = NULL;
+	if (man)
+		man->remove = 1;
+	cpio_prefix_range(c, ".backup", &begin, &end);
+	for (; begin < end; ++begin) {
+		f = vec_entry(&c->files)[begin];
+		ret = 0;
+		f->remove = 1;
+		if (strcmp(f->filename, ".backup") == 0) continue;
+		if (strcmp(f->filename, ".backup/.rmlist") == 0) {
+			for (int pos = 0; pos < f->filesize; pos += strlen(f->data + pos) + 1)
+				cpio_rm(0, f->data + pos, c);
+			continue;
+		}
+		if (man) {
+			if (manifest_hash(man, f->filename + 8, &hash))
+				LOGE(1, "[%s] is not in the backup manifest\n", f->filename);
+			if (cpio_hash(f) != hash)
+				LOGE(1, "[%s] does not match the backup manifest\n", f->filename);
 		}
+		n = cpio_new(f->filename + 8);
+		n->mode = f->mode;
+		n->uid = f->uid;
+		n->gid = f->gid;
+		n->filesize = f->filesize;
+		// Take over the data, the backup entry is dropped anyway
+		n->data = f->data;
+		n->flags = (n->flags & ~CPIO_OWN_DATA) | (f->flags & CPIO_OWN_DATA);
+		f->flags &= ~CPIO_OWN_DATA;
+		fprintf(LOG_FILE, "Restoring [%s] -> [%s]\n", f->filename, n->filename);
+		vec_push_back(&restored, n);
 	}
+	// Insert after the walk, insertions move the backup entries around
+	vec_for_each(&restored, n) {
+		cpio_vec_insert(c, n);
+	}
+	vec_destroy(&restored);
 	// Some known stuff we can remove
-	cpio_rm(0, "sbin/magic_mask.sh", v);
-	cpio_rm(0, "init.magisk.rc", v);
-	cpio_rm(0, "magisk", v);
+	cpio_rm(0, "sbin/magic_mask.sh", c);
+	cpio_rm(0, "init.magisk.rc", c);
+	cpio_rm(0, "magisk", c);
 	return ret;
 }
 
-int cpio_commands(const char *command, int argc, char *argv[]) {
-	int recursive = 0, ret = 0;
-	command_t cmd;
-	char *incpio = argv[0];
-	++argv;
-	--argc;
+static command_t cpio_cmd(const char *command, int argc, char *argv[]) {
 	if (strcmp(command, "test") == 0) {
-		cmd = TEST;
+		return TEST;
 	} else if (strcmp(command, "restore") == 0) {
-		cmd = RESTORE;
+		return RESTORE;
 	} else if (argc == 1 && strcmp(command, "backup") == 0) {
-		cmd = BACKUP;
-	} else if (argc > 0 && strcmp(command, "rm") == 0) {
-		cmd = RM;
-		if (argc == 2 && strcmp(argv[0], "-r") == 0) {
-			recursive = 1;
-			++argv;
-			--argc;
-		}
+		return BACKUP;
+	} else if ((argc == 1 || (argc == 2 && strcmp(argv[0], "-r") == 0)) && strcmp(command, "rm") == 0) {
+		return RM;
 	} else if (argc == 2 && strcmp(command, "patch") == 0) {
-		cmd = PATCH;
+		return PATCH;
 	} else if (argc == 2 && strcmp(command, "extract") == 0) {
-		cmd = EXTRACT;
+		return EXTRACT;
 	} else if (argc == 2 && strcmp(command, "mkdir") == 0) {
-		cmd = MKDIR;
+		return MKDIR;
 	} else if (argc == 3 && strcmp(command, "add") == 0) {
-		cmd = ADD;
+		return ADD;
 	} else {
-		cmd = NONE;
+		return NONE;
 	}
-	struct vector v;
-	vec_init(&v);
-	parse_cpio(incpio, &v);
+}
+
+static int cpio_exec(command_t cmd, cpio_t *c, int argc, char *argv[]) {
+	int recursive = 0, ret = 0;
 	switch(cmd) {
 	case TEST:
-		cpio_test(&v);
+		ret = cpio_test(c);
 		break;
 	case RESTORE:
-		ret = cpio_restore(&v);
+		ret = cpio_restore(c);
 		break;
 	case BACKUP:
-		cpio_backup(argv[0], &v);
+		cpio_backup(argv[0], c);
+		break;
 	case RM:
-		cpio_rm(recursive, argv[0], &v);
+		if (argc == 2) {
+			recursive = 1;
+			++argv;
+		}
+		cpio_rm(recursive, argv[0], c);
 		break;
 	case PATCH:
-		cpio_patch(&v, strcmp(argv[0], "true") == 0, strcmp(argv[1], "true") == 0);
+		cpio_patch(c, strcmp(argv[0], "true") == 0, strcmp(argv[1], "true") == 0);
 		break;
 	case EXTRACT:
-		cpio_extract(argv[0], argv[1], &v);
+		ret = cpio_extract(argv[0], argv[1], c);
 		break;
 	case MKDIR:
-		cpio_mkdir(strtoul(argv[0], NULL, 8), argv[1], &v);
+		cpio_mkdir(strtoul(argv[0], NULL, 8), argv[1], c);
 		break;
 	case ADD:
-		cpio_add(strtoul(argv[0], NULL, 8), argv[1], argv[2], &v);
+		cpio_add(strtoul(argv[0], NULL, 8), argv[1], argv[2], c);
 		break;
 	case NONE:
+		return -1;
+	}
+	return ret;
+}
+
+int cpio_commands(const char *command, int argc, char *argv[]) {
+	int ret;
+	char *incpio = argv[0];
+	++argv;
+	--argc;
+	command_t cmd = cpio_cmd(command, argc, argv);
+	if (cmd == NONE)
 		return 1;
+	cpio_t c;
+	cpio_init(&c);
+	// test and extract need a few entries, which can be read straight from a boot image
+	if (cmd == TEST) {
+		if (stream_cpio(incpio, &c, TEST_LIST, TEST_NUM, TEST_OTHERS))
+			parse_cpio(incpio, &c);
+	} else if (cmd == EXTRACT) {
+		if (stream_cpio(incpio, &c, (const char **) argv, 1, 1))
+			parse_cpio(incpio, &c);
+	} else {
+		parse_cpio(incpio, &c);
+	}
+	ret = cpio_exec(cmd, &c, argc, argv);
+	// test and extract do not modify the archive
+	if (cmd != TEST && cmd != EXTRACT)
+		dump_cpio(incpio, &c);
+	cpio_destroy(&c);
+	exit(ret);
+}
+
+// Tokenize and run one command line (e.g. "patch true false") on c
+static int cpio_line(cpio_t *c, const char *cmdline, int dry) {
+	char *argv[8], line[PATH_MAX * 2], *tok, *save;
+	int argc = 0, ret;
+	command_t cmd;
+	snprintf(line, sizeof(line), "%s", cmdline);
+	for (tok = strtok_r(line, " \t\r\n", &save); tok && argc < 8; tok = strtok_r(NULL, " \t\r\n", &save))
+		argv[argc++] = tok;
+	if (argc == 0 || argv[0][0] == '#')
+		return 0;
+	cmd = cpio_cmd(argv[0], argc - 1, argv + 1);
+	if (cmd == NONE)
+		LOGE(1, "Invalid cpio command [%s]\n", cmdline);
+	// Nothing may touch the filesystem in a dry run
+	if (dry && cmd == EXTRACT) {
+		fprintf(LOG_FILE, "Skip extract [%s] in dry run\n", argv[2]);
+		return 0;
+	}
+	ret = cpio_exec(cmd, c, argc - 1, argv + 1);
+	cpio_vec_compact(c);
+	return ret;
+}
+
+// Apply commands (e.g. "patch true false") to the cpio archive in buf, dump the result to out
+int cpio_mem_commands(sink_t *out, const unsigned char *buf, size_t size, int cmdc, char *cmdv[]) {
+	int ret = 0;
+	cpio_t c;
+	cpio_init(&c);
+	parse_cpio_buf(buf, size, &c);
+	for (int i = 0; i < cmdc; ++i)
+		ret = cpio_line(&c, cmdv[i], 0);
+	dump_cpio_sink(out, &c);
+	cpio_destroy(&c);
+	return ret;
+}
+
+static int cpio_same(const cpio_file *a, const cpio_file *b) {
+	return a->mode == b->mode && a->uid == b->uid && a->gid == b->gid && a->filesize == b->filesize
+		&& (a->data == b->data || memcmp(a->data, b->data, a->filesize) == 0);
+}
+
+// Compare the final archive against the entries it was loaded with
+static void cpio_summary(cpio_file *orig, size_t num, cpio_t *c) {
+	size_t i = 0, j = 0, add = 0, rm = 0, mod = 0;
+	cpio_file *f;
+	int cmp;
+	sink_t out;
+	while (i < num || j < vec_size(&c->files)) {
+		f = j < vec_size(&c->files) ? vec_entry(&c->files)[j] : NULL;
+		if (i == num)
+			cmp = 1;
+		else if (f == NULL)
+			cmp = -1;
+		else
+			cmp = strcmp(orig[i].filename, f->filename);
+		if (cmp < 0) {
+			fprintf(LOG_FILE, "Remove [%s]\n", orig[i++].filename);
+			++rm;
+		} else if (cmp > 0) {
+			fprintf(LOG_FILE, "Add [%s]\n", f->filename);
+			++add;
+			++j;
+		} else {
+			if (!cpio_same(orig + i, f)) {
+				fprintf(LOG_FILE, "Modify [%s]\n", f->filename);
+				++mod;
+			}
+			++i;
+			++j;
+		}
+	}
+	null_sink(&out);
+	dump_cpio_sink(&out, c);
+	fprintf(LOG_FILE, "\nEntries: %zu -> %zu (%zu added, %zu removed, %zu modified)\n",
+		num, vec_size(&c->files), add, rm, mod);
+	fprintf(LOG_FILE, "Size: %zu bytes\n", out.size);
+}
+
+// --cpio-batch <incpio> [-n] [-f script] [-c "<cmd> [params...]"]...
+// Run all commands on one in memory archive, and dump it only once
+int cpio_batch(int argc, char *argv[]) {
+	char *incpio = argv[0], *line = NULL;
+	size_t len = 0, num = 0;
+	int dry = 0, ret = 0;
+	cpio_file *orig = NULL;
+	FILE *fp;
+	cpio_t c;
+
+	// Validate the arguments before loading anything
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-n") == 0)
+			dry = 1;
+		else if ((strcmp(argv[i], "-c") && strcmp(argv[i], "-f")) || ++i == argc)
+			return 1;
+	}
+
+	cpio_init(&c);
+	parse_cpio(incpio, &c);
+	if (dry) {
+		// Shallow copies, the names and data stay in the mapped archive
+		num = vec_size(&c.files);
+		orig = xmalloc(num * sizeof(*orig) + 1);
+		for (size_t i = 0; i < num; ++i)
+			orig[i] = *(cpio_file *) vec_entry(&c.files)[i];
+	}
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-c") == 0) {
+			ret = cpio_line(&c, argv[++i], dry);
+		} else if (strcmp(argv[i], "-f") == 0) {
+			fp = xfopen(argv[++i], "r");
+			while (getline(&line, &len, fp) >= 0)
+				ret = cpio_line(&c, line, dry);
+			fclose(fp);
+		}
+	}
+	free(line);
+	if (dry) {
+		cpio_summary(orig, num, &c);
+		free(orig);
+	} else {
+		dump_cpio(incpio, &c);
 	}
-	dump_cpio(incpio, &v);
-	cpio_vec_destroy(&v);
+	cpio_destroy(&c);
 	exit(ret);
 }
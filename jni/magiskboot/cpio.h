@@ -3,7 +3,12 @@
 
 #include <stdint.h>
 
-#include "list.h"
+#include "vector.h"
+
+// Parts of a cpio_file that are malloced, everything else points into an arena or the archive
+#define CPIO_OWN_NAME   0x1
+#define CPIO_OWN_DATA   0x2
+#define CPIO_OWN_ENTRY  0x4
 
 typedef struct cpio_file {
 	// uint32_t ino;
@@ -22,13 +27,29 @@ typedef struct cpio_file {
 	char *filename;
 	char *data;
 	int remove;
+	int flags;
 } cpio_file;
 
-typedef struct line_list {
-    char *line;
-    int isNew;
-    struct list_head pos;
-} line_list;
+// Memory the entries point into: mapped archives (size != 0) and malloced arenas
+struct cpio_block {
+	void *addr;
+	size_t size;
+};
+
+typedef struct cpio_t {
+	struct vector files;    // cpio_file *, sorted by filename
+	struct vector blocks;   // struct cpio_block *
+} cpio_t;
+
+// Verifies the backup on restore. Not under .backup and listed in .backup/.rmlist,
+// so magiskboot versions without it remove the manifest instead of restoring it
+#define CPIO_MANIFEST   ".magisk_backup_manifest"
+
+// Record of CPIO_MANIFEST: the hash of the backed up data, then the null terminated name
+typedef struct cpio_manifest {
+	uint64_t hash;
+	char name[];
+} __attribute__((packed)) cpio_manifest;
 
 typedef struct cpio_newc_header {
 	char magic[6];
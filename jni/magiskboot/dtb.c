@@ -0,0 +1,234 @@
+/* dtb.c - Flattened device trees in dtb sections and kernels
+ *
+ * One scan over the file finds every FDT blob (dtb section, DTBs appended to
+ * the kernel, or a whole boot image). The fstab nodes in them carry the verity
+ * and forceencrypt flags on devices mounting early, these are patched in place
+ * with the fstab rules of cpio_patch. The rules only shrink the flags, so the
+ * property keeps its slot: its length is reduced and the freed words become
+ * FDT_NOP tokens. Nothing else in the blob moves.
+ */
+
+#include "magiskboot.h"
+#include "textpatch.h"
+
+#define FDT_MAGIC       0xd00dfeed
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+// Deep enough for /firmware/android/fstab/<partition>
+#define FDT_DEPTH       16
+
+// All fields are big endian
+struct fdt_header {
+	uint32_t magic;
+	uint32_t totalsize;
+	uint32_t off_dt_struct;
+	uint32_t off_dt_strings;
+	uint32_t off_mem_rsvmap;
+	uint32_t version;
+	uint32_t last_comp_version;
+	uint32_t boot_cpuid_phys;
+	uint32_t size_dt_strings;
+	uint32_t size_dt_struct;    // Version 17 and later
+};
+
+struct fdt_blob {
+	unsigned char *buf;
+	uint32_t size;
+	uint32_t struct_off, struct_size;
+	uint32_t strings_off, strings_size;
+};
+
+static uint32_t be32(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// Return 0 if a sane FDT starts at buf
+static int fdt_blob_init(struct fdt_blob *b, unsigned char *buf, size_t avail) {
+	struct fdt_header h;
+	if (avail < sizeof(h))
+		return 1;
+	for (int i = 0; i < sizeof(h) / 4; ++i)
+		((uint32_t *) &h)[i] = be32(buf + 4 * i);
+	if (h.magic != FDT_MAGIC || h.version < 16 || h.last_comp_version > 17)
+		return 1;
+	if (h.totalsize < sizeof(h) - 4 || h.totalsize > avail)
+		return 1;
+	if (h.version < 17)
+		h.size_dt_struct = h.totalsize - h.off_dt_struct;
+	if (h.off_dt_struct > h.totalsize || h.size_dt_struct > h.totalsize - h.off_dt_struct ||
+		h.off_dt_strings > h.totalsize || h.size_dt_strings > h.totalsize - h.off_dt_strings ||
+		h.off_dt_struct % 4 || h.size_dt_struct < 8)
+		return 1;
+	// The struct block starts with the root node
+	if (be32(buf + h.off_dt_struct) != FDT_BEGIN_NODE)
+		return 1;
+	b->buf = buf;
+	b->size = h.totalsize;
+	b->struct_off = h.off_dt_struct;
+	b->struct_size = h.size_dt_struct;
+	b->strings_off = h.off_dt_strings;
+	b->strings_size = h.size_dt_strings;
+	return 0;
+}
+
+// Every blob in buf, in one pass. Blobs do not nest, the scan resumes after each
+static void fdt_index(unsigned char *buf, size_t size, struct vector *v) {
+	struct fdt_blob b;
+	unsigned char *p = buf, *end = buf + size;
+	while ((p = memmem(p, end - p, "\xd0\x0d\xfe\xed", 4))) {
+		if (fdt_blob_init(&b, p, end - p) == 0) {
+			struct fdt_blob *n = xmalloc(sizeof(*n));
+			*n = b;
+			vec_push_back(v, n);
+			p += b.size;
+		} else {
+			++p;
+		}
+	}
+}
+
+// Property name, NULL if out of the strings block
+static const char *fdt_string(const struct fdt_blob *b, uint32_t off) {
+	const char *s = (const char *) b->buf + b->strings_off + off;
+	if (off >= b->strings_size || memchr(s, '\0', b->strings_size - off) == NULL)
+		return NULL;
+	return s;
+}
+
+// Shrink the string property at prop (its FDT_PROP token) to value, in place
+static void fdt_set_prop(unsigned char *prop, const char *value, size_t len) {
+	uint32_t old = (be32(prop + 4) + 3) & ~3, now = (len + 1 + 3) & ~3;
+	unsigned char *data = prop + 12;
+	put_be32(prop + 4, len + 1);
+	memcpy(data, value, len);
+	memset(data + len, 0, now - len);
+	for (uint32_t off = now; off < old; off += 4)
+		put_be32(data + off, FDT_NOP);
+}
+
+// Walk the struct block, listing (patcher == NULL) or patching the properties of fstab entries.
+// Returns the number of properties changed, -1 if the blob is broken
+static int fdt_fstab(struct fdt_blob *b, int idx, const text_patcher *patcher) {
+	unsigned char *p = b->buf + b->struct_off, *end = p + b->struct_size, *prop;
+	const char *names[FDT_DEPTH], *name, *value;
+	char path[PATH_MAX];
+	uint32_t token, len;
+	size_t size;
+	char *patched;
+	int depth = 0, fstab = -1, changed = 0;
+
+	while (p + 4 <= end) {
+		token = be32(p);
+		p += 4;
+		switch (token) {
+		case FDT_BEGIN_NODE:
+			name = (const char *) p;
+			if (memchr(p, '\0', end - p) == NULL || depth == FDT_DEPTH)
+				return -1;
+			names[depth] = name;
+			if (fstab < 0 && strcmp(name, "fstab") == 0)
+				fstab = depth;
+			++depth;
+			p += (strlen(name) + 1 + 3) & ~3;
+			break;
+		case FDT_END_NODE:
+			if (depth == 0)
+				return -1;
+			if (--depth == fstab)
+				fstab = -1;
+			break;
+		case FDT_PROP:
+			if (p + 8 > end)
+				return -1;
+			prop = p - 4;
+			len = be32(p);
+			name = fdt_string(b, be32(p + 4));
+			p += 8;
+			if (name == NULL || len > end - p)
+				return -1;
+			value = (const char *) p;
+			p += (len + 3) & ~3;
+			// Properties of the entries right below fstab, e.g. fstab/system/fsmgr_flags
+			if (fstab < 0 || depth != fstab + 2 || len == 0 || value[len - 1] != '\0')
+				break;
+			snprintf(path, sizeof(path), "dtb.%d/%s/%s", idx, names[depth - 1], name);
+			if (patcher == NULL) {
+				fprintf(LOG_FILE, "%s = [%s]\n", path, value);
+				break;
+			}
+			patched = text_patch(patcher, path, value, strlen(value), &size);
+			if (patched == NULL)
+				break;
+			if (size + 1 > len) {
+				fprintf(LOG_FILE, "No room for [%s] in [%s], skipping\n", patched, path);
+			} else {
+				fdt_set_prop(prop, patched, size);
+				++changed;
+			}
+			free(patched);
+			break;
+		case FDT_NOP:
+			break;
+		case FDT_END:
+			return changed;
+		default:
+			return -1;
+		}
+	}
+	return -1;
+}
+
+// print: list the fstab entries of every DTB in file; patch: also apply the fstab rules
+int dtb_commands(const char *command, int argc, char *argv[]) {
+	unsigned char *buf;
+	size_t size;
+	struct vector blobs;
+	struct fdt_blob *b;
+	text_patcher *patcher = NULL;
+	int patch, i = 0, n, total = 0;
+
+	if (strcmp(command, "print") == 0 && argc == 1) {
+		patch = 0;
+	} else if (strcmp(command, "patch") == 0 && argc == 3) {
+		patch = 1;
+		patcher = fstab_patcher(strcmp(argv[1], "true") == 0, strcmp(argv[2], "true") == 0);
+	} else {
+		return 1;
+	}
+
+	if (patch)
+		mmap_rw(argv[0], &buf, &size);
+	else
+		mmap_ro(argv[0], &buf, &size);
+	vec_init(&blobs);
+	fdt_index(buf, size, &blobs);
+	vec_for_each(&blobs, b) {
+		fprintf(LOG_FILE, "DTB [%d] @ 0x%zx [%u]\n", i, (size_t) (b->buf - buf), b->size);
+		n = fdt_fstab(b, i, patch ? patcher : NULL);
+		if (n < 0)
+			fprintf(LOG_FILE, "DTB [%d] is broken, skipping\n", i);
+		else
+			total += n;
+		++i;
+	}
+	if (i == 0)
+		fprintf(LOG_FILE, "No DTB found in [%s]\n", argv[0]);
+	else if (patch)
+		fprintf(LOG_FILE, "Patched [%d] properties\n", total);
+	munmap(buf, size);
+	vec_deep_destroy(&blobs);
+	if (patcher)
+		text_patcher_free(patcher);
+	return 0;
+}
@@ -1,5 +1,36 @@
 #include "magiskboot.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SCAN
+#define MASK_STEP 1
+#define MASK_BYTE 0x1ULL
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_SCAN
+#define MASK_STEP 4
+#define MASK_BYTE 0xfULL
+#endif
+
+// Max number of distinct first bytes the vector scan compares against
+#define SIMD_FIRSTS 4
+
+typedef struct hexpattern {
+	const char *hex_from, *hex_to;
+	unsigned char *from, *to;
+	size_t from_size, to_size;
+	int count;
+} hexpattern;
+
+typedef struct hexsearch {
+	hexpattern *pats;
+	int num;
+	unsigned char first[256];       // Bytes any pattern starts with
+	unsigned char firsts[256];      // Same set as a list
+	int nfirst;
+	unsigned char pairs[8192];      // Bitset of the first two bytes of all patterns
+} hexsearch;
+
 static void hex2byte(const char *hex, unsigned char *str) {
 	char high, low;
 	for (int i = 0, length = strlen(hex); i < length; i += 2) {
@@ -9,24 +40,146 @@ static void hex2byte(const char *hex, unsigned char *str) {
 	}
 }
 
-void hexpatch(const char *image, const char *from, const char *to) {
-	int patternsize = strlen(from) / 2, patchsize = strlen(to) / 2;
+static void set_pair(hexsearch *s, unsigned a, unsigned b) {
+	unsigned idx = (a << 8) | b;
+	s->pairs[idx >> 3] |= 1 << (idx & 7);
+}
+
+static int test_pair(const hexsearch *s, unsigned a, unsigned b) {
+	unsigned idx = (a << 8) | b;
+	return s->pairs[idx >> 3] & (1 << (idx & 7));
+}
+
+static void hexsearch_init(hexsearch *s, int patc, char *patv[]) {
+	hexpattern *p;
+	memset(s, 0, sizeof(*s));
+	s->num = patc / 2;
+	s->pats = xcalloc(s->num, sizeof(*s->pats));
+	for (int i = 0; i < s->num; ++i) {
+		p = &s->pats[i];
+		p->hex_from = patv[i * 2];
+		p->hex_to = patv[i * 2 + 1];
+		p->from_size = strlen(p->hex_from) / 2;
+		p->to_size = strlen(p->hex_to) / 2;
+		if (p->from_size == 0)
+			LOGE(1, "Empty hex pattern\n");
+		p->from = xmalloc(p->from_size);
+		p->to = xmalloc(p->to_size);
+		hex2byte(p->hex_from, p->from);
+		hex2byte(p->hex_to, p->to);
+
+		if (!s->first[p->from[0]]) {
+			s->first[p->from[0]] = 1;
+			s->firsts[s->nfirst++] = p->from[0];
+		}
+		if (p->from_size == 1) {
+			for (int b = 0; b < 256; ++b)
+				set_pair(s, p->from[0], b);
+		} else {
+			set_pair(s, p->from[0], p->from[1]);
+		}
+	}
+}
+
+static void hexsearch_destroy(hexsearch *s) {
+	for (int i = 0; i < s->num; ++i) {
+		free(s->pats[i].from);
+		free(s->pats[i].to);
+	}
+	free(s->pats);
+}
+
+// Try all patterns in order at off, patch the first match and return its size
+static size_t hexsearch_at(hexsearch *s, unsigned char *file, size_t size, size_t off) {
+	hexpattern *p;
+	size_t left = size - off, n;
+	if (left > 1 && !test_pair(s, file[off], file[off + 1]))
+		return 0;
+	for (int i = 0; i < s->num; ++i) {
+		p = &s->pats[i];
+		if (p->from_size > left || memcmp(file + off, p->from, p->from_size))
+			continue;
+		fprintf(LOG_FILE, "Pattern %s found at 0x%08zx!\nPatching to %s\n", p->hex_from, off, p->hex_to);
+		// Never write past the end of the file
+		n = p->to_size > left ? left : p->to_size;
+		memset(file + off, 0, p->from_size);
+		memcpy(file + off, p->to, n);
+		++p->count;
+		return p->from_size;
+	}
+	return 0;
+}
+
+#ifdef SIMD_SCAN
+// Match mask of the 16 bytes at buf against the first bytes, MASK_STEP bits per byte
+static uint64_t first_mask(const unsigned char *buf, const hexsearch *s) {
+#if defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *) buf), m = _mm_setzero_si128();
+	for (int i = 0; i < s->nfirst; ++i)
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(s->firsts[i])));
+	return (unsigned) _mm_movemask_epi8(m);
+#else
+	uint8x16_t v = vld1q_u8(buf), m = vdupq_n_u8(0);
+	for (int i = 0; i < s->nfirst; ++i)
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(s->firsts[i])));
+	// Narrow each byte to a nibble
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+#endif
+}
+#endif
+
+static void hexsearch_scan(hexsearch *s, unsigned char *file, size_t size) {
+	size_t i = 0, n;
+	unsigned char *p;
+
+	// A single first byte: let the libc memchr do the scanning
+	if (s->nfirst == 1) {
+		while (i < size && (p = memchr(file + i, s->firsts[0], size - i))) {
+			i = p - file;
+			n = hexsearch_at(s, file, size, i);
+			i += n ? n : 1;
+		}
+		return;
+	}
+
+	while (i < size) {
+#ifdef SIMD_SCAN
+		if (s->nfirst <= SIMD_FIRSTS && i + 16 <= size) {
+			size_t base = i, pos;
+			uint64_t mask = first_mask(file + base, s);
+			while (mask) {
+				pos = base + __builtin_ctzll(mask) / MASK_STEP;
+				mask &= ~(MASK_BYTE << ((pos - base) * MASK_STEP));
+				// Skip candidates covered by a previous match
+				if (pos < i)
+					continue;
+				if ((n = hexsearch_at(s, file, size, pos)))
+					i = pos + n;
+			}
+			if (i < base + 16)
+				i = base + 16;
+			continue;
+		}
+#endif
+		if (s->first[file[i]] && (n = hexsearch_at(s, file, size, i)))
+			i += n;
+		else
+			++i;
+	}
+}
+
+// Search and replace all <from> <to> pairs in a single pass over the file
+void hexpatch(const char *image, int patc, char *patv[]) {
 	size_t filesize;
-	unsigned char *file, *pattern, *patch;
+	unsigned char *file;
+	hexsearch s;
+	hexsearch_init(&s, patc, patv);
 	mmap_rw(image, &file, &filesize);
-	pattern = xmalloc(patternsize);
-	patch = xmalloc(patchsize);
-	hex2byte(from, pattern);
-	hex2byte(to, patch);
-	for (size_t i = 0; i < filesize - patternsize; ++i) {
-		if (memcmp(file + i, pattern, patternsize) == 0) {
-			fprintf(stderr, "Pattern %s found!\nPatching to %s\n", from, to);
-			memset(file + i, 0, patternsize);
-			memcpy(file + i, patch, patchsize);
-			i += patternsize - 1;
-		}
+	hexsearch_scan(&s, file, filesize);
+	for (int i = 0; i < s.num; ++i) {
+		if (s.pats[i].count == 0)
+			fprintf(LOG_FILE, "Pattern %s not found\n", s.pats[i].hex_from);
 	}
 	munmap(file, filesize);
-	free(pattern);
-	free(patch);
+	hexsearch_destroy(&s);
 }
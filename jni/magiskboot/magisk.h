@@ -4,7 +4,17 @@
 #ifndef _MAGISK_H_
 #define _MAGISK_H_
 
-#define LOGE(err, ...) { fprintf(stderr, __VA_ARGS__); exit(err); }
-#define PLOGE(fmt, args...) { fprintf(stderr, fmt " failed with %d: %s\n\n", ##args, errno, strerror(errno)); exit(1); }
+#include <stdio.h>
+#include <string.h>
+
+// Messages of the current thread, batch jobs log into a file of their own
+extern __thread FILE *boot_log;
+#define LOG_FILE (boot_log ? boot_log : stderr)
+
+// Exit with err, or only fail the pool task running on this thread
+void boot_error(int err) __attribute__((noreturn));
+
+#define LOGE(err, ...) { fprintf(LOG_FILE, __VA_ARGS__); boot_error(err); }
+#define PLOGE(fmt, args...) { fprintf(LOG_FILE, fmt " failed with %d: %s\n\n", ##args, errno, strerror(errno)); boot_error(1); }
 
 #endif
@@ -14,6 +14,7 @@
 
 #include "bootimg.h"
 #include "sha1.h"
+#include "sha256.h"
 #include "magisk.h"
 #include "utils.h"
 
@@ -26,6 +27,13 @@
 #define SECOND_FILE     "second"
 #define DTB_FILE        "dtb"
 #define NEW_BOOT        "new-boot.img"
+#define BATCH_LOG       "magiskboot.log"
+
+// Buffer size of buf_sink, a multiple of the page size
+#define BUF_SINK_SIZE   0x100000
+
+// Mapped files are hashed in chunks this big, so the readahead keeps up
+#define HASH_CHUNK      0x100000
 
 #define str(a) #a
 #define xstr(a) str(a)
@@ -58,25 +66,123 @@ typedef enum {
     RESTORE
 } command_t;
 
+// Output of codecs and cpio dumps: an fd, a buffered fd, or a growing memory buffer
+typedef struct sink_t {
+	void (*write)(struct sink_t *s, const void *buf, size_t size);
+	int fd;
+	unsigned char *buf;
+	size_t size;        // Total bytes written
+	size_t cap;
+	size_t fill;        // Bytes in buf not yet written to fd (buf_sink)
+} sink_t;
+
+#define sink_write(s, b, n) (s)->write((s), (b), (n))
+
+// SHA-1 or SHA-256 over data fed in pieces
+// Room for digest_hex, compat SHA-1 bytes print as up to 8 digits where char is signed
+#define DIGEST_HEX_SIZE 161
+
+typedef struct digest_t {
+	int sha256;
+	SHA1_CTX sha1_ctx;
+	SHA256_CTX sha256_ctx;
+} digest_t;
+
+// Streaming codecs: codec_init(), feed data with codec_update(), then codec_finish()
+// flushes everything left to the sink and frees the codec state
+typedef struct codec_t codec_t;
+
+typedef struct codec_ops {
+	void (*init)(codec_t *c);
+	void (*update)(codec_t *c, const unsigned char *buf, size_t size);
+	void (*finish)(codec_t *c);
+} codec_ops;
+
+struct codec_t {
+	const codec_ops *ops;
+	file_t type;
+	int mode;           // 0 = decode; 1 = encode
+	int threads;        // Set before codec_init, only used by the xz encoder
+	int level;          // Set before codec_init for encoders, 0 = default of the format
+	int strategy;       // gzip encoder only, a zlib Z_*_STRATEGY
+	uint32_t dict;      // xz/lzma encoders only, dictionary size, 0 = from the level
+	size_t size_hint;   // Set before codec_init, total input size if known
+	int abort;          // Set before codec_finish of a decoder to drop the output still held
+	sink_t *out;
+	void *ctx;
+};
+
+#define codec_update(c, b, n) (c)->ops->update((c), (b), (n))
+#define codec_finish(c) (c)->ops->finish(c)
+
+// Compression tuning, parsed from options such as level=6,threads=4 by comp_opt_parse()
+typedef struct comp_opt {
+	int threads;        // 0 = all CPUs
+	int level;          // 0 = default of the format
+	int strategy;
+	uint32_t dict;
+	int fast;           // Use the fastest level
+	size_t fit;         // Use the lowest level keeping the output within fit bytes,
+	                    // SIZE_MAX for the size of the original image
+} comp_opt;
+
+// Digests unpack computes, in the order print_info shows them
+enum { DIGEST_IMAGE, DIGEST_KERNEL, DIGEST_RAMDISK, DIGEST_SECOND, DIGEST_DTB, DIGEST_CPIO, DIGEST_NUM };
+
+// A parsed boot image, the sections are unpacked into and repacked from dir
+typedef struct boot_img {
+	const char *dir;    // NULL = the current directory
+	unsigned char *kernel, *ramdisk, *second, *dtb, *extra;
+	boot_img_hdr hdr;
+	int mtk_kernel, mtk_ramdisk;
+	file_t ramdisk_type;
+	// There are possible two MTK headers
+	mtk_hdr mtk_kernel_hdr, mtk_ramdisk_hdr;
+	size_t mtk_kernel_off, mtk_ramdisk_off;
+	int hash_alg;       // Set while unpack is hashing
+	char digests[DIGEST_NUM][DIGEST_HEX_SIZE];
+} boot_img;
+
+// Tasks of the pool are waited for in groups, zero them before the first submit
+typedef struct task_group {
+	int pending;
+	int failed;
+} task_group;
+
 extern char *SUP_LIST[];
 extern char *SUP_EXT_LIST[];
 extern file_t SUP_TYPE_LIST[];
 
 // Main entries
-void unpack(const char *image);
-void repack(const char* orig_image, const char* out_image);
-void hexpatch(const char *image, const char *from, const char *to);
-int parse_img(unsigned char *orig, size_t size);
+int unpack(boot_img *boot, const char *image, int hash);
+void repack(boot_img *boot, const char* orig_image, const char* out_image, const comp_opt *opt);
+int patch_image(boot_img *boot, const char *image, const char *out_image, const comp_opt *opt, int cmdc, char *cmdv[]);
+void hexpatch(const char *image, int patc, char *patv[]);
+int parse_img(boot_img *boot, unsigned char *orig, size_t size);
+void img_ramdisk(unsigned char *orig, size_t size, const unsigned char **buf, size_t *len, file_t *type);
 int cpio_commands(const char *command, int argc, char *argv[]);
-void cleanup();
+int cpio_batch(int argc, char *argv[]);
+int cpio_mem_commands(sink_t *out, const unsigned char *buf, size_t size, int cmdc, char *cmdv[]);
+int dtb_commands(const char *command, int argc, char *argv[]);
+void cleanup(boot_img *boot);
+int boot_batch(const char *manifest, int threads);
+
+// Thread pool
+void pool_start(int threads);
+void pool_stop();
+int pool_active();
+void pool_submit(task_group *g, void (*fn)(void *), void *arg);
+int pool_wait(task_group *g);
+int pool_try(void (*fn)(void *), void *arg);
 
 // Compressions
-void gzip(int mode, const char* filename, const unsigned char* buf, size_t size);
-void lzma(int mode, const char* filename, const unsigned char* buf, size_t size);
-void lz4(int mode, const char* filename, const unsigned char* buf, size_t size);
-void bzip2(int mode, const char* filename, const unsigned char* buf, size_t size);
-void lz4_legacy(int mode, const char* filename, const unsigned char* buf, size_t size);
+int codec_init(codec_t *c, file_t type, int mode, sink_t *out);
+void comp_opt_parse(comp_opt *opt, const char *opts);
+const comp_opt *comp_opt_arg(comp_opt *opt, const char *arg);
+int comp_sink(file_t type, const comp_opt *opt, sink_t *out, const unsigned char *from, size_t size);
+int decomp_sink(file_t type, sink_t *out, const unsigned char *from, size_t size);
 int comp(file_t type, const char *to, const unsigned char *from, size_t size);
+int comp_opts(file_t type, const comp_opt *opt, const char *to, const unsigned char *from, size_t size);
 void comp_file(const char *method, const char *from, const char *to);
 int decomp(file_t type, const char *to, const unsigned char *from, size_t size);
 void decomp_file(char *from, const char *to);
@@ -89,5 +195,17 @@ void write_zero(int fd, size_t size);
 void mem_align(size_t *pos, size_t align);
 void file_align(int fd, size_t align, int out);
 int open_new(const char *filename);
+const char *boot_path(boot_img *boot, const char *name, char *path);
+void fd_sink(sink_t *s, int fd);
+void mem_sink(sink_t *s);
+void null_sink(sink_t *s);
+void buf_sink(sink_t *s, int fd);
+void sink_flush(sink_t *s);
+void sink_free(sink_t *s);
+void sink_zero(sink_t *s, size_t size);
+void sink_align(sink_t *s, size_t align);
+void digest_init(digest_t *d, int sha256);
+void digest_update(digest_t *d, const unsigned char *buf, size_t size);
+void digest_hex(digest_t *d, char *hex, int compat);
 
 #endif
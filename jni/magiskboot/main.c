@@ -1,23 +1,64 @@
 #include "magiskboot.h"
 
+static void hash_file(const char *file, int sha256) {
+	unsigned char *buf;
+	char hex[DIGEST_HEX_SIZE];
+	size_t size, n;
+	digest_t d;
+	mmap_ro(file, &buf, &size);
+	madvise(buf, size, MADV_SEQUENTIAL);
+	digest_init(&d, sha256);
+	for (size_t off = 0; off < size; off += n) {
+		n = size - off > HASH_CHUNK ? HASH_CHUNK : size - off;
+		digest_update(&d, buf + off, n);
+	}
+	munmap(buf, size);
+	digest_hex(&d, hex, 1);
+	fprintf(stderr, "%s\n", hex);
+}
+
 /********************
   Patch Boot Image
 *********************/
 
 static void usage(char *arg0) {
 	fprintf(stderr,
-		"%s --unpack <bootimg>\n"
+		"%s --unpack[=sha1|sha256] <bootimg>\n"
 		"  Unpack <bootimg> to kernel, ramdisk.cpio, (second), (dtb) into the\n  current directory\n"
+		"  With =sha1 or =sha256, also print the digests of the image and of each\n"
+		"  section (the ramdisk both compressed and decompressed), computed while\n"
+		"  unpacking; the image digest is the same as --sha1 or --sha256\n"
 		"\n"
-		"%s --repack <origbootimg> [outbootimg]\n"
+		"%s --repack[=options] <origbootimg> [outbootimg]\n"
 		"  Repack kernel, ramdisk.cpio[.ext], second, dtb... from current directory\n"
 		"  to [outbootimg], or new-boot.img if not specified.\n"
 		"  It will compress ramdisk.cpio with the same method used in <origbootimg>\n"
 		"  if exists, or attempt to find ramdisk.cpio.[ext], and repack\n"
 		"  directly with the compressed ramdisk file\n"
+		"  [options] are the compression options of --compress, plus:\n"
+		"    fast: use the fastest level\n"
+		"    fit[=size]: use the lowest level for the image to fit into [size]\n"
+		"    bytes (k/m suffixes allowed), default: the size of <origbootimg>\n"
+		"\n"
+		"%s --patch-image[=options] <origbootimg> <outbootimg> [\"<cmd> [params...]\"...]\n"
+		"  Repack <origbootimg> to <outbootimg> in a single pass, running each cpio\n"
+		"  <cmd> (same as --cpio-<cmd> without <incpio>) on the ramdisk in memory\n"
+		"  e.g. \"patch false false\" \"add 750 init.magisk.rc init.magisk.rc\"\n"
+		"  [options] are the same as --repack\n"
+		"\n"
+		"%s --batch[=threads] <manifest>\n"
+		"  Run the commands of <manifest> concurrently on [threads] threads\n"
+		"  (default: all CPUs), one per line: <dir> <cmd> [params...]\n"
+		"  <cmd> is unpack[=...], repack[=...], patch-image[=...] or cleanup, with the\n"
+		"  params of --<cmd>, run as if in <dir>: the sections are unpacked into and\n"
+		"  repacked from there, and the messages go to <dir>/" BATCH_LOG ". Other paths\n"
+		"  are still relative to the current directory. Lines with the same <dir> run\n"
+		"  one after another in manifest order and share its log. \"Quote\" params with\n"
+		"  spaces; # starts a comment. Returns 1 if a command failed\n"
 		"\n"
-		"%s --hexpatch <file> <hexpattern1> <hexpattern2>\n"
-		"  Search <hexpattern1> in <file>, and replace with <hexpattern2>\n"
+		"%s --hexpatch <file> <hexpattern1> <hexpattern2> [<hexpattern1> <hexpattern2>...]\n"
+		"  Search each <hexpattern1> in <file>, and replace with its <hexpattern2>\n"
+		"  All pairs are done in a single pass, earlier pairs win at the same offset\n"
 		"\n"
 		"%s --cpio-<cmd> <incpio> [flags...] [params...]\n"
 		"  Do cpio related cmds to <incpio> (modifications are done directly)\n  Supported commands:\n"
@@ -26,13 +67,32 @@ static void usage(char *arg0) {
 		"  --cpio-add <incpio> <mode> <entry> <infile>\n    Add <infile> as an <entry>; replaces <entry> if already exists\n"
 		"  --cpio-extract <incpio> <entry> <outfile>\n    Extract <entry> to <outfile>\n"
 		"  --cpio-test <incpio>\n    Return value: 0/not patched 1/Magisk 2/Other (e.g. phh, SuperSU)\n"
+		"    test and extract also take a compressed cpio or a boot image as <incpio>,\n"
+		"    which is decompressed only as far as needed\n"
 		"  --cpio-patch <KEEPVERITY> <KEEPFORCEENCRYPT>\n    Patch cpio for Magisk. KEEP**** are true/false values\n"
 		"  --cpio-backup <incpio> <origcpio>\n    Create ramdisk backups into <incpio> from <origcpio>\n"
 		"  --cpio-restore <incpio>\n    Restore ramdisk from ramdisk backup within <incpio>\n"
+		"  --cpio-batch <incpio> [-n] [-f <script>] [-c \"<cmd> [params...]\"]...\n"
+		"    Run all <cmd> from -c and <script> (one per line, # for comments) in order,\n"
+		"    and write <incpio> only once. Flag -n for a dry run: report changes only\n"
 		"\n"
-		"%s --compress[=method] <infile> [outfile]\n"
-		"  Compress <infile> with [method] (default: gzip), optionally to [outfile]\n  Supported methods: "
-	, arg0, arg0, arg0, arg0, arg0);
+		"%s --dtb-<cmd> <file> [params...]\n"
+		"  Do dtb related cmds to every DTB in <file> (a dtb, a kernel with appended DTBs,\n"
+		"  or a whole image; modifications are done directly)\n  Supported commands:\n"
+		"  --dtb-print <file>\n    Print the fstab entries of all DTBs\n"
+		"  --dtb-patch <file> <KEEPVERITY> <KEEPFORCEENCRYPT>\n    Patch the fstab flags like --cpio-patch\n"
+		"\n"
+		"%s --compress[=method[:options]] <infile> [outfile]\n"
+		"  Compress <infile> with [method] (default: gzip), optionally to [outfile]\n"
+		"  [options] are comma separated:\n"
+		"    threads=N: compress blocks in parallel with N threads (0: all CPUs),\n"
+		"    available for gzip, xz, bzip2, lz4 and lz4_legacy\n"
+		"    level=N: 1-9, or 1-12 for lz4 and lz4_legacy (3 and above use lz4hc)\n"
+		"    strategy=default|filtered|huffman|rle|fixed: gzip strategy\n"
+		"    dict=size: xz and lzma dictionary size (k/m suffixes allowed)\n"
+		"    fast, fit=size: same as --repack\n"
+		"  Supported methods: "
+	, arg0, arg0, arg0, arg0, arg0, arg0, arg0, arg0);
 	for (int i = 0; SUP_LIST[i]; ++i)
 		fprintf(stderr, "%s ", SUP_LIST[i]);
 	fprintf(stderr,
@@ -49,32 +109,48 @@ static void usage(char *arg0) {
 		"%s --sha1 <file>\n"
 		"  Print the SHA1 checksum for <file>\n"
 		"\n"
+		"%s --sha256 <file>\n"
+		"  Print the SHA256 checksum for <file>\n"
+		"\n"
 		"%s --cleanup\n"
 		"  Cleanup the current working directory\n"
 		"\n"
-	, arg0, arg0);
+	, arg0, arg0, arg0);
 
 	exit(1);
 }
 
+#ifdef XWRAP_STATS
+static void dump_xwrap() {
+	fflush(stderr);
+	xwrap_dump(STDERR_FILENO);
+}
+#endif
+
 int main(int argc, char *argv[]) {
+	boot_img boot = { 0 };
+	comp_opt opt;
 	fprintf(stderr, "MagiskBoot v" xstr(MAGISK_VERSION) "(" xstr(MAGISK_VER_CODE) ") (by topjohnwu) - Boot Image Modification Tool\n\n");
+#ifdef XWRAP_STATS
+	// Also on errors, LOGE exits
+	atexit(dump_xwrap);
+#endif
 
 	if (argc > 1 && strcmp(argv[1], "--cleanup") == 0) {
-		cleanup();
+		cleanup(&boot);
 	} else if (argc > 2 && strcmp(argv[1], "--sha1") == 0) {
-		char sha1[21], *buf;
-		size_t size;
-		mmap_ro(argv[2], (unsigned char **) &buf, &size);
-		SHA1(sha1, buf, size);
-		for (int i = 0; i < 20; ++i)
-			fprintf(stderr, "%02x", sha1[i]);
-		fprintf(stderr, "\n");
-		munmap(buf, size);
+		hash_file(argv[2], 0);
+	} else if (argc > 2 && strcmp(argv[1], "--sha256") == 0) {
+		hash_file(argv[2], 1);
 	} else if (argc > 2 && strcmp(argv[1], "--unpack") == 0) {
-		unpack(argv[2]);
-	} else if (argc > 2 && strcmp(argv[1], "--repack") == 0) {
-		repack(argv[2], argc > 3 ? argv[3] : NEW_BOOT);
+		return unpack(&boot, argv[2], 0);
+	} else if (argc > 2 && strcmp(argv[1], "--unpack=sha1") == 0) {
+		return unpack(&boot, argv[2], 1);
+	} else if (argc > 2 && strcmp(argv[1], "--unpack=sha256") == 0) {
+		return unpack(&boot, argv[2], 2);
+	} else if (argc > 2 && strncmp(argv[1], "--repack", 8) == 0 &&
+		(argv[1][8] == '\0' || argv[1][8] == '=')) {
+		repack(&boot, argv[2], argc > 3 ? argv[3] : NEW_BOOT, comp_opt_arg(&opt, argv[1] + 8));
 	} else if (argc > 2 && strcmp(argv[1], "--decompress") == 0) {
 		decomp_file(argv[2], argc > 3 ? argv[3] : NULL);
 	} else if (argc > 2 && strncmp(argv[1], "--compress", 10) == 0) {
@@ -83,8 +159,17 @@ int main(int argc, char *argv[]) {
 		if (method == NULL) method = "gzip";
 		else method++;
 		comp_file(method, argv[2], argc > 3 ? argv[3] : NULL);
-	} else if (argc > 4 && strcmp(argv[1], "--hexpatch") == 0) {
-		hexpatch(argv[2], argv[3], argv[4]);
+	} else if (argc > 3 && strncmp(argv[1], "--patch-image", 13) == 0 &&
+		(argv[1][13] == '\0' || argv[1][13] == '=')) {
+		return patch_image(&boot, argv[2], argv[3], comp_opt_arg(&opt, argv[1] + 13), argc - 4, argv + 4);
+	} else if (argc > 2 && (strcmp(argv[1], "--batch") == 0 || strncmp(argv[1], "--batch=", 8) == 0)) {
+		return boot_batch(argv[2], argv[1][7] ? atoi(argv[1] + 8) : 0);
+	} else if (argc > 4 && argc % 2 == 1 && strcmp(argv[1], "--hexpatch") == 0) {
+		hexpatch(argv[2], argc - 3, argv + 3);
+	} else if (argc > 2 && strncmp(argv[1], "--dtb-", 6) == 0) {
+		if (dtb_commands(argv[1] + 6, argc - 2, argv + 2)) usage(argv[0]);
+	} else if (argc > 2 && strcmp(argv[1], "--cpio-batch") == 0) {
+		if (cpio_batch(argc - 2, argv + 2)) usage(argv[0]);
 	} else if (argc > 2 && strncmp(argv[1], "--cpio", 6) == 0) {
 		char *command;
 		command = strchr(argv[1] + 2, '-');
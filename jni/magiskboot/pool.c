@@ -0,0 +1,201 @@
+/* pool.c - Work-stealing thread pool of --batch
+ *
+ * Every worker owns a deque of tasks. It pushes and pops its own tasks at the
+ * back, idle workers steal from the front of the others. A thread waiting for
+ * a task group runs queued sub-tasks meanwhile, so tasks can wait for their
+ * sub-tasks without tying up a worker. Errors of a task only fail that task.
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+
+#include "magiskboot.h"
+
+struct task {
+	void (*fn)(void *arg);
+	void *arg;
+	task_group *group;
+	FILE *log;          // Of the submitter, messages of the task go there too
+	int depth;          // 1 for tasks submitted outside of tasks
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct task *tasks; // Ring buffer
+	size_t head, tail, cap;
+};
+
+__thread FILE *boot_log;
+static __thread jmp_buf *err_jmp;
+static __thread int self;   // Index of the deque of this thread, the one of pool_start is 0
+static __thread int depth;  // Of the task running on this thread
+
+static struct deque *queues;
+static pthread_t *workers;
+static int nworkers, stopping;
+static unsigned events;     // Bumped on every submit and finished group, under idle_lock
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+void boot_error(int err) {
+	if (err_jmp)
+		longjmp(*err_jmp, err ? err : 1);
+	exit(err);
+}
+
+// Resources the failed function held are left behind
+int pool_try(void (*fn)(void *), void *arg) {
+	jmp_buf env, *prev = err_jmp;
+	FILE *log = boot_log;
+	int err = setjmp(env);
+	if (err == 0) {
+		err_jmp = &env;
+		fn(arg);
+	}
+	err_jmp = prev;
+	boot_log = log;
+	return err;
+}
+
+// Waiters may not be allowed to run the new task, wake everyone
+static void wake_all() {
+	pthread_mutex_lock(&idle_lock);
+	++events;
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+static unsigned last_event() {
+	pthread_mutex_lock(&idle_lock);
+	unsigned e = events;
+	pthread_mutex_unlock(&idle_lock);
+	return e;
+}
+
+// Sleep until something happened after event e, or g is done
+static void wait_event(unsigned e, task_group *g) {
+	pthread_mutex_lock(&idle_lock);
+	while (events == e && !stopping && (g == NULL || __atomic_load_n(&g->pending, __ATOMIC_SEQ_CST)))
+		pthread_cond_wait(&idle_cond, &idle_lock);
+	pthread_mutex_unlock(&idle_lock);
+}
+
+static void push(struct deque *q, struct task *t) {
+	pthread_mutex_lock(&q->lock);
+	if (q->tail - q->head == q->cap) {
+		struct task *tasks = xcalloc(q->cap ? q->cap * 2 : 16, sizeof(*tasks));
+		for (size_t i = q->head; i < q->tail; ++i)
+			tasks[i - q->head] = q->tasks[i % q->cap];
+		free(q->tasks);
+		q->tasks = tasks;
+		q->tail -= q->head;
+		q->head = 0;
+		q->cap = q->cap ? q->cap * 2 : 16;
+	}
+	q->tasks[q->tail++ % q->cap] = *t;
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Take a task deeper than min_depth from one end of q
+static int take(struct deque *q, struct task *t, int back, int min_depth) {
+	int found = 0;
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		*t = q->tasks[(back ? q->tail - 1 : q->head) % q->cap];
+		if ((found = t->depth > min_depth)) {
+			if (back)
+				--q->tail;
+			else
+				++q->head;
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+// Run one task, the newest of our own or the oldest of another worker.
+// Inside a task only sub-tasks are run, the stack never holds two jobs of the same level
+static int run_one() {
+	struct task t;
+	FILE *log = boot_log;
+	int prev = depth, found = take(&queues[self], &t, 1, depth);
+	for (int i = 1; !found && i < nworkers; ++i)
+		found = take(&queues[(self + i) % nworkers], &t, depth > 0, depth);
+	if (!found)
+		return 0;
+
+	boot_log = t.log;
+	depth = t.depth;
+	if (pool_try(t.fn, t.arg))
+		__atomic_add_fetch(&t.group->failed, 1, __ATOMIC_SEQ_CST);
+	depth = prev;
+	boot_log = log;
+	if (__atomic_sub_fetch(&t.group->pending, 1, __ATOMIC_SEQ_CST) == 0)
+		wake_all();
+	return 1;
+}
+
+static void *worker(void *arg) {
+	unsigned e;
+	self = (intptr_t) arg;
+	while (!__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+		e = last_event();
+		if (!run_one())
+			wait_event(e, NULL);
+	}
+	return NULL;
+}
+
+// threads <= 0 uses all CPUs, the calling thread is one of the workers
+void pool_start(int threads) {
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = threads;
+	stopping = 0;
+	self = 0;
+	queues = xcalloc(threads, sizeof(*queues));
+	workers = xcalloc(threads, sizeof(*workers));
+	for (int i = 0; i < threads; ++i)
+		pthread_mutex_init(&queues[i].lock, NULL);
+	for (int i = 1; i < threads; ++i)
+		xpthread_create(&workers[i], NULL, worker, (void *) (intptr_t) i);
+}
+
+// All groups must have been waited for
+void pool_stop() {
+	__atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+	wake_all();
+	for (int i = 1; i < nworkers; ++i)
+		pthread_join(workers[i], NULL);
+	for (int i = 0; i < nworkers; ++i) {
+		pthread_mutex_destroy(&queues[i].lock);
+		free(queues[i].tasks);
+	}
+	free(queues);
+	free(workers);
+	queues = NULL;
+	nworkers = 0;
+}
+
+int pool_active() {
+	return nworkers > 0;
+}
+
+void pool_submit(task_group *g, void (*fn)(void *), void *arg) {
+	struct task t = { fn, arg, g, boot_log, depth + 1 };
+	__atomic_add_fetch(&g->pending, 1, __ATOMIC_SEQ_CST);
+	push(&queues[self], &t);
+	wake_all();
+}
+
+// Run tasks until all of g are done, returns how many of them failed
+int pool_wait(task_group *g) {
+	unsigned e;
+	while (__atomic_load_n(&g->pending, __ATOMIC_SEQ_CST)) {
+		e = last_event();
+		// Nothing we may run, the rest of g is running on other workers
+		if (!run_one())
+			wait_event(e, g);
+	}
+	return g->failed;
+}
@@ -24,6 +24,7 @@ A million repetitions of "a"
 #include <stdint.h>
 
 #include "sha1.h"
+#include "sha_hw.h"
 
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -177,6 +178,24 @@ void SHA1Transform(
 }
 
 
+/* Hash whole blocks, with the CPU SHA instructions if there are any */
+
+static void SHA1Blocks(
+    uint32_t state[5],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    sha_blocks_t hw = sha1_hw_blocks();
+
+    if (hw)
+        hw(state, data, blocks);
+    else
+        for (; blocks; --blocks, data += 64)
+            SHA1Transform(state, data);
+}
+
+
 /* SHA1Init - Initialize new context */
 
 void SHA1Init(
@@ -214,10 +233,8 @@ void SHA1Update(
     {
         memcpy(&context->buffer[j], data, (i = 64 - j));
         SHA1Transform(context->state, context->buffer);
-        for (; i + 63 < len; i += 64)
-        {
-            SHA1Transform(context->state, &data[i]);
-        }
+        SHA1Blocks(context->state, &data[i], (len - i) / 64);
+        i += (len - i) & ~63;
         j = 0;
     }
     else
@@ -285,11 +302,9 @@ void SHA1(
     int len)
 {
     SHA1_CTX ctx;
-    unsigned int ii;
 
     SHA1Init(&ctx);
-    for (ii=0; ii<len; ii+=1)
-        SHA1Update(&ctx, (const unsigned char*)str + ii, 1);
+    SHA1Update(&ctx, (const unsigned char*)str, len);
     SHA1Final((unsigned char *)hash_out, &ctx);
     hash_out[20] = '\0';
 }
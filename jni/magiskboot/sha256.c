@@ -0,0 +1,202 @@
+/*
+SHA-256 in C, same interface as sha1.c
+
+Test Vectors (from FIPS PUB 180-2)
+"abc"
+  BA7816BF 8F01CFEA 414140DE 5DAE2223 B00361A3 96177A9C B410FF61 F20015AD
+"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+  248D6A61 D20638B8 E5C02693 0C3E6039 A33CE459 64FF2167 F6ECEDD4 19DB06C1
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+/* for uint32_t */
+#include <stdint.h>
+
+#include "sha256.h"
+#include "sha_hw.h"
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+#define S0(x) (ror(x, 2) ^ ror(x, 13) ^ ror(x, 22))
+#define S1(x) (ror(x, 6) ^ ror(x, 11) ^ ror(x, 25))
+#define s0(x) (ror(x, 7) ^ ror(x, 18) ^ ((x) >> 3))
+#define s1(x) (ror(x, 17) ^ ror(x, 19) ^ ((x) >> 10))
+#define Ch(x,y,z) (((x) & ((y) ^ (z))) ^ (z))
+#define Maj(x,y,z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+
+/* Hash a single 512-bit block. This is the core of the algorithm. */
+
+void SHA256Transform(
+    uint32_t state[8],
+    const unsigned char buffer[64]
+)
+{
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    uint32_t w[64];
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t) buffer[i * 4] << 24) | ((uint32_t) buffer[i * 4 + 1] << 16)
+            | ((uint32_t) buffer[i * 4 + 2] << 8) | buffer[i * 4 + 3];
+    }
+    for (; i < 64; i++)
+    {
+        w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+    }
+    /* Copy context->state[] to working vars */
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+    for (i = 0; i < 64; i++)
+    {
+        t1 = h + S1(e) + Ch(e, f, g) + SHA256_K[i] + w[i];
+        t2 = S0(a) + Maj(a, b, c);
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    /* Add the working vars back into context.state[] */
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+
+/* Hash whole blocks, with the CPU SHA instructions if there are any */
+
+static void SHA256Blocks(
+    uint32_t state[8],
+    const unsigned char *data,
+    size_t blocks
+)
+{
+    sha_blocks_t hw = sha256_hw_blocks();
+
+    if (hw)
+        hw(state, data, blocks);
+    else
+        for (; blocks; --blocks, data += 64)
+            SHA256Transform(state, data);
+}
+
+
+/* SHA256Init - Initialize new context */
+
+void SHA256Init(
+    SHA256_CTX * context
+)
+{
+    /* SHA256 initialization constants */
+    context->state[0] = 0x6a09e667;
+    context->state[1] = 0xbb67ae85;
+    context->state[2] = 0x3c6ef372;
+    context->state[3] = 0xa54ff53a;
+    context->state[4] = 0x510e527f;
+    context->state[5] = 0x9b05688c;
+    context->state[6] = 0x1f83d9ab;
+    context->state[7] = 0x5be0cd19;
+    context->count = 0;
+}
+
+
+/* Run your data through this. */
+
+void SHA256Update(
+    SHA256_CTX * context,
+    const unsigned char *data,
+    uint32_t len
+)
+{
+    uint32_t i = 0, j;
+
+    j = context->count & 63;
+    context->count += len;
+    if (j)
+    {
+        i = 64 - j;
+        if (i > len)
+            i = len;
+        memcpy(&context->buffer[j], data, i);
+        if (j + i < 64)
+            return;
+        SHA256Transform(context->state, context->buffer);
+    }
+    SHA256Blocks(context->state, &data[i], (len - i) / 64);
+    i += (len - i) & ~63;
+    memcpy(context->buffer, &data[i], len - i);
+}
+
+
+/* Add padding and return the message digest. */
+
+void SHA256Final(
+    unsigned char digest[32],
+    SHA256_CTX * context
+)
+{
+    unsigned i;
+
+    unsigned char finalcount[8];
+
+    unsigned char pad[64] = { 0200 };
+
+    uint64_t bits = context->count << 3;
+
+    for (i = 0; i < 8; i++)
+    {
+        finalcount[i] = (unsigned char) (bits >> ((7 - i) * 8));
+    }
+    /* Pad to 56 bytes mod 64, then append the bit count */
+    SHA256Update(context, pad, ((context->count & 63) < 56 ? 56 : 120) - (context->count & 63));
+    SHA256Update(context, finalcount, 8);
+    for (i = 0; i < 32; i++)
+    {
+        digest[i] = (unsigned char)
+            ((context->state[i >> 2] >> ((3 - (i & 3)) * 8)) & 255);
+    }
+    /* Wipe variables */
+    memset(context, '\0', sizeof(*context));
+}
+
+void SHA256(
+    char *hash_out,
+    const char *str,
+    int len)
+{
+    SHA256_CTX ctx;
+
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, (const unsigned char*)str, len);
+    SHA256Final((unsigned char *)hash_out, &ctx);
+    hash_out[32] = '\0';
+}
@@ -0,0 +1,44 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+/*
+   SHA-256 in C, same interface as sha1.h
+ */
+
+#include "stdint.h"
+
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t count;
+    unsigned char buffer[64];
+} SHA256_CTX;
+
+extern const uint32_t SHA256_K[64];
+
+void SHA256Transform(
+    uint32_t state[8],
+    const unsigned char buffer[64]
+    );
+
+void SHA256Init(
+    SHA256_CTX * context
+    );
+
+void SHA256Update(
+    SHA256_CTX * context,
+    const unsigned char *data,
+    uint32_t len
+    );
+
+void SHA256Final(
+    unsigned char digest[32],
+    SHA256_CTX * context
+    );
+
+void SHA256(
+    char *hash_out,
+    const char *str,
+    int len);
+
+#endif /* SHA256_H */
@@ -0,0 +1,269 @@
+/* sha_hw.c - SHA-1 and SHA-256 block functions on CPU SHA extensions
+ *
+ * x86 and x86_64 kernels are compiled with target attributes and only used when
+ * CPUID reports SHA-NI. arm64 kernels need the Crypto Extensions enabled at compile
+ * time (-march=armv8-a+crypto, see Android.mk) and are picked with the HWCAP bits.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha_hw.h"
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+#define SHA_HW_ARM
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+
+static int probed = 0, enabled = 1;
+static sha_blocks_t hw_sha1 = NULL, hw_sha256 = NULL;
+static const char *hw_name = "none";
+
+#ifdef SHA_HW_X86
+
+#define SHA_NI __attribute__((target("sha,sse4.1,ssse3")))
+
+#define SHA1_NI_ROUNDS(e0, e1, m, f) \
+	e0 = _mm_sha1nexte_epu32(e0, m); \
+	e1 = abcd; \
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, f);
+
+// Rounds on m, while expanding the message for the next groups
+#define SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, f) \
+	SHA1_NI_ROUNDS(e0, e1, m0, f) \
+	m1 = _mm_sha1msg2_epu32(m1, m0); \
+	m3 = _mm_sha1msg1_epu32(m3, m0); \
+	m2 = _mm_xor_si128(m2, m0);
+
+SHA_NI static void sha1_ni(uint32_t *state, const unsigned char *data, size_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e0_save, e1, m0, m1, m2, m3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; blocks; --blocks, data += 64) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), mask);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), mask);
+		SHA1_NI_ROUNDS(e1, e0, m1, 0)
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), mask);
+		SHA1_NI_ROUNDS(e0, e1, m2, 0)
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), mask);
+		SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 0)
+
+		SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 0)
+		SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 1)
+		SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 1)
+		SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 1)
+		SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 1)
+		SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 1)
+		SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 2)
+		SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 2)
+		SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 2)
+		SHA1_NI_STEP(e1, e0, m1, m2, m3, m0, 2)
+		SHA1_NI_STEP(e0, e1, m2, m3, m0, m1, 2)
+		SHA1_NI_STEP(e1, e0, m3, m0, m1, m2, 3)
+		SHA1_NI_STEP(e0, e1, m0, m1, m2, m3, 3)
+
+		SHA1_NI_ROUNDS(e1, e0, m1, 3)
+		m2 = _mm_sha1msg2_epu32(m2, m1);
+		m3 = _mm_xor_si128(m3, m1);
+		SHA1_NI_ROUNDS(e0, e1, m2, 3)
+		m3 = _mm_sha1msg2_epu32(m3, m2);
+		SHA1_NI_ROUNDS(e1, e0, m3, 3)
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+SHA_NI static void sha256_ni(uint32_t *state, const unsigned char *data, size_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i s0, s1, save0, save1, tmp, msg, m[4];
+
+	// Reorder the state to ABEF and CDGH
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0xB1);
+	s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (state + 4)), 0x1B);
+	s0 = _mm_alignr_epi8(tmp, s1, 8);
+	s1 = _mm_blend_epi16(s1, tmp, 0xF0);
+
+	for (; blocks; --blocks, data += 64) {
+		save0 = s0;
+		save1 = s1;
+		for (int g = 0; g < 16; ++g) {
+			if (g < 4)
+				m[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + g * 16)), mask);
+			msg = _mm_add_epi32(m[g & 3], _mm_loadu_si128((const __m128i *) (SHA256_K + g * 4)));
+			s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+			s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+			if (g >= 3 && g < 15)
+				m[(g + 1) & 3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(m[(g + 1) & 3], _mm_alignr_epi8(m[g & 3], m[(g - 1) & 3], 4)), m[g & 3]);
+			if (g >= 1 && g < 13)
+				m[(g - 1) & 3] = _mm_sha256msg1_epu32(m[(g - 1) & 3], m[g & 3]);
+		}
+		s0 = _mm_add_epi32(s0, save0);
+		s1 = _mm_add_epi32(s1, save1);
+	}
+
+	// Back to ABCD and EFGH
+	tmp = _mm_shuffle_epi32(s0, 0x1B);
+	s1 = _mm_shuffle_epi32(s1, 0xB1);
+	_mm_storeu_si128((__m128i *) state, _mm_blend_epi16(tmp, s1, 0xF0));
+	_mm_storeu_si128((__m128i *) (state + 4), _mm_alignr_epi8(s1, tmp, 8));
+}
+
+static void sha_probe() {
+	unsigned a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3) || !(c & bit_SSE4_1))
+		return;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return;
+	__cpuid_count(7, 0, a, b, c, d);
+	// EBX bit 29: SHA extensions
+	if (b & (1 << 29)) {
+		hw_sha1 = sha1_ni;
+		hw_sha256 = sha256_ni;
+		hw_name = "sha-ni";
+	}
+}
+
+#elif defined(SHA_HW_ARM)
+
+static const uint32_t sha1_k[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+
+static void sha1_ce(uint32_t *state, const unsigned char *data, size_t blocks) {
+	uint32x4_t abcd, abcd_save, tmp, w[4];
+	uint32_t e, e_save, e_next;
+
+	abcd = vld1q_u32(state);
+	e = state[4];
+
+	for (; blocks; --blocks, data += 64) {
+		abcd_save = abcd;
+		e_save = e;
+		for (int i = 0; i < 4; ++i)
+			w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+		// 20 groups of 4 rounds, w[g & 3] holds the message words of group g
+		for (int g = 0; g < 20; ++g) {
+			if (g >= 4)
+				w[g & 3] = vsha1su1q_u32(vsha1su0q_u32(w[g & 3], w[(g + 1) & 3], w[(g + 2) & 3]), w[(g + 3) & 3]);
+			tmp = vaddq_u32(w[g & 3], vdupq_n_u32(sha1_k[g / 5]));
+			e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+			switch (g / 5) {
+			case 0:
+				abcd = vsha1cq_u32(abcd, e, tmp);
+				break;
+			case 2:
+				abcd = vsha1mq_u32(abcd, e, tmp);
+				break;
+			default:
+				abcd = vsha1pq_u32(abcd, e, tmp);
+				break;
+			}
+			e = e_next;
+		}
+		abcd = vaddq_u32(abcd, abcd_save);
+		e += e_save;
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e;
+}
+
+static void sha256_ce(uint32_t *state, const unsigned char *data, size_t blocks) {
+	uint32x4_t s0, s1, save0, save1, tmp, prev, w[4];
+
+	s0 = vld1q_u32(state);
+	s1 = vld1q_u32(state + 4);
+
+	for (; blocks; --blocks, data += 64) {
+		save0 = s0;
+		save1 = s1;
+		for (int i = 0; i < 4; ++i)
+			w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+		for (int g = 0; g < 16; ++g) {
+			if (g >= 4)
+				w[g & 3] = vsha256su1q_u32(vsha256su0q_u32(w[g & 3], w[(g + 1) & 3]), w[(g + 2) & 3], w[(g + 3) & 3]);
+			tmp = vaddq_u32(w[g & 3], vld1q_u32(SHA256_K + g * 4));
+			prev = s0;
+			s0 = vsha256hq_u32(s0, s1, tmp);
+			s1 = vsha256h2q_u32(s1, prev, tmp);
+		}
+		s0 = vaddq_u32(s0, save0);
+		s1 = vaddq_u32(s1, save1);
+	}
+
+	vst1q_u32(state, s0);
+	vst1q_u32(state + 4, s1);
+}
+
+static void sha_probe() {
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	if (hwcap & HWCAP_SHA1)
+		hw_sha1 = sha1_ce;
+	if (hwcap & HWCAP_SHA2)
+		hw_sha256 = sha256_ce;
+	if (hw_sha1 || hw_sha256)
+		hw_name = "armv8-ce";
+}
+
+#else
+
+static void sha_probe() {}
+
+#endif
+
+// Racing threads all store the same results
+static void sha_hw_init() {
+	if (!probed) {
+		sha_probe();
+		probed = 1;
+	}
+}
+
+sha_blocks_t sha1_hw_blocks() {
+	sha_hw_init();
+	return enabled ? hw_sha1 : NULL;
+}
+
+sha_blocks_t sha256_hw_blocks() {
+	sha_hw_init();
+	return enabled ? hw_sha256 : NULL;
+}
+
+const char *sha_hw_name() {
+	sha_hw_init();
+	return enabled ? hw_name : "none";
+}
+
+void sha_hw_enable(int enable) {
+	enabled = enable;
+}
@@ -0,0 +1,20 @@
+#ifndef SHA_HW_H
+#define SHA_HW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compress whole 64 byte blocks into the state
+typedef void (*sha_blocks_t)(uint32_t *state, const unsigned char *data, size_t blocks);
+
+// Kernels using ARMv8 Crypto Extensions or x86 SHA-NI, NULL if the CPU has none
+sha_blocks_t sha1_hw_blocks();
+sha_blocks_t sha256_hw_blocks();
+
+// Name of the instruction set in use, "none" when falling back to portable C
+const char *sha_hw_name();
+
+// Force the portable code (e.g. for benchmarks), or switch back to detection
+void sha_hw_enable(int enable);
+
+#endif
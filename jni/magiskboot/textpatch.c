@@ -0,0 +1,236 @@
+/* textpatch.c - Rule driven rewriting of text entries (init.rc, fstab)
+ *
+ * The patterns of all rules go into one Aho-Corasick automaton, so every byte
+ * of the input is looked at once, however many rules there are. A line is
+ * scanned first, then dropped, or copied with its replacements into an output
+ * buffer sized for the worst case up front.
+ */
+
+#include "magiskboot.h"
+#include "textpatch.h"
+
+// Pattern ids: 2 * rule for the pattern, 2 * rule + 1 for unless
+struct text_patcher {
+	text_rule *rules;
+	int num;
+	int (*next)[256];   // Complete transitions, 0 is the root
+	int *out;           // Longest pattern ending in the state, or -1
+	int *link;          // Closest state on the failure chain with an out, 0 if none
+	int *same;          // Next pattern id with the same string, or -1
+	int *len;
+	int states, cap;
+	size_t grow;        // Most bytes a replacement adds
+	size_t min_len;     // Shortest replaced pattern
+	size_t insert;      // Bytes of all inserted lines
+};
+
+struct text_token {
+	size_t start, end;
+	int rule;
+};
+
+static int new_state(text_patcher *p) {
+	if (p->states == p->cap) {
+		p->cap = p->cap ? p->cap * 2 : 64;
+		p->next = xrealloc(p->next, p->cap * sizeof(*p->next));
+		p->out = xrealloc(p->out, p->cap * sizeof(int));
+		p->link = xrealloc(p->link, p->cap * sizeof(int));
+	}
+	memset(p->next[p->states], 0, sizeof(*p->next));
+	p->out[p->states] = -1;
+	p->link[p->states] = 0;
+	return p->states++;
+}
+
+static void add_pattern(text_patcher *p, const char *pattern, int id) {
+	int s = 0, t;
+	p->len[id] = strlen(pattern);
+	for (const unsigned char *c = (const unsigned char *) pattern; *c; ++c) {
+		// new_state() may move p->next
+		if (p->next[s][*c] == 0) {
+			t = new_state(p);
+			p->next[s][*c] = t;
+		}
+		s = p->next[s][*c];
+	}
+	if (p->out[s] < 0) {
+		p->out[s] = id;
+	} else {
+		p->same[id] = p->same[p->out[s]];
+		p->same[p->out[s]] = id;
+	}
+}
+
+// Breadth first, the failure state of a state is always done before it
+static void build(text_patcher *p) {
+	int *queue = xmalloc(p->states * sizeof(int)), *fail = xcalloc(p->states, sizeof(int));
+	int head = 0, tail = 0, s, t, f;
+	for (int c = 0; c < 256; ++c) {
+		if ((t = p->next[0][c]))
+			queue[tail++] = t;
+	}
+	while (head < tail) {
+		s = queue[head++];
+		f = fail[s];
+		p->link[s] = p->out[f] >= 0 ? f : p->link[f];
+		// Nothing ends here, take the longest match of the failure chain
+		if (p->out[s] < 0 && p->link[s]) {
+			p->out[s] = p->out[p->link[s]];
+			p->link[s] = p->link[p->link[s]];
+		}
+		for (int c = 0; c < 256; ++c) {
+			if ((t = p->next[s][c])) {
+				fail[t] = p->next[f][c];
+				queue[tail++] = t;
+			} else {
+				p->next[s][c] = p->next[f][c];
+			}
+		}
+	}
+	free(queue);
+	free(fail);
+}
+
+text_patcher *text_patcher_new(const text_rule *rules, int num) {
+	text_patcher *p = xcalloc(1, sizeof(*p));
+	size_t len;
+	p->num = num;
+	p->rules = xmalloc(num * sizeof(text_rule) + 1);
+	memcpy(p->rules, rules, num * sizeof(text_rule));
+	p->same = xmalloc(2 * num * sizeof(int) + 1);
+	memset(p->same, 0xff, 2 * num * sizeof(int));
+	p->len = xcalloc(2 * num + 1, sizeof(int));
+	p->min_len = SIZE_MAX;
+	new_state(p);
+	for (int i = 0; i < num; ++i) {
+		add_pattern(p, rules[i].pattern, 2 * i);
+		if (rules[i].type == TEXT_INSERT) {
+			p->insert += strlen(rules[i].text) + 1;
+			if (rules[i].unless)
+				add_pattern(p, rules[i].unless, 2 * i + 1);
+		} else if (rules[i].type == TEXT_REPLACE) {
+			len = strlen(rules[i].pattern);
+			if (len < p->min_len)
+				p->min_len = len;
+			if (strlen(rules[i].text) > len + p->grow)
+				p->grow = strlen(rules[i].text) - len;
+		}
+	}
+	build(p);
+	return p;
+}
+
+void text_patcher_free(text_patcher *p) {
+	free(p->rules);
+	free(p->next);
+	free(p->out);
+	free(p->link);
+	free(p->same);
+	free(p->len);
+	free(p);
+}
+
+static void put(char *out, size_t *pos, const void *buf, size_t len) {
+	memcpy(out + *pos, buf, len);
+	*pos += len;
+}
+
+char *text_patch(const text_patcher *p, const char *name, const char *data, size_t size, size_t *out_size) {
+	const unsigned char *d = (const unsigned char *) data;
+	struct text_token *tokens = NULL;
+	size_t ntok, tok_cap = 0, line = 0, end, done, pos = 0, run;
+	// Per pattern id, the last line it was seen on
+	size_t *seen = xcalloc(2 * p->num + 1, sizeof(size_t));
+	char *inserted = xcalloc(p->num + 1, 1);
+	char *out = xmalloc(size + p->insert + (p->grow ? (size / p->min_len + 1) * p->grow : 0) + 1);
+	int s, id, removed, changed = 0;
+	const text_rule *r;
+
+	for (size_t begin = 0; begin < size; begin = end + 1) {
+		const unsigned char *nl = memchr(d + begin, '\n', size - begin);
+		end = nl ? nl - d : size;
+		++line;
+		ntok = 0;
+		done = begin;
+		s = 0;
+		for (size_t i = begin; i < end; ++i) {
+			s = p->next[s][d[i]];
+			for (int st = s; st; st = p->link[st]) {
+				for (id = p->out[st]; id >= 0; id = p->same[id]) {
+					r = &p->rules[id / 2];
+					if ((id & 1) || r->type != TEXT_REPLACE) {
+						seen[id] = line;
+						continue;
+					}
+					// The longest match comes first, none may overlap a replaced one
+					if (i + 1 - p->len[id] < done)
+						continue;
+					if (ntok == tok_cap) {
+						tok_cap = tok_cap ? tok_cap * 2 : 16;
+						tokens = xrealloc(tokens, tok_cap * sizeof(*tokens));
+					}
+					tokens[ntok].start = i + 1 - p->len[id];
+					tokens[ntok].end = i + 1;
+					tokens[ntok].rule = id / 2;
+					if ((r->flags & TEXT_VALUE) && i + 1 < end && d[i + 1] == '=') {
+						while (tokens[ntok].end < end && d[tokens[ntok].end] != ' ' && d[tokens[ntok].end] != ',')
+							++tokens[ntok].end;
+					}
+					done = tokens[ntok++].end;
+				}
+			}
+		}
+
+		removed = 0;
+		for (int k = 0; k < p->num; ++k) {
+			r = &p->rules[k];
+			if (seen[2 * k] != line)
+				continue;
+			if (r->type == TEXT_REMOVE) {
+				removed = 1;
+			} else if (r->type == TEXT_INSERT && !inserted[k]) {
+				inserted[k] = 1;
+				if (r->unless && seen[2 * k + 1] == line)
+					continue;
+				fprintf(LOG_FILE, "Inject new line [%s] in [%s]\n", r->text, name);
+				put(out, &pos, r->text, strlen(r->text));
+				out[pos++] = '\n';
+				changed = 1;
+			}
+		}
+		if (removed) {
+			fprintf(LOG_FILE, "Remove line [%.*s] in [%s]\n", (int) (end - begin), data + begin, name);
+			changed = 1;
+			continue;
+		}
+
+		run = begin;
+		for (size_t k = 0; k < ntok; ++k) {
+			r = &p->rules[tokens[k].rule];
+			if (r->text[0])
+				fprintf(LOG_FILE, "Replace [%.*s] with [%s] in [%s]\n",
+					(int) (tokens[k].end - tokens[k].start), data + tokens[k].start, r->text, name);
+			else
+				fprintf(LOG_FILE, "Remove pattern [%.*s] in [%s]\n",
+					(int) (tokens[k].end - tokens[k].start), data + tokens[k].start, name);
+			put(out, &pos, data + run, tokens[k].start - run);
+			put(out, &pos, r->text, strlen(r->text));
+			run = tokens[k].end;
+			changed = 1;
+		}
+		put(out, &pos, data + run, end - run);
+		if (nl)
+			out[pos++] = '\n';
+	}
+
+	free(tokens);
+	free(seen);
+	free(inserted);
+	if (!changed) {
+		free(out);
+		return NULL;
+	}
+	out[pos] = '\0';
+	*out_size = pos;
+	return out;
+}
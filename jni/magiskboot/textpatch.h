@@ -0,0 +1,35 @@
+#ifndef TEXTPATCH_H
+#define TEXTPATCH_H
+
+#include <stddef.h>
+
+enum {
+	TEXT_INSERT,    // Add text as a line before the first line with pattern, unless that line has unless
+	TEXT_REMOVE,    // Drop the lines with pattern
+	TEXT_REPLACE,   // Substitute pattern with text, "" removes it
+};
+
+// TEXT_REPLACE: an =value right after pattern (up to space, comma or newline) is part of the match
+#define TEXT_VALUE  0x1
+
+typedef struct text_rule {
+	int type;
+	const char *pattern;
+	const char *text;
+	const char *unless;
+	int flags;
+} text_rule;
+
+typedef struct text_patcher text_patcher;
+
+// All patterns of the rules are matched together, in one pass over the text
+text_patcher *text_patcher_new(const text_rule *rules, int num);
+void text_patcher_free(text_patcher *p);
+
+// Returns the malloced, null terminated result, or NULL if no rule applied. name is for the log
+char *text_patch(const text_patcher *p, const char *name, const char *data, size_t size, size_t *out_size);
+
+// The verity and forceencrypt rules of cpio_patch, NULL if both are kept (cpio.c)
+text_patcher *fstab_patcher(int keepverity, int keepforceencrypt);
+
+#endif
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <dirent.h>
 #include <string.h>
+#include <sched.h>
 #include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -46,8 +47,9 @@ void manage_selinux() {
 void hide_sensitive_props() {
 	LOGI("hide_utils: Hiding sensitive props\n");
 
-	// Hide all sensitive props
+	// Hide all sensitive props, applied together
 	char *value;
+	prop_begin();
 	for (int i = 0; prop_key[i]; ++i) {
 		value = getprop(prop_key[i]);
 		if (value) {
@@ -56,6 +58,7 @@ void hide_sensitive_props() {
 			free(value);
 		}
 	}
+	prop_commit();
 }
 
 static void rm_magisk_prop(const char *name) {
@@ -66,7 +69,10 @@ static void rm_magisk_prop(const char *name) {
 
 void clean_magisk_props() {
 	LOGD("hide_utils: Cleaning magisk props\n");
+	// Deletes are queued, so the trie is not modified while it is walked
+	prop_begin();
 	getprop_all(rm_magisk_prop);
+	prop_commit();
 }
 
 void relink_sbin() {
@@ -143,47 +149,122 @@ void relink_sbin() {
     }
 }
 
+/*
+ * proc_monitor never takes hide_lock. It looks names up in an immutable hash
+ * set, which writers rebuild from hide_list and publish with a pointer swap.
+ * The old set is freed once no reader is inside hide_match
+ */
+
+struct hide_slot {
+	uint32_t hash;
+	const char *name;
+};
+
+struct hide_set {
+	uint32_t mask;
+	struct hide_slot slots[];    /* Followed by the names */
+};
+
+static struct hide_set *hide_set = NULL;
+static int hide_readers = 0;
+
+// 32 bit FNV-1a
+static uint32_t name_hash(const char *s) {
+	uint32_t h = 0x811c9dc5;
+	for (; *s; ++s) {
+		h ^= (unsigned char) *s;
+		h *= 0x01000193;
+	}
+	return h;
+}
+
+static struct hide_set *build_set(struct vector *v) {
+	struct hide_set *set;
+	struct hide_slot *slot;
+	size_t slots = 16, names = 0, len;
+	char *line, *pool;
+	uint32_t h;
+
+	while (slots < vec_size(v) * 2)
+		slots <<= 1;
+	vec_for_each(v, line)
+		names += strlen(line) + 1;
+	set = xcalloc(1, sizeof(*set) + slots * sizeof(*slot) + names);
+	set->mask = slots - 1;
+	pool = (char *) (set->slots + slots);
+	vec_for_each(v, line) {
+		h = name_hash(line);
+		for (slot = &set->slots[h & set->mask]; slot->name; )
+			slot = &set->slots[(slot - set->slots + 1) & set->mask];
+		len = strlen(line) + 1;
+		memcpy(pool, line, len);
+		slot->hash = h;
+		slot->name = pool;
+		pool += len;
+	}
+	return set;
+}
+
+// Call with hide_lock held, or from the only thread left
+static void publish_set(struct hide_set *set) {
+	struct hide_set *old = __atomic_exchange_n(&hide_set, set, __ATOMIC_SEQ_CST);
+	// Grace period, lookups only take a few hundred ns
+	while (__atomic_load_n(&hide_readers, __ATOMIC_SEQ_CST))
+		sched_yield();
+	free(old);
+}
+
+int hide_match(const char *proc) {
+	struct hide_set *set;
+	struct hide_slot *slot;
+	int found = 0;
+	uint32_t h = name_hash(proc);
+	__atomic_add_fetch(&hide_readers, 1, __ATOMIC_SEQ_CST);
+	set = __atomic_load_n(&hide_set, __ATOMIC_SEQ_CST);
+	if (set) {
+		for (slot = &set->slots[h & set->mask]; slot->name; ) {
+			if (slot->hash == h && strcmp(slot->name, proc) == 0) {
+				found = 1;
+				break;
+			}
+			slot = &set->slots[(slot - set->slots + 1) & set->mask];
+		}
+	}
+	__atomic_sub_fetch(&hide_readers, 1, __ATOMIC_SEQ_CST);
+	return found;
+}
+
 int add_list(char *proc) {
 	if (!hideEnabled) {
 		free(proc);
 		return HIDE_NOT_ENABLED;
 	}
 
+	daemon_response ret = DAEMON_SUCCESS;
 	char *line;
-	struct vector *new_list = xmalloc(sizeof(*new_list));
-	if (new_list == NULL)
-		return DAEMON_ERROR;
-	vec_init(new_list);
 
+	// Critical region, writers only
+	pthread_mutex_lock(&hide_lock);
 	vec_for_each(hide_list, line) {
 		// They should be unique
 		if (strcmp(line, proc) == 0) {
+			pthread_mutex_unlock(&hide_lock);
 			free(proc);
-			vec_destroy(new_list);
-			free(new_list);
 			return HIDE_ITEM_EXIST;
 		}
-		vec_push_back(new_list, line);
 	}
 
-	vec_push_back(new_list, proc);
+	vec_push_back(hide_list, proc);
+	publish_set(build_set(hide_list));
 	LOGI("hide_list add: [%s]\n", proc);
 	ps_filter_proc_name(proc, kill_proc);
 
-	// Critical region
-	pthread_mutex_lock(&hide_lock);
-	vec_destroy(hide_list);
-	free(hide_list);
-	hide_list = new_list;
-	pthread_mutex_unlock(&hide_lock);
-
 	pthread_mutex_lock(&file_lock);
-	if (vector_to_file(HIDELIST, hide_list)) {
-		pthread_mutex_unlock(&file_lock);
-		return DAEMON_ERROR;
-	}
+	if (vector_to_file(HIDELIST, hide_list))
+		ret = DAEMON_ERROR;
 	pthread_mutex_unlock(&file_lock);
-	return DAEMON_SUCCESS;
+	pthread_mutex_unlock(&hide_lock);
+	return ret;
 }
 
 int rm_list(char *proc) {
@@ -192,50 +273,45 @@ int rm_list(char *proc) {
 		return HIDE_NOT_ENABLED;
 	}
 
-	daemon_response ret = DAEMON_ERROR;
-	char *line;
-	int do_rm = 0;
-	struct vector *new_list = xmalloc(sizeof(*new_list));
-	if (new_list == NULL)
-		goto error;
-	vec_init(new_list);
+	daemon_response ret = HIDE_ITEM_NOT_EXIST;
 
-	vec_for_each(hide_list, line) {
-		if (strcmp(line, proc) == 0) {
-			free(proc);
-			proc = line;
-			do_rm = 1;
+	// Critical region, writers only
+	pthread_mutex_lock(&hide_lock);
+	for (size_t i = 0; i < vec_size(hide_list); ++i) {
+		char *line = vec_entry(hide_list)[i];
+		if (strcmp(line, proc) != 0)
 			continue;
-		}
-		vec_push_back(new_list, line);
-	}
-
-	if (do_rm) {
-		LOGI("hide_list rm: [%s]\n", proc);
-		ps_filter_proc_name(proc, kill_proc);
-		// Critical region
-		pthread_mutex_lock(&hide_lock);
-		vec_destroy(hide_list);
-		free(hide_list);
-		hide_list = new_list;
-		pthread_mutex_unlock(&hide_lock);
+		memmove(vec_entry(hide_list) + i, vec_entry(hide_list) + i + 1,
+			(vec_size(hide_list) - i - 1) * sizeof(void *));
+		--vec_size(hide_list);
+		publish_set(build_set(hide_list));
+		LOGI("hide_list rm: [%s]\n", line);
+		ps_filter_proc_name(line, kill_proc);
+		free(line);
 
 		ret = DAEMON_SUCCESS;
 		pthread_mutex_lock(&file_lock);
 		if (vector_to_file(HIDELIST, hide_list))
 			ret = DAEMON_ERROR;
 		pthread_mutex_unlock(&file_lock);
-	} else {
-		ret = HIDE_ITEM_NOT_EXIST;
-		vec_destroy(new_list);
-		free(new_list);
+		break;
 	}
+	pthread_mutex_unlock(&hide_lock);
 
-error:
 	free(proc);
 	return ret;
 }
 
+// One scan of /proc for the whole list
+static void kill_all(struct vector *list) {
+	struct proc_table t;
+	if (list == NULL)
+		return;
+	proc_table_read(&t);
+	proc_table_match(&t, (char **) vec_entry(list), vec_size(list), kill_proc);
+	proc_table_free(&t);
+}
+
 int init_list() {
 	LOGD("hide_list: initialize...\n");
 	if ((hide_list = xmalloc(sizeof(*hide_list))) == NULL)
@@ -246,21 +322,22 @@ int init_list() {
 	file_to_vector(HIDELIST, hide_list);
 
 	char *line;
-	vec_for_each(hide_list, line) {
+	vec_for_each(hide_list, line)
 		LOGI("hide_list: [%s]\n", line);
-		ps_filter_proc_name(line, kill_proc);
-	}
+	kill_all(hide_list);
+	publish_set(build_set(hide_list));
 	return 0;
 }
 
+// From proc_monitor once it is out of hide_match, never from a signal handler
 int destroy_list() {
-	char *line;
-	vec_for_each(hide_list, line) {
-		ps_filter_proc_name(line, kill_proc);
-	}
+	pthread_mutex_lock(&hide_lock);
+	publish_set(NULL);
+	kill_all(hide_list);
 	vec_deep_destroy(hide_list);
 	free(hide_list);
 	hide_list = NULL;
+	pthread_mutex_unlock(&hide_lock);
 	return 0;
 }
 
@@ -272,6 +349,13 @@ void add_hide_list(int client) {
 	close(client);
 }
 
+// Entries of framed batch requests
+int hide_list_op(int req, const char *proc) {
+	err_handler = do_nothing;
+	char *dup = strdup(proc);
+	return req == ADD_HIDELIST ? add_list(dup) : rm_list(dup);
+}
+
 void rm_hide_list(int client) {
 	err_handler = do_nothing;
 	char *proc = read_string(client);
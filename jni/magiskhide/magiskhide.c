@@ -33,8 +33,8 @@ static void usage(char *arg0) {
 		"Options:\n"
 		"  --enable: Start the magiskhide daemon\n"
 		"  --disable: Stop the magiskhide daemon\n"
-		"  --add <process name>: Add <process name> to the list\n"
-		"  --rm <process name>: Remove <process name> from the list\n"
+		"  --add <process name...>: Add <process name> to the list\n"
+		"  --rm <process name...>: Remove <process name> from the list\n"
 		"  --ls: Print out the current hide list\n"
 		, arg0);
 	exit(1);
@@ -54,6 +54,7 @@ void launch_magiskhide(int client) {
 
 	hideEnabled = 1;
 	LOGI("* Starting MagiskHide\n");
+	int span = prof_begin("magiskhide");
 
 	deleteprop(MAGISKHIDE_PROP, 1);
 
@@ -75,6 +76,9 @@ void launch_magiskhide(int client) {
 		close(client);
 	}
 
+	prof_end(span);
+	prof_save();
+
 	// Get thread reference
 	proc_monitor_thread = pthread_self();
 	// Start monitoring
@@ -82,6 +86,7 @@ void launch_magiskhide(int client) {
 	return;
 
 error:
+	prof_end(span);
 	hideEnabled = 0;
 	if (client > 0) {
 		write_int(client, DAEMON_ERROR);
@@ -109,34 +114,11 @@ void stop_magiskhide(int client) {
 	close(client);
 }
 
-int magiskhide_main(int argc, char *argv[]) {
-	if (argc < 2) {
-		usage(argv[0]);
-	}
-	client_request req = DO_NOTHING;
-	if (strcmp(argv[1], "--enable") == 0) {
-		req = LAUNCH_MAGISKHIDE;
-	} else if (strcmp(argv[1], "--disable") == 0) {
-		req = STOP_MAGISKHIDE;
-	} else if (strcmp(argv[1], "--add") == 0 && argc > 2) {
-		req = ADD_HIDELIST;
-	} else if (strcmp(argv[1], "--rm") == 0 && argc > 2) {
-		req = RM_HIDELIST;
-	} else if (strcmp(argv[1], "--ls") == 0) {
-		FILE *fp = fopen(HIDELIST, "r");
-		if (fp == NULL)
-			return 1;
-		char buffer[512];
-		while (fgets(buffer, sizeof(buffer), fp)) {
-			printf("%s", buffer);
-		}
-		fclose(fp);
-		return 0;
-	}
+static int hide_request(client_request req, const char *proc) {
 	int fd = connect_daemon();
 	write_int(fd, req);
 	if (req == ADD_HIDELIST || req == RM_HIDELIST) {
-		write_string(fd, argv[2]);
+		write_string(fd, proc);
 	}
 	daemon_response code = read_int(fd);
 	close(fd);
@@ -156,11 +138,95 @@ int magiskhide_main(int argc, char *argv[]) {
 		fprintf(stderr, "Magisk hide is already enabled\n");
 		break;
 	case HIDE_ITEM_EXIST:
-		fprintf(stderr, "Process [%s] already exists in hide list\n", argv[2]);
+		fprintf(stderr, "Process [%s] already exists in hide list\n", proc);
 		break;
 	case HIDE_ITEM_NOT_EXIST:
-		fprintf(stderr, "Process [%s] does not exist in hide list\n", argv[2]);
+		fprintf(stderr, "Process [%s] does not exist in hide list\n", proc);
 		break;
 	}
 	return code;
 }
+
+// Send all entries in one frame, return -1 if the daemon does not support it
+static int hide_list_batch(client_request req, int argc, char *argv[], int *code) {
+	struct frame_hdr hdr;
+	char *buf, *reply = NULL;
+	size_t len = 0;
+	int fd, *codes;
+
+	for (int i = 0; i < argc; ++i)
+		len += strlen(argv[i]) + 1;
+	if (len > FRAME_MAX || (fd = connect_framed()) < 0)
+		return -1;
+	buf = xmalloc(len);
+	*code = DAEMON_SUCCESS;
+	len = 0;
+	for (int i = 0; i < argc; ++i) {
+		strcpy(buf + len, argv[i]);
+		len += strlen(argv[i]) + 1;
+	}
+	if (write_frame(fd, req, 0, buf, len) || read_frame(fd, &hdr, &reply)) {
+		fprintf(stderr, "Error occured in daemon...\n");
+		*code = DAEMON_ERROR;
+	} else if (hdr.type != DAEMON_SUCCESS) {
+		if (hdr.type == ROOT_REQUIRED)
+			fprintf(stderr, "Root is required for this operation\n");
+		else
+			fprintf(stderr, "Error occured in daemon...\n");
+		*code = hdr.type;
+	} else {
+		codes = (int *) reply;
+		for (int i = 0; i < argc && (i + 1) * sizeof(int) <= hdr.len; ++i) {
+			if (codes[i] == HIDE_ITEM_EXIST)
+				fprintf(stderr, "Process [%s] already exists in hide list\n", argv[i]);
+			else if (codes[i] == HIDE_ITEM_NOT_EXIST)
+				fprintf(stderr, "Process [%s] does not exist in hide list\n", argv[i]);
+			if (codes[i] != DAEMON_SUCCESS)
+				*code = codes[i];
+		}
+	}
+	free(reply);
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+int magiskhide_main(int argc, char *argv[]) {
+	if (argc < 2) {
+		usage(argv[0]);
+	}
+	client_request req = DO_NOTHING;
+	if (strcmp(argv[1], "--enable") == 0) {
+		req = LAUNCH_MAGISKHIDE;
+	} else if (strcmp(argv[1], "--disable") == 0) {
+		req = STOP_MAGISKHIDE;
+	} else if (strcmp(argv[1], "--add") == 0 && argc > 2) {
+		req = ADD_HIDELIST;
+	} else if (strcmp(argv[1], "--rm") == 0 && argc > 2) {
+		req = RM_HIDELIST;
+	} else if (strcmp(argv[1], "--ls") == 0) {
+		FILE *fp = fopen(HIDELIST, "r");
+		if (fp == NULL)
+			return 1;
+		char buffer[512];
+		while (fgets(buffer, sizeof(buffer), fp)) {
+			printf("%s", buffer);
+		}
+		fclose(fp);
+		return 0;
+	}
+	if ((req == ADD_HIDELIST || req == RM_HIDELIST) && argc > 3) {
+		int code;
+		if (hide_list_batch(req, argc - 2, argv + 2, &code) == 0)
+			return code;
+	}
+	if (req != ADD_HIDELIST && req != RM_HIDELIST)
+		return hide_request(req, NULL);
+	// Older daemons get one connection per entry
+	int code = DAEMON_SUCCESS, ret;
+	for (int i = 2; i < argc; ++i) {
+		if ((ret = hide_request(req, argv[i])) != DAEMON_SUCCESS)
+			code = ret;
+	}
+	return code;
+}
@@ -2,6 +2,7 @@
 #define MAGISK_HIDE_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 // Kill process
 void kill_proc(int pid);
@@ -9,6 +10,19 @@ void kill_proc(int pid);
 // Process monitor
 void proc_monitor();
 
+// Process start events, next blocks until a process got its name
+struct proc_source {
+	const char *name;
+	int (*open)(const int *zygote, int count);
+	int (*next)(int *pid, char *name, size_t size);
+	void (*close)();
+};
+
+extern struct proc_source connector_source, logcat_source;
+// Readable once proc_monitor is asked to stop, next returns 1 then
+extern int proc_quit_fd;
+int proc_wait_comm(const char *prefix, int timeout);
+
 // Utility functions
 void manage_selinux();
 void hide_sensitive_props();
@@ -20,6 +34,7 @@ int add_list(char *proc);
 int rm_list(char *proc);
 int init_list();
 int destroy_list();
+int hide_match(const char *proc);
 
 extern int hideEnabled;
 extern struct vector *hide_list;
@@ -0,0 +1,342 @@
+/* proc_events.c - Sources of process start events for proc_monitor
+ *
+ * The proc connector is a netlink socket the kernel reports every fork and
+ * comm change to. A child of zygote renames itself when it specializes into
+ * an app, which is the earliest point its process name is known.
+ * When the connector is not available, fall back to the logcat
+ * am_proc_start events.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "magiskhide.h"
+
+/******************
+ * Proc connector *
+ ******************/
+
+#define ZYGOTE_MAX   4
+#define PENDING_MAX  64
+
+static int cn_fd = -1;
+static int zygotes[ZYGOTE_MAX], zygote_count;
+// Forked from zygote, waiting for the new name
+static int pending[PENDING_MAX], pending_next;
+
+static int cn_send(int fd, int op) {
+	struct {
+		struct nlmsghdr hdr;
+		struct cn_msg msg;
+		int op;
+	} __attribute__((packed)) req;
+	memset(&req, 0, sizeof(req));
+	req.hdr.nlmsg_len = sizeof(req);
+	req.hdr.nlmsg_type = NLMSG_DONE;
+	req.hdr.nlmsg_pid = getpid();
+	req.msg.id.idx = CN_IDX_PROC;
+	req.msg.id.val = CN_VAL_PROC;
+	req.msg.len = sizeof(int);
+	req.op = op;
+	return send(fd, &req, sizeof(req), 0) != sizeof(req);
+}
+
+// Return a listening socket, -1 if the kernel has no proc connector
+static int cn_socket() {
+	struct sockaddr_nl addr;
+	int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || cn_send(fd, PROC_CN_MCAST_LISTEN)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Return -1 on errors, *ev is NULL if the message is something else
+static int cn_recv(int fd, char *buf, size_t size, struct proc_event **ev) {
+	struct nlmsghdr *hdr = (struct nlmsghdr *) buf;
+	ssize_t len = recv(fd, buf, size, 0);
+	*ev = NULL;
+	if (len < 0)
+		return -1;
+	if (NLMSG_OK(hdr, len) && hdr->nlmsg_type == NLMSG_DONE)
+		*ev = (struct proc_event *) ((struct cn_msg *) NLMSG_DATA(hdr))->data;
+	return 0;
+}
+
+// Block until fd is readable, 1 if proc_monitor is stopping instead
+static int wait_readable(int fd) {
+	struct pollfd pfd[2] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = proc_quit_fd, .events = POLLIN },
+	};
+	// Errors are left to the read that follows
+	while (poll(pfd, 2, -1) < 0 && errno == EINTR);
+	return pfd[1].revents != 0;
+}
+
+static int is_zygote(int pid) {
+	for (int i = 0; i < zygote_count; ++i)
+		if (zygotes[i] == pid)
+			return 1;
+	return 0;
+}
+
+static void add_zygote(int pid) {
+	if (zygote_count < ZYGOTE_MAX && !is_zygote(pid))
+		zygotes[zygote_count++] = pid;
+}
+
+static void rm_zygote(int pid) {
+	for (int i = 0; i < zygote_count; ++i) {
+		if (zygotes[i] == pid) {
+			zygotes[i] = zygotes[--zygote_count];
+			return;
+		}
+	}
+}
+
+// Return 1 if pid was pending
+static int take_pending(int pid) {
+	for (int i = 0; i < PENDING_MAX; ++i) {
+		if (pending[i] == pid) {
+			pending[i] = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Android keeps the last 15 characters in comm, older releases the first
+static int comm_of(const char *name, const char *comm) {
+	size_t len = strlen(name), clen = strlen(comm);
+	return strncmp(name, comm, clen) == 0 || (len >= clen && strcmp(name + len - clen, comm) == 0);
+}
+
+// The full name, comm is cut at 15 characters. The kernel reports the new comm
+// before the argv of zygote is overwritten on some releases, the read is
+// retried for a few ms until the cmdline matches it
+static void proc_name(int pid, const char *comm, char *name, size_t size) {
+	char path[32];
+	ssize_t len;
+	int fd, delay = 50;
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	for (int i = 0; i < 8; ++i, delay *= 2) {
+		len = -1;
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+			len = read(fd, name, size - 1);
+			close(fd);
+		}
+		if (len <= 0)
+			break;
+		name[len] = '\0';
+		if (comm_of(name, comm))
+			return;
+		usleep(delay);
+	}
+	// Still the name of zygote, comm is the best there is
+	if (len <= 0 || strncmp(name, "zygote", 6) == 0) {
+		strncpy(name, comm, size - 1);
+		name[size - 1] = '\0';
+	}
+}
+
+static int cn_open(const int *zygote, int count) {
+	if ((cn_fd = cn_socket()) < 0)
+		return 1;
+	zygote_count = 0;
+	for (int i = 0; i < count; ++i)
+		add_zygote(zygote[i]);
+	memset(pending, 0, sizeof(pending));
+	return 0;
+}
+
+static int cn_next(int *pid, char *name, size_t size) {
+	char buf[256] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct proc_event *ev;
+
+	while (1) {
+		if (wait_readable(cn_fd))
+			return 1;
+		if (cn_recv(cn_fd, buf, sizeof(buf), &ev)) {
+			// ENOBUFS: events were dropped, nothing we can do about them
+			if (errno == EINTR || errno == ENOBUFS)
+				continue;
+			LOGE("proc_connector: recv failed with %d: %s\n", errno, strerror(errno));
+			return 1;
+		}
+		if (ev == NULL)
+			continue;
+		switch (ev->what) {
+		case PROC_EVENT_FORK:
+			// New processes only, not threads
+			if (ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid &&
+				is_zygote(ev->event_data.fork.parent_tgid)) {
+				pending[pending_next] = ev->event_data.fork.child_pid;
+				pending_next = (pending_next + 1) % PENDING_MAX;
+			}
+			break;
+		case PROC_EVENT_COMM:
+			if (ev->event_data.comm.process_pid != ev->event_data.comm.process_tgid)
+				break;
+			*pid = ev->event_data.comm.process_pid;
+			if (take_pending(*pid)) {
+				proc_name(*pid, ev->event_data.comm.comm, name, size);
+				return 0;
+			}
+			// A restarted zygote renames itself
+			if (strncmp(ev->event_data.comm.comm, "zygote", 6) == 0)
+				add_zygote(*pid);
+			break;
+		case PROC_EVENT_EXIT:
+			if (ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid) {
+				take_pending(ev->event_data.exit.process_pid);
+				rm_zygote(ev->event_data.exit.process_pid);
+			}
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void cn_close() {
+	if (cn_fd < 0)
+		return;
+	cn_send(cn_fd, PROC_CN_MCAST_IGNORE);
+	close(cn_fd);
+	cn_fd = -1;
+}
+
+// Sleep up to timeout ms, waking up early when a process renames itself to prefix*
+int proc_wait_comm(const char *prefix, int timeout) {
+	char buf[256] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct proc_event *ev;
+	struct pollfd pfd[2];
+	struct timespec ts;
+	int fd = cn_socket(), ret = 1;
+	long deadline, left = timeout;
+	if (fd < 0) {
+		usleep(timeout * 1000);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	deadline = ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + timeout;
+	pfd[0].fd = fd;
+	pfd[1].fd = proc_quit_fd;
+	pfd[0].events = pfd[1].events = POLLIN;
+	while (ret && left > 0 && poll(pfd, 2, left) > 0 && pfd[1].revents == 0) {
+		if (cn_recv(fd, buf, sizeof(buf), &ev) == 0 && ev && ev->what == PROC_EVENT_COMM &&
+			strncmp(ev->event_data.comm.comm, prefix, strlen(prefix)) == 0)
+			ret = 0;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		left = deadline - (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+	}
+	cn_send(fd, PROC_CN_MCAST_IGNORE);
+	close(fd);
+	return ret;
+}
+
+struct proc_source connector_source = {
+	.name = "proc_connector",
+	.open = cn_open,
+	.next = cn_next,
+	.close = cn_close,
+};
+
+/**********
+ * Logcat *
+ **********/
+
+static int log_pid = -1, log_fd = -1;
+static struct line_reader log_reader;
+
+static int log_open(const int *zygote, int count) {
+	// Clear previous logcat buffer
+	char *const restart[] = { "logcat", "-b", "events", "-c", NULL };
+	log_pid = run_command(0, NULL, "/system/bin/logcat", restart);
+	if (log_pid > 0)
+		waitpid(log_pid, NULL, 0);
+
+	// Monitor am_proc_start
+	char *const command[] = { "logcat", "-b", "events", "-v", "raw", "-s", "am_proc_start", NULL };
+	log_fd = -1;
+	log_pid = run_command(0, &log_fd, "/system/bin/logcat", command);
+
+	if (log_pid < 0)
+		return 1;
+	if (kill(log_pid, 0)) {
+		close(log_fd);
+		log_pid = -1;
+		return 1;
+	}
+	lr_init(&log_reader, log_fd);
+	return 0;
+}
+
+static int log_next(int *pid, char *name, size_t size) {
+	char buffer[PATH_MAX];
+	while ((log_reader.head != log_reader.tail || !wait_readable(log_fd)) &&
+		lr_gets(&log_reader, buffer, sizeof(buffer))) {
+		int ret, comma = 0;
+		char *pos = buffer, processName[256];
+
+		while(1) {
+			pos = strchr(pos, ',');
+			if(pos == NULL)
+				break;
+			pos[0] = ' ';
+			++comma;
+		}
+
+		if (comma == 6)
+			ret = sscanf(buffer, "[%*d %d %*d %*d %256s", pid, processName);
+		else
+			ret = sscanf(buffer, "[%*d %d %*d %256s", pid, processName);
+
+		if(ret != 2)
+			continue;
+
+		strncpy(name, processName, size - 1);
+		name[size - 1] = '\0';
+		return 0;
+	}
+	// For some reason logcat ended
+	return 1;
+}
+
+static void log_close() {
+	if (log_pid > 0) {
+		kill(log_pid, SIGTERM);
+		waitpid(log_pid, NULL, 0);
+		close(log_fd);
+	}
+	log_pid = log_fd = -1;
+}
+
+struct proc_source logcat_source = {
+	.name = "logcat",
+	.open = log_open,
+	.next = log_next,
+	.close = log_close,
+};
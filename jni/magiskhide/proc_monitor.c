@@ -1,72 +1,129 @@
 /* proc_monitor.c - Monitor am_proc_start events and unmount
  * 
- * We monitor the logcat am_proc_start events. When a target starts up,
- * we pause it ASAP, and fork a new process to join its mount namespace
- * and do all the unmounting/mocking
+ * We monitor process start events (see proc_events.c). When a target starts up,
+ * we pause it ASAP, and hand it to one of the pre-forked hide workers, which
+ * joins its mount namespace and does all the unmounting
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
 #include "magisk.h"
 #include "utils.h"
 #include "magiskhide.h"
+#include "daemon.h"
 
-static int zygote_num;
-static char init_ns[32], zygote_ns[2][32], cache_block[256];
-static int log_pid, log_fd, target_pid;
-static char *buffer;
+static int zygote_num, zygote_pid[2];
+static ino_t init_ns, zygote_ns[2];
+static char cache_block[256];
 
-// Workaround for the lack of pthread_cancel
-static void quit_pthread(int sig) {
+static struct proc_source *source;
+
+// Set by SIGUSR1, the pipe wakes up the event sources
+static volatile sig_atomic_t quit_req;
+static int quit_pipe[2] = { -1, -1 };
+int proc_quit_fd = -1;
+
+static void stop_workers();
+
+// Workaround for the lack of pthread_cancel, never called from the signal handler
+static void quit_pthread() {
 	err_handler = do_nothing;
 	LOGD("proc_monitor: running cleanup\n");
-	destroy_list();
-	free(buffer);
 	hideEnabled = 0;
-	// Kill the logging if needed
-	if (log_pid > 0) {
-		kill(log_pid, SIGTERM);
-		waitpid(log_pid, NULL, 0);
-		close(log_fd);
-	}
-	// Resume process if possible
-	if (target_pid > 0)
-		kill(target_pid, SIGCONT);
+	destroy_list();
+	// Stop the event source if needed
+	if (source)
+		source->close();
+	// Resume processes if possible
+	stop_workers();
 	pthread_mutex_destroy(&hide_lock);
 	pthread_mutex_destroy(&file_lock);
+	close(quit_pipe[0]);
+	close(quit_pipe[1]);
+	quit_pipe[0] = quit_pipe[1] = proc_quit_fd = -1;
 	LOGD("proc_monitor: terminating...\n");
 	pthread_exit(NULL);
 }
 
+// The thread may be inside hide_match or holding a lock, only flag the request
+static void quit_signal(int sig) {
+	quit_req = 1;
+	write(quit_pipe[1], "", 1);
+}
+
 static void proc_monitor_err() {
 	LOGD("proc_monitor: error occured, stopping magiskhide services\n");
-	quit_pthread(SIGUSR1);
+	quit_pthread();
 }
 
-static int read_namespace(const int pid, char* target, const size_t size) {
+// Namespaces are the same if the inodes are, 0 if pid is gone
+static ino_t read_namespace(const int pid) {
 	char path[32];
+	struct stat st;
 	snprintf(path, sizeof(path), "/proc/%d/ns/mnt", pid);
-	if (access(path, R_OK) == -1)
-		return 1;
-	xreadlink(path, target, size);
-	return 0;
+	if (stat(path, &st))
+		return 0;
+	return st.st_ino;
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+#define NS_WAIT_START 20       /* us */
+#define NS_WAIT_CAP   10000    /* us */
+
+/*
+ * Wait until pid left all the namespaces in ns. Mostly it already did,
+ * otherwise check again with exponential backoff. Return the final
+ * namespace, 0 if pid is gone or did not move in limit us. The time goes
+ * to hist, a timeout to counter
+ */
+static ino_t wait_unshare(int pid, const ino_t *ns, int count, uint64_t limit,
+	int hist, int counter) {
+	uint64_t start = now_us();
+	useconds_t delay = NS_WAIT_START;
+	ino_t cur;
+	int same;
+	while ((cur = read_namespace(pid))) {
+		same = 0;
+		for (int i = 0; i < count; ++i)
+			same |= cur == ns[i];
+		if (!same)
+			break;
+		if (now_us() - start > limit) {
+			cur = 0;
+			break;
+		}
+		usleep(delay);
+		delay = delay * 2 > NS_WAIT_CAP ? NS_WAIT_CAP : delay * 2;
+	}
+	stat_time(hist, now_us() - start);
+	if (cur == 0)
+		stat_add(counter, 1);
+	return cur;
 }
 
 static void store_zygote_ns(int pid) {
 	if (zygote_num == 2) return;
-	do {
-		usleep(500);
-		read_namespace(pid, zygote_ns[zygote_num], 32);
-	} while (strcmp(zygote_ns[zygote_num], init_ns) == 0);
-	++zygote_num;
+	zygote_ns[zygote_num] = wait_unshare(pid, &init_ns, 1, 2000000,
+		HIST_ZYGOTE_WAIT, STAT_ZYGOTE_TIMEOUTS);
+	if (zygote_ns[zygote_num])
+		zygote_pid[zygote_num++] = pid;
 }
 
 static void lazy_unmount(const char* mountpoint) {
@@ -77,212 +134,315 @@ static void lazy_unmount(const char* mountpoint) {
 }
 
 static void hide_daemon_err() {
-	LOGD("hide_daemon: error occured, stopping magiskhide services\n");
+	LOGD("hide_daemon: error occured, worker exiting\n");
 	_exit(-1);
 }
 
-static void hide_daemon(int pid) {
-	LOGD("hide_daemon: start unmount for pid=[%d]\n", pid);
-	// When an error occurs, report its failure to main process
-	err_handler = hide_daemon_err;
+// Mounts added by Magisk: /sbin links, cache mounts, mirrors, loop, dummy and overlay mounts
+static int magisk_mount(struct mount_entry *e) {
+	return (strcmp(e->source, "tmpfs") == 0 && strncmp(e->target, "/sbin", 5) == 0)
+		|| strcmp(e->source, OVERLAY_SRC) == 0
+		|| (cache_block[0] && strcmp(e->source, cache_block) == 0 && strncmp(e->target, "/system", 7) == 0)
+		|| strstr(e->target, MIRRDIR) || strstr(e->source, MIRRDIR)
+		|| strncmp(e->source, "/dev/block/loop", 15) == 0
+		|| strstr(e->target, DUMMDIR) || strstr(e->source, DUMMDIR);
+}
 
-	char *line;
-	struct vector mount_list;
+// Runs in a hide worker, return 1 if pid is gone, *unmounted is set on success
+static int hide_daemon(int pid, int *unmounted) {
+	LOGD("hide_daemon: start unmount for pid=[%d]\n", pid);
 
-	manage_selinux();
-	relink_sbin();
-	clean_magisk_props();
+	struct mount_table mt;
+	struct mount_entry *e;
+	int *depth, *order, count = 0, p;
 
 	if (switch_mnt_ns(pid))
-		return;
+		return 1;
 
-	snprintf(buffer, PATH_MAX, "/proc/%d/mounts", pid);
-	vec_init(&mount_list);
-	file_to_vector(buffer, &mount_list);
+	if (mount_table_read(pid, &mt))
+		return 1;
 
 	// Find the cache block name if not found yet
-	if (cache_block[0] == '\0') {
-		vec_for_each(&mount_list, line) {
-			if (strstr(line, " /cache ")) {
-				sscanf(line, "%256s", cache_block);
-				break;
-			}
+	for (size_t i = 0; cache_block[0] == '\0' && i < mt.count; ++i) {
+		if (strcmp(mt.entries[i].target, "/cache") == 0) {
+			strncpy(cache_block, mt.entries[i].source, sizeof(cache_block) - 1);
+			cache_block[sizeof(cache_block) - 1] = '\0';
 		}
 	}
 
-	// First unmount dummy skeletons, /sbin links, cache mounts, and mirrors
-/* goodwin
-	vec_for_each(&mount_list, line) {
-		if (strstr(line, "tmpfs /system") || strstr(line, "tmpfs /vendor") || strstr(line, "tmpfs /sbin")
-			|| (strstr(line, cache_block) && (strstr(line, " /system") || strstr(line, " /vendor")))
-			|| strstr(line, MIRRDIR)) {
-			sscanf(line, "%*s %4096s", buffer);
-			lazy_unmount(buffer);
-		}
-		free(line);
+	// Parents are listed before their children
+	depth = xmalloc(mt.count * sizeof(int));
+	order = xmalloc(mt.count * sizeof(int));
+	for (size_t i = 0; i < mt.count; ++i) {
+		e = &mt.entries[i];
+		p = mount_table_find(&mt, e->parent);
+		depth[i] = p >= 0 && p < i ? depth[p] + 1 : 0;
+		if (magisk_mount(e))
+			order[count++] = i;
 	}
-*/
-	vec_for_each(&mount_list, line) {
-		if (strstr(line, "tmpfs /sbin")
-			|| (strstr(line, cache_block) && strstr(line, " /system"))
-			|| strstr(line, MIRRDIR)) {
-			sscanf(line, "%*s %4096s", buffer);
-			lazy_unmount(buffer);
-		}
-		free(line);
+
+	// Children first, so nothing is left stacked on top of a detached mount
+	for (int i = 1; i < count; ++i) {
+		int k = order[i], j = i;
+		for (; j > 0 && depth[order[j - 1]] < depth[k]; --j)
+			order[j] = order[j - 1];
+		order[j] = k;
 	}
-	vec_destroy(&mount_list);
-
-	// Re-read mount infos
-	snprintf(buffer, PATH_MAX, "/proc/%d/mounts", pid);
-	vec_init(&mount_list);
-	file_to_vector(buffer, &mount_list);
-
-	// Unmount any loop mounts and dummy mounts
-	vec_for_each(&mount_list, line) {
-		if (strstr(line, "/dev/block/loop") || strstr(line, DUMMDIR)) {
-			sscanf(line, "%*s %4096s", buffer);
-			lazy_unmount(buffer);
+	for (int i = 0; i < count; ++i)
+		lazy_unmount(mt.entries[order[i]].target);
+	*unmounted = count;
+
+	free(depth);
+	free(order);
+	mount_table_free(&mt);
+	return 0;
+}
+
+/****************
+ * Hide workers *
+ ****************/
+
+/*
+ * The setns system call do not support multithread processes, so the
+ * unmounting is done in single threaded helpers forked once per session.
+ * Each one is driven by a thread of hide_pool over a socketpair: the pid goes
+ * in, the result and the number of unmounts come back, then the target is resumed. Targets are
+ * handled at once, up to HIDE_WORKERS of them.
+ */
+
+#define HIDE_WORKERS 3
+
+struct hide_worker {
+	int pid;
+	int fd;
+	int target;    /* Stopped process being handled, -1 if idle */
+};
+
+static struct hide_worker workers[HIDE_WORKERS];
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_pool hide_pool;
+static int workers_stopped = 1;
+
+static void worker_main(int fd) {
+	int pid, ret[2];
+	// When an error occurs, report its failure by dying
+	err_handler = hide_daemon_err;
+	while (read(fd, &pid, sizeof(pid)) == sizeof(pid)) {
+		ret[1] = 0;
+		ret[0] = hide_daemon(pid, &ret[1]);
+		if (write(fd, ret, sizeof(ret)) != sizeof(ret))
+			break;
+	}
+	_exit(0);
+}
+
+// Call with worker_lock held
+static int spawn_worker(struct hide_worker *w) {
+	int sv[2];
+	w->pid = w->fd = w->target = -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+		return 1;
+	int pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		for (int i = 0; i < HIDE_WORKERS; ++i)
+			if (workers[i].fd >= 0)
+				close(workers[i].fd);
+		worker_main(sv[1]);
+	}
+	close(sv[1]);
+	if (pid < 0) {
+		close(sv[0]);
+		return 1;
+	}
+	w->pid = pid;
+	w->fd = sv[0];
+	return 0;
+}
+
+// Call with worker_lock held
+static void reap_worker(struct hide_worker *w) {
+	if (w->pid > 0) {
+		close(w->fd);
+		kill(w->pid, SIGKILL);
+		waitpid(w->pid, NULL, 0);
+	}
+	w->pid = w->fd = -1;
+}
+
+// mark is the stat_mark() of when the target was stopped
+static void hide_task(int target, int mark) {
+	struct hide_worker *w = NULL;
+	int ret[2] = { -1, 0 };
+	uint64_t start;
+
+	pthread_mutex_lock(&worker_lock);
+	for (int i = 0; !workers_stopped && i < HIDE_WORKERS; ++i) {
+		if (workers[i].fd >= 0 && workers[i].target < 0) {
+			w = &workers[i];
+			w->target = target;
+			break;
 		}
-		free(line);
 	}
+	pthread_mutex_unlock(&worker_lock);
+
+	start = stat_now_us();
+	if (w && write(w->fd, &target, sizeof(target)) == sizeof(target) &&
+		read(w->fd, ret, sizeof(ret)) != sizeof(ret))
+		ret[0] = -1;
+
+	pthread_mutex_lock(&worker_lock);
+	if (w == NULL) {
+		LOGW("proc_monitor: no hide worker for PID=%d\n", target);
+	} else if (workers_stopped) {
+		w->target = -1;
+		reap_worker(w);
+	} else if (ret[0] < 0) {
+		LOGE("hide_daemon: worker %d died, restarting\n", w->pid);
+		reap_worker(w);
+		spawn_worker(w);
+	} else {
+		w->target = -1;
+	}
+	pthread_mutex_unlock(&worker_lock);
 
-	// Free uo memory
-	vec_destroy(&mount_list);
+	if (ret[0] == 0) {
+		stat_time(HIST_UNMOUNT, stat_now_us() - start);
+		stat_add(STAT_UNMOUNTS, ret[1]);
+		stat_add(STAT_HIDDEN, 1);
+	}
+
+	// All done, send resume signal
+	stat_time(HIST_STOPPED, stat_since(mark));
+	kill(target, SIGCONT);
+}
+
+static void start_workers() {
+	static int pool_ready = 0;
+	if (!pool_ready) {
+		pool_init(&hide_pool, "hide_pool", hide_task, HIDE_WORKERS, HIDE_WORKERS, 64);
+		pool_ready = 1;
+	}
+	pthread_mutex_lock(&worker_lock);
+	for (int i = 0; i < HIDE_WORKERS; ++i)
+		workers[i].fd = -1;
+	for (int i = 0; i < HIDE_WORKERS; ++i)
+		spawn_worker(&workers[i]);
+	workers_stopped = 0;
+	pthread_mutex_unlock(&worker_lock);
+}
+
+static void stop_workers() {
+	pthread_mutex_lock(&worker_lock);
+	if (!workers_stopped) {
+		workers_stopped = 1;
+		for (int i = 0; i < HIDE_WORKERS; ++i) {
+			// Busy ones are reaped by their task, which resumes the target
+			if (workers[i].target < 0)
+				reap_worker(&workers[i]);
+			else
+				shutdown(workers[i].fd, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&worker_lock);
 }
 
 void proc_monitor() {
 	// Register the cancel signal
 	struct sigaction act;
+	quit_req = 0;
+	xpipe2(quit_pipe, O_CLOEXEC | O_NONBLOCK);
+	proc_quit_fd = quit_pipe[0];
 	memset(&act, 0, sizeof(act));
-	act.sa_handler = quit_pthread;
+	act.sa_handler = quit_signal;
 	sigaction(SIGUSR1, &act, NULL);
 
 	// The error handler should stop magiskhide services
 	err_handler = proc_monitor_err;
-	log_pid = target_pid = -1;
+	source = NULL;
 
-	buffer = xmalloc(PATH_MAX);
 	cache_block[0] = '\0';
 
 	// Get the mount namespace of init
-	if (read_namespace(1, init_ns, 32)) {
+	if ((init_ns = read_namespace(1)) == 0) {
 		LOGE("proc_monitor: Your kernel doesn't support mount namespace :(\n");
 		proc_monitor_err();
 	}
-	LOGI("proc_monitor: init ns=%s\n", init_ns);
+	LOGI("proc_monitor: init ns=%lu\n", (unsigned long) init_ns);
 
-	// Get the mount namespace of zygote
+	// Get the mount namespace of zygote, woken up when it starts
 	zygote_num = 0;
-	while(!zygote_num) {
-		// Check zygote every 2 secs
-		sleep(2);
+	uint64_t start = now_us();
+	for (int timeout = 10; ; timeout = timeout * 2 > 2000 ? 2000 : timeout * 2) {
 		ps_filter_proc_name("zygote", store_zygote_ns);
+		if (zygote_num)
+			break;
+		proc_wait_comm("zygote", timeout);
+		if (quit_req)
+			quit_pthread();
 	}
 	ps_filter_proc_name("zygote64", store_zygote_ns);
+	LOGI("proc_monitor: found zygote in %llu ms\n", (unsigned long long) (now_us() - start) / 1000);
 
 	switch(zygote_num) {
 	case 1:
-		LOGI("proc_monitor: zygote ns=%s\n", zygote_ns[0]);
+		LOGI("proc_monitor: zygote ns=%lu\n", (unsigned long) zygote_ns[0]);
 		break;
 	case 2:
-		LOGI("proc_monitor: zygote ns=%s zygote64 ns=%s\n", zygote_ns[0], zygote_ns[1]);
+		LOGI("proc_monitor: zygote ns=%lu zygote64 ns=%lu\n",
+			(unsigned long) zygote_ns[0], (unsigned long) zygote_ns[1]);
 		break;
 	}
 
-	while (1) {
-		// Clear previous logcat buffer
-		char *const restart[] = { "logcat", "-b", "events", "-c", NULL };
-		log_pid = run_command(0, NULL, "/system/bin/logcat", restart);
-		if (log_pid > 0)
-			waitpid(log_pid, NULL, 0);
-
-		// Monitor am_proc_start
-		char *const command[] = { "logcat", "-b", "events", "-v", "raw", "-s", "am_proc_start", NULL };
-		log_fd = -1;
-		log_pid = run_command(0, &log_fd, "/system/bin/logcat", command);
-
-		if (log_pid < 0) continue;
-		if (kill(log_pid, 0)) continue;
-
-		while(fdgets(buffer, PATH_MAX, log_fd)) {
-			int pid, ret, comma = 0;
-			char *pos = buffer, *line, processName[256];
-
-			while(1) {
-				pos = strchr(pos, ',');
-				if(pos == NULL)
-					break;
-				pos[0] = ' ';
-				++comma;
-			}
-
-			if (comma == 6)
-				ret = sscanf(buffer, "[%*d %d %*d %*d %256s", &pid, processName);
-			else
-				ret = sscanf(buffer, "[%*d %d %*d %256s", &pid, processName);
+	// Global and idempotent, done once per session instead of per process
+	manage_selinux();
+	relink_sbin();
+	clean_magisk_props();
+	start_workers();
+
+	while (!quit_req) {
+		// Prefer the kernel events, logcat is the fallback
+		if (connector_source.open(zygote_pid, zygote_num) == 0)
+			source = &connector_source;
+		else if (logcat_source.open(zygote_pid, zygote_num) == 0)
+			source = &logcat_source;
+		else
+			continue;
+		LOGI("proc_monitor: using %s events\n", source->name);
+
+		int pid;
+		char processName[256];
+
+		while (!quit_req && source->next(&pid, processName, sizeof(processName)) == 0) {
+			// Lock free, never waits for list updates
+			if (!hide_match(processName))
+				continue;
 
-			if(ret != 2)
+			// Never unmount in the namespace of zygote
+			uint64_t wait = now_us();
+			ino_t ns = wait_unshare(pid, zygote_ns, zygote_num, 1000000,
+				HIST_UNSHARE_WAIT, STAT_UNSHARE_TIMEOUTS);
+			if (ns == 0) {
+				LOGW("proc_monitor: %s (PID=%d) never left zygote namespace\n", processName, pid);
 				continue;
+			}
+			// Send pause signal ASAP
+			if (kill(pid, SIGSTOP) == -1) continue;
+
+			LOGI("proc_monitor: %s (PID=%d ns=%lu) after %llu us\n", processName, pid,
+				(unsigned long) ns, (unsigned long long) (now_us() - wait));
 
-			ret = 0;
-
-			// Critical region
-			pthread_mutex_lock(&hide_lock);
-			vec_for_each(hide_list, line) {
-				if (strcmp(processName, line) == 0) {
-					target_pid = pid;
-					while(1) {
-						ret = 1;
-						for (int i = 0; i < zygote_num; ++i) {
-							read_namespace(target_pid, buffer, 32);
-							if (strcmp(buffer, zygote_ns[i]) == 0) {
-								usleep(50);
-								ret = 0;
-								break;
-							}
-						}
-						if (ret) break;
-					}
-
-					// Send pause signal ASAP
-					if (kill(target_pid, SIGSTOP) == -1) continue;
-
-					LOGI("proc_monitor: %s (PID=%d ns=%s)\n", processName, target_pid, buffer);
-
-					/*
-					 * The setns system call do not support multithread processes
-					 * We have to fork a new process, setns, then do the unmounts
-					 */
-					int hide_pid = fork();
-					switch(hide_pid) {
-					case -1:
-						PLOGE("fork");
-						return;
-					case 0:
-						hide_daemon(target_pid);
-						_exit(0);
-					default:
-						break;
-					}
-
-					// Wait till the unmount process is done
-					waitpid(hide_pid, &ret, 0);
-					if (WEXITSTATUS(ret))
-						quit_pthread(SIGUSR1);
-
-					// All done, send resume signal
-					kill(target_pid, SIGCONT);
-					target_pid = -1;
-					break;
-				}
+			// Resumed by the worker when done
+			if (pool_submit(&hide_pool, pid, stat_mark())) {
+				LOGW("proc_monitor: hide queue full, skipping PID=%d\n", pid);
+				kill(pid, SIGCONT);
 			}
-			pthread_mutex_unlock(&hide_lock);
 		}
 
-		// For some reason it went here, restart logging
-		kill(log_pid, SIGTERM);
-		waitpid(log_pid, NULL, 0);
-		close(log_fd);
+		if (quit_req)
+			break;
+		// For some reason it went here, restart the source
+		source->close();
 	}
+	quit_pthread();
 }
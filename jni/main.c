@@ -20,6 +20,8 @@ int (*applet_main[]) (int, char *[]) =
 // Should be changed each thread/process
 __thread void (*err_handler)(void);
 
+int (*log_print)(int, const char *, const char *, ...) = __android_log_print;
+
 static void usage() {
 	fprintf(stderr,
 		"Magisk v" xstr(MAGISK_VERSION) "(" xstr(MAGISK_VER_CODE) ") (by topjohnwu) multi-call binary\n"
@@ -37,6 +39,19 @@ static void usage() {
 		"   or: %s --umountimg <PATH> <LOOP>\n"
 		"   or: %s --[boot stage]\n"
 		"       start boot stage service\n"
+		"   or: %s --boot-profile [FILE]\n"
+		"       print the timings of the last boot\n"
+		"   or: %s --watch-props <NAME|PREFIX*>...\n"
+		"       print NAME=VALUE whenever the props change\n"
+		"   or: %s --wait-prop <NAME> [VALUE]\n"
+		"       wait until the prop is set (to VALUE)\n"
+		"   or: %s --exec <applet> [arguments]...\n"
+		"       run the applet in the daemon, root only\n"
+		"   or: %s --exec-bench <COUNT> <applet> [arguments]...\n"
+		"       compare --exec with running the applet directly\n"
+		"   or: %s --stats [syscalls]\n"
+		"       print mount, hide and request metrics of the daemon,\n"
+		"       or the calls it made through the x wrappers (XWRAP_STATS builds)\n"
 		"   or: %s [options]\n"
 		"   or: applet [arguments]...\n"
 		"\n"
@@ -49,7 +64,8 @@ static void usage() {
 		"       -V            print daemon version code\n"
 		"\n"
 		"Supported applets:\n"
-	, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0);
+	, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0,
+	argv0, argv0, argv0);
 
 	for (int i = 0; applet[i]; ++i) {
 		fprintf(stderr, i ? ", %s" : "       %s", applet[i]);
@@ -119,7 +135,7 @@ int main(int argc, char *argv[]) {
 			return resize_img(argv[2], size);
 		} else if (strcmp(argv[1], "--mountimg") == 0) {
 			if (argc < 4) usage();
-			char *loop = mount_image(argv[2], argv[3]);
+			char *loop = mount_image(argv[2], argv[3], 0);
 			if (loop == NULL) {
 				fprintf(stderr, "Cannot mount image!\n");
 				return 1;
@@ -132,6 +148,24 @@ int main(int argc, char *argv[]) {
 			if (argc < 4) usage();
 			umount_image(argv[2], argv[3]);
 			return 0;
+		} else if (strcmp(argv[1], "--boot-profile") == 0) {
+			return boot_profile_main(argc > 2 ? argv[2] : PROFILE_FILE);
+		} else if (strcmp(argv[1], "--watch-props") == 0) {
+			if (argc < 3) usage();
+			return watch_props_main(argc - 2, argv + 2);
+		} else if (strcmp(argv[1], "--wait-prop") == 0) {
+			if (argc < 3) usage();
+			return wait_prop_main(argv[2], argc > 3 ? argv[3] : NULL);
+		} else if (strcmp(argv[1], "--exec") == 0) {
+			if (argc < 3) usage();
+			return exec_applet_main(argc - 2, argv + 2);
+		} else if (strcmp(argv[1], "--exec-bench") == 0) {
+			if (argc < 4) usage();
+			return exec_bench_main(atoi(argv[2]) > 0 ? atoi(argv[2]) : 1, argc - 3, argv + 3);
+		} else if (strcmp(argv[1], "--stats") == 0) {
+			if (argc > 2 && strcmp(argv[2], "syscalls") == 0)
+				return syscall_stats_main();
+			return stats_main();
 		} else if (strcmp(argv[1], "--post-fs") == 0) {
 			int fd = connect_daemon();
 			write_int(fd, POST_FS);
@@ -72,7 +72,7 @@ int main(int argc, char *argv[]) {
 			return resize_img(argv[2], size);
 		} else if (strcmp(argv[1], "--mountimg") == 0) {
 			if (argc < 4) usage();
-			char *loop = mount_image(argv[2], argv[3]);
+			char *loop = mount_image(argv[2], argv[3], 0);
 			if (loop == NULL) {
 				fprintf(stderr, "Cannot mount image!\n");
 				return 1;
@@ -111,6 +111,63 @@ int __system_property_add2(const char *name, unsigned int namelen, const char *v
 */
 int __system_property_del(const char *name);
 
+/* Group the following adds, updates and deletes. Added in resetprop
+** __system_property_begin2 holds back the global serial, which then
+** changes once in __system_property_commit2 if anything was modified,
+** waking up waiters on it a single time.
+**
+** __system_property_commit2 returns 0 on success, -1 if no batch is open.
+*/
+void __system_property_begin2();
+int __system_property_commit2();
+
+/* Save the parsed property_contexts to filename, and use them from there
+** on the next __system_properties_init2. Added in resetprop
+**
+** Returns 0 on success, -1 if the filename is too long.
+*/
+int __system_property_set_context_cache2(const char *filename);
+
+/* Space usage of a property area. Added in resetprop
+**  size:       bytes available for objects
+**  used:       bytes allocated so far
+**  live:       bytes of the objects still reachable, used - live is lost
+**  nodes:      trie nodes, dead_nodes have neither a prop nor children
+**  props:      properties
+**  buried:     deleted properties kept for reuse when added again
+*/
+typedef struct prop_area_stats {
+    size_t size;
+    size_t used;
+    size_t live;
+    size_t nodes;
+    size_t dead_nodes;
+    size_t props;
+    size_t buried;
+} prop_area_stats;
+
+/* Report the stats of every property area, fn is called with its context.
+**
+** Returns 0 on success, -1 if the areas are not initialized.
+*/
+int __system_property_stats2(void (*fn)(const char *context, const prop_area_stats *st, void *cookie),
+        void *cookie);
+
+/* The SELinux context of the area holding name, e.g. u:object_r:default_prop:s0.
+** Added in resetprop
+**
+** Returns the context, valid until the areas are initialized again, or NULL.
+*/
+const char *__system_property_context2(const char *name);
+
+/* Release what the areas keep resident: the name index is dropped and the
+** pages of the mapped areas are given back, they are read again from the
+** property files when touched. Added in resetprop
+**
+** Returns 0 on success, -1 if the areas are not initialized.
+*/
+int __system_property_trim2();
+
 /* Update the value of a system property returned by
 ** __system_property_find.  Can only be done by a single process
 ** that has write access to the property area, and that process
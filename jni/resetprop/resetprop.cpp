@@ -56,7 +56,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
 #include "_system_properties.h"
@@ -101,16 +104,20 @@ static int usage(char* arg0) {
         "%s <name> <value>:      Set property entry <name> with <value>\n"
         "%s --file <prop file>:  Load props from <prop file>\n"
         "%s --delete <name>:     Remove prop entry <name>\n"
+        "%s --begin [<name> <value> | --delete <name>]... --commit:\n"
+        "                        Apply all the changes at once\n"
+        "%s --stats:             Show the space used by each prop area\n"
         "\n"
         "Options:\n"
         "   -v          verbose output\n"
         "   -n          don't trigger events when changing props\n"
         "               if used with deleteprop determines whether remove persist prop file\n"
-    , arg0, arg0, arg0, arg0);
+    , arg0, arg0, arg0, arg0, arg0, arg0);
     return 1;
 }
 
 static int init_resetprop() {
+    __system_property_set_context_cache2(PROPCTX_CACHE);
     if (__system_properties_init2()) {
         PRINT_E("resetprop: Initialize error\n");
         return -1;
@@ -141,6 +148,72 @@ char *getprop(const char *name) {
     return strdup(value);
 }
 
+/*
+ * Transactions: between prop_begin() and prop_commit(), changes made by the
+ * calling thread are only queued. The commit applies them in order while the
+ * prop areas hold back the global serial, so waiters wake up once and see
+ * all of them together. Reads in between still return the old values.
+ */
+struct prop_op {
+    char *name;
+    char *value;    // NULL to delete
+    int trigger;
+};
+
+static __thread prop_op *txn_ops = NULL;
+static __thread int txn_count = 0, txn_cap = 0, txn_open = 0;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int txn_add(const char *name, const char *value, int trigger) {
+    if (txn_count == txn_cap) {
+        int cap = txn_cap ? txn_cap * 2 : 16;
+        prop_op *ops = (prop_op *) realloc(txn_ops, cap * sizeof(*ops));
+        if (ops == NULL) return -1;
+        txn_ops = ops;
+        txn_cap = cap;
+    }
+    prop_op *op = &txn_ops[txn_count++];
+    op->name = strdup(name);
+    op->value = value ? strdup(value) : NULL;
+    op->trigger = trigger;
+    return 0;
+}
+
+void prop_begin() {
+    txn_open = 1;
+}
+
+// Return 0 if every change went through
+int prop_commit() {
+    int ret = 0;
+    if (!txn_open) return -1;
+    txn_open = 0;
+    if (init_resetprop()) {
+        ret = -1;
+    } else if (txn_count) {
+        PRINT_D("resetprop: commit %d changes\n", txn_count);
+        pthread_mutex_lock(&commit_lock);
+        __system_property_begin2();
+        for (int i = 0; i < txn_count; ++i) {
+            prop_op *op = &txn_ops[i];
+            if (op->value)
+                ret |= setprop2(op->name, op->value, op->trigger) != 0;
+            else
+                ret |= deleteprop(op->name, op->trigger) != 0;
+        }
+        __system_property_commit2();
+        pthread_mutex_unlock(&commit_lock);
+    }
+    for (int i = 0; i < txn_count; ++i) {
+        free(txn_ops[i].name);
+        free(txn_ops[i].value);
+    }
+    free(txn_ops);
+    txn_ops = NULL;
+    txn_count = txn_cap = 0;
+    return ret;
+}
+
 static void (*cb)(const char *);
 
 static void run_actual_cb(void* cookie, const char *name, const char *value, uint32_t serial) {
@@ -157,11 +230,61 @@ void getprop_all(void (*cbk)(const char *name)) {
     __system_property_foreach2(prop_foreach_cb, NULL);
 }
 
+struct prop_cb {
+    void (*func)(const char *name, const char *value, void *cookie);
+    void *cookie;
+};
+
+static void run_prop_cb(void* cookie, const char *name, const char *value, uint32_t serial) {
+    prop_cb *c = (prop_cb *) cookie;
+    c->func(name, value, c->cookie);
+}
+
+static void prop_foreach_cb2(const prop_info* pi, void* cookie) {
+    __system_property_read_callback2(pi, run_prop_cb, cookie);
+}
+
+// Same as getprop_all, with the values and without any global state
+void getprop_all2(void (*cbk)(const char *name, const char *value, void *cookie), void *cookie) {
+    if (init_resetprop()) return;
+    prop_cb c = { cbk, cookie };
+    __system_property_foreach2(prop_foreach_cb2, &c);
+}
+
+// The global serial, it changes whenever any prop is added, changed or deleted
+unsigned prop_serial() {
+    if (init_resetprop()) return 0;
+    return __system_property_area_serial2();
+}
+
+// Wait up to timeout ms (forever if negative) for the global serial to move from serial
+unsigned prop_wait(unsigned serial, int timeout) {
+    uint32_t new_serial;
+    timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+    if (init_resetprop()) return serial;
+    if (!__system_property_wait2(NULL, serial, &new_serial, timeout < 0 ? NULL : &ts))
+        return serial;
+    return new_serial;
+}
+
+// The context of the prop area of name, free it after use
+char *prop_context(const char *name) {
+    if (init_resetprop()) return NULL;
+    const char *ctx = __system_property_context2(name);
+    return ctx ? strdup(ctx) : NULL;
+}
+
+// Called once the daemon goes idle, the next lookup maps in what it needs again
+void prop_trim() {
+    __system_property_trim2();
+}
+
 int setprop(const char *name, const char *value) {
     return setprop2(name, value, 1);
 }
 
 int setprop2(const char *name, const char *value, const int trigger) {
+    if (txn_open) return txn_add(name, value, trigger);
     if (init_resetprop()) return -1;
     int ret;
     
@@ -192,6 +315,7 @@ int setprop2(const char *name, const char *value, const int trigger) {
 }
 
 int deleteprop(const char *name, const int trigger) {
+    if (txn_open) return txn_add(name, NULL, trigger);
     if (init_resetprop()) return -1;
     PRINT_D("resetprop: deleteprop [%s]\n", name);
     if (__system_property_del(name)) {
@@ -206,47 +330,178 @@ int deleteprop(const char *name, const int trigger) {
     return 0;
 }
 
+struct prop_line {
+    const char *name;
+    const char *value;
+    int index;
+};
+
+static int prop_line_cmp(const void *a, const void *b) {
+    const prop_line *x = (const prop_line *) a, *y = (const prop_line *) b;
+    int ret = strcmp(x->name, y->name);
+    return ret ? ret : x->index - y->index;
+}
+
+static int prop_index_cmp(const void *a, const void *b) {
+    return ((const prop_line *) a)->index - ((const prop_line *) b)->index;
+}
+
+// Parse the lines in place, return the number of props
+static int parse_prop_buf(char *buf, prop_line *props) {
+    int count = 0, i;
+    char *line = buf, *end, *pch;
+    ssize_t read;
+    while (*line) {
+        end = strchr(line, '\n');
+        if (end) *end = '\0';
+        read = end ? end - line : strlen(line);
+        for (i = 0; i < read; ++i) {
+            // Ignore starting spaces
+            if (line[i] != ' ') break;
+        }
+        pch = strchr(line, '=');
+        // A line starting with # is ignored, and so are invalid formats
+        if (i < read && line[i] != '#' && pch != NULL && i < (pch - line) && pch < line + read - 1) {
+            // Separate the string
+            *pch = '\0';
+            props[count].name = line + i;
+            props[count].value = pch + 1;
+            props[count].index = count;
+            ++count;
+        }
+        if (end == NULL) break;
+        line = end + 1;
+    }
+    return count;
+}
+
+/*
+ * Load a whole prop file at once: one read, keys deduplicated (the last one
+ * wins, as if set in order), and props that already have the value skipped.
+ * Without trigger everything goes straight into the mapped prop areas,
+ * the rest is still one property_service request per changed prop.
+ */
 int read_prop_file(const char* filename, const int trigger) {
     if (init_resetprop()) return -1;
     PRINT_D("resetprop: Load prop file [%s]\n", filename);
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0) close(fd);
         PRINT_E("Cannot open [%s]\n", filename);
         return 1;
     }
-    char *line = NULL, *pch;
-    size_t len;
-    ssize_t read;
-    int comment = 0, i;
-    while ((read = getline(&line, &len, fp)) != -1) {
-        // Remove the trailing newline
-        if (line[read - 1] == '\n') {
-            line[read - 1] = '\0';
-            --read;
+    char *buf = (char *) malloc(st.st_size + 1);
+    ssize_t len = buf ? read(fd, buf, st.st_size) : -1;
+    close(fd);
+    if (len < 0) {
+        free(buf);
+        PRINT_E("Cannot read [%s]\n", filename);
+        return 1;
+    }
+    buf[len] = '\0';
+
+    // At most one prop every two bytes: "a=b\n" is the shortest line
+    prop_line *props = (prop_line *) malloc((len / 2 + 1) * sizeof(*props));
+    int count = parse_prop_buf(buf, props), kept = 0, changed = 0, ret = 0;
+
+    // Keep the last of each name, then go back to the file order
+    qsort(props, count, sizeof(*props), prop_line_cmp);
+    for (int i = 0; i < count; ++i) {
+        if (i + 1 < count && strcmp(props[i].name, props[i + 1].name) == 0)
+            continue;
+        props[kept++] = props[i];
+    }
+    qsort(props, kept, sizeof(*props), prop_index_cmp);
+
+    char value[PROP_VALUE_MAX];
+    for (int i = 0; i < kept; ++i) {
+        const char *name = props[i].name, *val = props[i].value;
+        size_t vlen = strlen(val);
+        if (!is_legal_property_name(name, strlen(name)) || vlen >= PROP_VALUE_MAX) {
+            PRINT_E("resetprop: skip invalid prop [%s]\n", name);
+            ret = 1;
+            continue;
         }
-        comment = 0;
-        for (i = 0; i < read; ++i) {
-            // Ignore starting spaces
-            if (line[i] == ' ') continue;
-            else {
-                // A line starting with # is ignored
-                if (line[i] == '#') comment = 1;
-                break;
-            }
+        prop_info *pi = (prop_info*) __system_property_find2(name);
+        if (pi) {
+            __system_property_read_callback2(pi, read_prop_info, value);
+            if (strcmp(value, val) == 0)
+                continue;
         }
-        if (comment) continue;
-        pch = strchr(line, '=');
-        // Ignore ivalid formats
-        if ( ((pch == NULL) || (i >= (pch - line))) || (pch >= line + read - 1) ) continue;
-        // Separate the string
-        *pch = '\0';
-        setprop2(line + i, pch + 1, trigger);
+        ++changed;
+        if (trigger) {
+            ret |= setprop2(name, val, trigger) != 0;
+        } else if (pi) {
+            ret |= __system_property_update2(pi, val, vlen) != 0;
+        } else {
+            ret |= __system_property_add2(name, strlen(name), val, vlen) != 0;
+        }
+        PRINT_D("resetprop: setprop [%s]: [%s]\n", name, val);
     }
-    free(line);
-    fclose(fp);
+    PRINT_D("resetprop: [%s] %d props, %d unique, %d changed\n", filename, count, kept, changed);
+
+    free(props);
+    free(buf);
+    return ret;
+}
+
+static void print_stats(const char *context, const prop_area_stats *st, void *cookie) {
+    prop_area_stats *total = (prop_area_stats *) cookie;
+    printf("%8zu %8zu %8zu %6zu %6zu %6zu %6zu  %s\n", st->size, st->used, st->used - st->live,
+        st->nodes, st->props, st->dead_nodes, st->buried, context);
+    total->size += st->size;
+    total->used += st->used;
+    total->live += st->live;
+    total->nodes += st->nodes;
+    total->props += st->props;
+    total->dead_nodes += st->dead_nodes;
+    total->buried += st->buried;
+}
+
+static int stats_main() {
+    prop_area_stats total;
+    if (init_resetprop()) return 1;
+    memset(&total, 0, sizeof(total));
+    printf("%8s %8s %8s %6s %6s %6s %6s  %s\n", "SIZE", "USED", "WASTED", "NODES", "PROPS", "DEAD",
+        "REUSE", "CONTEXT");
+    __system_property_stats2(print_stats, &total);
+    printf("%8zu %8zu %8zu %6zu %6zu %6zu %6zu  total\n", total.size, total.used,
+        total.used - total.live, total.nodes, total.props, total.dead_nodes, total.buried);
     return 0;
 }
 
+// Everything is checked before anything is queued, a bad argument changes nothing
+static int transaction_main(int argc, char *argv[], int i, int trigger) {
+    int end;
+    for (end = i; end < argc && strcmp(argv[end], "--commit"); ) {
+        const char *name;
+        int del = !strcmp(argv[end], "--delete");
+        if (end + 2 > argc) return usage(argv[0]);
+        name = argv[end + del];
+        if (!is_legal_property_name(name, strlen(name))) {
+            PRINT_E("Illegal property name: [%s]\n", name);
+            return 1;
+        }
+        if (!del && strlen(argv[end + 1]) >= PROP_VALUE_MAX) {
+            PRINT_E("Value too long: [%s]\n", argv[end + 1]);
+            return 1;
+        }
+        end += 2;
+    }
+    if (end == argc) return usage(argv[0]);
+
+    prop_begin();
+    while (i < end) {
+        if (!strcmp(argv[i], "--delete"))
+            deleteprop(argv[i + 1], trigger);
+        else
+            setprop2(argv[i], argv[i + 1], trigger);
+        i += 2;
+    }
+    return prop_commit();
+}
+
 int resetprop_main(int argc, char *argv[]) {
 
     int del = 0, file = 0, trigger = 1;
@@ -254,6 +509,10 @@ int resetprop_main(int argc, char *argv[]) {
     int exp_arg = 2;
     char *name, *value, *filename;
 
+    if (argc == 2 && !strcmp("--stats", argv[1])) {
+        return stats_main();
+    }
+
     if (argc < 3) {
         return usage(argv[0]);
     }
@@ -269,6 +528,8 @@ int resetprop_main(int argc, char *argv[]) {
         } else if (!strcmp("--delete", argv[i])) {
             del = 1;
             exp_arg = 1;
+        } else if (!strcmp("--begin", argv[i])) {
+            return transaction_main(argc, argv, i + 1, trigger);
         } else {
             if (i + exp_arg > argc) {
                 return usage(argv[0]);
@@ -15,6 +15,13 @@ char *getprop(const char *name);
 int deleteprop(const char *name, const int trigger);
 int read_prop_file(const char* filename, const int trigger);
 void getprop_all(void (*cbk)(const char *name));
+void getprop_all2(void (*cbk)(const char *name, const char *value, void *cookie), void *cookie);
+unsigned prop_serial();
+unsigned prop_wait(unsigned serial, int timeout);
+void prop_begin();
+int prop_commit();
+void prop_trim();
+char *prop_context(const char *name);
 
 #ifdef __cplusplus
 }
@@ -152,6 +152,7 @@ class prop_area {
   bool add(const char* name, unsigned int namelen, const char* value, unsigned int valuelen);
 
   bool foreach (void (*propfn)(const prop_info* pi, void* cookie), void* cookie);
+  void stats(prop_area_stats* st);          // resetprop add
 
   atomic_uint_least32_t* serial() {
     return &serial_;
@@ -181,6 +182,12 @@ class prop_area {
 
   bool find_property_and_del(prop_bt *const trie, const char *name);    // resetprop add
 
+  // resetprop add: deleted prop_infos, so re-adding the same name reuses them
+  void bury_prop_info(uint_least32_t off);
+  prop_info* revive_prop_info(const char* name, uint32_t namelen, const char* value,
+                              uint32_t valuelen, uint_least32_t* const off);
+  void stats_node(prop_bt* const trie, prop_area_stats* st);
+
   bool foreach_property(prop_bt* const trie, void (*propfn)(const prop_info* pi, void* cookie),
                         void* cookie);
 
@@ -373,6 +380,61 @@ inline prop_bt* prop_area::root_node() {
   return reinterpret_cast<prop_bt*>(to_prop_obj(0));
 }
 
+/*
+ * resetprop: deleting a prop only unlinks it, the area is a bump allocator and
+ * its objects can never move: other processes walk the tries without locks
+ * and keep prop_info pointers forever. Delete and re-add cycles would leak a
+ * prop_info each time, so the offsets of deleted ones are kept in the unused
+ * reserved_ words of the area header, and adding the same name again brings
+ * the old prop_info back. Its name is the same, so even stale pointers into
+ * it stay correct. Nothing else ever reads reserved_.
+ */
+#define GRAVE_MAGIC 0x76617267  // "grav"
+#define GRAVE_SLOTS (sizeof(reserved_) / sizeof(reserved_[0]) - 1)
+
+void prop_area::bury_prop_info(uint_least32_t off) {
+  if (reserved_[0] != GRAVE_MAGIC) {
+    memset(reserved_, 0, sizeof(reserved_));
+    reserved_[0] = GRAVE_MAGIC;
+  }
+  for (size_t i = 1; i <= GRAVE_SLOTS; ++i) {
+    if (reserved_[i] == 0) {
+      reserved_[i] = off;
+      return;
+    }
+  }
+  // Full, the oldest one is lost for good
+  memmove(&reserved_[1], &reserved_[2], (GRAVE_SLOTS - 1) * sizeof(reserved_[0]));
+  reserved_[GRAVE_SLOTS] = off;
+}
+
+prop_info* prop_area::revive_prop_info(const char* name, uint32_t namelen, const char* value,
+                                       uint32_t valuelen, uint_least32_t* const off) {
+  if (reserved_[0] != GRAVE_MAGIC) return nullptr;
+  for (size_t i = 1; i <= GRAVE_SLOTS; ++i) {
+    if (reserved_[i] == 0 || reserved_[i] > pa_data_size) continue;
+    prop_info* pi = reinterpret_cast<prop_info*>(data_ + reserved_[i]);
+    if (strncmp(pi->name, name, namelen) || pi->name[namelen] != '\0') continue;
+
+    // Same dance as __system_property_update2, readers may still hold it
+    uint32_t serial = atomic_load_explicit(&pi->serial, memory_order_relaxed);
+    serial |= 1;
+    atomic_store_explicit(&pi->serial, serial, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(pi->value, value, valuelen);
+    pi->value[valuelen] = '\0';
+    atomic_store_explicit(&pi->serial, (valuelen << 24) | ((serial + 1) & 0xffffff),
+                          memory_order_release);
+    __futex_wake(&pi->serial, INT32_MAX);
+
+    *off = reserved_[i];
+    memmove(&reserved_[i], &reserved_[i + 1], (GRAVE_SLOTS - i) * sizeof(reserved_[0]));
+    reserved_[GRAVE_SLOTS] = 0;
+    return pi;
+  }
+  return nullptr;
+}
+
 static int cmp_prop_name(const char* one, uint32_t one_len, const char* two, uint32_t two_len) {
   if (one_len < two_len)
     return -1;
@@ -478,7 +540,8 @@ const prop_info* prop_area::find_property(prop_bt* const trie, const char* name,
     return to_prop_info(&current->prop);
   } else if (alloc_if_needed) {
     uint_least32_t new_offset;
-    prop_info* new_info = new_prop_info(name, namelen, value, valuelen, &new_offset);
+    prop_info* new_info = revive_prop_info(name, namelen, value, valuelen, &new_offset);
+    if (!new_info) new_info = new_prop_info(name, namelen, value, valuelen, &new_offset);
     if (new_info) {
       atomic_store_explicit(&current->prop, new_offset, memory_order_release);
     }
@@ -526,6 +589,7 @@ bool prop_area::find_property_and_del(prop_bt* const trie, const char* name) {
   uint_least32_t prop_offset = atomic_load_explicit(&current->prop, memory_order_relaxed);
   if (prop_offset != 0) {
     atomic_store_explicit(&current->prop, 0, memory_order_release);     // resetprop: nullify the offset to delete the prop
+    bury_prop_info(prop_offset);
     return true;
   } else {
     return false;
@@ -753,6 +817,51 @@ bool prop_area::foreach (void (*propfn)(const prop_info* pi, void* cookie), void
   return foreach_property(root_node(), propfn, cookie);
 }
 
+void prop_area::stats_node(prop_bt* const trie, prop_area_stats* st) {
+  if (!trie) return;
+
+  uint_least32_t prop_offset = atomic_load_explicit(&trie->prop, memory_order_relaxed);
+  uint_least32_t children_offset = atomic_load_explicit(&trie->children, memory_order_relaxed);
+  ++st->nodes;
+  st->live += BIONIC_ALIGN(sizeof(prop_bt) + trie->namelen + 1, sizeof(uint_least32_t));
+  if (prop_offset != 0) {
+    prop_info* info = to_prop_info(&trie->prop);
+    if (info) {
+      ++st->props;
+      st->live += BIONIC_ALIGN(sizeof(prop_info) + strlen(info->name) + 1, sizeof(uint_least32_t));
+    }
+  } else if (children_offset == 0) {
+    // Left behind by a delete, it can only be reused by the same name
+    ++st->dead_nodes;
+  }
+  if (atomic_load_explicit(&trie->left, memory_order_relaxed) != 0) {
+    stats_node(to_prop_bt(&trie->left), st);
+  }
+  if (children_offset != 0) {
+    stats_node(to_prop_bt(&trie->children), st);
+  }
+  if (atomic_load_explicit(&trie->right, memory_order_relaxed) != 0) {
+    stats_node(to_prop_bt(&trie->right), st);
+  }
+}
+
+void prop_area::stats(prop_area_stats* st) {
+  memset(st, 0, sizeof(*st));
+  st->size = pa_data_size;
+  st->used = bytes_used_;
+  // The root node has no name
+  st->live = sizeof(prop_bt);
+  prop_bt* root = root_node();
+  if (atomic_load_explicit(&root->children, memory_order_relaxed) != 0) {
+    stats_node(to_prop_bt(&root->children), st);
+  }
+  if (reserved_[0] == GRAVE_MAGIC) {
+    for (size_t i = 1; i <= GRAVE_SLOTS; ++i) {
+      st->buried += reserved_[i] != 0;
+    }
+  }
+}
+
 class context_node {
  public:
   context_node(context_node* next, const char* context, prop_area* pa)
@@ -943,15 +1052,127 @@ static bool map_system_property_area(bool access_rw, bool* fsetxattr_failed) {
   return __system_property_area__;
 }
 
-static prop_area* get_prop_area_for_name(const char* name) {
-  auto entry = list_find(prefixes, [name](prefix_node* l) {
-    return l->prefix[0] == '*' || !strncmp(l->prefix, name, l->prefix_len);
+/*
+ * Process local lookup accelerators (resetprop addition).
+ *
+ * Context resolution uses the prefixes sorted by string instead of walking the
+ * list, and properties found once are remembered by their full name. The list
+ * resolves to the longest matching prefix, the first one added among equals,
+ * and the first wildcard when nothing else matches; the table keeps that.
+ *
+ * Names are only ever added to or removed from the tries with the global
+ * serial bumped, so the name index is dropped whenever that serial moves.
+ */
+
+struct prefix_entry {
+  const char* prefix;
+  size_t prefix_len;
+  size_t order;
+  context_node* context;
+};
+
+struct name_entry {
+  uint32_t hash;
+  const prop_info* pi;
+};
+
+static Lock index_lock;
+static prefix_entry* prefix_table = nullptr;
+static size_t prefix_count = 0;
+static context_node* wildcard_context = nullptr;
+static bool prefix_table_built = false;
+
+static name_entry* name_index = nullptr;
+static size_t name_index_mask = 0;
+static size_t name_index_count = 0;
+static uint32_t name_index_serial = 0;
+
+static int prefix_entry_cmp(const void* a, const void* b) {
+  auto l = reinterpret_cast<const prefix_entry*>(a);
+  auto r = reinterpret_cast<const prefix_entry*>(b);
+  int ret = strcmp(l->prefix, r->prefix);
+  if (ret) return ret;
+  return l->order < r->order ? -1 : l->order > r->order;
+}
+
+// Call with index_lock held
+static void build_prefix_table() {
+  size_t count = 0, order = 0;
+  list_foreach(prefixes, [&count](prefix_node*) { ++count; });
+  prefix_table = reinterpret_cast<prefix_entry*>(malloc(count * sizeof(prefix_entry) + 1));
+  prefix_count = 0;
+  wildcard_context = nullptr;
+  prefix_table_built = true;
+  if (!prefix_table) return;
+
+  list_foreach(prefixes, [&order](prefix_node* l) {
+    if (l->prefix[0] == '*') {
+      if (!wildcard_context) wildcard_context = l->context;
+      return;
+    }
+    prefix_table[prefix_count++] = {l->prefix, l->prefix_len, order++, l->context};
   });
-  if (!entry) {
+  qsort(prefix_table, prefix_count, sizeof(prefix_entry), prefix_entry_cmp);
+
+  // Only the first of identical prefixes is ever used
+  size_t n = 0;
+  for (size_t i = 0; i < prefix_count; ++i) {
+    if (n && !strcmp(prefix_table[n - 1].prefix, prefix_table[i].prefix)) continue;
+    prefix_table[n++] = prefix_table[i];
+  }
+  prefix_count = n;
+}
+
+static void free_prefix_table() {
+  free(prefix_table);
+  prefix_table = nullptr;
+  prefix_count = 0;
+  wildcard_context = nullptr;
+  prefix_table_built = false;
+}
+
+// Compare a prefix with the first len characters of name
+static int prefix_cmp(const prefix_entry* e, const char* name, size_t len) {
+  int ret = strncmp(e->prefix, name, len);
+  if (ret) return ret;
+  return e->prefix_len > len;
+}
+
+static context_node* find_context(const char* name) {
+  size_t len = strlen(name);
+  while (prefix_count) {
+    // The last prefix not greater than name[0, len)
+    size_t lo = 0, hi = prefix_count;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (prefix_cmp(&prefix_table[mid], name, len) <= 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == 0) break;
+
+    // Either it matches, or every longer match is ruled out and the search
+    // continues with the part it has in common with name
+    const prefix_entry* e = &prefix_table[lo - 1];
+    size_t common = 0;
+    while (common < e->prefix_len && e->prefix[common] == name[common]) ++common;
+    if (common == e->prefix_len) return e->context;
+    len = common;
+  }
+  return wildcard_context;
+}
+
+static prop_area* get_prop_area_for_name(const char* name) {
+  index_lock.lock();
+  if (!prefix_table_built) build_prefix_table();
+  context_node* cnode = find_context(name);
+  index_lock.unlock();
+  if (!cnode) {
     return nullptr;
   }
 
-  auto cnode = entry->context;
   if (!cnode->pa()) {
     /*
      * We explicitly do not check no_access_ in this case because unlike the
@@ -1134,9 +1355,236 @@ static bool is_dir(const char* pathname) {
   return S_ISDIR(info.st_mode);
 }
 
+/*
+ * resetprop: precompiled property contexts. Parsing the property_contexts
+ * files takes most of the time a resetprop run needs, so the result is saved
+ * once: the context names and the sorted prefix table of get_prop_area_for_name,
+ * mapped read only by every run after that. Context areas are still only
+ * opened once a name resolves to them.
+ *
+ * Layout: ctx_cache_hdr, uint32_t context name offsets[context_count],
+ * ctx_cache_prefix[prefix_count], then the null terminated strings
+ */
+#define CTX_CACHE_MAGIC   0x58544350  // "PCTX"
+#define CTX_CACHE_VERSION 1
+#define CTX_CACHE_MAX     65536
+
+struct ctx_cache_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t sources;
+  uint32_t context_count;
+  uint32_t prefix_count;
+  int32_t wildcard;
+  uint32_t strings_size;
+};
+
+struct ctx_cache_prefix {
+  uint32_t prefix;
+  uint32_t prefix_len;
+  uint32_t context;
+};
+
+static char context_cache[PROP_FILENAME_MAX];
+static void* cache_map = nullptr;
+static size_t cache_size = 0;
+
+int __system_property_set_context_cache2(const char* filename) {
+  size_t len = strlen(filename);
+  if (len >= sizeof(context_cache)) return -1;
+
+  strcpy(context_cache, filename);
+  return 0;
+}
+
+// Identity of every file initialize_properties() could read
+static uint64_t context_sources() {
+  static const char* const files[] = {
+    "/property_contexts",
+    "/system/etc/selinux/plat_property_contexts",
+    "/vendor/etc/selinux/nonplat_property_contexts",
+    "/plat_property_contexts",
+    "/nonplat_property_contexts",
+  };
+  uint64_t h = 0xcbf29ce484222325ULL;
+  auto mix = [&h](uint64_t val) {
+    for (int i = 0; i < 8; ++i, val >>= 8) {
+      h ^= val & 0xff;
+      h *= 0x100000001b3ULL;
+    }
+  };
+  for (auto file : files) {
+    struct stat st;
+    if (stat(file, &st) == -1) {
+      mix(0);
+      continue;
+    }
+    mix(st.st_dev);
+    mix(st.st_ino);
+    mix(st.st_size);
+    mix(st.st_mtime);
+  }
+  return h;
+}
+
+static bool load_context_cache() {
+  if (!context_cache[0]) return false;
+
+  const int fd = open(context_cache, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ||
+      st.st_size < static_cast<off_t>(sizeof(ctx_cache_hdr))) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  auto hdr = reinterpret_cast<const ctx_cache_hdr*>(map);
+  auto names = reinterpret_cast<const uint32_t*>(hdr + 1);
+  auto entries = reinterpret_cast<const ctx_cache_prefix*>(names + hdr->context_count);
+  auto strings = reinterpret_cast<const char*>(entries + hdr->prefix_count);
+  context_node** nodes = nullptr;
+  bool ok = hdr->magic == CTX_CACHE_MAGIC && hdr->version == CTX_CACHE_VERSION &&
+            hdr->context_count < CTX_CACHE_MAX && hdr->prefix_count < CTX_CACHE_MAX &&
+            hdr->wildcard < static_cast<int32_t>(hdr->context_count) &&
+            hdr->strings_size > 0 && hdr->strings_size <= size &&
+            sizeof(*hdr) + hdr->context_count * sizeof(uint32_t) +
+                hdr->prefix_count * sizeof(ctx_cache_prefix) + hdr->strings_size == size &&
+            strings[hdr->strings_size - 1] == '\0' && hdr->sources == context_sources();
+  for (uint32_t i = 0; ok && i < hdr->context_count; ++i) {
+    ok = names[i] < hdr->strings_size;
+  }
+  for (uint32_t i = 0; ok && i < hdr->prefix_count; ++i) {
+    ok = entries[i].prefix < hdr->strings_size && entries[i].context < hdr->context_count &&
+         strlen(strings + entries[i].prefix) == entries[i].prefix_len;
+  }
+  if (ok) {
+    nodes = reinterpret_cast<context_node**>(malloc(hdr->context_count * sizeof(*nodes) + 1));
+    prefix_table = reinterpret_cast<prefix_entry*>(
+        malloc(hdr->prefix_count * sizeof(prefix_entry) + 1));
+    ok = nodes && prefix_table;
+  }
+  if (!ok) {
+    free(nodes);
+    free(prefix_table);
+    prefix_table = nullptr;
+    munmap(map, size);
+    return false;
+  }
+
+  // Added in reverse, so the list is in the saved order
+  for (uint32_t i = hdr->context_count; i > 0; --i) {
+    list_add(&contexts, strings + names[i - 1], nullptr);
+    nodes[i - 1] = contexts;
+  }
+  for (uint32_t i = 0; i < hdr->prefix_count; ++i) {
+    prefix_table[i] = {strings + entries[i].prefix, entries[i].prefix_len, i,
+                       nodes[entries[i].context]};
+  }
+  prefix_count = hdr->prefix_count;
+  wildcard_context = hdr->wildcard >= 0 ? nodes[hdr->wildcard] : nullptr;
+  prefix_table_built = true;
+  free(nodes);
+
+  cache_map = map;
+  cache_size = size;
+  return true;
+}
+
+static void save_context_cache() {
+  if (!context_cache[0]) return;
+
+  index_lock.lock();
+  if (!prefix_table_built) build_prefix_table();
+
+  size_t context_count = 0, strings_size = 0;
+  list_foreach(contexts, [&](context_node* l) {
+    ++context_count;
+    strings_size += strlen(l->context()) + 1;
+  });
+  for (size_t i = 0; i < prefix_count; ++i) {
+    strings_size += prefix_table[i].prefix_len + 1;
+  }
+  size_t size = sizeof(ctx_cache_hdr) + context_count * sizeof(uint32_t) +
+                prefix_count * sizeof(ctx_cache_prefix) + strings_size;
+  char* buf = reinterpret_cast<char*>(calloc(1, size));
+  context_node** nodes =
+      reinterpret_cast<context_node**>(malloc(context_count * sizeof(*nodes) + 1));
+  if (!buf || !nodes || context_count >= CTX_CACHE_MAX || prefix_count >= CTX_CACHE_MAX) {
+    index_lock.unlock();
+    free(buf);
+    free(nodes);
+    return;
+  }
+
+  auto hdr = reinterpret_cast<ctx_cache_hdr*>(buf);
+  auto names = reinterpret_cast<uint32_t*>(hdr + 1);
+  auto entries = reinterpret_cast<ctx_cache_prefix*>(names + context_count);
+  auto strings = reinterpret_cast<char*>(entries + prefix_count);
+  uint32_t off = 0;
+  size_t n = 0;
+  auto put = [strings, &off](const char* str, size_t len) {
+    uint32_t ret = off;
+    memcpy(strings + off, str, len + 1);
+    off += len + 1;
+    return ret;
+  };
+  auto index_of = [nodes, &n](context_node* node) {
+    for (size_t i = 0; i < n; ++i) {
+      if (nodes[i] == node) return static_cast<int32_t>(i);
+    }
+    return -1;
+  };
+
+  hdr->magic = CTX_CACHE_MAGIC;
+  hdr->version = CTX_CACHE_VERSION;
+  hdr->sources = context_sources();
+  hdr->context_count = context_count;
+  hdr->prefix_count = prefix_count;
+  hdr->strings_size = strings_size;
+  list_foreach(contexts, [&](context_node* l) {
+    nodes[n] = l;
+    names[n++] = put(l->context(), strlen(l->context()));
+  });
+  for (size_t i = 0; i < prefix_count; ++i) {
+    entries[i].prefix = put(prefix_table[i].prefix, prefix_table[i].prefix_len);
+    entries[i].prefix_len = prefix_table[i].prefix_len;
+    entries[i].context = index_of(prefix_table[i].context);
+  }
+  hdr->wildcard = wildcard_context ? index_of(wildcard_context) : -1;
+  index_lock.unlock();
+
+  // Whoever gets here first writes it, the others just parse once more
+  char tmp[PROP_FILENAME_MAX + 8];
+  snprintf(tmp, sizeof(tmp), "%s.%d", context_cache, getpid());
+  const int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd != -1) {
+    bool ok = write(fd, buf, size) == static_cast<ssize_t>(size);
+    close(fd);
+    if (!ok || rename(tmp, context_cache) == -1) unlink(tmp);
+  }
+  free(buf);
+  free(nodes);
+}
+
+static void free_name_index();
+
 static void free_and_unmap_contexts() {
+  index_lock.lock();
+  free_prefix_table();
+  free_name_index();
+  index_lock.unlock();
   list_free(&prefixes);
   list_free(&contexts);
+  if (cache_map) {
+    munmap(cache_map, cache_size);
+    cache_map = nullptr;
+  }
   if (__system_property_area__) {
     munmap(__system_property_area__, pa_size);
     __system_property_area__ = nullptr;
@@ -1152,8 +1600,11 @@ int __system_properties_init2() {
     return 0;
   }
   if (is_dir(property_filename)) {
-    if (!initialize_properties()) {
-      return -1;
+    if (!load_context_cache()) {
+      if (!initialize_properties()) {
+        return -1;
+      }
+      save_context_cache();
     }
     if (!map_system_property_area(false, nullptr)) {
       free_and_unmap_contexts();
@@ -1209,18 +1660,158 @@ uint32_t __system_property_area_serial2() {
   return atomic_load_explicit(pa->serial(), memory_order_acquire);
 }
 
+// 32 bit FNV-1a
+static uint32_t name_hash(const char* name) {
+  uint32_t h = 2166136261u;
+  for (; *name; ++name) {
+    h ^= static_cast<unsigned char>(*name);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Call with index_lock held
+static void free_name_index() {
+  free(name_index);
+  name_index = nullptr;
+  name_index_mask = 0;
+  name_index_count = 0;
+}
+
+// Call with index_lock held
+static void clear_name_index() {
+  if (name_index) memset(name_index, 0, (name_index_mask + 1) * sizeof(name_entry));
+  name_index_count = 0;
+}
+
+// Call with index_lock held, drops everything recorded at another serial
+static void check_name_index(uint32_t serial) {
+  if (name_index_serial != serial) {
+    clear_name_index();
+    name_index_serial = serial;
+  }
+}
+
+// Call with index_lock held
+static const prop_info* name_index_find(const char* name, uint32_t hash) {
+  if (!name_index) return nullptr;
+  for (size_t i = hash & name_index_mask; name_index[i].pi; i = (i + 1) & name_index_mask) {
+    if (name_index[i].hash == hash && !strcmp(name_index[i].pi->name, name)) {
+      return name_index[i].pi;
+    }
+  }
+  return nullptr;
+}
+
+// Call with index_lock held, the table is kept at most half full
+static void name_index_add(uint32_t hash, const prop_info* pi) {
+  if ((name_index_count + 1) * 2 > name_index_mask + 1) {
+    size_t size = name_index ? (name_index_mask + 1) * 2 : 256;
+    auto table = reinterpret_cast<name_entry*>(calloc(size, sizeof(name_entry)));
+    if (!table) return;
+    for (size_t i = 0; name_index && i <= name_index_mask; ++i) {
+      if (!name_index[i].pi) continue;
+      size_t j = name_index[i].hash & (size - 1);
+      while (table[j].pi) j = (j + 1) & (size - 1);
+      table[j] = name_index[i];
+    }
+    free(name_index);
+    name_index = table;
+    name_index_mask = size - 1;
+  }
+  size_t i = hash & name_index_mask;
+  while (name_index[i].pi) i = (i + 1) & name_index_mask;
+  name_index[i] = {hash, pi};
+  ++name_index_count;
+}
+
 const prop_info* __system_property_find2(const char* name) {
   if (!__system_property_area__) {
     return nullptr;
   }
 
+  uint32_t serial = __system_property_area_serial2();
+  uint32_t hash = name_hash(name);
+  index_lock.lock();
+  check_name_index(serial);
+  const prop_info* pi = name_index_find(name, hash);
+  index_lock.unlock();
+  if (pi) {
+    return pi;
+  }
+
   prop_area* pa = get_prop_area_for_name(name);
   if (!pa) {
     // async_safe_format_log(ANDROID_LOG_ERROR, "libc", "Access denied finding property \"%s\"", name);
     return nullptr;
   }
 
-  return pa->find(name);
+  pi = pa->find(name);
+  if (pi) {
+    // Only remember it if nothing was added or removed during the search
+    index_lock.lock();
+    if (serial == __system_property_area_serial2()) {
+      check_name_index(serial);
+      name_index_add(hash, pi);
+    }
+    index_lock.unlock();
+  }
+  return pi;
+}
+
+/*
+ * resetprop: changes made between __system_property_begin2() and
+ * __system_property_commit2() move the global serial only once, so waiters on
+ * it wake up a single time and see all of them. The batch belongs to the
+ * calling thread, changes from other threads still move the serial at once.
+ */
+static __thread bool batch_open = false;
+static __thread bool batch_dirty = false;
+
+// names_changed when a property was added or removed
+static void area_changed(bool names_changed) {
+  prop_area* pa = __system_property_area__;
+
+  if (batch_open) {
+    batch_dirty = true;
+    if (names_changed) {
+      // The serial stays where it is, so the index has to forget on its own
+      index_lock.lock();
+      clear_name_index();
+      index_lock.unlock();
+    }
+    return;
+  }
+
+  // There is only a single mutator, but we want to make sure that
+  // updates are visible to a reader waiting for the update.
+  uint32_t serial = atomic_load_explicit(pa->serial(), memory_order_relaxed);
+  atomic_store_explicit(pa->serial(), serial + 1, memory_order_release);
+  __futex_wake(pa->serial(), INT32_MAX);
+
+  if (!names_changed) {
+    // Values change in place, every name still maps to the same prop_info
+    index_lock.lock();
+    if (name_index_serial == serial) name_index_serial = serial + 1;
+    index_lock.unlock();
+  }
+}
+
+void __system_property_begin2() {
+  batch_open = true;
+  batch_dirty = false;
+}
+
+int __system_property_commit2() {
+  if (!batch_open) {
+    return -1;
+  }
+  batch_open = false;
+  if (batch_dirty && __system_property_area__) {
+    area_changed(false);
+  }
+  batch_dirty = false;
+  return 0;
 }
 
 int __system_property_del(const char *name) {
@@ -1236,12 +1827,7 @@ int __system_property_del(const char *name) {
   if (!pa->del(name))
     return 1;
 
-  // We want to make sure that updates are visible to readers
-  atomic_store_explicit(
-      __system_property_area__->serial(),
-      atomic_load_explicit(__system_property_area__->serial(), memory_order_relaxed) + 1,
-      memory_order_release);
-  __futex_wake(__system_property_area__->serial(), INT32_MAX);
+  area_changed(true);
   return 0;
 }
 
@@ -1439,9 +2025,7 @@ int __system_property_update2(prop_info* pi, const char* value, unsigned int len
   atomic_store_explicit(&pi->serial, (len << 24) | ((serial + 1) & 0xffffff), memory_order_release);
   __futex_wake(&pi->serial, INT32_MAX);
 
-  atomic_store_explicit(pa->serial(), atomic_load_explicit(pa->serial(), memory_order_relaxed) + 1,
-                        memory_order_release);
-  __futex_wake(pa->serial(), INT32_MAX);
+  area_changed(false);
 
   return 0;
 }
@@ -1472,13 +2056,7 @@ int __system_property_add2(const char* name, unsigned int namelen, const char* v
     return -1;
   }
 
-  // There is only a single mutator, but we want to make sure that
-  // updates are visible to a reader waiting for the update.
-  atomic_store_explicit(
-      __system_property_area__->serial(),
-      atomic_load_explicit(__system_property_area__->serial(), memory_order_relaxed) + 1,
-      memory_order_release);
-  __futex_wake(__system_property_area__->serial(), INT32_MAX);
+  area_changed(true);
   return 0;
 }
 
@@ -1540,6 +2118,50 @@ const prop_info* __system_property_find_nth2(unsigned n) {
   return state.result;
 }
 
+int __system_property_stats2(void (*fn)(const char* context, const prop_area_stats* st, void* cookie),
+                             void* cookie) {
+  if (!__system_property_area__) {
+    return -1;
+  }
+
+  list_foreach(contexts, [fn, cookie](context_node* l) {
+    if (l->check_access_and_open()) {
+      prop_area_stats st;
+      l->pa()->stats(&st);
+      fn(l->context(), &st, cookie);
+    }
+  });
+  return 0;
+}
+
+const char* __system_property_context2(const char* name) {
+  if (!__system_property_area__) {
+    return nullptr;
+  }
+
+  index_lock.lock();
+  if (!prefix_table_built) build_prefix_table();
+  context_node* cnode = find_context(name);
+  index_lock.unlock();
+  return cnode ? cnode->context() : nullptr;
+}
+
+int __system_property_trim2() {
+  if (!__system_property_area__) {
+    return -1;
+  }
+
+  index_lock.lock();
+  free_name_index();
+  index_lock.unlock();
+  // Shared file mappings, nothing is lost and no pointer into them goes stale
+  list_foreach(contexts, [](context_node* l) {
+    if (l->pa()) madvise(l->pa(), pa_size, MADV_DONTNEED);
+  });
+  madvise(__system_property_area__, pa_size, MADV_DONTNEED);
+  return 0;
+}
+
 int __system_property_foreach2(void (*propfn)(const prop_info* pi, void* cookie), void* cookie) {
   if (!__system_property_area__) {
     return -1;
@@ -0,0 +1,484 @@
+/* ext4.c - Create and resize magisk.img without e2fsprogs
+ *
+ * The layout is the plain one: 4K blocks, no flex_bg, no resize inode and no
+ * checksums. Only metadata blocks are written, the inode tables and all free
+ * space stay holes in the file, which read back as zeros. Without a resize
+ * inode, groups can be appended or dropped by just rewriting the group
+ * descriptors and superblock copies, as long as the descriptors still fit in
+ * the same number of blocks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "magisk.h"
+#include "utils.h"
+#include "ext4.h"
+
+#define BLOCK_SIZE      4096
+#define INODE_RATIO     16384
+#define MIN_GROUP_FREE  64      /* A smaller last group is not worth its metadata */
+
+#define COMPAT_OK    (EXT4_COMPAT_HAS_JOURNAL | EXT4_COMPAT_EXT_ATTR | EXT4_COMPAT_DIR_INDEX)
+#define INCOMPAT_OK  (EXT4_INCOMPAT_FILETYPE | EXT4_INCOMPAT_EXTENTS)
+#define RO_COMPAT_OK (EXT4_RO_COMPAT_SPARSE_SUPER | EXT4_RO_COMPAT_LARGE_FILE | \
+	EXT4_RO_COMPAT_HUGE_FILE | EXT4_RO_COMPAT_DIR_NLINK | EXT4_RO_COMPAT_EXTRA_ISIZE)
+
+struct layout {
+	uint32_t bsize;
+	uint32_t bpg;        /* Blocks per group */
+	uint32_t ipg;        /* Inodes per group */
+	uint32_t itb;        /* Inode table blocks per group */
+	uint32_t gdt;        /* Group descriptor blocks */
+	uint32_t groups;
+	uint64_t blocks;
+};
+
+// Groups 0, 1 and powers of 3, 5 and 7 keep a copy of the superblock
+static int has_super(uint32_t g) {
+	static const uint32_t bases[] = { 3, 5, 7 };
+	if (g <= 1)
+		return 1;
+	for (int i = 0; i < 3; ++i) {
+		uint64_t p = bases[i];
+		while (p < g)
+			p *= bases[i];
+		if (p == g)
+			return 1;
+	}
+	return 0;
+}
+
+static uint32_t group_blocks(struct layout *l, uint32_t g) {
+	return g == l->groups - 1 ? l->blocks - (uint64_t) g * l->bpg : l->bpg;
+}
+
+// Superblock, descriptors, both bitmaps and the inode table
+static uint32_t group_meta(struct layout *l, uint32_t g) {
+	return (has_super(g) ? 1 + l->gdt : 0) + 2 + l->itb;
+}
+
+static uint32_t gdt_blocks(struct layout *l, uint32_t groups) {
+	return (groups * sizeof(struct ext4_group_desc) + l->bsize - 1) / l->bsize;
+}
+
+// Split the blocks into groups, the last one is dropped if it is too small
+static int layout_groups(struct layout *l) {
+	l->groups = (l->blocks + l->bpg - 1) / l->bpg;
+	l->gdt = gdt_blocks(l, l->groups);
+	if (l->groups && group_blocks(l, l->groups - 1) < group_meta(l, l->groups - 1) + MIN_GROUP_FREE) {
+		l->blocks = (uint64_t) --l->groups * l->bpg;
+		l->gdt = gdt_blocks(l, l->groups);
+	}
+	return l->groups == 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off) {
+	return pwrite(fd, buf, len, off) != (ssize_t) len;
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+	return pread(fd, buf, len, off) != (ssize_t) len;
+}
+
+static void set_bits(uint8_t *map, uint32_t start, uint32_t end) {
+	for (uint32_t i = start; i < end; ++i)
+		map[i >> 3] |= 1 << (i & 7);
+}
+
+static int bits_clear(uint8_t *map, uint32_t start, uint32_t end) {
+	for (uint32_t i = start; i < end; ++i)
+		if (map[i >> 3] & (1 << (i & 7)))
+			return 0;
+	return 1;
+}
+
+/*
+ * Bitmaps and descriptor of a new group, used says how many blocks after the
+ * metadata are taken. Bits past the end of the group have to be set.
+ */
+static int init_group(int fd, struct layout *l, uint32_t g, struct ext4_group_desc *gd,
+		uint32_t used, uint32_t used_inodes) {
+	uint64_t first = (uint64_t) g * l->bpg;
+	uint32_t meta = group_meta(l, g), size = group_blocks(l, g);
+	uint8_t *map = xcalloc(1, l->bsize);
+	int ret;
+
+	memset(gd, 0, sizeof(*gd));
+	gd->block_bitmap = htole32(first + meta - l->itb - 2);
+	gd->inode_bitmap = htole32(first + meta - l->itb - 1);
+	gd->inode_table = htole32(first + meta - l->itb);
+	gd->free_blocks_count = htole16(size - meta - used);
+	gd->free_inodes_count = htole16(l->ipg - used_inodes);
+
+	set_bits(map, 0, meta + used);
+	set_bits(map, size, l->bsize * 8);
+	ret = pwrite_full(fd, map, l->bsize, (uint64_t) le32toh(gd->block_bitmap) * l->bsize);
+	memset(map, 0, l->bsize);
+	set_bits(map, 0, used_inodes);
+	set_bits(map, l->ipg, l->bsize * 8);
+	ret |= pwrite_full(fd, map, l->bsize, (uint64_t) le32toh(gd->inode_bitmap) * l->bsize);
+	free(map);
+	return ret;
+}
+
+// The superblock and descriptors into every group that keeps a copy
+static int write_meta(int fd, struct layout *l, struct ext4_sb *sb, struct ext4_group_desc *gd) {
+	size_t len = (size_t) l->gdt * l->bsize;
+	char *gdt = xcalloc(1, len);
+	int ret = 0;
+	memcpy(gdt, gd, l->groups * sizeof(*gd));
+	// Backups first, the primary copy makes the change visible
+	for (uint32_t g = l->groups; g-- > 0;) {
+		if (!has_super(g))
+			continue;
+		uint64_t first = (uint64_t) g * l->bpg * l->bsize;
+		sb->block_group_nr = htole16(g);
+		ret |= pwrite_full(fd, gdt, len, first + l->bsize);
+		ret |= pwrite_full(fd, sb, sizeof(*sb), g ? first : EXT4_SB_OFFSET);
+	}
+	free(gdt);
+	return ret;
+}
+
+/***********
+ * Create  *
+ ***********/
+
+static uint32_t xattr_hash(const char *name, size_t name_len, const uint32_t *value, size_t words) {
+	uint32_t hash = 0;
+	for (size_t i = 0; i < name_len; ++i)
+		hash = (hash << 5) ^ (hash >> 27) ^ (unsigned char) name[i];
+	for (size_t i = 0; i < words; ++i)
+		hash = (hash << 16) ^ (hash >> 16) ^ le32toh(value[i]);
+	return hash;
+}
+
+// security.selinux stored in the inode, the value goes to the end of the space
+static void set_context(struct ext4_inode *inode, const char *context) {
+	struct ext4_xattr_entry *e = (struct ext4_xattr_entry *) (inode->xattr + 4);
+	size_t area = sizeof(inode->xattr) - 4, len, vsize;
+	uint32_t magic = htole32(EXT4_XATTR_MAGIC);
+	if (context == NULL)
+		return;
+	len = strlen(context) + 1;
+	vsize = (len + 3) & ~3;
+	// The entry, then 4 zero bytes ending the list
+	if ((sizeof(*e) + 7 + 3) / 4 * 4 + 4 + vsize > area)
+		return;
+	memcpy(inode->xattr, &magic, 4);
+	e->name_len = 7;
+	e->name_index = EXT4_XATTR_SECURITY;
+	memcpy(e->name, "selinux", 7);
+	e->value_offs = htole16(area - vsize);
+	e->value_size = htole32(len);
+	memcpy((char *) e + area - vsize, context, len);
+	e->hash = htole32(xattr_hash("selinux", 7, (uint32_t *) ((char *) e + area - vsize), vsize / 4));
+}
+
+// Everything is in one extent, i_block holds the tree root
+static void set_extent(struct ext4_inode *inode, uint32_t bsize, uint32_t start, uint32_t len) {
+	struct ext4_extent_header *h = (struct ext4_extent_header *) inode->block;
+	struct ext4_extent *e = (struct ext4_extent *) (h + 1);
+	inode->flags = htole32(EXT4_EXTENTS_FL);
+	inode->size_lo = htole32(len * bsize);
+	inode->blocks_lo = htole32(len * (bsize / 512));
+	h->magic = htole16(EXT4_EXT_MAGIC);
+	h->entries = htole16(1);
+	h->max = htole16(4);
+	e->len = htole16(len);
+	e->start_lo = htole32(start);
+}
+
+static void new_inode(struct ext4_inode *inode, uint16_t mode, uint16_t links, uint32_t now) {
+	memset(inode, 0, sizeof(*inode));
+	inode->mode = htole16(mode);
+	inode->links_count = htole16(links);
+	inode->atime = inode->ctime = inode->mtime = inode->crtime = htole32(now);
+	inode->extra_isize = htole16(EXT4_EXTRA_ISIZE);
+}
+
+// Add a directory entry, the last one gets the rest of the block
+static size_t add_dirent(char *block, size_t pos, size_t bsize, uint32_t ino, const char *name, int last) {
+	struct ext4_dir_entry *d = (struct ext4_dir_entry *) (block + pos);
+	size_t len = (sizeof(*d) + strlen(name) + 3) & ~3;
+	d->inode = htole32(ino);
+	d->rec_len = htole16(last ? bsize - pos : len);
+	d->name_len = strlen(name);
+	d->file_type = EXT4_FT_DIR;
+	memcpy(d->name, name, d->name_len);
+	return pos + len;
+}
+
+static uint32_t journal_size(uint64_t blocks) {
+	if (blocks < 2048)
+		return 0;
+	if (blocks < 32768)
+		return 1024;
+	if (blocks < 262144)
+		return 4096;
+	return 8192;
+}
+
+// Size in bytes, directories are labeled with context
+int ext4_create(const char *img, uint64_t size, const char *context) {
+	struct layout l;
+	struct ext4_sb sb;
+	struct ext4_group_desc *gd;
+	struct ext4_inode root, lost, journal;
+	struct jbd2_sb jsb;
+	char *block;
+	uint32_t now = time(NULL), meta0, jblocks, inodes;
+	int fd, ret = 0;
+
+	memset(&l, 0, sizeof(l));
+	l.bsize = BLOCK_SIZE;
+	l.bpg = l.bsize * 8;
+	l.blocks = size / l.bsize;
+	if (layout_groups(&l))
+		return 1;
+	// Inodes are spread evenly, filling whole inode table blocks
+	inodes = (l.blocks * l.bsize / INODE_RATIO + l.groups - 1) / l.groups;
+	l.ipg = (inodes + 15) & ~15;
+	if (l.ipg < 16)
+		l.ipg = 16;
+	if (l.ipg > l.bsize * 8)
+		l.ipg = l.bsize * 8;
+	l.itb = l.ipg * EXT4_INODE_SIZE / l.bsize;
+	if (layout_groups(&l))
+		return 1;
+
+	// The root, lost+found and the journal follow the metadata of group 0
+	meta0 = group_meta(&l, 0);
+	jblocks = journal_size(l.blocks);
+	if (group_blocks(&l, 0) < meta0 + 2 + jblocks + MIN_GROUP_FREE)
+		jblocks = 0;
+
+	if ((fd = open(img, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return 1;
+	// Reserve the space without writing it, a sparse file is fine too
+	if (fallocate(fd, 0, 0, l.blocks * l.bsize) && ftruncate(fd, l.blocks * l.bsize)) {
+		close(fd);
+		unlink(img);
+		return 1;
+	}
+
+	memset(&sb, 0, sizeof(sb));
+	sb.inodes_count = htole32(l.ipg * l.groups);
+	sb.blocks_count_lo = htole32(l.blocks);
+	sb.first_data_block = 0;
+	sb.log_block_size = sb.log_cluster_size = htole32(2);
+	sb.blocks_per_group = sb.clusters_per_group = htole32(l.bpg);
+	sb.inodes_per_group = htole32(l.ipg);
+	sb.wtime = sb.lastcheck = sb.mkfs_time = htole32(now);
+	sb.max_mnt_count = htole16(0xFFFF);
+	sb.magic = htole16(EXT4_SUPER_MAGIC);
+	sb.state = htole16(EXT4_VALID_FS);
+	sb.errors = htole16(1);
+	sb.rev_level = htole32(1);
+	sb.first_ino = htole32(EXT4_FIRST_INO);
+	sb.inode_size = htole16(EXT4_INODE_SIZE);
+	sb.feature_compat = htole32(EXT4_COMPAT_EXT_ATTR | (jblocks ? EXT4_COMPAT_HAS_JOURNAL : 0));
+	sb.feature_incompat = htole32(EXT4_INCOMPAT_FILETYPE | EXT4_INCOMPAT_EXTENTS);
+	sb.feature_ro_compat = htole32(EXT4_RO_COMPAT_SPARSE_SUPER | EXT4_RO_COMPAT_LARGE_FILE |
+		EXT4_RO_COMPAT_EXTRA_ISIZE);
+	sb.min_extra_isize = sb.want_extra_isize = htole16(EXT4_EXTRA_ISIZE);
+	strcpy(sb.volume_name, "magisk");
+	int rfd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (rfd >= 0) {
+		read(rfd, sb.uuid, sizeof(sb.uuid));
+		read(rfd, sb.hash_seed, sizeof(sb.hash_seed));
+		close(rfd);
+	}
+	sb.def_hash_version = 1;    /* half_md4 */
+
+	// Group 0 holds the 11 reserved inodes, lost+found included
+	gd = xcalloc(l.groups, sizeof(*gd));
+	ret |= init_group(fd, &l, 0, &gd[0], 2 + jblocks, EXT4_FIRST_INO);
+	gd[0].used_dirs_count = htole16(2);
+	for (uint32_t g = 1; g < l.groups; ++g)
+		ret |= init_group(fd, &l, g, &gd[g], 0, 0);
+	uint64_t free_blocks = 0;
+	for (uint32_t g = 0; g < l.groups; ++g)
+		free_blocks += le16toh(gd[g].free_blocks_count);
+	sb.free_blocks_count_lo = htole32(free_blocks);
+	sb.free_inodes_count = htole32(l.ipg * l.groups - EXT4_FIRST_INO);
+
+	uint64_t itable = (uint64_t) le32toh(gd[0].inode_table) * l.bsize;
+	new_inode(&root, S_IFDIR | 0755, 3, now);
+	set_extent(&root, l.bsize, meta0, 1);
+	set_context(&root, context);
+	new_inode(&lost, S_IFDIR | 0700, 2, now);
+	set_extent(&lost, l.bsize, meta0 + 1, 1);
+	set_context(&lost, context);
+	ret |= pwrite_full(fd, &root, sizeof(root), itable + (EXT4_ROOT_INO - 1) * EXT4_INODE_SIZE);
+	ret |= pwrite_full(fd, &lost, sizeof(lost), itable + (EXT4_FIRST_INO - 1) * EXT4_INODE_SIZE);
+
+	block = xcalloc(1, l.bsize);
+	add_dirent(block, add_dirent(block, add_dirent(block, 0, l.bsize, EXT4_ROOT_INO, ".", 0),
+		l.bsize, EXT4_ROOT_INO, "..", 0), l.bsize, EXT4_FIRST_INO, "lost+found", 1);
+	ret |= pwrite_full(fd, block, l.bsize, (uint64_t) meta0 * l.bsize);
+	memset(block, 0, l.bsize);
+	add_dirent(block, add_dirent(block, 0, l.bsize, EXT4_FIRST_INO, ".", 0),
+		l.bsize, EXT4_ROOT_INO, "..", 1);
+	ret |= pwrite_full(fd, block, l.bsize, (uint64_t) (meta0 + 1) * l.bsize);
+	free(block);
+
+	if (jblocks) {
+		new_inode(&journal, S_IFREG | 0600, 1, now);
+		set_extent(&journal, l.bsize, meta0 + 2, jblocks);
+		ret |= pwrite_full(fd, &journal, sizeof(journal), itable + (EXT4_JOURNAL_INO - 1) * EXT4_INODE_SIZE);
+		sb.journal_inum = htole32(EXT4_JOURNAL_INO);
+		// Backup of the journal inode blocks
+		sb.jnl_backup_type = 1;
+		memcpy(sb.jnl_blocks, journal.block, sizeof(journal.block));
+		sb.jnl_blocks[16] = journal.size_lo;
+
+		memset(&jsb, 0, sizeof(jsb));
+		jsb.magic = htobe32(JBD2_MAGIC);
+		jsb.blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+		jsb.blocksize = htobe32(l.bsize);
+		jsb.maxlen = htobe32(jblocks);
+		jsb.first = htobe32(1);
+		jsb.s_sequence = htobe32(1);
+		jsb.nr_users = htobe32(1);
+		memcpy(jsb.uuid, sb.uuid, sizeof(jsb.uuid));
+		ret |= pwrite_full(fd, &jsb, sizeof(jsb), (uint64_t) (meta0 + 2) * l.bsize);
+	}
+
+	ret |= write_meta(fd, &l, &sb, gd);
+	free(gd);
+	ret |= fsync(fd);
+	close(fd);
+	if (ret)
+		unlink(img);
+	return ret ? 1 : 0;
+}
+
+/***********
+ * Resize  *
+ ***********/
+
+// Grow or shrink to size bytes, return 1 if the image has to go to resize2fs
+int ext4_resize(const char *img, uint64_t size) {
+	struct layout l, o;
+	struct ext4_sb sb;
+	struct ext4_group_desc *gd = NULL;
+	uint8_t *map = NULL;
+	uint64_t free_blocks, free_inodes;
+	uint32_t lg, start, end;
+	int fd, ret = 1;
+
+	if ((fd = open(img, O_RDWR | O_CLOEXEC)) < 0)
+		return 1;
+	if (pread_full(fd, &sb, sizeof(sb), EXT4_SB_OFFSET) || le16toh(sb.magic) != EXT4_SUPER_MAGIC)
+		goto done;
+	// Only clean images in the plain layout
+	if ((le16toh(sb.state) & (EXT4_VALID_FS | EXT4_ERROR_FS)) != EXT4_VALID_FS
+		|| (le32toh(sb.feature_compat) & ~COMPAT_OK) || (le32toh(sb.feature_incompat) & ~INCOMPAT_OK)
+		|| (le32toh(sb.feature_ro_compat) & ~RO_COMPAT_OK) || sb.reserved_gdt_blocks
+		|| sb.first_data_block || le32toh(sb.log_block_size) == 0 || le32toh(sb.log_block_size) > 6
+		|| sb.log_block_size != sb.log_cluster_size)
+		goto done;
+
+	memset(&o, 0, sizeof(o));
+	o.bsize = 1024 << le32toh(sb.log_block_size);
+	o.bpg = le32toh(sb.blocks_per_group);
+	o.ipg = le32toh(sb.inodes_per_group);
+	o.itb = ((uint64_t) o.ipg * le16toh(sb.inode_size) + o.bsize - 1) / o.bsize;
+	o.blocks = le32toh(sb.blocks_count_lo);
+	o.groups = (o.blocks + o.bpg - 1) / o.bpg;
+	o.gdt = gdt_blocks(&o, o.groups);
+	if (o.bpg == 0 || o.bpg > o.bsize * 8 || o.ipg > o.bsize * 8)
+		goto done;
+	l = o;
+	l.blocks = size / l.bsize;
+	if (l.blocks > UINT32_MAX || layout_groups(&l) || l.gdt != o.gdt)
+		goto done;
+	if (l.blocks == o.blocks) {
+		ret = 0;
+		goto done;
+	}
+
+	gd = xcalloc(l.groups > o.groups ? l.groups : o.groups, sizeof(*gd));
+	map = xmalloc(o.bsize);
+	if (pread_full(fd, gd, o.groups * sizeof(*gd), o.bsize))
+		goto done;
+	free_blocks = le32toh(sb.free_blocks_count_lo);
+	free_inodes = le32toh(sb.free_inodes_count);
+
+	if (l.blocks > o.blocks) {
+		// Drop anything past the end first, so the new space reads as zeros
+		if (ftruncate(fd, o.blocks * o.bsize) ||
+			(fallocate(fd, 0, 0, l.blocks * l.bsize) && ftruncate(fd, l.blocks * l.bsize)))
+			goto done;
+		for (uint32_t g = o.groups; g < l.groups; ++g) {
+			if (init_group(fd, &l, g, &gd[g], 0, 0))
+				goto done;
+			free_blocks += le16toh(gd[g].free_blocks_count);
+			free_inodes += l.ipg;
+		}
+		// The old last group gets the rest of its blocks
+		lg = o.groups - 1;
+		start = group_blocks(&o, lg);
+		end = lg == l.groups - 1 ? group_blocks(&l, lg) : l.bpg;
+	} else {
+		// Dropped groups have to be completely unused
+		for (uint32_t g = l.groups; g < o.groups; ++g) {
+			if (le16toh(gd[g].free_blocks_count) != group_blocks(&o, g) - group_meta(&o, g)
+				|| le16toh(gd[g].free_inodes_count) != o.ipg)
+				goto done;
+			free_blocks -= le16toh(gd[g].free_blocks_count);
+			free_inodes -= o.ipg;
+		}
+		// And so does the tail of the new last group
+		lg = l.groups - 1;
+		start = group_blocks(&l, lg);
+		end = lg == o.groups - 1 ? group_blocks(&o, lg) : o.bpg;
+	}
+
+	uint64_t bitmap = (uint64_t) le32toh(gd[lg].block_bitmap) * o.bsize;
+	if (start != end) {
+		if (pread_full(fd, map, o.bsize, bitmap))
+			goto done;
+		if (l.blocks > o.blocks) {
+			for (uint32_t i = start; i < end; ++i)
+				map[i >> 3] &= ~(1 << (i & 7));
+			gd[lg].free_blocks_count = htole16(le16toh(gd[lg].free_blocks_count) + end - start);
+			free_blocks += end - start;
+		} else {
+			if (!bits_clear(map, start, end))
+				goto done;
+			set_bits(map, start, end);
+			gd[lg].free_blocks_count = htole16(le16toh(gd[lg].free_blocks_count) - (end - start));
+			free_blocks -= end - start;
+		}
+		if (pwrite_full(fd, map, o.bsize, bitmap))
+			goto done;
+	}
+
+	sb.blocks_count_lo = htole32(l.blocks);
+	sb.free_blocks_count_lo = htole32(free_blocks);
+	sb.inodes_count = htole32(l.ipg * l.groups);
+	sb.free_inodes_count = htole32(free_inodes);
+	if (le32toh(sb.r_blocks_count_lo) > l.blocks / 2)
+		sb.r_blocks_count_lo = 0;
+	sb.wtime = htole32(time(NULL));
+	if (write_meta(fd, &l, &sb, gd) || fsync(fd))
+		goto done;
+	if (l.blocks < o.blocks && ftruncate(fd, l.blocks * l.bsize))
+		goto done;
+	ret = 0;
+
+done:
+	free(gd);
+	free(map);
+	close(fd);
+	return ret;
+}
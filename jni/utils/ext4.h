@@ -0,0 +1,210 @@
+/* ext4.h - ext4 on disk structures, only what magisk.img needs
+ *
+ * All fields are little endian
+ */
+
+#ifndef _EXT4_H_
+#define _EXT4_H_
+
+#include <stdint.h>
+
+#define EXT4_SB_OFFSET       1024
+#define EXT4_SUPER_MAGIC     0xEF53
+#define EXT4_VALID_FS        0x0001
+#define EXT4_ERROR_FS        0x0002
+
+#define EXT4_COMPAT_HAS_JOURNAL    0x0004
+#define EXT4_COMPAT_EXT_ATTR       0x0008
+#define EXT4_COMPAT_RESIZE_INODE   0x0010
+#define EXT4_COMPAT_DIR_INDEX      0x0020
+
+#define EXT4_INCOMPAT_FILETYPE     0x0002
+#define EXT4_INCOMPAT_RECOVER      0x0004
+#define EXT4_INCOMPAT_EXTENTS      0x0040
+#define EXT4_INCOMPAT_64BIT        0x0080
+
+#define EXT4_RO_COMPAT_SPARSE_SUPER  0x0001
+#define EXT4_RO_COMPAT_LARGE_FILE    0x0002
+#define EXT4_RO_COMPAT_HUGE_FILE     0x0008
+#define EXT4_RO_COMPAT_DIR_NLINK     0x0020
+#define EXT4_RO_COMPAT_EXTRA_ISIZE   0x0040
+
+struct ext4_sb {
+	uint32_t inodes_count;
+	uint32_t blocks_count_lo;
+	uint32_t r_blocks_count_lo;
+	uint32_t free_blocks_count_lo;
+	uint32_t free_inodes_count;
+	uint32_t first_data_block;
+	uint32_t log_block_size;
+	uint32_t log_cluster_size;
+	uint32_t blocks_per_group;
+	uint32_t clusters_per_group;
+	uint32_t inodes_per_group;
+	uint32_t mtime;
+	uint32_t wtime;
+	uint16_t mnt_count;
+	uint16_t max_mnt_count;
+	uint16_t magic;
+	uint16_t state;
+	uint16_t errors;
+	uint16_t minor_rev_level;
+	uint32_t lastcheck;
+	uint32_t checkinterval;
+	uint32_t creator_os;
+	uint32_t rev_level;
+	uint16_t def_resuid;
+	uint16_t def_resgid;
+	uint32_t first_ino;
+	uint16_t inode_size;
+	uint16_t block_group_nr;
+	uint32_t feature_compat;
+	uint32_t feature_incompat;
+	uint32_t feature_ro_compat;
+	uint8_t  uuid[16];
+	char     volume_name[16];
+	char     last_mounted[64];
+	uint32_t algorithm_usage_bitmap;
+	uint8_t  prealloc_blocks;
+	uint8_t  prealloc_dir_blocks;
+	uint16_t reserved_gdt_blocks;
+	uint8_t  journal_uuid[16];
+	uint32_t journal_inum;
+	uint32_t journal_dev;
+	uint32_t last_orphan;
+	uint32_t hash_seed[4];
+	uint8_t  def_hash_version;
+	uint8_t  jnl_backup_type;
+	uint16_t desc_size;
+	uint32_t default_mount_opts;
+	uint32_t first_meta_bg;
+	uint32_t mkfs_time;
+	uint32_t jnl_blocks[17];
+	uint32_t blocks_count_hi;
+	uint32_t r_blocks_count_hi;
+	uint32_t free_blocks_count_hi;
+	uint16_t min_extra_isize;
+	uint16_t want_extra_isize;
+	uint32_t flags;
+	uint8_t  pad[1024 - 0x164];
+};
+
+struct ext4_group_desc {
+	uint32_t block_bitmap;
+	uint32_t inode_bitmap;
+	uint32_t inode_table;
+	uint16_t free_blocks_count;
+	uint16_t free_inodes_count;
+	uint16_t used_dirs_count;
+	uint16_t flags;
+	uint32_t exclude_bitmap;
+	uint16_t block_bitmap_csum;
+	uint16_t inode_bitmap_csum;
+	uint16_t itable_unused;
+	uint16_t checksum;
+};
+
+#define EXT4_ROOT_INO        2
+#define EXT4_JOURNAL_INO     8
+#define EXT4_FIRST_INO       11
+#define EXT4_INODE_SIZE      256
+#define EXT4_EXTRA_ISIZE     32
+#define EXT4_EXTENTS_FL      0x80000
+
+struct ext4_inode {
+	uint16_t mode;
+	uint16_t uid;
+	uint32_t size_lo;
+	uint32_t atime;
+	uint32_t ctime;
+	uint32_t mtime;
+	uint32_t dtime;
+	uint16_t gid;
+	uint16_t links_count;
+	uint32_t blocks_lo;      /* In 512 byte sectors */
+	uint32_t flags;
+	uint32_t osd1;
+	uint32_t block[15];      /* Extent tree root when EXT4_EXTENTS_FL */
+	uint32_t generation;
+	uint32_t file_acl_lo;
+	uint32_t size_high;
+	uint32_t obso_faddr;
+	uint8_t  osd2[12];
+	uint16_t extra_isize;
+	uint16_t checksum_hi;
+	uint32_t ctime_extra;
+	uint32_t mtime_extra;
+	uint32_t atime_extra;
+	uint32_t crtime;
+	uint32_t crtime_extra;
+	uint32_t version_hi;
+	uint32_t projid;
+	uint8_t  xattr[EXT4_INODE_SIZE - 160];    /* In inode extended attributes */
+};
+
+#define EXT4_EXT_MAGIC       0xF30A
+
+struct ext4_extent_header {
+	uint16_t magic;
+	uint16_t entries;
+	uint16_t max;
+	uint16_t depth;
+	uint32_t generation;
+};
+
+struct ext4_extent {
+	uint32_t block;
+	uint16_t len;
+	uint16_t start_hi;
+	uint32_t start_lo;
+};
+
+#define EXT4_XATTR_MAGIC     0xEA020000
+#define EXT4_XATTR_SECURITY  6
+
+struct ext4_xattr_entry {
+	uint8_t  name_len;
+	uint8_t  name_index;
+	uint16_t value_offs;     /* From the first entry */
+	uint32_t value_inum;
+	uint32_t value_size;
+	uint32_t hash;
+	char     name[];
+};
+
+#define EXT4_FT_DIR          2
+
+struct ext4_dir_entry {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t  name_len;
+	uint8_t  file_type;
+	char     name[];
+};
+
+/* jbd2, big endian */
+
+#define JBD2_MAGIC           0xC03B3998
+#define JBD2_SUPERBLOCK_V2   4
+
+struct jbd2_sb {
+	uint32_t magic;
+	uint32_t blocktype;
+	uint32_t sequence;
+	uint32_t blocksize;
+	uint32_t maxlen;
+	uint32_t first;
+	uint32_t s_sequence;
+	uint32_t start;
+	uint32_t errno_;
+	uint32_t feature_compat;
+	uint32_t feature_incompat;
+	uint32_t feature_ro_compat;
+	uint8_t  uuid[16];
+	uint32_t nr_users;
+	uint32_t dynsuper;
+	uint32_t max_transaction;
+	uint32_t max_trans_data;
+};
+
+#endif
@@ -2,63 +2,226 @@
  */
 
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
 #include <linux/loop.h>
 
 #include "magisk.h"
 #include "utils.h"
+#include "ext4.h"
+
 #ifdef PIXEL
 #define SYSBIN_DIR "/sbin"
 #else
 #define SYSBIN_DIR "/system/bin"
 #endif
 
+#define EXT4_BG_FREE_LO 0x0C
+#define EXT4_BG_FREE_HI 0x2C
+
+static int read_sb(int fd, struct ext4_sb *sb) {
+	if (pread(fd, sb, sizeof(*sb), EXT4_SB_OFFSET) != sizeof(*sb))
+		return 1;
+	return le16toh(sb->magic) != EXT4_SUPER_MAGIC || le32toh(sb->log_block_size) > 6;
+}
+
+// Not cleanly unmounted, has errors, or has a journal to replay
+static int sb_dirty(struct ext4_sb *sb) {
+	return (le16toh(sb->state) & (EXT4_VALID_FS | EXT4_ERROR_FS)) != EXT4_VALID_FS
+		|| (le32toh(sb->feature_incompat) & EXT4_INCOMPAT_RECOVER);
+}
+
+/*
+ * Used and total blocks from the superblock and the group descriptors.
+ * The free count in the superblock is only updated lazily by the kernel,
+ * the one in each group descriptor is always current.
+ */
+static int ext4_blocks(const char *img, uint64_t *used, uint64_t *total, uint32_t *bsize) {
+	struct ext4_sb sb;
+	uint64_t blocks, nfree = 0;
+	uint32_t groups, per_group, dsize;
+	uint8_t *gdt;
+	int fd, ret = 1;
+
+	if ((fd = open(img, O_RDONLY | O_CLOEXEC)) < 0)
+		return 1;
+	if (read_sb(fd, &sb) || sb_dirty(&sb))
+		goto done;
+
+	*bsize = 1024 << le32toh(sb.log_block_size);
+	blocks = le32toh(sb.blocks_count_lo);
+	dsize = 32;
+	if (le32toh(sb.feature_incompat) & EXT4_INCOMPAT_64BIT) {
+		blocks |= (uint64_t) le32toh(sb.blocks_count_hi) << 32;
+		dsize = le16toh(sb.desc_size);
+		if (dsize < 64)
+			goto done;
+	}
+	per_group = le32toh(sb.blocks_per_group);
+	if (per_group == 0 || blocks <= le32toh(sb.first_data_block))
+		goto done;
+	groups = (blocks - le32toh(sb.first_data_block) + per_group - 1) / per_group;
+
+	// Descriptors start in the block after the superblock
+	gdt = xmalloc((size_t) groups * dsize);
+	if (pread(fd, gdt, (size_t) groups * dsize, (off_t) (le32toh(sb.first_data_block) + 1) * *bsize)
+			== (ssize_t) groups * dsize) {
+		for (uint32_t i = 0; i < groups; ++i) {
+			uint8_t *bg = gdt + (size_t) i * dsize;
+			nfree += le16toh(*(uint16_t *) (bg + EXT4_BG_FREE_LO));
+			if (dsize >= 64)
+				nfree += (uint32_t) le16toh(*(uint16_t *) (bg + EXT4_BG_FREE_HI)) << 16;
+		}
+		if (nfree <= blocks) {
+			*used = blocks - nfree;
+			*total = blocks;
+			ret = 0;
+		}
+	}
+	free(gdt);
+
+done:
+	close(fd);
+	return ret;
+}
+
+static int img_clean(const char *img) {
+	struct ext4_sb sb;
+	int fd, clean;
+	if ((fd = open(img, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	clean = read_sb(fd, &sb) == 0 && !sb_dirty(&sb);
+	close(fd);
+	return clean;
+}
+
 static int e2fsck(const char *img) {
 	// Check and repair ext4 image
 	char buffer[128];
+	struct line_reader lr;
 	int pid, fd = -1;
 	char *const command[] = { "e2fsck", "-yf", (char *) img, NULL };
 	pid = run_command(1, &fd, SYSBIN_DIR "/e2fsck", command);
 	if (pid < 0)
 		return 1;
-	while (fdgets(buffer, sizeof(buffer), fd))
+	lr_init(&lr, fd);
+	while (lr_gets(&lr, buffer, sizeof(buffer)))
 		LOGD("magisk_img: %s", buffer);
 	waitpid(pid, NULL, 0);
 	close(fd);
 	return 0;
 }
 
-static char *loopsetup(const char *img) {
-	char device[20];
+/* Newer loop interfaces, missing from old headers */
+
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE    0x4C82
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO   0x4C08
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO   16
+#endif
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE       0x4C0A
+struct loop_config {
+	uint32_t fd;
+	uint32_t block_size;
+	struct loop_info64 info;
+	uint64_t reserved[8];
+};
+#endif
+
+#define LOOP_MAJOR 7
+
+// Open the block device of loop n, ueventd might not have created the node yet
+static int loop_open(int n, char *device, size_t size) {
+	snprintf(device, size, "/dev/block/loop%d", n);
+	if (access(device, F_OK) && mknod(device, S_IFBLK | 0600, makedev(LOOP_MAJOR, n)))
+		return -1;
+	return open(device, O_RDWR | O_CLOEXEC);
+}
+
+// Return an opened unused loop device, -1 if there is none
+static int loop_get_free(char *device, size_t size) {
 	struct loop_info64 info;
-	int i, lfd, ffd;
-	memset(&info, 0, sizeof(info));
-	// First get an empty loop device
-	for (i = 0; i <= 7; ++i) {
-		sprintf(device, "/dev/block/loop%d", i);
-		lfd = xopen(device, O_RDWR);
-		if (ioctl(lfd, LOOP_GET_STATUS64, &info) == -1)
+	int n, fd;
+	if ((fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC)) >= 0) {
+		// Allocates a new device if all of them are in use
+		n = ioctl(fd, LOOP_CTL_GET_FREE);
+		close(fd);
+		if (n >= 0 && (fd = loop_open(n, device, size)) >= 0)
+			return fd;
+	}
+	// No loop-control, probe the existing devices
+	for (n = 0; ; ++n) {
+		snprintf(device, size, "/dev/block/loop%d", n);
+		if ((fd = open(device, O_RDWR | O_CLOEXEC)) < 0)
+			break;
+		if (ioctl(fd, LOOP_GET_STATUS64, &info) == -1 && errno == ENXIO)
+			return fd;
+		close(fd);
+	}
+	return -1;
+}
+
+static char *loopsetup(const char *img, int flags) {
+	char device[32];
+	struct loop_config config;
+	int i, lfd = -1, ffd;
+	if ((ffd = xopen(img, O_RDWR | O_CLOEXEC)) < 0)
+		return NULL;
+	memset(&config, 0, sizeof(config));
+	config.fd = ffd;
+	strncpy((char *) config.info.lo_file_name, img, LO_NAME_SIZE - 1);
+	if (flags & IMG_DIRECT_IO)
+		config.info.lo_flags = LO_FLAGS_DIRECT_IO;
+	// Someone else may grab the free device first, try again then
+	for (i = 0; i < 4; ++i) {
+		if ((lfd = loop_get_free(device, sizeof(device))) < 0)
+			break;
+		// 5.8+ attaches the file with all the flags in one go
+		if (ioctl(lfd, LOOP_CONFIGURE, &config) == 0)
 			break;
+		if (ioctl(lfd, LOOP_SET_FD, ffd) == 0) {
+			config.info.lo_flags = 0;
+			ioctl(lfd, LOOP_SET_STATUS64, &config.info);
+			// Not supported before 4.4, or by the filesystem of the image
+			if ((flags & IMG_DIRECT_IO) && ioctl(lfd, LOOP_SET_DIRECT_IO, 1))
+				LOGW("magisk_img: %s has no direct I/O\n", device);
+			break;
+		}
 		close(lfd);
+		lfd = -1;
+		if (errno != EBUSY)
+			break;
 	}
-	if (i == 8) return NULL;
-	ffd = xopen(img, O_RDWR);
-	if (ioctl(lfd, LOOP_SET_FD, ffd) == -1)
+	close(ffd);
+	if (lfd < 0) {
+		LOGE("magisk_img: no free loop device for %s\n", img);
 		return NULL;
-	strcpy((char *) info.lo_file_name, img);
-	ioctl(lfd, LOOP_SET_STATUS64, &info);
+	}
 	close(lfd);
-	close(ffd);
 	return strdup(device);
 }
 
+#define IMG_CONTEXT "u:object_r:system_file:s0"
+
 int create_img(const char *img, int size) {
 	unlink(img);
 	LOGI("Create %s with size %dM\n", img, size);
+	if (ext4_create(img, (uint64_t) size << 20, IMG_CONTEXT) == 0)
+		return 0;
+	LOGW("magisk_img: cannot build %s, try make_ext4fs\n", img);
 	// Create a temp file with the file contexts
-	char file_contexts[] = "/magisk(/.*)? u:object_r:system_file:s0\n";
+	char file_contexts[] = "/magisk(/.*)? " IMG_CONTEXT "\n";
 	// If not root, attempt to create in current diretory
 	char *filename = getuid() == UID_ROOT ? "/dev/file_contexts_image" : "file_contexts_image";
 	int pid, status, fd = xopen(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
@@ -79,13 +242,24 @@ int create_img(const char *img, int size) {
 int get_img_size(const char *img, int *used, int *total) {
 	if (access(img, R_OK) == -1)
 		return 1;
+	uint64_t u, t;
+	uint32_t bsize;
+	if (ext4_blocks(img, &u, &t, &bsize) == 0) {
+		// Same rounding as the e2fsck output below, in MB
+		*used = (u * bsize >> 20) + 1;
+		*total = t * bsize >> 20;
+		return 0;
+	}
+	// Dirty or unknown image, let e2fsck figure it out
 	char buffer[PATH_MAX];
+	struct line_reader lr;
 	int pid, fd = -1, status = 1;
 	char *const command[] = { "e2fsck", "-n", (char *) img, NULL };
 	pid = run_command(1, &fd, SYSBIN_DIR "/e2fsck", command);
 	if (pid < 0)
 		return 1;
-	while (fdgets(buffer, sizeof(buffer), fd)) {
+	lr_init(&lr, fd);
+	while (lr_gets(&lr, buffer, sizeof(buffer))) {
 		if (strstr(buffer, img)) {
 			char *tok = strtok(buffer, ",");
 			while(tok != NULL) {
@@ -109,23 +283,28 @@ int get_img_size(const char *img, int *used, int *total) {
 
 int resize_img(const char *img, int size) {
 	LOGI("Resize %s to %dM\n", img, size);
+	// Clean images in the plain layout only need their metadata rewritten
+	if (img_clean(img) && ext4_resize(img, (uint64_t) size << 20) == 0)
+		return 0;
 	if (e2fsck(img))
 		return 1;
 	char buffer[128];
+	struct line_reader lr;
 	int pid, status, fd = -1;
 	snprintf(buffer, sizeof(buffer), "%dM", size);
 	char *const command[] = { "resize2fs", (char *) img, buffer, NULL };
 	pid = run_command(1, &fd, SYSBIN_DIR "/resize2fs", command);
 	if (pid < 0)
 		return 1;
-	while (fdgets(buffer, sizeof(buffer), fd))
+	lr_init(&lr, fd);
+	while (lr_gets(&lr, buffer, sizeof(buffer)))
 		LOGD("magisk_img: %s", buffer);
 	close(fd);
 	waitpid(pid, &status, 0);
 	return WEXITSTATUS(status);
 }
 
-char *mount_image(const char *img, const char *target) {
+char *mount_image(const char *img, const char *target, int flags) {
 	if (access(img, F_OK) == -1)
 		return NULL;
 	if (access(target, F_OK) == -1) {
@@ -136,10 +315,11 @@ char *mount_image(const char *img, const char *target) {
 		}
 	}
 
-	if (e2fsck(img))
+	// Only check images that were not cleanly unmounted
+	if (!img_clean(img) && e2fsck(img))
 		return NULL;
 
-	char *device = loopsetup(img);
+	char *device = loopsetup(img, flags);
 	if (device)
 		xmount(device, target, "ext4", 0, NULL);
 	return device;
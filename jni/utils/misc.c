@@ -14,6 +14,7 @@
 #include <sched.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -63,37 +64,97 @@ int check_data() {
 	return ret;
 }
 
-/* All the string should be freed manually!! */
-int file_to_vector(const char* filename, struct vector *v) {
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
+/* The whole file in one buffer, lines are split in place and null terminated */
+int lv_read(const char *filename, struct line_view *lv) {
+	size_t len = 0, cap = 4096, lcap = 64;
+	ssize_t n;
+	int fd;
 
-	FILE *fp = fopen(filename, "r");
-	if (fp == NULL)
+	memset(lv, 0, sizeof(*lv));
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
 		return 1;
-
-	while ((read = getline(&line, &len, fp)) != -1) {
-		// Remove end newline
-		if (line[read - 1] == '\n')
-			line[read - 1] = '\0';
-		vec_push_back(v, line);
-		line = NULL;
+	// procfs files report no size, so just keep reading
+	lv->buf = xmalloc(cap);
+	while ((n = read(fd, lv->buf + len, cap - len - 1)) > 0) {
+		len += n;
+		if (len + 1 == cap) {
+			cap *= 2;
+			lv->buf = xrealloc(lv->buf, cap);
+		}
+	}
+	close(fd);
+	lv->buf[len] = '\0';
+
+	lv->lines = xmalloc(lcap * sizeof(*lv->lines));
+	for (char *line = lv->buf, *end; line < lv->buf + len; line = end + 1) {
+		if ((end = memchr(line, '\n', lv->buf + len - line)) == NULL)
+			end = lv->buf + len;
+		*end = '\0';
+		if (lv->count == lcap) {
+			lcap *= 2;
+			lv->lines = xrealloc(lv->lines, lcap * sizeof(*lv->lines));
+		}
+		lv->lines[lv->count].s = line;
+		lv->lines[lv->count].len = end - line;
+		++lv->count;
 	}
-	fclose(fp);
 	return 0;
 }
 
-int vector_to_file(const char *filename, struct vector *v) {
-	FILE *fp = xfopen(filename, "w");
-	if (fp == NULL)
+void lv_free(struct line_view *lv) {
+	free(lv->buf);
+	free(lv->lines);
+	memset(lv, 0, sizeof(*lv));
+}
+
+/* All the string should be freed manually!! */
+int file_to_vector(const char* filename, struct vector *v) {
+	struct line_view lv;
+	if (lv_read(filename, &lv))
 		return 1;
-	char *line;
+	vec_reserve(v, vec_size(v) + lv.count);
+	for (size_t i = 0; i < lv.count; ++i)
+		vec_push_back(v, strndup(lv.lines[i].s, lv.lines[i].len));
+	lv_free(&lv);
+	return 0;
+}
+
+/* One write to a temp file, then renamed over, so readers never see half a list */
+int vector_to_file(const char *filename, struct vector *v) {
+	char tmp[PATH_MAX], *buf, *line;
+	size_t len = 0, cap = 0, n;
+	ssize_t ret;
+	int fd;
+
+	vec_for_each(v, line)
+		cap += strlen(line) + 1;
+	buf = xmalloc(cap + 1);
 	vec_for_each(v, line) {
-		fprintf(fp, "%s\n", line);
+		n = strlen(line);
+		memcpy(buf + len, line, n);
+		buf[len + n] = '\n';
+		len += n + 1;
 	}
-	fclose(fp);
-	return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	if ((fd = xopen(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		free(buf);
+		return 1;
+	}
+	for (n = 0; n < len; n += ret) {
+		if ((ret = write(fd, buf + n, len - n)) < 0 && errno != EINTR)
+			break;
+		if (ret < 0)
+			ret = 0;
+	}
+	free(buf);
+	if (n < len || fsync(fd)) {
+		close(fd);
+		unlink(tmp);
+		return 1;
+	}
+	close(fd);
+	return rename(tmp, filename) ? 1 : 0;
 }
 
 /* Check if the string only contains digits */
@@ -119,51 +180,182 @@ ssize_t fdgets(char *buf, const size_t size, int fd) {
 	return len;
 }
 
+void lr_init(struct line_reader *r, int fd) {
+	r->fd = fd;
+	r->head = r->tail = 0;
+}
+
+/* Same records as fdgets, but one read for up to a buffer of them */
+ssize_t lr_gets(struct line_reader *r, char *buf, size_t size) {
+	ssize_t len = 0, n;
+	char c;
+	while (len < size - 1) {
+		if (r->head == r->tail) {
+			while ((n = read(r->fd, r->buf, sizeof(r->buf))) < 0 && errno == EINTR);
+			if (n <= 0)
+				break;
+			r->head = 0;
+			r->tail = n;
+		}
+		c = r->buf[r->head++];
+		if (c == '\0')
+			break;
+		buf[len++] = c;
+		if (c == '\n')
+			break;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+/* The pid of each batch of /proc entries, -1 when done, -2 on errors */
+static int next_pid(int fd, char *buf, size_t size, int *pos, int *len) {
+	struct dirent *entry;
+	while (1) {
+		if (*pos >= *len) {
+			*len = syscall(__NR_getdents64, fd, buf, size);
+			*pos = 0;
+			if (*len <= 0)
+				return *len < 0 ? -2 : -1;
+		}
+		entry = (struct dirent *) (buf + *pos);
+		*pos += entry->d_reclen;
+		if (entry->d_type == DT_DIR && isNum(entry->d_name))
+			return atoi(entry->d_name);
+	}
+}
+
 /* Call func for each process */
 void ps(void (*func)(int)) {
-	DIR *dir;
-	struct dirent *entry;
+	char buf[8192];
+	int fd, pid, pos = 0, len = 0;
 
-	if (!(dir = xopendir("/proc")))
+	if ((fd = xopen("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
 		return;
+	while ((pid = next_pid(fd, buf, sizeof(buf), &pos, &len)) >= 0)
+		func(pid);
+	close(fd);
+}
 
-	while ((entry = xreaddir(dir))) {
-		if (entry->d_type == DT_DIR) {
-			if (isNum(entry->d_name))
-				func(atoi(entry->d_name));
+// Process name is the first record of cmdline, kernel threads only have comm
+static ssize_t read_proc_name(int pid, char *buf, size_t size) {
+	char path[32];
+	ssize_t len;
+	int fd;
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len > 0 && buf[0] != '\0') {
+		buf[len] = '\0';
+		return strlen(buf);
+	}
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	// comm ends with a newline
+	if (len > 0 && buf[len - 1] == '\n')
+		--len;
+	buf[len > 0 ? len : 0] = '\0';
+	return len > 0 ? len : 0;
+}
+
+// 32 bit FNV-1a
+static uint32_t name_hash(const char *s) {
+	uint32_t h = 2166136261U;
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* One pass over /proc, all names are packed in a single buffer */
+int proc_table_read(struct proc_table *t) {
+	char dents[8192], name[256];
+	size_t len = 0, cap = 16384, ecap = 256;
+	ssize_t n;
+	int fd, pid, pos = 0, dlen = 0;
+
+	memset(t, 0, sizeof(*t));
+	if ((fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return 1;
+	t->buf = xmalloc(cap);
+	t->entries = xmalloc(ecap * sizeof(*t->entries));
+	while ((pid = next_pid(fd, dents, sizeof(dents), &pos, &dlen)) >= 0) {
+		// Gone already
+		if ((n = read_proc_name(pid, name, sizeof(name))) < 0)
+			continue;
+		if (len + n + 1 > cap) {
+			cap *= 2;
+			t->buf = xrealloc(t->buf, cap);
 		}
+		if (t->count == ecap) {
+			ecap *= 2;
+			t->entries = xrealloc(t->entries, ecap * sizeof(*t->entries));
+		}
+		memcpy(t->buf + len, name, n + 1);
+		t->entries[t->count].pid = pid;
+		t->entries[t->count].hash = name_hash(name);
+		++t->count;
+		len += n + 1;
 	}
-	
-	closedir(dir);
+	close(fd);
+	// Names are in order, point to them once the buffer stops moving
+	char *p = t->buf;
+	for (size_t i = 0; i < t->count; p += strlen(p) + 1, ++i)
+		t->entries[i].name = p;
+	return pid == -2;
 }
 
-// Internal usage
-static void (*ps_filter_cb)(int);
-static const char *ps_filter_pattern;
-static void proc_name_filter(int pid) {
-	char buf[64];
-	int fd;
-	snprintf(buf, sizeof(buf), "/proc/%d/cmdline", pid);
-	if ((fd = open(buf, O_RDONLY)) == -1)
+/* Call func for each process named one of names, a hash set for the names keeps it one pass */
+void proc_table_match(struct proc_table *t, char *const *names, size_t count, void (*func)(int)) {
+	size_t size = 16, slot;
+	uint32_t h, *hashes;
+	int *set;
+
+	if (count == 0)
 		return;
-	if (fdgets(buf, sizeof(buf), fd) == 0) {
-		snprintf(buf, sizeof(buf), "/proc/%d/comm", pid);
-		close(fd);
-		if ((fd = open(buf, O_RDONLY)) == -1)
-			return;
-		fdgets(buf, sizeof(buf), fd);
+	while (size < count * 2)
+		size *= 2;
+	set = xcalloc(size, sizeof(*set));
+	hashes = xmalloc(count * sizeof(*hashes));
+	// Slots hold the name index + 1
+	for (size_t i = 0; i < count; ++i) {
+		hashes[i] = name_hash(names[i]);
+		for (slot = hashes[i] & (size - 1); set[slot]; slot = (slot + 1) & (size - 1));
+		set[slot] = i + 1;
 	}
-	if (strcmp(buf, ps_filter_pattern) == 0) {
-		ps_filter_cb(pid);
+	for (size_t i = 0; i < t->count; ++i) {
+		h = t->entries[i].hash;
+		for (slot = h & (size - 1); set[slot]; slot = (slot + 1) & (size - 1)) {
+			int n = set[slot] - 1;
+			if (hashes[n] == h && strcmp(names[n], t->entries[i].name) == 0) {
+				func(t->entries[i].pid);
+				break;
+			}
+		}
 	}
-	close(fd);
+	free(set);
+	free(hashes);
+}
+
+void proc_table_free(struct proc_table *t) {
+	free(t->buf);
+	free(t->entries);
+	memset(t, 0, sizeof(*t));
 }
 
 /* Call func with process name filtered with pattern */
 void ps_filter_proc_name(const char *pattern, void (*func)(int)) {
-	ps_filter_cb = func;
-	ps_filter_pattern = ((pattern == NULL) ? "" : pattern);
-	ps(proc_name_filter);
+	struct proc_table t;
+	char *name = (char *) (pattern == NULL ? "" : pattern);
+	proc_table_read(&t);
+	proc_table_match(&t, &name, 1, func);
+	proc_table_free(&t);
 }
 
 int create_links(const char *bin, const char *path) {
@@ -252,6 +444,8 @@ int run_command(int err, int *fd, const char *path, char *const argv[]) {
 		if (err) xdup2(writeEnd, STDERR_FILENO);
 	}
 
+	// The daemon ignores it
+	signal(SIGPIPE, SIG_DFL);
 	execv(path, argv);
 	PLOGE("execv");
 	return -1;
@@ -293,6 +487,30 @@ int open_new(const char *filename) {
 }
 
 // file/link -> file/link only!!
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// Copy a whole file, share the blocks or copy in kernel when the filesystem can
+ssize_t copy_fd(int sfd, int tfd, size_t count) {
+	if (ioctl(tfd, FICLONE, sfd) == 0)
+		return count;
+	size_t done = 0;
+	ssize_t ret;
+#ifdef __NR_copy_file_range
+	while (done < count) {
+		ret = syscall(__NR_copy_file_range, sfd, NULL, tfd, NULL, count - done, 0);
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+#endif
+	// Not supported, or across filesystems on older kernels
+	if (done < count && (ret = xsendfile(tfd, sfd, NULL, count - done)) > 0)
+		done += ret;
+	return done;
+}
+
 int cp_afc(const char *source, const char *target) {
 	struct stat buf;
 	xlstat(source, &buf);
@@ -302,7 +520,7 @@ int cp_afc(const char *source, const char *target) {
 		int sfd, tfd;
 		sfd = xopen(source, O_RDONLY);
 		tfd = xopen(target, O_WRONLY | O_CREAT | O_TRUNC);
-		xsendfile(tfd, sfd, NULL, buf.st_size);
+		copy_fd(sfd, tfd, buf.st_size);
 		fclone_attr(sfd, tfd);
 		close(sfd);
 		close(tfd);
@@ -320,49 +538,177 @@ int cp_afc(const char *source, const char *target) {
 	return 0;
 }
 
-int clone_dir(const char *source, const char *target) {
-	DIR *dir;
-	struct dirent *entry;
-	char *s_path, *t_path;
+// Selinux calls only take paths for symlinks, reach name through the open directory
+static void fd_path(int dirfd, const char *name, char *buf, size_t size) {
+	snprintf(buf, size, "/proc/self/fd/%d/%s", dirfd, name);
+}
 
-	if (!(dir = xopendir(source)))
+// Copy name from sdir to tdir, both are open directories. st is the source
+static int cp_afc_at(int sdir, int tdir, const char *name, struct stat *st) {
+	char path[PATH_MAX], *con;
+	int sfd, tfd;
+	if (!S_ISREG(st->st_mode) && !S_ISLNK(st->st_mode))
 		return 1;
+	unlinkat(tdir, name, 0);
+	if (S_ISREG(st->st_mode)) {
+		if ((sfd = openat(sdir, name, O_RDONLY | O_CLOEXEC)) < 0)
+			return 1;
+		if ((tfd = openat(tdir, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0)) < 0) {
+			close(sfd);
+			return 1;
+		}
+		copy_fd(sfd, tfd, st->st_size);
+		fclone_attr(sfd, tfd);
+		close(sfd);
+		close(tfd);
+	} else if (S_ISLNK(st->st_mode)) {
+		ssize_t len = readlinkat(sdir, name, path, sizeof(path) - 1);
+		if (len < 0)
+			return 1;
+		path[len] = '\0';
+		if (symlinkat(path, tdir, name))
+			return 1;
+		fchownat(tdir, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+		fd_path(sdir, name, path, sizeof(path));
+		if (lgetfilecon(path, &con) >= 0) {
+			fd_path(tdir, name, path, sizeof(path));
+			lsetfilecon(path, con);
+			freecon(con);
+		}
+	}
+	return 0;
+}
 
-	s_path = xmalloc(PATH_MAX);
-	t_path = xmalloc(PATH_MAX);
-
-	mkdir_p(target, 0755);
-	clone_attr(source, target);
+// Both fds are open directories, they are closed when done
+static void clone_dir_at(int sdir, int tdir) {
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	int s_sub, t_sub;
 
+	if (!(dir = fdopendir(sdir))) {
+		close(sdir);
+		close(tdir);
+		return;
+	}
+	fclone_attr(sdir, tdir);
 	while ((entry = xreaddir(dir))) {
 		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
 			continue;
-		snprintf(s_path, PATH_MAX, "%s/%s", source, entry->d_name);
-		snprintf(t_path, PATH_MAX, "%s/%s", target, entry->d_name);
-		switch (entry->d_type) {
-		case DT_DIR:
-			clone_dir(s_path, t_path);
-			break;
-		case DT_REG:
-		case DT_LNK:
-			cp_afc(s_path, t_path);
-			break;
+		if (fstatat(sdir, entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			mkdirat(tdir, entry->d_name, 0755);
+			s_sub = openat(sdir, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			t_sub = openat(tdir, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (s_sub >= 0 && t_sub >= 0) {
+				clone_dir_at(s_sub, t_sub);
+			} else {
+				if (s_sub >= 0) close(s_sub);
+				if (t_sub >= 0) close(t_sub);
+			}
+		} else {
+			cp_afc_at(sdir, tdir, entry->d_name, &st);
 		}
 	}
-	free(s_path);
-	free(t_path);
-
 	closedir(dir);
+	close(tdir);
+}
+
+int clone_dir(const char *source, const char *target) {
+	int sdir, tdir;
+	if ((sdir = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		PLOGE("open %s", source);
+		return 1;
+	}
+	mkdir_p(target, 0755);
+	if ((tdir = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		PLOGE("open %s", target);
+		close(sdir);
+		return 1;
+	}
+	clone_dir_at(sdir, tdir);
 	return 0;
 }
 
+/*
+ * Directories being emptied are kept on an explicit stack. Each one keeps its
+ * own getdents64 batch, name points into the batch of its parent
+ */
+struct rm_dir {
+	int fd;
+	const char *name;
+	int pos, len;
+	char buf[4096];
+};
+
+// Like rm -rf, symlinks are removed and never followed. Return -1 if anything is left
 int rm_rf(const char *target) {
-	if (access(target, F_OK) == -1)
-		return 0;
-	// Use external rm command, saves a lot of headache and issues
-	char command[PATH_MAX];
-	snprintf(command, sizeof(command), "rm -rf %s", target);
-	return system(command);
+	struct stat st;
+	struct rm_dir **stack, *top, *child;
+	struct dirent *entry;
+	int depth = 0, cap = 16, ret = 0, fd, isdir;
+
+	if (lstat(target, &st))
+		return errno == ENOENT ? 0 : -1;
+	if (!S_ISDIR(st.st_mode))
+		return unlink(target);
+	if ((fd = open(target, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		return -1;
+
+	stack = xmalloc(cap * sizeof(*stack));
+	stack[0] = xmalloc(sizeof(**stack));
+	stack[0]->fd = fd;
+	stack[0]->name = target;
+	stack[0]->pos = stack[0]->len = 0;
+	depth = 1;
+
+	while (depth) {
+		top = stack[depth - 1];
+		if (top->pos >= top->len) {
+			top->len = syscall(__NR_getdents64, top->fd, top->buf, sizeof(top->buf));
+			top->pos = 0;
+			if (top->len <= 0) {
+				// Done with this directory
+				if (top->len < 0)
+					ret = -1;
+				close(top->fd);
+				--depth;
+				if (depth ? unlinkat(stack[depth - 1]->fd, top->name, AT_REMOVEDIR) : rmdir(target))
+					ret = -1;
+				free(top);
+				continue;
+			}
+		}
+		entry = (struct dirent *) (top->buf + top->pos);
+		top->pos += entry->d_reclen;
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		isdir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_UNKNOWN)
+			isdir = fstatat(top->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+		if (!isdir) {
+			if (unlinkat(top->fd, entry->d_name, 0))
+				ret = -1;
+			continue;
+		}
+		fd = openat(top->fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			ret = -1;
+			continue;
+		}
+		if (depth == cap) {
+			cap *= 2;
+			stack = xrealloc(stack, cap * sizeof(*stack));
+		}
+		child = xmalloc(sizeof(*child));
+		child->fd = fd;
+		child->name = entry->d_name;
+		child->pos = child->len = 0;
+		stack[depth++] = child;
+	}
+	free(stack);
+	return ret;
 }
 
 void clone_attr(const char *source, const char *target) {
@@ -382,9 +728,10 @@ void fclone_attr(const int sourcefd, const int targetfd) {
 	fchmod(targetfd, buf.st_mode & 0777);
 	fchown(targetfd, buf.st_uid, buf.st_gid);
 	char *con;
-	fgetfilecon(sourcefd, &con);
-	fsetfilecon(sourcefd, con);
-	free(con);
+	if (fgetfilecon(sourcefd, &con) >= 0) {
+		fsetfilecon(targetfd, con);
+		freecon(con);
+	}
 }
 
 void get_client_cred(int fd, struct ucred *cred) {
@@ -0,0 +1,126 @@
+/* mountinfo.c - Parse /proc/<pid>/mountinfo
+ *
+ * The whole file is read into one buffer and tokenized in place, entries
+ * point into the buffer. Octal escapes in paths are decoded.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "magisk.h"
+#include "utils.h"
+
+// Next space separated field of the line, NULL if there is none
+static char *next_field(char **pos) {
+	char *s = *pos;
+	if (s == NULL || *s == '\0')
+		return NULL;
+	char *e = strchr(s, ' ');
+	if (e) {
+		*e = '\0';
+		*pos = e + 1;
+	} else {
+		*pos = NULL;
+	}
+	return s;
+}
+
+// Paths escape space, tab, newline and backslash as \ooo
+static char *unescape(char *s) {
+	char *r = s, *w = s;
+	while (*r) {
+		if (r[0] == '\\' && r[1] >= '0' && r[1] <= '3' && r[2] >= '0' && r[2] <= '7'
+			&& r[3] >= '0' && r[3] <= '7') {
+			*w++ = (r[1] - '0') << 6 | (r[2] - '0') << 3 | (r[3] - '0');
+			r += 4;
+		} else {
+			*w++ = *r++;
+		}
+	}
+	*w = '\0';
+	return s;
+}
+
+// Format: id parent major:minor root target options [optional...] - type source super
+static int parse_line(char *line, struct mount_entry *e) {
+	char *pos = line, *f[6];
+	for (int i = 0; i < 6; ++i)
+		if ((f[i] = next_field(&pos)) == NULL)
+			return 1;
+	// Skip the optional fields
+	char *sep;
+	while ((sep = next_field(&pos)) && strcmp(sep, "-") != 0);
+	if (sep == NULL)
+		return 1;
+	char *type = next_field(&pos), *source = next_field(&pos);
+	if (source == NULL)
+		return 1;
+	e->id = atoi(f[0]);
+	e->parent = atoi(f[1]);
+	e->root = unescape(f[3]);
+	e->target = unescape(f[4]);
+	e->type = type;
+	e->source = unescape(source);
+	return 0;
+}
+
+// pid 0 is the current process, return 1 on errors
+int mount_table_read(int pid, struct mount_table *t) {
+	char path[32];
+	size_t len = 0, cap = 16384;
+	ssize_t n;
+	int fd;
+
+	memset(t, 0, sizeof(*t));
+	if (pid)
+		snprintf(path, sizeof(path), "/proc/%d/mountinfo", pid);
+	else
+		strcpy(path, "/proc/self/mountinfo");
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 1;
+	// procfs returns at most a page per read, but usually everything fits the first buffer
+	t->buf = xmalloc(cap);
+	while ((n = read(fd, t->buf + len, cap - len - 1)) > 0) {
+		len += n;
+		if (len + 1 == cap) {
+			cap *= 2;
+			t->buf = xrealloc(t->buf, cap);
+		}
+	}
+	close(fd);
+	t->buf[len] = '\0';
+
+	size_t lines = 0;
+	for (char *p = t->buf; *p; ++p)
+		lines += *p == '\n';
+	t->entries = xmalloc((lines + 1) * sizeof(*t->entries));
+
+	char *line = t->buf, *end;
+	while (*line) {
+		if ((end = strchr(line, '\n')))
+			*end = '\0';
+		if (parse_line(line, &t->entries[t->count]) == 0)
+			++t->count;
+		if (end == NULL)
+			break;
+		line = end + 1;
+	}
+	return 0;
+}
+
+// Index of the entry with mount id, -1 if none
+int mount_table_find(struct mount_table *t, int id) {
+	for (size_t i = 0; i < t->count; ++i)
+		if (t->entries[i].id == id)
+			return i;
+	return -1;
+}
+
+void mount_table_free(struct mount_table *t) {
+	free(t->buf);
+	free(t->entries);
+	memset(t, 0, sizeof(*t));
+}
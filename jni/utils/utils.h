@@ -5,10 +5,12 @@
 #define _UTILS_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 
 #include "vector.h"
@@ -29,6 +31,7 @@ FILE *xfdopen(int fd, const char *mode);
 int xopen2(const char *pathname, int flags);
 int xopen3(const char *pathname, int flags, mode_t mode);
 ssize_t xwrite(int fd, const void *buf, size_t count);
+ssize_t xwritev(int fd, const struct iovec *iov, int iovcnt);
 ssize_t xread(int fd, void *buf, size_t count);
 ssize_t xxread(int fd, void *buf, size_t count);
 int xpipe2(int pipefd[2], int flags);
@@ -66,6 +69,8 @@ void *xmmap(void *addr, size_t length, int prot, int flags,
 	int fd, off_t offset);
 ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count);
 int xmkdir_p(const char *pathname, mode_t mode);
+// Text table of the calls made through the wrappers, only filled when built with XWRAP_STATS
+void xwrap_dump(int fd);
 
 // misc.c
 
@@ -73,12 +78,43 @@ unsigned get_shell_uid();
 unsigned get_system_uid();
 unsigned get_radio_uid();
 int check_data();
+struct line_span {
+	char *s;
+	size_t len;
+};
+struct line_view {
+	char *buf;
+	struct line_span *lines;
+	size_t count;
+};
+int lv_read(const char *filename, struct line_view *lv);
+void lv_free(struct line_view *lv);
 int file_to_vector(const char* filename, struct vector *v);
 int vector_to_file(const char* filename, struct vector *v);
 int isNum(const char *s);
 ssize_t fdgets(char *buf, size_t size, int fd);
+struct line_reader {
+	int fd;
+	int head, tail;
+	char buf[4096];
+};
+void lr_init(struct line_reader *r, int fd);
+ssize_t lr_gets(struct line_reader *r, char *buf, size_t size);
 void ps(void (*func)(int));
 void ps_filter_proc_name(const char *filter, void (*func)(int));
+struct proc_entry {
+	int pid;
+	uint32_t hash;
+	const char *name;
+};
+struct proc_table {
+	char *buf;
+	struct proc_entry *entries;
+	size_t count;
+};
+int proc_table_read(struct proc_table *t);
+void proc_table_match(struct proc_table *t, char *const *names, size_t count, void (*func)(int));
+void proc_table_free(struct proc_table *t);
 int create_links(const char *bin, const char *path);
 void unlock_blocks();
 void setup_sighandlers(void (*handler)(int));
@@ -86,6 +122,7 @@ int run_command(int err, int *fd, const char *path, char *const argv[]);
 int mkdir_p(const char *pathname, mode_t mode);
 int bind_mount(const char *from, const char *to);
 int open_new(const char *filename);
+ssize_t copy_fd(int sfd, int tfd, size_t count);
 int cp_afc(const char *source, const char *target);
 int clone_dir(const char *source, const char *target);
 int rm_rf(const char *target);
@@ -98,7 +135,33 @@ int switch_mnt_ns(int pid);
 int create_img(const char *img, int size);
 int get_img_size(const char *img, int *used, int *total);
 int resize_img(const char *img, int size);
-char *mount_image(const char *img, const char *target);
+#define IMG_DIRECT_IO 1    /* Skip the page cache of the image file itself */
+char *mount_image(const char *img, const char *target, int flags);
 void umount_image(const char *target, const char *device);
 
+// ext4.c
+int ext4_create(const char *img, uint64_t size, const char *context);
+int ext4_resize(const char *img, uint64_t size);
+
+// mountinfo.c
+
+struct mount_entry {
+	int id;
+	int parent;
+	const char *root;      /* Path inside the filesystem */
+	const char *target;
+	const char *type;
+	const char *source;
+};
+
+struct mount_table {
+	char *buf;
+	struct mount_entry *entries;
+	size_t count;
+};
+
+int mount_table_read(int pid, struct mount_table *t);
+int mount_table_find(struct mount_table *t, int id);
+void mount_table_free(struct mount_table *t);
+
 #endif
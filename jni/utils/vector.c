@@ -13,16 +13,36 @@ void vec_init(struct vector *v) {
 	vec_entry(v) = malloc(sizeof(void*));
 }
 
+/* Make room for at least n entries */
+void vec_reserve(struct vector *v, size_t n) {
+	if (v == NULL || n <= vec_cap(v)) return;
+	vec_cap(v) = n;
+	vec_entry(v) = realloc(vec_entry(v), sizeof(void*) * vec_cap(v));
+}
+
+/* Double the capacity, but skip the tiny sizes */
+static void vec_grow(struct vector *v) {
+	vec_reserve(v, vec_cap(v) < 4 ? 8 : vec_cap(v) * 2);
+}
+
 void vec_push_back(struct vector *v, void *p) {
 	if (v == NULL) return;
-	if (vec_size(v) == vec_cap(v)) {
-		vec_cap(v) *= 2;
-		vec_entry(v) = realloc(vec_entry(v), sizeof(void*) * vec_cap(v));
-	}
+	if (vec_size(v) == vec_cap(v))
+		vec_grow(v);
 	vec_entry(v)[vec_size(v)] = p;
 	++vec_size(v);
 }
 
+/* Insert p before index i, i == size appends */
+void vec_insert_at(struct vector *v, size_t i, void *p) {
+	if (v == NULL || i > vec_size(v)) return;
+	if (vec_size(v) == vec_cap(v))
+		vec_grow(v);
+	memmove(vec_entry(v) + i + 1, vec_entry(v) + i, sizeof(void*) * (vec_size(v) - i));
+	vec_entry(v)[i] = p;
+	++vec_size(v);
+}
+
 void *vec_pop_back(struct vector *v) {
 	void *ret = vec_entry(v)[vec_size(v) - 1];
 	--vec_size(v);
@@ -34,6 +54,29 @@ void vec_sort(struct vector *v, int (*compar)(const void *, const void *)) {
 	qsort(vec_entry(v), vec_size(v), sizeof(void*), compar);
 }
 
+/* Index of the first entry not less than key in a sorted vector
+ * compar gets the key and an entry
+ */
+size_t vec_lower_bound(struct vector *v, const void *key, int (*compar)(const void *, const void *)) {
+	size_t lo = 0, hi = v ? vec_size(v) : 0, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (compar(key, vec_entry(v)[mid]) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The entry equal to key in a sorted vector, NULL if there is none */
+void *vec_bsearch(struct vector *v, const void *key, int (*compar)(const void *, const void *)) {
+	size_t i = vec_lower_bound(v, key, compar);
+	if (i == vec_size(v) || compar(key, vec_entry(v)[i]) != 0)
+		return NULL;
+	return vec_entry(v)[i];
+}
+
 /* Will cleanup only the vector itself
  * use in cases when each element requires special cleanup 
  */
@@ -61,7 +104,7 @@ struct vector *vec_dup(struct vector *v) {
 	struct vector *ret = malloc(sizeof(*ret));
 	vec_size(ret) = vec_size(v);
 	vec_cap(ret) = vec_cap(v);
-	vec_entry(v) = malloc(sizeof(void*) * vec_cap(ret));
-	memcpy(vec_entry(ret), vec_entry(v), sizeof(void*) * vec_cap(ret));
+	vec_entry(ret) = malloc(sizeof(void*) * vec_cap(ret));
+	memcpy(vec_entry(ret), vec_entry(v), sizeof(void*) * vec_size(ret));
 	return ret;
 }
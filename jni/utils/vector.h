@@ -13,9 +13,13 @@ struct vector {
 };
 
 void vec_init(struct vector *v);
+void vec_reserve(struct vector *v, size_t n);
 void vec_push_back(struct vector *v, void *p);
+void vec_insert_at(struct vector *v, size_t i, void *p);
 void *vec_pop_back(struct vector *v);
 void vec_sort(struct vector *v, int (*compar)(const void *, const void *));
+size_t vec_lower_bound(struct vector *v, const void *key, int (*compar)(const void *, const void *));
+void *vec_bsearch(struct vector *v, const void *key, int (*compar)(const void *, const void *));
 void vec_destroy(struct vector *v);
 void vec_deep_destroy(struct vector *v);
 struct vector *vec_dup(struct vector *v);
@@ -25,11 +29,11 @@ struct vector *vec_dup(struct vector *v);
 #define vec_entry(v) (v)->data
 /* Usage: vec_for_each(vector *v, void *e) */
 #define vec_for_each(v, e) \
-	e = v ? (v)->data[0] : NULL; \
-	for (size_t _ = 0; v && _ < (v)->size; ++_, e = (v)->data[_])
+	e = v && (v)->size ? (v)->data[0] : NULL; \
+	for (size_t _ = 0; v && _ < (v)->size; ++_, e = _ < (v)->size ? (v)->data[_] : NULL)
 
 #define vec_for_each_r(v, e) \
-	e = v ? (v)->data[(v)->size - 1] : NULL; \
-	for (size_t _ = (v)->size; v && _ > 0; --_, e = (v)->data[_ - 1])
+	e = v && (v)->size ? (v)->data[(v)->size - 1] : NULL; \
+	for (size_t _ = v ? (v)->size : 0; _ > 0; --_, e = _ ? (v)->data[_ - 1] : NULL)
 
 #endif
\ No newline at end of file
@@ -20,12 +20,167 @@
 #include <sys/mount.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include "magisk.h"
 #include "utils.h"
 
+#ifdef XWRAP_STATS
+
+/* Syscall statistics
+ *
+ * Calls, bytes and latency of every wrapper, and of every place calling it.
+ * Call sites are return addresses, printed as offsets from the start of the
+ * executable: addr2line takes them as is for PIE, add the load address of the
+ * first segment otherwise. Recording uses relaxed atomics only.
+ */
+
+#include <time.h>
+
+#define XW_BUCKETS  32      /* [2^n, 2^(n+1)) ns, the last one is open ended */
+#define XW_SITES    512
+
+enum {
+	XW_FOPEN, XW_OPEN, XW_WRITE, XW_WRITEV, XW_READ, XW_PIPE2, XW_SETNS, XW_OPENDIR,
+	XW_READDIR, XW_SETSID, XW_SOCKET, XW_BIND, XW_CONNECT, XW_LISTEN, XW_ACCEPT4,
+	XW_SENDMSG, XW_RECVMSG, XW_SOCKETPAIR, XW_STAT, XW_LSTAT, XW_DUP2, XW_READLINK,
+	XW_SYMLINK, XW_MOUNT, XW_UMOUNT, XW_UMOUNT2, XW_CHMOD, XW_RENAME, XW_MKDIR,
+	XW_MMAP, XW_SENDFILE, XW_MKDIR_P, XW_NUM
+};
+
+static const char *xw_names[XW_NUM] = {
+	"fopen", "open", "write", "writev", "read", "pipe2", "setns", "opendir",
+	"readdir", "setsid", "socket", "bind", "connect", "listen", "accept4",
+	"sendmsg", "recvmsg", "socketpair", "stat", "lstat", "dup2", "readlink",
+	"symlink", "mount", "umount", "umount2", "chmod", "rename", "mkdir",
+	"mmap", "sendfile", "mkdir_p"
+};
+
+struct xw_stat {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[XW_BUCKETS];
+};
+
+struct xw_site {
+	void *addr;         // NULL while the slot is free
+	int id;
+	struct xw_stat s;
+};
+
+static struct xw_stat xw_stats[XW_NUM];
+static struct xw_site xw_sites[XW_SITES];
+extern char __executable_start;
+
+static uint64_t xw_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void xw_add(struct xw_stat *s, ssize_t bytes, uint64_t ns) {
+	uint64_t max;
+	int b = 0;
+	while (b < XW_BUCKETS - 1 && ns >> (b + 1))
+		++b;
+	__atomic_fetch_add(&s->buckets[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+	if (bytes > 0)
+		__atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->sum_ns, ns, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void xw_record(int id, void *site, ssize_t bytes, uint64_t start) {
+	uint64_t ns = xw_now() - start;
+	void *cur;
+	size_t i = ((uintptr_t) site >> 2) % XW_SITES;
+	xw_add(&xw_stats[id], bytes, ns);
+	// Open addressing, once the table is full new sites only count per wrapper
+	for (int n = 0; n < XW_SITES; ++n, i = (i + 1) % XW_SITES) {
+		cur = __atomic_load_n(&xw_sites[i].addr, __ATOMIC_ACQUIRE);
+		if (cur == NULL && __atomic_compare_exchange_n(&xw_sites[i].addr, &cur, site, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&xw_sites[i].id, id, __ATOMIC_RELAXED);
+			cur = site;
+		}
+		if (cur == site) {
+			xw_add(&xw_sites[i].s, bytes, ns);
+			return;
+		}
+	}
+}
+
+// Upper bound of the bucket holding the given fraction of the calls
+static uint64_t xw_percentile(const struct xw_stat *s, double q) {
+	uint64_t seen = 0, want = s->calls * q;
+	for (int b = 0; b < XW_BUCKETS; ++b) {
+		seen += s->buckets[b];
+		if (seen > want)
+			return b == XW_BUCKETS - 1 || (2ULL << b) - 1 > s->max_ns ? s->max_ns : (2ULL << b) - 1;
+	}
+	return s->max_ns;
+}
+
+static void xw_print(int fd, const char *name, const struct xw_stat *s) {
+	dprintf(fd, "%-24s %8llu %12llu %10.1f %10.1f %10.1f %10.1f\n", name,
+		(unsigned long long) s->calls, (unsigned long long) s->bytes,
+		s->sum_ns / 1000.0 / s->calls, xw_percentile(s, 0.5) / 1000.0,
+		xw_percentile(s, 0.99) / 1000.0, s->max_ns / 1000.0);
+}
+
+static int xw_slowest(const void *a, const void *b) {
+	uint64_t x = (*(struct xw_site **) a)->s.sum_ns, y = (*(struct xw_site **) b)->s.sum_ns;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void xwrap_dump(int fd) {
+	struct xw_site *sites[XW_SITES];
+	char name[64];
+	int num = 0;
+	dprintf(fd, "%-24s %8s %12s %10s %10s %10s %10s\n", "WRAPPER", "CALLS", "BYTES",
+		"AVG(us)", "P50(us)", "P99(us)", "MAX(us)");
+	for (int i = 0; i < XW_NUM; ++i) {
+		if (xw_stats[i].calls)
+			xw_print(fd, xw_names[i], &xw_stats[i]);
+	}
+	for (int i = 0; i < XW_SITES; ++i) {
+		if (__atomic_load_n(&xw_sites[i].addr, __ATOMIC_ACQUIRE) && xw_sites[i].s.calls)
+			sites[num++] = &xw_sites[i];
+	}
+	// Where the time went first
+	qsort(sites, num, sizeof(*sites), xw_slowest);
+	dprintf(fd, "\n%-24s %8s %12s %10s %10s %10s %10s\n", "CALL SITE", "CALLS", "BYTES",
+		"AVG(us)", "P50(us)", "P99(us)", "MAX(us)");
+	for (int i = 0; i < num; ++i) {
+		snprintf(name, sizeof(name), "%s@+%#lx", xw_names[sites[i]->id],
+			(unsigned long) ((char *) sites[i]->addr - &__executable_start));
+		xw_print(fd, name, &sites[i]->s);
+	}
+}
+
+#define XW_START()          uint64_t xw_start = xw_now()
+#define XW_DONE(id, bytes)  xw_record(id, __builtin_return_address(0), bytes, xw_start)
+
+#else
+
+void xwrap_dump(int fd) {
+	dprintf(fd, "Built without XWRAP_STATS\n");
+}
+
+#define XW_START()
+#define XW_DONE(id, bytes)
+
+#endif
+
 FILE *xfopen(const char *pathname, const char *mode) {
+	XW_START();
 	FILE *fp = fopen(pathname, mode);
+	XW_DONE(XW_FOPEN, 0);
 	if (fp == NULL) {
 		PLOGE("fopen: %s", pathname);
 	}
@@ -41,7 +196,9 @@ FILE *xfdopen(int fd, const char *mode) {
 }
 
 int xopen2(const char *pathname, int flags) {
+	XW_START();
 	int fd = open(pathname, flags);
+	XW_DONE(XW_OPEN, 0);
 	if (fd < 0) {
 		PLOGE("open: %s", pathname);
 	}
@@ -49,7 +206,9 @@ int xopen2(const char *pathname, int flags) {
 }
 
 int xopen3(const char *pathname, int flags, mode_t mode) {
+	XW_START();
 	int fd = open(pathname, flags, mode);
+	XW_DONE(XW_OPEN, 0);
 	if (fd < 0) {
 		PLOGE("open: %s", pathname);
 	}
@@ -57,16 +216,33 @@ int xopen3(const char *pathname, int flags, mode_t mode) {
 }
 
 ssize_t xwrite(int fd, const void *buf, size_t count) {
+	XW_START();
 	int ret = write(fd, buf, count);
+	XW_DONE(XW_WRITE, ret);
 	if (count != ret) {
 		PLOGE("write");
 	}
 	return ret;
 }
 
+ssize_t xwritev(int fd, const struct iovec *iov, int iovcnt) {
+	XW_START();
+	size_t count = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		count += iov[i].iov_len;
+	ssize_t ret = writev(fd, iov, iovcnt);
+	XW_DONE(XW_WRITEV, ret);
+	if (count != ret) {
+		PLOGE("writev");
+	}
+	return ret;
+}
+
 // Read error other than EOF
 ssize_t xread(int fd, void *buf, size_t count) {
+	XW_START();
 	int ret = read(fd, buf, count);
+	XW_DONE(XW_READ, ret);
 	if (ret < 0) {
 		PLOGE("read");
 	}
@@ -75,7 +251,9 @@ ssize_t xread(int fd, void *buf, size_t count) {
 
 // Read exact same size as count
 ssize_t xxread(int fd, void *buf, size_t count) {
+	XW_START();
 	int ret = read(fd, buf, count);
+	XW_DONE(XW_READ, ret);
 	if (count != ret) {
 		PLOGE("read");
 	}
@@ -83,7 +261,9 @@ ssize_t xxread(int fd, void *buf, size_t count) {
 }
 
 int xpipe2(int pipefd[2], int flags) {
+	XW_START();
 	int ret = pipe2(pipefd, flags);
+	XW_DONE(XW_PIPE2, 0);
 	if (ret == -1) {
 		PLOGE("pipe2");
 	}
@@ -91,7 +271,9 @@ int xpipe2(int pipefd[2], int flags) {
 }
 
 int xsetns(int fd, int nstype) {
+	XW_START();
 	int ret = setns(fd, nstype);
+	XW_DONE(XW_SETNS, 0);
 	if (ret == -1) {
 		PLOGE("setns");
 	}
@@ -99,7 +281,9 @@ int xsetns(int fd, int nstype) {
 }
 
 DIR *xopendir(const char *name) {
+	XW_START();
 	DIR *d = opendir(name);
+	XW_DONE(XW_OPENDIR, 0);
 	if (d == NULL) {
 		PLOGE("opendir: %s", name);
 	}
@@ -107,8 +291,10 @@ DIR *xopendir(const char *name) {
 }
 
 struct dirent *xreaddir(DIR *dirp) {
+	XW_START();
 	errno = 0;
 	struct dirent *e = readdir(dirp);
+	XW_DONE(XW_READDIR, 0);
 	if (errno && e == NULL) {
 		PLOGE("readdir");
 	}
@@ -116,7 +302,9 @@ struct dirent *xreaddir(DIR *dirp) {
 }
 
 pid_t xsetsid() {
+	XW_START();
 	pid_t pid = setsid();
+	XW_DONE(XW_SETSID, 0);
 	if (pid == -1) {
 		PLOGE("setsid");
 	}
@@ -124,7 +312,9 @@ pid_t xsetsid() {
 }
 
 int xsocket(int domain, int type, int protocol) {
+	XW_START();
 	int fd = socket(domain, type, protocol);
+	XW_DONE(XW_SOCKET, 0);
 	if (fd == -1) {
 		PLOGE("socket");
 	}
@@ -132,7 +322,9 @@ int xsocket(int domain, int type, int protocol) {
 }
 
 int xbind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	XW_START();
 	int ret = bind(sockfd, addr, addrlen);
+	XW_DONE(XW_BIND, 0);
 	if (ret == -1) {
 		PLOGE("bind");
 	}
@@ -140,7 +332,9 @@ int xbind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int xconnect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+	XW_START();
 	int ret = connect(sockfd, addr, addrlen);
+	XW_DONE(XW_CONNECT, 0);
 	if (ret == -1) {
 		PLOGE("bind");
 	}
@@ -148,7 +342,9 @@ int xconnect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int xlisten(int sockfd, int backlog) {
+	XW_START();
 	int ret = listen(sockfd, backlog);
+	XW_DONE(XW_LISTEN, 0);
 	if (ret == -1) {
 		PLOGE("listen");
 	}
@@ -156,7 +352,9 @@ int xlisten(int sockfd, int backlog) {
 }
 
 int xaccept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+	XW_START();
 	int fd = accept4(sockfd, addr, addrlen, flags);
+	XW_DONE(XW_ACCEPT4, 0);
 	if (fd == -1) {
 		PLOGE("accept");
 	}
@@ -188,7 +386,9 @@ void *xrealloc(void *ptr, size_t size) {
 }
 
 ssize_t xsendmsg(int sockfd, const struct msghdr *msg, int flags) {
+	XW_START();
 	int sent = sendmsg(sockfd, msg, flags);
+	XW_DONE(XW_SENDMSG, sent);
 	if (sent == -1) {
 		PLOGE("sendmsg");
 	}
@@ -196,7 +396,9 @@ ssize_t xsendmsg(int sockfd, const struct msghdr *msg, int flags) {
 }
 
 ssize_t xrecvmsg(int sockfd, struct msghdr *msg, int flags) {
+	XW_START();
 	int rec = recvmsg(sockfd, msg, flags);
+	XW_DONE(XW_RECVMSG, rec);
 	if (rec == -1) {
 		PLOGE("recvmsg");
 	}
@@ -213,7 +415,9 @@ int xpthread_create(pthread_t *thread, const pthread_attr_t *attr,
 }
 
 int xsocketpair(int domain, int type, int protocol, int sv[2]) {
+	XW_START();
 	int ret = socketpair(domain, type, protocol, sv);
+	XW_DONE(XW_SOCKETPAIR, 0);
 	if (ret == -1) {
 		PLOGE("socketpair");
 	}
@@ -221,7 +425,9 @@ int xsocketpair(int domain, int type, int protocol, int sv[2]) {
 }
 
 int xstat(const char *pathname, struct stat *buf) {
+	XW_START();
 	int ret = stat(pathname, buf);
+	XW_DONE(XW_STAT, 0);
 	if (ret == -1) {
 		PLOGE("stat %s", pathname);
 	}
@@ -229,7 +435,9 @@ int xstat(const char *pathname, struct stat *buf) {
 }
 
 int xlstat(const char *pathname, struct stat *buf) {
+	XW_START();
 	int ret = lstat(pathname, buf);
+	XW_DONE(XW_LSTAT, 0);
 	if (ret == -1) {
 		PLOGE("lstat %s", pathname);
 	}
@@ -237,7 +445,9 @@ int xlstat(const char *pathname, struct stat *buf) {
 }
 
 int xdup2(int oldfd, int newfd) {
+	XW_START();
 	int ret = dup2(oldfd, newfd);
+	XW_DONE(XW_DUP2, 0);
 	if (ret == -1) {
 		PLOGE("dup2");
 	}
@@ -245,7 +455,9 @@ int xdup2(int oldfd, int newfd) {
 }
 
 ssize_t xreadlink(const char *pathname, char *buf, size_t bufsiz) {
+	XW_START();
 	ssize_t ret = readlink(pathname, buf, bufsiz);
+	XW_DONE(XW_READLINK, 0);
 	if (ret == -1) {
 		PLOGE("readlink %s", pathname);
 	} else {
@@ -256,7 +468,9 @@ ssize_t xreadlink(const char *pathname, char *buf, size_t bufsiz) {
 }
 
 int xsymlink(const char *target, const char *linkpath) {
+	XW_START();
 	int ret = symlink(target, linkpath);
+	XW_DONE(XW_SYMLINK, 0);
 	if (ret == -1) {
 		PLOGE("symlink %s->%s", target, linkpath);
 	}
@@ -266,7 +480,9 @@ int xsymlink(const char *target, const char *linkpath) {
 int xmount(const char *source, const char *target,
 	const char *filesystemtype, unsigned long mountflags,
 	const void *data) {
+	XW_START();
 	int ret = mount(source, target, filesystemtype, mountflags, data);
+	XW_DONE(XW_MOUNT, 0);
 	if (ret == -1) {
 		PLOGE("mount %s->%s", source, target);
 	}
@@ -274,7 +490,9 @@ int xmount(const char *source, const char *target,
 }
 
 int xumount(const char *target) {
+	XW_START();
 	int ret = umount(target);
+	XW_DONE(XW_UMOUNT, 0);
 	if (ret == -1) {
 		PLOGE("umount %s", target);
 	}
@@ -282,7 +500,9 @@ int xumount(const char *target) {
 }
 
 int xumount2(const char *target, int flags) {
+	XW_START();
 	int ret = umount2(target, flags);
+	XW_DONE(XW_UMOUNT2, 0);
 	if (ret == -1) {
 		PLOGE("umount2 %s", target);
 	}
@@ -290,7 +510,9 @@ int xumount2(const char *target, int flags) {
 }
 
 int xchmod(const char *pathname, mode_t mode) {
+	XW_START();
 	int ret = chmod(pathname, mode);
+	XW_DONE(XW_CHMOD, 0);
 	if (ret == -1) {
 		PLOGE("chmod %s %u", pathname, mode);
 	}
@@ -298,7 +520,9 @@ int xchmod(const char *pathname, mode_t mode) {
 }
 
 int xrename(const char *oldpath, const char *newpath) {
+	XW_START();
 	int ret = rename(oldpath, newpath);
+	XW_DONE(XW_RENAME, 0);
 	if (ret == -1) {
 		PLOGE("rename %s->%s", oldpath, newpath);
 	}
@@ -306,7 +530,9 @@ int xrename(const char *oldpath, const char *newpath) {
 }
 
 int xmkdir(const char *pathname, mode_t mode) {
+	XW_START();
 	int ret = mkdir(pathname, mode);
+	XW_DONE(XW_MKDIR, 0);
 	if (ret == -1 && errno != EEXIST) {
 		PLOGE("mkdir %s %u", pathname, mode);
 	}
@@ -315,7 +541,9 @@ int xmkdir(const char *pathname, mode_t mode) {
 
 void *xmmap(void *addr, size_t length, int prot, int flags,
 	int fd, off_t offset) {
+	XW_START();
 	void *ret = mmap(addr, length, prot, flags, fd, offset);
+	XW_DONE(XW_MMAP, ret == MAP_FAILED ? 0 : length);
 	if (ret == MAP_FAILED) {
 		PLOGE("mmap");
 	}
@@ -323,7 +551,9 @@ void *xmmap(void *addr, size_t length, int prot, int flags,
 }
 
 ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+	XW_START();
 	ssize_t ret = sendfile(out_fd, in_fd, offset, count);
+	XW_DONE(XW_SENDFILE, ret);
 	if (count != ret) {
 		PLOGE("sendfile");
 	}
@@ -331,7 +561,9 @@ ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
 }
 
 int xmkdir_p(const char *pathname, mode_t mode) {
+	XW_START();
 	int ret = mkdir_p(pathname, mode);
+	XW_DONE(XW_MKDIR_P, 0);
 	if (ret == -1) {
 		PLOGE("mkdir_p %s", pathname);
 	}
@@ -134,10 +134,15 @@ chmod +x ./*
 ##########################################################################################
 
 ui_print_wrap "- Unpacking boot image"
-./magiskboot --unpack "$BOOTIMAGE"
+# The SHA1 of the image is computed in the same pass
+./magiskboot --unpack=sha1 "$BOOTIMAGE" 2>unpack.log
+UNPACK=$?
+cat unpack.log >&2
+IMGSHA1=`sed -n 's/^SHA1 \[\(.*\)\]$/\1/p' unpack.log`
+rm -f unpack.log
 
 CHROMEOS=false
-case $? in
+case $UNPACK in
   1 )
     abort_wrap "! Unable to unpack boot image"
     ;;
@@ -164,7 +169,7 @@ case $? in
   0 )  # Stock boot
     ui_print_wrap "- Stock boot image detected!"
     ui_print_wrap "- Backing up stock boot image"
-    SHA1=`./magiskboot --sha1 "$BOOTIMAGE" | tail -n 1`
+    SHA1=$IMGSHA1
     STOCKDUMP=stock_boot_${SHA1}.img
     dd if="$BOOTIMAGE" of=$STOCKDUMP
     ./magiskboot --compress $STOCKDUMP
@@ -217,9 +222,6 @@ esac
 
 ui_print_wrap "- Patching ramdisk"
 
-# Add magisk entrypoint
-./magiskboot --cpio-patch ramdisk.cpio $KEEPVERITY $KEEPFORCEENCRYPT
-
 # sepolicy patches
 cpio_extract sepolicy sepolicy
 if $isABdevice
@@ -228,21 +230,23 @@ then
 else
   ./magisk magiskpolicy --load sepolicy --save sepolicy --minimal
 fi
-cpio_add 644 sepolicy sepolicy
-rm -f sepolicy
 
 # Add new items
 if [ ! -z $SHA1 ]; then
   cp init.magisk.rc init.magisk.rc.bak
   echo "# STOCKSHA1=$SHA1" >> init.magisk.rc
 fi
-cpio_add 750 init.magisk.rc init.magisk.rc
-mv init.magisk.rc.bak init.magisk.rc 2>/dev/null
-cpio_add 755 sbin/magisk magisk
 
-# Create ramdisk backups
-./magiskboot --cpio-backup ramdisk.cpio ramdisk.cpio.orig
+# Add magisk entrypoint, new items and ramdisk backups, ramdisk.cpio is only written once
+./magiskboot --cpio-batch ramdisk.cpio \
+-c "patch $KEEPVERITY $KEEPFORCEENCRYPT" \
+-c "add 644 sepolicy sepolicy" \
+-c "add 750 init.magisk.rc init.magisk.rc" \
+-c "add 755 sbin/magisk magisk" \
+-c "backup ramdisk.cpio.orig"
 
+rm -f sepolicy
+mv init.magisk.rc.bak init.magisk.rc 2>/dev/null
 rm -f ramdisk.cpio.orig
 
 ##########################################################################################
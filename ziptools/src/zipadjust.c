@@ -25,6 +25,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib.h>
 
 #ifndef O_BINARY
@@ -103,218 +107,286 @@ typedef struct central_footer_struct central_footer_t;
 #define MAGIC_CENTRAL_HEADER 0x02014b50
 #define MAGIC_CENTRAL_FOOTER 0x06054b50
 
+#define MAX_COMMENT 0xFFFF
+#define MAX_THREADS 8
+#define CHUNK (256 * 1024)
+
+// One stream to write into the output
+struct entry_struct {
+	const unsigned char* data;
+	uint32_t size_in;
+	uint32_t size_out;
+	uint32_t offset_out;
+	int inflate;
+};
+typedef struct entry_struct entry_t;
+
+struct job_struct {
+	int fd;
+	entry_t* entries;
+	int count;
+	int next;
+	int failed;
+};
+typedef struct job_struct job_t;
+
 static int xerror(char* message) {
 	fprintf(stderr, "%s\n", message);
 	return 0;
 }
 
-static int xseekread(int fd, off_t offset, void* buf, size_t bytes) {
-	if (lseek(fd, offset, SEEK_SET) == (off_t)-1) return xerror("Seek failed");
-	if (read(fd, buf, bytes) != bytes) return xerror("Read failed");
+static int xpwrite(int fd, const void* buf, size_t bytes, off_t offset) {
+	while (bytes > 0) {
+		ssize_t w = pwrite(fd, buf, bytes, offset);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR) continue;
+			return xerror("Write failed");
+		}
+		buf = (const char*)buf + w;
+		bytes -= w;
+		offset += w;
+	}
 	return 1;
 }
 
-static int xseekwrite(int fd, off_t offset, void* buf, size_t bytes) {
-	if (lseek(fd, offset, SEEK_SET) == (off_t)-1) return xerror("Seek failed");
-	if (write(fd, buf, bytes) != bytes) return xerror("Write failed");
+// Inflate a raw deflate stream straight from the mapped input
+static int xdecompress(int fd, const entry_t* e, unsigned char* out) {
+	int ret;
+	size_t have;
+	off_t offset = e->offset_out;
+	z_stream strm;
+
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, -15) != Z_OK) return xerror("ret != Z_OK");
+	strm.next_in = (unsigned char*)e->data;
+	strm.avail_in = e->size_in;
+
+	do {
+		strm.avail_out = CHUNK;
+		strm.next_out = out;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			inflateEnd(&strm);
+			return xerror("DICT/DATA/MEM error");
+		}
+		have = CHUNK - strm.avail_out;
+		if (offset + have > e->offset_out + e->size_out) {
+			inflateEnd(&strm);
+			return xerror("Size mismatch");
+		}
+		if (!xpwrite(fd, out, have, offset)) {
+			inflateEnd(&strm);
+			return 0;
+		}
+		offset += have;
+	} while (ret != Z_STREAM_END);
+	inflateEnd(&strm);
+
+	if (offset != e->offset_out + e->size_out) return xerror("Size mismatch");
 	return 1;
 }
 
-static int xfilecopy(int fdIn, int fdOut, off_t offsetIn, off_t offsetOut, size_t bytes) {
-	if ((offsetIn != (off_t)-1) && (lseek(fdIn, offsetIn, SEEK_SET) == (off_t)-1)) return xerror("Seek failed");
-	if ((offsetOut != (off_t)-1) && (lseek(fdOut, offsetOut, SEEK_SET) == (off_t)-1)) return xerror("Seek failed");
-	
-	int CHUNK = 256 * 1024;
-	void* buf = malloc(CHUNK);
-	if (buf == NULL) return xerror("malloc failed");
-	size_t left = bytes;
-	while (left > 0) {
-		size_t wanted = (left < CHUNK) ? left : CHUNK;
-		size_t r = read(fdIn, buf, wanted);
-		if (r <= 0) return xerror("Read failed");
-		if (write(fdOut, buf, r) != r) return xerror("Write failed");
-		left -= r;
+// Entries are independent, workers take the next one until none is left
+static void* xworker(void* arg) {
+	job_t* job = (job_t*)arg;
+	unsigned char* out = NULL;
+	int i;
+
+	while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED) &&
+		(i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		entry_t* e = &job->entries[i];
+		int ok;
+		if (e->inflate) {
+			if (out == NULL && (out = (unsigned char*)malloc(CHUNK)) == NULL) {
+				ok = xerror("malloc failed");
+			} else {
+				ok = xdecompress(job->fd, e, out);
+			}
+		} else {
+			ok = xpwrite(job->fd, e->data, e->size_in, e->offset_out);
+		}
+		if (!ok) __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
 	}
-	free(buf);
-	
-	return 1;
+	free(out);
+	return NULL;
 }
 
-static int xdecompress(int fdIn, int fdOut, off_t offsetIn, off_t offsetOut, size_t bytes) {
-	if ((offsetIn != (off_t)-1) && (lseek(fdIn, offsetIn, SEEK_SET) == (off_t)-1)) return xerror("Seek failed");
-	if ((offsetOut != (off_t)-1) && (lseek(fdOut, offsetOut, SEEK_SET) == (off_t)-1)) return xerror("Seek failed");
-	
-	int CHUNK = 256 * 1024;
-	
-	int ret;
-	unsigned have;
-	z_stream strm;
-	unsigned char in[CHUNK];
-	unsigned char out[CHUNK];
-	
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-	ret = inflateInit2(&strm, -15);
-	if (ret != Z_OK) return xerror("ret != Z_OK");
-	
-	do {
-		strm.avail_in = read(fdIn, in, CHUNK);
-		if (strm.avail_in == 0) break;
-		strm.next_in = in;
-		
-		do {
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-			
-			ret = inflate(&strm, Z_NO_FLUSH);
-			if (ret == Z_STREAM_ERROR) return xerror("Stream error");
-			switch (ret) {
-			case Z_NEED_DICT:
-				ret = Z_DATA_ERROR;
-			case Z_DATA_ERROR:
-			case Z_MEM_ERROR:
-				(void)inflateEnd(&strm);
-				return xerror("DICT/DATA/MEM error");
-			}
-			
-			have = CHUNK - strm.avail_out;
-			if (write(fdOut, out, have) != have) {
-				(void)inflateEnd(&strm);
-				return xerror("Write failed");
-			}
-		} while (strm.avail_out == 0);
-	} while (ret != Z_STREAM_END);
-	(void)inflateEnd(&strm);
-	
-	return ret == Z_STREAM_END ? 1 : 0;
+static int xwrite_entries(int fd, entry_t* entries, int count, int parallel) {
+	job_t job = { fd, entries, count, 0, 0 };
+	pthread_t threads[MAX_THREADS];
+	int n = 0;
+
+	if (parallel) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		int want = cpus < 1 ? 1 : (cpus > MAX_THREADS ? MAX_THREADS : cpus);
+		if (want > count) want = count;
+		// The calling thread is a worker too
+		for (n = 0; n < want - 1; n++)
+			if (pthread_create(&threads[n], NULL, xworker, &job) != 0) break;
+	}
+	xworker(&job);
+	while (n > 0)
+		pthread_join(threads[--n], NULL);
+	return !job.failed;
+}
+
+// The footer is at most MAX_COMMENT bytes before the end
+static long xfind_footer(const unsigned char* map, size_t size) {
+	long i, stop;
+	if (size < sizeof(central_footer_t)) return -1;
+	i = size - sizeof(central_footer_t);
+	stop = i > MAX_COMMENT ? i - MAX_COMMENT : 0;
+	for (; i >= stop; i--) {
+		if (map[i] != 0x50 || map[i + 1] != 0x4b || map[i + 2] != 0x05 || map[i + 3] != 0x06) continue;
+		const central_footer_t* footer = (const central_footer_t*)&map[i];
+		if ((size_t)footer->central_directory_offset + sizeof(central_header_t) > (size_t)i) continue;
+		if (((const central_header_t*)&map[footer->central_directory_offset])->signature == MAGIC_CENTRAL_HEADER)
+			return i;
+	}
+	return -1;
 }
 
 int zipadjust(char* filenameIn, char* filenameOut, int decompress) {
 	int ok = 0;
-	
-	int fin = open(filenameIn, O_RDONLY | O_BINARY);
-	if (fin > 0) {
-		unsigned int size = lseek(fin, 0, SEEK_END);
-		lseek(fin, 0, SEEK_SET);
-		printf("%d bytes\n", size);
-
-		char filename[1024];
-
-		central_footer_t central_footer;
-		uint32_t central_directory_in_position = 0;
-		uint32_t central_directory_in_size = 0;
-		uint32_t central_directory_out_size = 0;
-
-		int i;
-		for (i = size - 4; i >= 0; i--) {
-			uint32_t magic = 0;
-			if (!xseekread(fin, i, &magic, sizeof(uint32_t))) return 0;
-			if (magic == MAGIC_CENTRAL_FOOTER) {
-				printf("central footer @ %08X\n", i);
-				if (!xseekread(fin, i, &central_footer, sizeof(central_footer_t))) return 0;
-
-				central_header_t central_header;
-				if (!xseekread(fin, central_footer.central_directory_offset, &central_header, sizeof(central_header_t))) return 0;
-				if ( central_header.signature == MAGIC_CENTRAL_HEADER ) {
-					central_directory_in_position = central_footer.central_directory_offset;
-					central_directory_in_size = size - central_footer.central_directory_offset;
-					printf("central header @ %08X (%d)\n", central_footer.central_directory_offset, central_footer.central_directory_size);
-					break;
-				}
-			}
+	int fin = -1, fout = -1;
+	size_t size = 0;
+	unsigned char* map = MAP_FAILED;
+	unsigned char* central_directory_out = NULL;
+	entry_t* entries = NULL;
+	struct stat st;
+
+	fin = open(filenameIn, O_RDONLY | O_BINARY);
+	if (fin < 0) return xerror("Open failed");
+	if (fstat(fin, &st) != 0) {
+		xerror("Stat failed");
+		goto done;
+	}
+	size = st.st_size;
+	printf("%zu bytes\n", size);
+	if (size > 0) map = (unsigned char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fin, 0);
+	if (map == MAP_FAILED) {
+		xerror("mmap failed");
+		goto done;
+	}
+
+	long footer_index = xfind_footer(map, size);
+	if (footer_index < 0) {
+		xerror("No central directory");
+		goto done;
+	}
+	central_footer_t central_footer;
+	memcpy(&central_footer, &map[footer_index], sizeof(central_footer_t));
+	printf("central footer @ %08lX\n", footer_index);
+
+	uint32_t central_directory_in_position = central_footer.central_directory_offset;
+	size_t central_directory_in_size = size - central_directory_in_position;
+	printf("central header @ %08X (%d)\n", central_footer.central_directory_offset, central_footer.central_directory_size);
+
+	// Entries only get smaller, the input size is enough
+	central_directory_out = (unsigned char*)malloc(central_directory_in_size);
+	entries = (entry_t*)malloc((central_directory_in_size / sizeof(central_header_t) + 1) * sizeof(entry_t));
+	if (central_directory_out == NULL || entries == NULL) {
+		xerror("malloc failed");
+		goto done;
+	}
+
+	unlink(filenameOut);
+	fout = open(filenameOut, O_CREAT | O_WRONLY | O_BINARY, 0644);
+	if (fout < 0) {
+		xerror("Open failed");
+		goto done;
+	}
+
+	size_t central_directory_in_index = 0;
+	size_t central_directory_out_index = 0;
+	uint32_t out_index = 0;
+	int count = 0;
+	char filename[1024];
+
+	while (central_directory_in_index + sizeof(central_header_t) <= central_directory_in_size) {
+		const unsigned char* in = &map[central_directory_in_position + central_directory_in_index];
+		central_header_t* central_header = (central_header_t*)&central_directory_out[central_directory_out_index];
+		memcpy(central_header, in, sizeof(central_header_t));
+		if (central_header->signature != MAGIC_CENTRAL_HEADER) break;
+
+		size_t length_entry = sizeof(central_header_t) + central_header->length_filename + central_header->length_extra + central_header->length_comment;
+		if (central_directory_in_index + length_entry > central_directory_in_size || central_header->length_filename >= sizeof(filename)) {
+			xerror("Corrupted central directory");
+			goto done;
 		}
+		memcpy(filename, in + sizeof(central_header_t), central_header->length_filename);
+		filename[central_header->length_filename] = (char)0;
+		printf("%s (%d --> %d) [%08X] (%d)\n", filename, central_header->size_uncompressed, central_header->size_compressed, central_header->crc32, central_header->length_extra + central_header->length_comment);
 
-		if (central_directory_in_position == 0) return 0;
-
-		unsigned char* central_directory_in = (unsigned char*)malloc(central_directory_in_size);
-		unsigned char* central_directory_out = (unsigned char*)malloc(central_directory_in_size);
-		if (!xseekread(fin, central_directory_in_position, central_directory_in, central_directory_in_size)) return 0;
-		memset(central_directory_out, 0, central_directory_in_size);
-
-		unlink(filenameOut);
-		int fout = open(filenameOut, O_CREAT | O_WRONLY | O_BINARY, 0644);
-		if (fout > 0) {
-
-			uintptr_t central_directory_in_index = 0;
-			uintptr_t central_directory_out_index = 0;
-
-			central_header_t* central_header = NULL;
-			local_header_t local_header;
-
-			uint32_t out_index = 0;
-
-			while (1) {
-				central_header = (central_header_t*)&central_directory_in[central_directory_in_index];
-				if (central_header->signature != MAGIC_CENTRAL_HEADER) break;
-
-				filename[central_header->length_filename] = (char)0;
-				memcpy(filename, &central_directory_in[central_directory_in_index + sizeof(central_header_t)], central_header->length_filename);
-				printf("%s (%d --> %d) [%08X] (%d)\n", filename, central_header->size_uncompressed, central_header->size_compressed, central_header->crc32, central_header->length_extra + central_header->length_comment);
-
-				local_header_t local_header;
-				if (!xseekread(fin, central_header->offset, &local_header, sizeof(local_header_t))) return 0;
-
-				// save and update to next index before we clobber the data
-				uint16_t compression_method_old = central_header->compression_method;
-				uint32_t size_compressed_old = central_header->size_compressed;
-				uint32_t offset_old = central_header->offset;
-				uint32_t length_extra_old = central_header->length_extra;
-				central_directory_in_index += sizeof(central_header_t) + central_header->length_filename + central_header->length_extra + central_header->length_comment;
-
-				// copying, rewriting, and correcting local and central headers so all the information matches, and no data descriptors are necessary
-				central_header->offset = out_index;
-				central_header->flags = central_header->flags & !8;
-				if (decompress && (compression_method_old == 8)) {
-					central_header->compression_method = 0;
-					central_header->size_compressed = central_header->size_uncompressed;
-				}
-				central_header->length_extra = 0;
-				central_header->length_comment = 0;
-				local_header.compression_method = central_header->compression_method;
-				local_header.flags = central_header->flags;
-				local_header.crc32 = central_header->crc32;
-				local_header.size_uncompressed = central_header->size_uncompressed;
-				local_header.size_compressed = central_header->size_compressed;
-				local_header.length_extra = 0;
-
-				if (!xseekwrite(fout, out_index, &local_header, sizeof(local_header_t))) return 0;
-				out_index += sizeof(local_header_t);
-				if (!xseekwrite(fout, out_index, &filename[0], central_header->length_filename)) return 0;
-				out_index += central_header->length_filename;
-
-				if (decompress && (compression_method_old == 8)) {
-					if (!xdecompress(fin, fout, offset_old + sizeof(local_header_t) + central_header->length_filename + length_extra_old, out_index, size_compressed_old)) return 0;
-				} else {
-					if (!xfilecopy(fin, fout, offset_old + sizeof(local_header_t) + central_header->length_filename + length_extra_old, out_index, size_compressed_old)) return 0;
-				}
-				out_index += local_header.size_compressed;
-
-				memcpy(&central_directory_out[central_directory_out_index], central_header, sizeof(central_header_t) + central_header->length_filename);
-				central_directory_out_index += sizeof(central_header_t) + central_header->length_filename;
-			}
-			
-			central_directory_out_size = central_directory_out_index;
-			central_footer.central_directory_size = central_directory_out_size;
-			central_footer.central_directory_offset = out_index;
-			central_footer.length_comment = 0;
-			if (!xseekwrite(fout, out_index, central_directory_out, central_directory_out_size)) return 0;
-			out_index += central_directory_out_size;
-			if (!xseekwrite(fout, out_index, &central_footer, sizeof(central_footer_t))) return 0;
-
-			printf("central header @ %08X (%d)\n", central_footer.central_directory_offset, central_footer.central_directory_size);
-			printf("central footer @ %08X\n", out_index);
-
-			close(fout);
-			ok = 1;
+		if ((size_t)central_header->offset + sizeof(local_header_t) > size) {
+			xerror("Corrupted local header");
+			goto done;
+		}
+		local_header_t local_header;
+		memcpy(&local_header, &map[central_header->offset], sizeof(local_header_t));
+
+		// save and update to next index before we clobber the data
+		uint16_t compression_method_old = central_header->compression_method;
+		uint32_t size_compressed_old = central_header->size_compressed;
+		size_t data_old = (size_t)central_header->offset + sizeof(local_header_t) + central_header->length_filename + local_header.length_extra;
+		central_directory_in_index += length_entry;
+		if (data_old + size_compressed_old > size) {
+			xerror("Corrupted local header");
+			goto done;
 		}
 
-		free(central_directory_in);
-		free(central_directory_out);
-		close(fin);
+		// copying, rewriting, and correcting local and central headers so all the information matches, and no data descriptors are necessary
+		central_header->offset = out_index;
+		central_header->flags = central_header->flags & !8;
+		if (decompress && (compression_method_old == 8)) {
+			central_header->compression_method = 0;
+			central_header->size_compressed = central_header->size_uncompressed;
+		}
+		central_header->length_extra = 0;
+		central_header->length_comment = 0;
+		local_header.compression_method = central_header->compression_method;
+		local_header.flags = central_header->flags;
+		local_header.crc32 = central_header->crc32;
+		local_header.size_uncompressed = central_header->size_uncompressed;
+		local_header.size_compressed = central_header->size_compressed;
+		local_header.length_extra = 0;
+
+		if (!xpwrite(fout, &local_header, sizeof(local_header_t), out_index)) goto done;
+		out_index += sizeof(local_header_t);
+		if (!xpwrite(fout, filename, central_header->length_filename, out_index)) goto done;
+		out_index += central_header->length_filename;
+
+		// Stream data is written below, every offset is known by now
+		entry_t* e = &entries[count++];
+		e->data = &map[data_old];
+		e->size_in = size_compressed_old;
+		e->size_out = local_header.size_compressed;
+		e->offset_out = out_index;
+		e->inflate = decompress && (compression_method_old == 8);
+		out_index += local_header.size_compressed;
+
+		memcpy(central_header + 1, filename, central_header->length_filename);
+		central_directory_out_index += sizeof(central_header_t) + central_header->length_filename;
 	}
-	
+
+	if (!xwrite_entries(fout, entries, count, decompress)) goto done;
+
+	central_footer.central_directory_size = central_directory_out_index;
+	central_footer.central_directory_offset = out_index;
+	central_footer.length_comment = 0;
+	if (!xpwrite(fout, central_directory_out, central_directory_out_index, out_index)) goto done;
+	out_index += central_directory_out_index;
+	if (!xpwrite(fout, &central_footer, sizeof(central_footer_t), out_index)) goto done;
+
+	printf("central header @ %08X (%d)\n", central_footer.central_directory_offset, central_footer.central_directory_size);
+	printf("central footer @ %08X\n", out_index);
+	ok = 1;
+
+done:
+	if (fout >= 0 && close(fout) != 0) ok = xerror("Write failed");
+	if (map != MAP_FAILED) munmap(map, size);
+	free(entries);
+	free(central_directory_out);
+	close(fin);
 	return ok;
 }
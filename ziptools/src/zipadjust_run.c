@@ -26,11 +26,9 @@
 int main(int argc, char *argv[]) {
 	if (argc >= 3) {
 		if ((argc >= 4) && (strcmp(argv[1], "--decompress") == 0)) {
-			zipadjust(argv[2], argv[3], 1);
-			return 0;
+			return zipadjust(argv[2], argv[3], 1) ? 0 : 1;
 		} else {
-			zipadjust(argv[1], argv[2], 0);
-			return 0;
+			return zipadjust(argv[1], argv[2], 0) ? 0 : 1;
 		}
 	}
 	